@@ -157,6 +157,8 @@ static symbol_t type_id[] =
     SYM("i16", UINT16),
     SYM("i32", UINT32),
     SYM("i64", UINT64),
+    SYM("f16", FLOAT16),
+    SYM("bf16", BFLOAT16),
     SYM("f32", FLOAT32),
     SYM("f64", FLOAT64),
 };
@@ -167,6 +169,8 @@ static symbol_t symbol_id[] =
     SYM("jmp", OP_JMP),
     SYM("jnz.", OP_JNZ),
     SYM("jz.", OP_JZ),
+    SYM("vjany.", OP_VJANY),
+    SYM("vjall.", OP_VJALL),
     SYM("ret", OP_RET),
     SYM("neg.", OP_NEG),
     SYM("bnot.", OP_BNOT),
@@ -261,6 +265,9 @@ static symbol_t symbol_id[] =
     SYM("vneg.", OP_VNEG),
     SYM("vbnot.", OP_VBNOT),
     SYM("vinv.", OP_VINV),
+    SYM("vsel.", OP_VSEL),
+    SYM("vcvt.", OP_VCVT),
+    SYM("vcvtn.", OP_VCVTN),
 
 // registers
     SYM("%v0", 0),
@@ -279,6 +286,22 @@ static symbol_t symbol_id[] =
     SYM("%v13", 13),
     SYM("%v14", 14),
     SYM("%v15", 15),
+    SYM("%v16", 16),
+    SYM("%v17", 17),
+    SYM("%v18", 18),
+    SYM("%v19", 19),
+    SYM("%v20", 20),
+    SYM("%v21", 21),
+    SYM("%v22", 22),
+    SYM("%v23", 23),
+    SYM("%v24", 24),
+    SYM("%v25", 25),
+    SYM("%v26", 26),
+    SYM("%v27", 27),
+    SYM("%v28", 28),
+    SYM("%v29", 29),
+    SYM("%v30", 30),
+    SYM("%v31", 31),
 
     SYM("%r0", 0),
     SYM("%r1", 1),
@@ -296,6 +319,22 @@ static symbol_t symbol_id[] =
     SYM("%r13", 13),
     SYM("%r14", 14),
     SYM("%r15", 15),
+    SYM("%r16", 16),
+    SYM("%r17", 17),
+    SYM("%r18", 18),
+    SYM("%r19", 19),
+    SYM("%r20", 20),
+    SYM("%r21", 21),
+    SYM("%r22", 22),
+    SYM("%r23", 23),
+    SYM("%r24", 24),
+    SYM("%r25", 25),
+    SYM("%r26", 26),
+    SYM("%r27", 27),
+    SYM("%r28", 28),
+    SYM("%r29", 29),
+    SYM("%r30", 30),
+    SYM("%r31", 31),
     
     SYM(NULL, -1),
 };
@@ -443,6 +482,18 @@ static inline char* scan_token(char* ptr, int* twp, token_t* tp)
 
 int pp = 0;
 instr_t prog[MAX_PROG_SIZE];
+int wide = 0;   // -w: instr64_t encoding, 32 registers, imm32/imm24
+instr64_t prog64[MAX_PROG_SIZE];
+
+// set field in the selected encoding, imm8/imm12 are imm32/imm24 wide
+#define SET(field, value) do {				\
+	if (wide) prog64[pp].field = (value);		\
+	else prog[pp].field = (value);			\
+    } while(0)
+#define SET_IMM(nfield, wfield, value) do {		\
+	if (wide) prog64[pp].wfield = (value);		\
+	else prog[pp].nfield = (value);			\
+    } while(0)
 
 // emit_instruction
 // should probably be piped directly to jitter_x86:emit_instruction
@@ -462,37 +513,43 @@ void emit_instruction(int line, token_t label, token_t instruction,
     if (instruction.name) {
 	if ((opcode = instruction.id) >= 0) {
 	    char* ptr;
-	    prog[pp].op = opcode;
-	    prog[pp].type = DEFAULT_TYPE_ID;
+	    SET(op, opcode);
+	    SET(type, DEFAULT_TYPE_ID);
 	    if ((ptr = strchr(instruction.name, '.')) != NULL) {
 		int len = strlen(++ptr);
 		int t;
 		if ((t = lookup(type_id, ptr, len)) < 0)
 		    opcode = -1;
 		else
-		    prog[pp].type = t;
+		    SET(type, t);
 	    }
 	}
-	fprintf(fout, "{%s:%d:%d} ",
-		instruction.name, prog[pp].op, prog[pp].type);
+	fprintf(fout, "{%s:%d:%d} ", instruction.name,
+		wide ? prog64[pp].op : prog[pp].op,
+		wide ? prog64[pp].type : prog[pp].type);
+    }
+
+    for (i = 0; i < (int)n; i++) {   // %r16-%r31,%v16-%v31 need -w
+	if (!wide && (operand[i].type == SYM_REGISTER) && (operand[i].id > 15))
+	    opcode = -1;
     }
 
     if (n == 1) {
 	if ((operand[0].type == SYM_REGISTER))        // ret %ri
-	    prog[pp].rd = operand[0].id;
+	    SET(rd, operand[0].id);
 	else if (operand[0].type == SYM_IMMEDIATE)
-	    prog[pp].imm12 = atoi(operand[0].name+1);  // jmp L
+	    SET_IMM(imm12, imm24, atoi(operand[0].name+1));  // jmp L
     }
     else if (n == 2) {
 	if ((operand[0].type == SYM_REGISTER) &&
 	    (operand[1].type == SYM_REGISTER)) {    // neg, mov, vmov
-	    prog[pp].rd = operand[0].id;
-	    prog[pp].ri = operand[1].id;
+	    SET(rd, operand[0].id);
+	    SET(ri, operand[1].id);
 	}
 	else if ((operand[0].type == SYM_REGISTER) &&  // movi, vmovi
 		 (operand[1].type == SYM_IMMEDIATE)) {
-	    prog[pp].rd = operand[0].id;
-	    prog[pp].imm12 = atoi(operand[1].name+1);
+	    SET(rd, operand[0].id);
+	    SET_IMM(imm12, imm32, atoi(operand[1].name+1));
 	}
     }
     else if (n == 3) {
@@ -500,16 +557,27 @@ void emit_instruction(int line, token_t label, token_t instruction,
 	    (operand[1].type == SYM_REGISTER) &&
 	    (operand[2].type == SYM_REGISTER)) {
 
-	    prog[pp].rd = operand[0].id;
-	    prog[pp].ri = operand[1].id;
-	    prog[pp].rj = operand[2].id;
+	    SET(rd, operand[0].id);
+	    SET(ri, operand[1].id);
+	    SET(rj, operand[2].id);
 	}
 	else if ((operand[0].type == SYM_REGISTER) &&
 		 (operand[1].type == SYM_REGISTER) &&
 		 (operand[2].type == SYM_IMMEDIATE)) {
-	    prog[pp].rd = operand[0].id;
-	    prog[pp].ri = operand[1].id;
-	    prog[pp].imm8 = atoi(operand[2].name+1);
+	    SET(rd, operand[0].id);
+	    SET(ri, operand[1].id);
+	    SET_IMM(imm8, imm32, atoi(operand[2].name+1));
+	}
+    }
+    else if (n == 4) {
+	if ((operand[0].type == SYM_REGISTER) &&     // vsel
+	    (operand[1].type == SYM_REGISTER) &&
+	    (operand[2].type == SYM_REGISTER) &&
+	    (operand[3].type == SYM_REGISTER)) {
+	    SET(rd, operand[0].id);
+	    SET(ri, operand[1].id);
+	    SET(rj, operand[2].id);
+	    SET(rk, operand[3].id);
 	}
     }
     
@@ -616,6 +684,11 @@ int main(int argc, char** argv)
     char* errptr;
     int line;
     
+    if ((argc > 1) && (strcmp(argv[1], "-w") == 0)) {
+	wide = 1;
+	argc--;
+	argv++;
+    }
     if (argc > 1) {
 	filename = argv[1];
 	if ((fin = fopen(argv[1], "r")) == NULL) {
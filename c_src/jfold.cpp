@@ -0,0 +1,163 @@
+//
+// Fold perf samples per jitter instruction
+//
+// usage: perf script -F ip | jfold /tmp/jit-<pid>.src
+//    or  jfold /tmp/jit-<pid>.src samples.txt
+//
+// The .src file is written by jit_perf_open(JIT_PERF_SRC,...), each
+// sample line starts with the sampled address in hex.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "jitter_types.h"
+#include "jitter.h"
+
+extern void print_instr(FILE* f,instr_t* pc);
+extern int pc_map_lookup(const uint32_t* map, size_t n, uint32_t offs);
+
+typedef struct {
+    char name[64];
+    uint64_t addr;
+    uint64_t size;
+    std::vector<instr_t> code;
+    std::vector<uint32_t> map;     // n+1 offsets
+    std::vector<uint64_t> count;   // n+2, prolog, instructions, epilog
+    uint64_t total;
+} fold_kernel_t;
+
+static int load_src(FILE* f, std::vector<fold_kernel_t*>& ks)
+{
+    char line[256];
+    fold_kernel_t* k = NULL;
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+	unsigned long addr, size, n;
+	unsigned int offs;
+	char name[64];
+	char hex[64];
+
+	if (sscanf(line, "code %63s %lx %lx %lu", name, &addr, &size, &n) == 4) {
+	    k = new fold_kernel_t;
+	    strcpy(k->name, name);
+	    k->addr = addr;
+	    k->size = size;
+	    k->total = 0;
+	    ks.push_back(k);
+	}
+	else if (k == NULL)
+	    return -1;
+	else if (sscanf(line, "epilog %x", &offs) == 1) {
+	    k->map.push_back(offs);
+	    k->count.assign(k->code.size()+2, 0);
+	}
+	else if (sscanf(line, "%x %63s", &offs, hex) == 2) {
+	    instr_t ins;
+	    uint8_t* ip = (uint8_t*) &ins;
+	    size_t j;
+
+	    if (strlen(hex) != 2*sizeof(instr_t))
+		return -1;
+	    for (j = 0; j < sizeof(instr_t); j++) {
+		unsigned int b;
+		sscanf(hex+2*j, "%2x", &b);
+		ip[j] = b;
+	    }
+	    k->code.push_back(ins);
+	    k->map.push_back(offs);
+	}
+    }
+    return 0;
+}
+
+static fold_kernel_t* find_kernel(std::vector<fold_kernel_t*>& ks,
+				  uint64_t ip)
+{
+    size_t i;
+
+    // later kernels may reuse the address of a released one
+    for (i = ks.size(); i > 0; i--) {
+	fold_kernel_t* k = ks[i-1];
+	if ((ip >= k->addr) && (ip < k->addr + k->size) &&
+	    (k->map.size() == k->code.size()+1))
+	    return k;
+    }
+    return NULL;
+}
+
+static void print_kernel(FILE* f, fold_kernel_t* k)
+{
+    size_t n = k->code.size();
+    size_t i;
+
+    fprintf(f, "%s %lx samples=%lu\n", k->name,
+	    (unsigned long) k->addr, (unsigned long) k->total);
+    for (i = 0; i < n+2; i++) {
+	uint64_t c = k->count[i];
+	double pct = (100.0 * c) / k->total;
+
+	if (i == 0)
+	    fprintf(f, "%8lu %5.1f%%      prolog\n", (unsigned long) c, pct);
+	else if (i == n+1)
+	    fprintf(f, "%8lu %5.1f%% %4x epilog\n", (unsigned long) c, pct,
+		    k->map[n]);
+	else {
+	    fprintf(f, "%8lu %5.1f%% %4x   ", (unsigned long) c, pct,
+		    k->map[i-1]);
+	    print_instr(f, &k->code[i-1]);
+	    fprintf(f, "\n");
+	}
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<fold_kernel_t*> ks;
+    char line[1024];
+    FILE* f;
+    FILE* in = stdin;
+    uint64_t other = 0;
+    size_t i;
+
+    if ((argc < 2) || (argc > 3)) {
+	fprintf(stderr, "usage: jfold <jit-pid.src> [samples]\n");
+	exit(1);
+    }
+    if ((f = fopen(argv[1], "r")) == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+    if (load_src(f, ks) < 0) {
+	fprintf(stderr, "%s: bad format\n", argv[1]);
+	exit(1);
+    }
+    fclose(f);
+    if ((argc == 3) && ((in = fopen(argv[2], "r")) == NULL)) {
+	perror(argv[2]);
+	exit(1);
+    }
+    while(fgets(line, sizeof(line), in) != NULL) {
+	unsigned long ip;
+	fold_kernel_t* k;
+	int j;
+
+	if (sscanf(line, "%lx", &ip) != 1)
+	    continue;
+	if ((k = find_kernel(ks, ip)) == NULL) {
+	    other++;
+	    continue;
+	}
+	j = pc_map_lookup(k->map.data(), k->code.size(), ip - k->addr);
+	k->count[j+1]++;
+	k->total++;
+    }
+    for (i = 0; i < ks.size(); i++) {
+	if (ks[i]->total > 0)
+	    print_kernel(stdout, ks[i]);
+    }
+    printf("other samples=%lu\n", (unsigned long) other);
+    exit(0);
+}
@@ -37,8 +37,9 @@
 // JFMT_XXX_vvv   (vd,vs1,vs2)   vadd, ...
 // JFMT_IIU_vvr   (vd,vs1,rs2)   vsll
 // JFMT_IIU_vvb   (vd,vs,imm)    vaddi, vslli,
+// JFMT_XXXX_vvvv (vd,vm,vs1,vs2) vsel
 //
-// FOMAT:4 OP:4  TYPE:5, _:3, Rd:4, Ri:4, Rj:4, _:4
+// FOMAT:4 OP:4  TYPE:5, _:3, Rd:4, Ri:4, Rj:4, Rk:4
 // FOMAT:4 OP:4  TYPE:5, _:3, Rd:4, Ri:4, Imm:8
 // FOMAT:4 OP:4  TYPE:5, _:3, Rd:4, Imm:12
 //
@@ -66,6 +67,18 @@
 #define    OP_JMP  (6|OP_IMM)  // imm12 (relative)
 #define    OP_JNZ  (7|OP_IMM)  // imm12 (relative)
 #define    OP_JZ   (8|OP_IMM)  // imm12 (relative)
+// jump if any / all lanes (of type) in v<d> are non zero
+#define    OP_VJANY (11|OP_IMM|OP_VEC)  // imm12 (relative)
+#define    OP_VJALL (12|OP_IMM|OP_VEC)  // imm12 (relative)
+
+#define OP_IS_JUMP(op) \
+    (((op)==OP_JMP)||((op)==OP_JNZ)||((op)==OP_JZ)||	\
+     ((op)==OP_VJANY)||((op)==OP_VJALL))
+
+// Convert FLOAT16/BFLOAT16 (type) lanes in lower half of vi to FLOAT32 lanes
+#define    OP_VCVT  (9|OP_VEC)
+// Convert FLOAT32 lanes to FLOAT16/BFLOAT16 (type) in lower half, upper zero
+#define    OP_VCVTN (10|OP_VEC)
 
 // Add 
 #define    OP_ADD   (OP_BIN|1)
@@ -155,9 +168,12 @@
 #define    OP_VRSUB  (OP_RSUB|OP_VEC)
 #define    OP_VRSUBI (OP_VRSUB|OP_IMM)
 
+// Select vd = (vj & vi) | (vk & ~vi), vi is a lane mask from vcmp (vector only)
+#define    OP_VSEL   (OP_BIN|OP_VEC|18)
+
 // base_type: 0 => UINT
 // base_type: 1 => INT
-// base_type: 2 => FLOAT01 (?use me)
+// base_type: 2 => FLOAT01 (16 bit: BFLOAT16)
 // base_type: 3 => FLOAT
 
 // NEW vector_size coding (3 bit!) implement me?
@@ -180,7 +196,7 @@ typedef struct {
 	    union {
 		struct {
 		    unsigned rj:4;   // src2 r<j> | v<j>
-		    unsigned pad:4;
+		    unsigned rk:4;   // src3 v<k> (vsel)
 		};
 		int8_t imm8;    // addi,subi,slli,srli,slai
 	    };
@@ -189,4 +205,68 @@ typedef struct {
     };
 } instr_t;
 
+// Wide 64-bit encoding, 5 bit register fields, 32 bit immediates for
+// alu ops and movi and 24 bit jump offsets. Wide code is lowered to
+// instr_t by jit_narrow (see jitter_wide.cpp) before it is run.
+//
+// OP:8 TYPE:8 Rd:5 Ri:5 _:6 | Rj:5 Rk:5 _:22
+// OP:8 TYPE:8 Rd:5 Ri:5 _:6 | Imm:32
+// OP:8 TYPE:8 Rd:5 _:11     | Imm:24 _:8
+//
+#define NUM_WIDE_REGISTERS 32
+
+typedef struct {
+    unsigned op:8;
+    unsigned type:8;
+    unsigned rd:5;
+    unsigned ri:5;
+    unsigned _pad:6;
+    union {
+	struct {
+	    unsigned rj:5;
+	    unsigned rk:5;
+	};
+	int32_t imm32;  // addi,subi,..,movi,vmovi
+	int imm24:24;   // jmp,jnz,jz relative offset
+    };
+} instr64_t;
+
+// max number of instr_t generated from one instr64_t, not counting
+// jump islands for jumps out of imm12 range
+#define WIDE_EXPAND 8
+
+// per kernel counters, updated by code assembled with profiling
+#define PROF_NONE 0
+#define PROF_TSC  1   // rdtsc, reference cycles
+#define PROF_PMC  2   // rdpmc fixed counter 1, unhalted core cycles
+
+typedef struct {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t pad[6];  // keep the block in its own cache line
+} jit_prof_t;
+
+// C prototype for assemble_native, argument i is loaded into register i
+// (scalar integer or FLOAT32/FLOAT64), ret is the type returned by ret
+// or VOID
+#define JIT_MAX_ARGS 4
+
+typedef struct {
+    uint8_t ret;
+    uint8_t nargs;
+    uint8_t arg[JIT_MAX_ARGS];
+} jit_proto_t;
+
+// emulator profile, counted by emulate_prof in builds with -DEMU_PROFILE
+typedef struct {
+    instr_t* code;       // profiled code (not owned)
+    size_t n;
+    uint64_t runs;       // number of emulate_prof calls
+    uint64_t dispatch;   // dispatches, a fused sequence is one
+    uint64_t* count;     // executions per instruction
+    uint64_t* taken;     // jumps taken per instruction
+    uint64_t* trip_run;  // backward jumps: current run of taken jumps
+    uint64_t* trip_max;  // backward jumps: longest run of taken jumps
+} emu_prof_t;
+
 #endif
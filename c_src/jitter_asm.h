@@ -18,6 +18,8 @@ extern void crash(const char* filename, int line, int code);
 #define VEC_TYPE_SSE4_2 (1 << 6)
 #define VEC_TYPE_AVX    (1 << 7)
 #define VEC_TYPE_AVX2   (1 << 8)
+#define VEC_TYPE_F16C   (1 << 9)
+#define VEC_TYPE_FMA    (1 << 10)  // used by jitter_gemm only
 
 // all vector flags
 #define VEC_TYPE_VEC    (0x7f)
@@ -25,6 +27,30 @@ extern void crash(const char* filename, int line, int code);
 #define R_FREE_MASK 0x6c00   // r14,r13,r11,r10  01101100|00000000
 #define X_FREE_MASK 0x3800   // v13,v12,v11      00111000|00000000
 
+// registers that may be spilled to get a temporary when the free
+// registers run out (not rax,rcx,rdx,rsp,rbp,rdi / xmm0 used implicitly)
+#define R_SPILL_MASK 0x9348  // r15,r12,r9,r8,rsi,rbx
+#define X_SPILL_MASK 0xc7fe  // v15,v14,v10..v1
+
+#define SPILL_GP_SLOTS  4
+#define SPILL_XMM_SLOTS 4
+// size of spill area in FuncFrame local stack
+#define SPILL_SIZE (SPILL_GP_SLOTS*8 + SPILL_XMM_SLOTS*16)
+
+// compile statistics collected by assemble when stats are set
+typedef struct {
+    size_t   code_size;       // bytes in text section, with constant pool
+    size_t   pool_size;       // constant pool bytes
+    uint32_t nops;            // jitter instructions assembled
+    uint32_t ninstr;          // native instructions emitted
+    uint32_t gp_peak;         // max gp temporaries used by one instruction
+    uint32_t xmm_peak;        // max xmm temporaries used by one instruction
+    uint32_t spills;          // temporaries that had to be spilled
+    unsigned vec_mask;        // enabled VEC_TYPE_xxx
+    uint32_t op_count[256];   // jitter instructions per op
+    uint32_t op_native[256];  // native instructions emitted per op
+} jit_stats_t;
+
 class ZAssembler : public x86::Assembler {
     Zone*      z_;
     ConstPool* pool_;
@@ -35,6 +61,22 @@ class ZAssembler : public x86::Assembler {
     unsigned vec_enabled;
     uint16_t r_free_mask;
     uint16_t x_free_mask;
+    uint16_t r_scratch_mask;  // free registers after reset
+    uint16_t x_scratch_mask;
+    uint32_t pin_mask;        // registers used by current instruction
+    int8_t spill_gp[SPILL_GP_SLOTS];    // spilled register or -1
+    int8_t spill_xmm[SPILL_XMM_SLOTS];
+    const void* dispatch_;    // emitter table for dispatch_vec (jitter_x86.cpp)
+    unsigned dispatch_vec;
+    bool dispatch_on;
+    jit_stats_t* stats_;
+    uint32_t* pc_map_;        // code offset per instruction or NULL
+    int prof_;                // PROF_xxx
+    Label prof_label_;        // jit_prof_t counter block
+    int fuel_;                // yield when vregfile_t.fuel is used up
+    int dump_;                // fxsave64 to save_ptr before return
+    int r_live;               // temporaries used by current instruction
+    int x_live;
 
 //    RegAlloc* r_alloc;   // allocate general registers
 //    RegAlloc* v_alloc;   // allocate vector registers
@@ -48,11 +90,21 @@ public:
 	code_ = code;
 	frame_ = NULL;
 	vec_available = 0;
-	r_free_mask = R_FREE_MASK;
-	x_free_mask = X_FREE_MASK;
+	r_scratch_mask = R_FREE_MASK;
+	x_scratch_mask = X_FREE_MASK;
+	pin_mask = 0;
+	dispatch_ = NULL;
+	dispatch_vec = 0;
+	dispatch_on = true;
+	stats_ = NULL;
+	pc_map_ = NULL;
+	prof_ = PROF_NONE;
+	fuel_ = 0;
+	dump_ = 1;
+	reg_alloc_reset();
 	if (code != NULL) {
 	    if (code->cpuFeatures().x86().hasMMX())
-		vec_available |= VEC_TYPE_AVX;
+		vec_available |= VEC_TYPE_MMX;
 	    if (code->cpuFeatures().x86().hasSSE())
 		vec_available |= VEC_TYPE_SSE;
 	    if (code->cpuFeatures().x86().hasSSE2())
@@ -69,6 +121,10 @@ public:
 		vec_available |= VEC_TYPE_AVX;
 	    if (code->cpuFeatures().x86().hasAVX2())
 		vec_available |= VEC_TYPE_AVX2;
+	    if (code->cpuFeatures().x86().hasF16C())
+		vec_available |= VEC_TYPE_F16C;
+	    if (code->cpuFeatures().x86().hasFMA())
+		vec_available |= VEC_TYPE_FMA;
 	    vec_enabled = vec_available;
 	}
     }
@@ -92,6 +148,8 @@ public:
     bool has_sse4_2() { return (vec_available & VEC_TYPE_SSE4_1) != 0; }
     bool has_avx() { return (vec_available & VEC_TYPE_AVX) != 0; }
     bool has_avx2() { return (vec_available & VEC_TYPE_AVX2) != 0; }
+    bool has_f16c() { return (vec_available & VEC_TYPE_F16C) != 0; }
+    bool has_fma() { return (vec_available & VEC_TYPE_FMA) != 0; }
 
     bool use_all(unsigned mask) { return (vec_enabled & mask) == mask; }
     bool use_any(unsigned mask) { return (vec_enabled & mask) != 0; }    
@@ -105,12 +163,17 @@ public:
     bool use_sse4_2() { return (vec_enabled & VEC_TYPE_SSE4_2) != 0; }    
     bool use_avx() { return (vec_enabled & VEC_TYPE_AVX) != 0; }
     bool use_avx2() { return (vec_enabled & VEC_TYPE_AVX2) != 0; }        
+    bool use_f16c() { return (vec_enabled & VEC_TYPE_F16C) != 0; }
+    bool use_fma() { return (vec_enabled & VEC_TYPE_FMA) != 0; }
+
+    unsigned enabled() { return vec_enabled; }
 
     void disable(unsigned mask) { vec_enabled &= ~mask; }
     void disable_vec() { vec_enabled &= ~(VEC_TYPE_VEC); }        
     void disable_mmx() { vec_enabled &= ~(VEC_TYPE_MMX); }    
     void disable_avx() { vec_enabled &= ~(VEC_TYPE_AVX); }
     void disable_avx2() { vec_enabled &= ~(VEC_TYPE_AVX2); }
+    void disable_f16c() { vec_enabled &= ~(VEC_TYPE_F16C); }
     void disable_sse() { vec_enabled &= ~(VEC_TYPE_SSE); }
     void disable_sse2() { vec_enabled &= ~(VEC_TYPE_SSE2); }
     void disable_sse3() { vec_enabled &= ~(VEC_TYPE_SSE3); }
@@ -123,6 +186,7 @@ public:
     void enable_mmx() { vec_enabled |= (vec_available & VEC_TYPE_MMX); }        
     void enable_avx() { vec_enabled |= (vec_available & VEC_TYPE_AVX); }        
     void enable_avx2() {vec_enabled |= (vec_available & VEC_TYPE_AVX2); }
+    void enable_f16c() {vec_enabled |= (vec_available & VEC_TYPE_F16C); }
     void enable_sse() { vec_enabled |= (vec_available & VEC_TYPE_SSE); }    
     void enable_sse2() {vec_enabled |= (vec_available & VEC_TYPE_SSE2); }
     void enable_sse3() {vec_enabled |= (vec_available & VEC_TYPE_SSE3); }
@@ -130,6 +194,61 @@ public:
     void enable_sse4_1() {vec_enabled |= (vec_available & VEC_TYPE_SSE4_1); }
     void enable_sse4_2() {vec_enabled |= (vec_available & VEC_TYPE_SSE4_2); }
 
+    // emitter table resolved for the currently enabled features
+    const void* dispatch() {
+	return (dispatch_vec == vec_enabled) ? dispatch_ : NULL;
+    }
+    void set_dispatch(const void* table) {
+	dispatch_ = table;
+	dispatch_vec = vec_enabled;
+    }
+    bool use_dispatch() { return dispatch_on; }
+    void enable_dispatch(bool on) { dispatch_on = on; }
+
+    void set_stats(jit_stats_t* sp) { stats_ = sp; }
+    jit_stats_t* stats() { return stats_; }
+
+    void set_pc_map(uint32_t* map) { pc_map_ = map; }
+    uint32_t* pc_map() { return pc_map_; }
+
+    // count calls and cycles in a jit_prof_t block emitted by assemble
+    void set_prof(int mode) {
+	prof_ = mode;
+	if (mode != PROF_NONE)
+	    prof_label_ = newLabel();
+    }
+    int prof() { return prof_; }
+    Label prof_label() { return prof_label_; }
+
+    // backward jumps use vregfile_t.fuel and yield when it runs out,
+    // the code then continues at vregfile_t.pc when called again
+    void set_fuel(int on) { fuel_ = on; }
+    int fuel() { return fuel_; }
+
+    // dump registers to save_ptr and return save_ptr (default), when
+    // off save_ptr is not used and the code returns NULL
+    void set_dump(int on) { dump_ = on; }
+    int dump() { return dump_; }
+
+    // count native instructions
+    Error _emit(uint32_t instId, const Operand_& o0, const Operand_& o1,
+		const Operand_& o2, const Operand_* opExt) override {
+	if (stats_ != NULL) stats_->ninstr++;
+	return x86::Assembler::_emit(instId, o0, o1, o2, opExt);
+    }
+
+    // temporary register taken (d=1) or given back (d=-1)
+    void gp_used(int d) {
+	r_live += d;
+	if ((stats_ != NULL) && (r_live > (int)stats_->gp_peak))
+	    stats_->gp_peak = r_live;
+    }
+    void xmm_used(int d) {
+	x_live += d;
+	if ((stats_ != NULL) && (x_live > (int)stats_->xmm_peak))
+	    stats_->xmm_peak = x_live;
+    }
+
     void set_func_frame(FuncFrame* frame) {
 	frame_ = frame;
     }
@@ -169,9 +288,81 @@ public:
 	return add_constant(&vvalue, sizeof(vvalue));
     }
 
+    x86::Mem add_vuint32(uint32_t value) {
+	vuint32_t vvalue = vuint32_t_const(value);
+	return add_constant(&vvalue, sizeof(vvalue));
+    }
+
+    // emit constant pool (if used) and start a new one
+    void embed_const_pool() {
+	if (pool_->size() > 0) {
+	    if (stats_ != NULL) stats_->pool_size += pool_->size();
+	    embedConstPool(pool_label_, *pool_);
+	    pool_->reset(z_);
+	    pool_label_ = newLabel();
+	}
+    }
+
     void reg_alloc_reset() {
-	r_free_mask = R_FREE_MASK;
-	x_free_mask = X_FREE_MASK;
+	int i;
+	r_free_mask = r_scratch_mask;
+	x_free_mask = x_scratch_mask;
+	r_live = 0;
+	x_live = 0;
+	for (i = 0; i < SPILL_GP_SLOTS; i++) spill_gp[i] = -1;
+	for (i = 0; i < SPILL_XMM_SLOTS; i++) spill_xmm[i] = -1;
+    }
+
+    // limit the free registers (subset of R_FREE_MASK/X_FREE_MASK)
+    void reg_scratch(uint16_t r_mask, uint16_t x_mask) {
+	r_scratch_mask = r_mask & R_FREE_MASK;
+	x_scratch_mask = x_mask & X_FREE_MASK;
+	reg_alloc_reset();
+    }
+
+    // registers that must not be spilled, bit 0-15 vector 16-31 scalar
+    // (scalar floats live in xmm so both halves pin both files)
+    void reg_pin(uint32_t mask) {
+	pin_mask = (mask & 0xffff) | (mask >> 16);
+    }
+
+    // pick register to spill and a slot for it, -1 if none left
+    int spill_(int8_t* slot, int nslots, uint16_t mask) {
+	int i, s = -1;
+	for (i = 0; i < nslots; i++) {
+	    if (slot[i] < 0) { if (s < 0) s = i; }
+	    else mask &= ~(1 << slot[i]);
+	}
+	mask &= ~pin_mask;
+	if ((s < 0) || (mask == 0))
+	    return -1;
+	for (i = 15; !(mask & (1 << i)); i--) ;
+	slot[s] = i;
+	if (stats_ != NULL) stats_->spills++;
+	return i;
+    }
+
+    int spill_slot_(int8_t* slot, int nslots, int r) {
+	int i;
+	for (i = 0; i < nslots; i++)
+	    if (slot[i] == r) return i;
+	return -1;
+    }
+
+    x86::Mem spill_mem_(int offs) {
+	return x86::ptr(x86::regs::rsp, frame_->localStackOffset() + offs);
+    }
+
+    int  reg_spill() { return spill_(spill_gp, SPILL_GP_SLOTS, R_SPILL_MASK); }
+    int  reg_spill_slot(int r) { return spill_slot_(spill_gp, SPILL_GP_SLOTS, r); }
+    void reg_unspill(int r) { spill_gp[reg_spill_slot(r)] = -1; }
+    x86::Mem reg_spill_mem(int r) { return spill_mem_(reg_spill_slot(r)*8); }
+
+    int  xreg_spill() { return spill_(spill_xmm, SPILL_XMM_SLOTS, X_SPILL_MASK); }
+    int  xreg_spill_slot(int v) { return spill_slot_(spill_xmm, SPILL_XMM_SLOTS, v); }
+    void xreg_unspill(int v) { spill_xmm[xreg_spill_slot(v)] = -1; }
+    x86::Mem xreg_spill_mem(int v) {
+	return spill_mem_(SPILL_GP_SLOTS*8 + xreg_spill_slot(v)*16);
     }
 
     int alloc_(uint16_t& mask) {
@@ -0,0 +1,145 @@
+//
+// Compile throughput benchmark
+// assemble large random programs with the emitter tables and with
+// the op switch, report instructions per second
+//
+
+#include <asmjit/x86.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace asmjit;
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_asm.h"
+
+extern void assemble(ZAssembler &a, const Environment &env,
+		     uint32_t reg_mask,
+		     x86::Mem save_ptr,
+		     instr_t* code, size_t n);
+
+#define BENCH_CODE_LEN 4000
+#define BENCH_ROUNDS   50
+
+static const uint8_t bench_ops[] = {
+    OP_MOV, OP_MOVI, OP_NEG, OP_BNOT, OP_ADD, OP_ADDI, OP_SUB, OP_SUBI,
+    OP_MUL, OP_MULI, OP_SLLI, OP_SRLI, OP_SRAI, OP_BAND, OP_BOR, OP_BXOR,
+    OP_CMPLT, OP_CMPEQ, OP_CMPGTI,
+    OP_VMOV, OP_VMOVI, OP_VNEG, OP_VBNOT, OP_VADD, OP_VADDI, OP_VSUB,
+    OP_VMUL, OP_VSLLI, OP_VSRLI, OP_VBAND, OP_VBOR, OP_VBXOR,
+    OP_VCMPLT, OP_VCMPEQ, OP_VCMPGTI, OP_VSEL
+};
+
+#define NUM_BENCH_OPS (sizeof(bench_ops)/sizeof(bench_ops[0]))
+
+static const uint8_t bench_types[] = {
+    UINT8, UINT16, UINT32, UINT64, INT8, INT16, INT32, INT64
+};
+
+static void bench_code(instr_t* code, size_t n)
+{
+    size_t i;
+
+    memset(code, 0, n*sizeof(instr_t));
+    for (i = 0; i < n-1; i++) {
+	instr_t* p = &code[i];
+	p->op = bench_ops[rand() % NUM_BENCH_OPS];
+	p->type = bench_types[rand() % sizeof(bench_types)];
+	p->rd = rand() % 4;
+	if ((p->op == OP_MOVI) || (p->op == OP_VMOVI))
+	    p->imm12 = (rand() % 4096) - 2048;
+	else if (p->op & OP_IMM) {
+	    p->ri = rand() % 4;
+	    p->imm8 = rand() % 8;
+	}
+	else {
+	    p->ri = rand() % 4;
+	    p->rj = rand() % 4;
+	    p->rk = rand() % 4;
+	}
+    }
+    code[n-1].op = OP_RET;
+    code[n-1].type = INT64;
+    code[n-1].rd = 0;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// seconds to assemble code rounds times
+static double bench_assemble(JitRuntime& rt, unsigned vec_mask, bool dispatch,
+			     instr_t* code, size_t n, int rounds)
+{
+    uint32_t reg_mask = 0x000f000f;
+    double t0 = bench_now();
+    int r;
+
+    for (r = 0; r < rounds; r++) {
+	CodeHolder ch;
+	Section* data;
+	Label save_label;
+
+	ch.init(rt.environment(), rt.cpuFeatures());
+	ch.newSection(&data, ".data", 5, SectionFlags::kNone, 128);
+	ZAssembler a(&ch, 1024);
+	a.disable(~0u);
+	a.enable(vec_mask);
+	a.enable_dispatch(dispatch);
+	save_label = a.newLabel();
+	assemble(a, rt.environment(), reg_mask, x86::ptr(save_label), code, n);
+	a.section(data);
+	a.bind(save_label);
+	a.embedDataArray(TypeId::kUInt8, "\0", 1, 512);
+    }
+    return bench_now() - t0;
+}
+
+int main(int argc, char** argv)
+{
+    static const struct {
+	const char* name;
+	unsigned mask;
+    } tier[] = {
+	{ "sse2", VEC_TYPE_SSE|VEC_TYPE_SSE2 },
+	{ "sse4.1", VEC_TYPE_SSE|VEC_TYPE_SSE2|VEC_TYPE_SSE3|VEC_TYPE_SSSE3|
+	  VEC_TYPE_SSE4_1 },
+	{ "avx2", VEC_TYPE_SSE|VEC_TYPE_SSE2|VEC_TYPE_SSE3|VEC_TYPE_SSSE3|
+	  VEC_TYPE_SSE4_1|VEC_TYPE_SSE4_2|VEC_TYPE_AVX|VEC_TYPE_AVX2|
+	  VEC_TYPE_F16C },
+    };
+    int rounds = (argc > 1) ? atoi(argv[1]) : BENCH_ROUNDS;
+    JitRuntime rt;
+    instr_t code[BENCH_CODE_LEN];
+    size_t n = BENCH_CODE_LEN;
+    size_t i;
+
+    srand(1);
+    bench_code(code, n);
+    printf("%lu instructions, %d rounds\n", n, rounds);
+    for (i = 0; i < sizeof(tier)/sizeof(tier[0]); i++) {
+	CodeHolder ch;
+	double t_switch, t_table;
+
+	ch.init(rt.environment(), rt.cpuFeatures());
+	ZAssembler a(&ch, 64);
+	if ((a.enabled() & tier[i].mask) != tier[i].mask) {
+	    printf("%-8s not available\n", tier[i].name);
+	    continue;
+	}
+	bench_assemble(rt, tier[i].mask, true, code, n, 1);  // warm up
+	t_switch = bench_assemble(rt, tier[i].mask, false, code, n, rounds);
+	t_table = bench_assemble(rt, tier[i].mask, true, code, n, rounds);
+	printf("%-8s switch %8.0f instr/s  table %8.0f instr/s  (%+.1f%%)\n",
+	       tier[i].name,
+	       n*rounds/t_switch, n*rounds/t_table,
+	       100.0*(t_switch - t_table)/t_switch);
+    }
+    exit(0);
+}
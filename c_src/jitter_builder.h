@@ -0,0 +1,388 @@
+#ifndef __JITTER_BUILDER_H__
+#define __JITTER_BUILDER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jitter_types.h"
+#include "jitter.h"
+
+// Program builder. Instructions are encoded by constexpr functions, so
+// a fixed kernel is built and checked at compile time:
+//
+//   constexpr Program<8> sum_code() {
+//       Program<8> p;
+//       auto loop = p.label();
+//       p.add<int32_t>(r1, r1, r0);
+//       p.subi<int32_t>(r0, r0, 1);
+//       p.jnz<int32_t>(r0, loop);
+//       p.ret<int32_t>(r1);
+//       p.end();
+//       return p;
+//   }
+//   constexpr Program<8> sum = sum_code();
+//
+// Register numbers, imm8/imm12 ranges, integer only operations, jump
+// targets and unbound labels are checked with crash(), in a constexpr
+// context that is a compile error. The code must be ended with end()
+// before code() is passed to assemble() or emulate().
+
+extern void crash(const char* filename, int line, int code);
+
+template<typename T> struct jit_type_of;
+template<> struct jit_type_of<void>     { static const uint8_t value = VOID; };
+template<> struct jit_type_of<uint8_t>  { static const uint8_t value = UINT8; };
+template<> struct jit_type_of<uint16_t> { static const uint8_t value = UINT16; };
+template<> struct jit_type_of<uint32_t> { static const uint8_t value = UINT32; };
+template<> struct jit_type_of<uint64_t> { static const uint8_t value = UINT64; };
+template<> struct jit_type_of<int8_t>   { static const uint8_t value = INT8; };
+template<> struct jit_type_of<int16_t>  { static const uint8_t value = INT16; };
+template<> struct jit_type_of<int32_t>  { static const uint8_t value = INT32; };
+template<> struct jit_type_of<int64_t>  { static const uint8_t value = INT64; };
+template<> struct jit_type_of<float>    { static const uint8_t value = FLOAT32; };
+template<> struct jit_type_of<double>   { static const uint8_t value = FLOAT64; };
+
+typedef struct { unsigned i; } jit_reg_t;   // scalar register r<i>
+typedef struct { unsigned i; } jit_vreg_t;  // vector register v<i>
+
+constexpr jit_reg_t r0{0},   r1{1},   r2{2},   r3{3},
+                    r4{4},   r5{5},   r6{6},   r7{7},
+                    r8{8},   r9{9},   r10{10}, r11{11},
+                    r12{12}, r13{13}, r14{14}, r15{15};
+constexpr jit_vreg_t v0{0},   v1{1},   v2{2},   v3{3},
+                     v4{4},   v5{5},   v6{6},   v7{7},
+                     v8{8},   v9{9},   v10{10}, v11{11},
+                     v12{12}, v13{13}, v14{14}, v15{15};
+
+// instruction encoding
+
+constexpr instr_t jit_op_rrr(unsigned op, unsigned type,
+			     unsigned d, unsigned i, unsigned j, unsigned k)
+{
+    return instr_t{ .op = op, .type = type, .rd = d,
+		    .ri = i, .rj = j, .rk = k };
+}
+
+constexpr instr_t jit_op_imm8(unsigned op, unsigned type,
+			      unsigned d, unsigned i, int imm)
+{
+    return instr_t{ .op = op, .type = type, .rd = d,
+		    .ri = i, .imm8 = (int8_t) imm };
+}
+
+constexpr instr_t jit_op_imm12(unsigned op, unsigned type,
+			       unsigned d, int imm)
+{
+    instr_t p = { .op = op, .type = type, .rd = d, .imm12 = 0 };
+    p.imm12 = imm;
+    return p;
+}
+
+#define JIT_IS_INT_TYPE(t) (get_base_type(t) <= INT)
+
+// scalar and vector forms of a binary operation, with imm8 versions
+#define BUILD_BIN(name, OP, int_only)					\
+    constexpr void name(uint8_t t, jit_reg_t d, jit_reg_t i, jit_reg_t j) { \
+	check_type(t, int_only);					\
+	emit(jit_op_rrr(OP, t, reg(d.i), reg(i.i), reg(j.i), 0));	\
+    }									\
+    constexpr void name##i(uint8_t t, jit_reg_t d, jit_reg_t i, int imm) { \
+	check_type(t, int_only);					\
+	emit(jit_op_imm8(OP|OP_IMM, t, reg(d.i), reg(i.i), imm8(imm)));	\
+    }									\
+    constexpr void v##name(uint8_t t, jit_vreg_t d, jit_vreg_t i, jit_vreg_t j) { \
+	check_type(t, int_only);					\
+	emit(jit_op_rrr(OP|OP_VEC, t, reg(d.i), reg(i.i), reg(j.i), 0)); \
+    }									\
+    constexpr void v##name##i(uint8_t t, jit_vreg_t d, jit_vreg_t i, int imm) { \
+	check_type(t, int_only);					\
+	emit(jit_op_imm8(OP|OP_VEC|OP_IMM, t, reg(d.i), reg(i.i), imm8(imm))); \
+    }									\
+    template<typename T>						\
+    constexpr void name(jit_reg_t d, jit_reg_t i, jit_reg_t j) {	\
+	name(jit_type_of<T>::value, d, i, j);				\
+    }									\
+    template<typename T>						\
+    constexpr void name##i(jit_reg_t d, jit_reg_t i, int imm) {		\
+	name##i(jit_type_of<T>::value, d, i, imm);			\
+    }									\
+    template<typename T>						\
+    constexpr void v##name(jit_vreg_t d, jit_vreg_t i, jit_vreg_t j) {	\
+	v##name(jit_type_of<T>::value, d, i, j);			\
+    }									\
+    template<typename T>						\
+    constexpr void v##name##i(jit_vreg_t d, jit_vreg_t i, int imm) {	\
+	v##name##i(jit_type_of<T>::value, d, i, imm);			\
+    }
+
+// shifts, scalar forms and the vector imm8 form, the vector shift by
+// register takes a scalar shift amount (BUILD_VSHIFT)
+#define BUILD_SHIFT(name, OP)						\
+    constexpr void name(uint8_t t, jit_reg_t d, jit_reg_t i, jit_reg_t j) { \
+	check_type(t, 1);						\
+	emit(jit_op_rrr(OP, t, reg(d.i), reg(i.i), reg(j.i), 0));	\
+    }									\
+    constexpr void name##i(uint8_t t, jit_reg_t d, jit_reg_t i, int imm) { \
+	check_type(t, 1);						\
+	emit(jit_op_imm8(OP|OP_IMM, t, reg(d.i), reg(i.i), imm8(imm)));	\
+    }									\
+    constexpr void v##name##i(uint8_t t, jit_vreg_t d, jit_vreg_t i, int imm) { \
+	check_type(t, 1);						\
+	emit(jit_op_imm8(OP|OP_VEC|OP_IMM, t, reg(d.i), reg(i.i), imm8(imm))); \
+    }									\
+    template<typename T>						\
+    constexpr void name(jit_reg_t d, jit_reg_t i, jit_reg_t j) {	\
+	name(jit_type_of<T>::value, d, i, j);				\
+    }									\
+    template<typename T>						\
+    constexpr void name##i(jit_reg_t d, jit_reg_t i, int imm) {		\
+	name##i(jit_type_of<T>::value, d, i, imm);			\
+    }									\
+    template<typename T>						\
+    constexpr void v##name##i(jit_vreg_t d, jit_vreg_t i, int imm) {	\
+	v##name##i(jit_type_of<T>::value, d, i, imm);			\
+    }
+
+// vector shift by a scalar register, vd = vi << rj
+#define BUILD_VSHIFT(name, OP)						\
+    constexpr void name(uint8_t t, jit_vreg_t d, jit_vreg_t i, jit_reg_t j) { \
+	check_type(t, 1);						\
+	emit(jit_op_rrr(OP, t, reg(d.i), reg(i.i), reg(j.i), 0));	\
+    }									\
+    template<typename T>						\
+    constexpr void name(jit_vreg_t d, jit_vreg_t i, jit_reg_t j) {	\
+	name(jit_type_of<T>::value, d, i, j);				\
+    }
+
+// scalar and vector forms of a unary operation
+#define BUILD_UNARY(name, OP, int_only)					\
+    constexpr void name(uint8_t t, jit_reg_t d, jit_reg_t i) {		\
+	check_type(t, int_only);					\
+	emit(jit_op_rrr(OP, t, reg(d.i), reg(i.i), 0, 0));		\
+    }									\
+    constexpr void v##name(uint8_t t, jit_vreg_t d, jit_vreg_t i) {	\
+	check_type(t, int_only);					\
+	emit(jit_op_rrr(OP|OP_VEC, t, reg(d.i), reg(i.i), 0, 0));	\
+    }									\
+    template<typename T>						\
+    constexpr void name(jit_reg_t d, jit_reg_t i) {			\
+	name(jit_type_of<T>::value, d, i);				\
+    }									\
+    template<typename T>						\
+    constexpr void v##name(jit_vreg_t d, jit_vreg_t i) {		\
+	v##name(jit_type_of<T>::value, d, i);				\
+    }
+
+// conditional jump on a register
+#define BUILD_JUMP(name, OP, R)						\
+    constexpr void name(uint8_t t, R d, Label l) {			\
+	check_type(t, 0);						\
+	jump(jit_op_imm12(OP, t, reg(d.i), 0), l);			\
+    }									\
+    template<typename T>						\
+    constexpr void name(R d, Label l) {					\
+	name(jit_type_of<T>::value, d, l);				\
+    }
+
+template<size_t N>
+class Program {
+public:
+    typedef struct { size_t id; } Label;
+
+    constexpr Program() {}
+
+    // new label bound at the current position (backward jumps)
+    constexpr Label label() {
+	Label l = new_label();
+	bind(l);
+	return l;
+    }
+
+    // new unbound label (forward jumps)
+    constexpr Label new_label() {
+	if (nlabels_ > N)
+	    crash(__FILE__, __LINE__, (int) nlabels_);
+	lpos_[nlabels_] = -1;
+	return Label{ nlabels_++ };
+    }
+
+    constexpr void bind(Label l) {
+	if ((l.id >= nlabels_) || (lpos_[l.id] >= 0))
+	    crash(__FILE__, __LINE__, (int) l.id);
+	lpos_[l.id] = (int) n_;
+    }
+
+    constexpr void nop() { emit(jit_op_rrr(OP_NOP, INT64, 0, 0, 0, 0)); }
+
+    constexpr void ret(uint8_t t, jit_reg_t d) {
+	check_type(t, 0);
+	emit(jit_op_rrr(OP_RET, t, reg(d.i), 0, 0, 0));
+    }
+    constexpr void vret(uint8_t t, jit_vreg_t d) {
+	check_type(t, 0);
+	emit(jit_op_rrr(OP_VRET, t, reg(d.i), 0, 0, 0));
+    }
+    template<typename T> constexpr void ret(jit_reg_t d) {
+	ret(jit_type_of<T>::value, d);
+    }
+    template<typename T> constexpr void vret(jit_vreg_t d) {
+	vret(jit_type_of<T>::value, d);
+    }
+
+    constexpr void movi(uint8_t t, jit_reg_t d, int imm) {
+	check_type(t, 0);
+	emit(jit_op_imm12(OP_MOVI, t, reg(d.i), imm12(imm)));
+    }
+    constexpr void vmovi(uint8_t t, jit_vreg_t d, int imm) {
+	check_type(t, 0);
+	emit(jit_op_imm12(OP_VMOVI, t, reg(d.i), imm12(imm)));
+    }
+    template<typename T> constexpr void movi(jit_reg_t d, int imm) {
+	movi(jit_type_of<T>::value, d, imm);
+    }
+    template<typename T> constexpr void vmovi(jit_vreg_t d, int imm) {
+	vmovi(jit_type_of<T>::value, d, imm);
+    }
+
+    BUILD_UNARY(mov, OP_MOV, 0)
+    BUILD_UNARY(neg, OP_NEG, 0)
+    BUILD_UNARY(bnot, OP_BNOT, 1)
+    BUILD_UNARY(inv, OP_INV, 0)
+
+    BUILD_BIN(add, OP_ADD, 0)
+    BUILD_BIN(sub, OP_SUB, 0)
+    BUILD_BIN(rsub, OP_RSUB, 0)
+    BUILD_BIN(mul, OP_MUL, 0)
+    BUILD_SHIFT(sll, OP_SLL)
+    BUILD_SHIFT(srl, OP_SRL)
+    BUILD_SHIFT(sra, OP_SRA)
+    BUILD_BIN(band, OP_BAND, 1)
+    BUILD_BIN(bandn, OP_BANDN, 1)
+    BUILD_BIN(bor, OP_BOR, 1)
+    BUILD_BIN(bxor, OP_BXOR, 1)
+    BUILD_BIN(cmplt, OP_CMPLT, 0)
+    BUILD_BIN(cmple, OP_CMPLE, 0)
+    BUILD_BIN(cmpeq, OP_CMPEQ, 0)
+    BUILD_BIN(cmpgt, OP_CMPGT, 0)
+    BUILD_BIN(cmpge, OP_CMPGE, 0)
+    BUILD_BIN(cmpne, OP_CMPNE, 0)
+
+    BUILD_VSHIFT(vsll, OP_VSLL)
+    BUILD_VSHIFT(vsrl, OP_VSRL)
+    BUILD_VSHIFT(vsra, OP_VSRA)
+
+    // vd = (va & vm) | (vb & ~vm)
+    constexpr void vsel(uint8_t t, jit_vreg_t d, jit_vreg_t m,
+			jit_vreg_t va, jit_vreg_t vb) {
+	check_type(t, 0);
+	emit(jit_op_rrr(OP_VSEL, t, reg(d.i), reg(m.i), reg(va.i), reg(vb.i)));
+    }
+    template<typename T> constexpr void vsel(jit_vreg_t d, jit_vreg_t m,
+					     jit_vreg_t va, jit_vreg_t vb) {
+	vsel(jit_type_of<T>::value, d, m, va, vb);
+    }
+
+    // t is FLOAT16 or BFLOAT16
+    constexpr void vcvt(uint8_t t, jit_vreg_t d, jit_vreg_t i) {
+	check_half(t);
+	emit(jit_op_rrr(OP_VCVT, t, reg(d.i), reg(i.i), 0, 0));
+    }
+    constexpr void vcvtn(uint8_t t, jit_vreg_t d, jit_vreg_t i) {
+	check_half(t);
+	emit(jit_op_rrr(OP_VCVTN, t, reg(d.i), reg(i.i), 0, 0));
+    }
+
+    constexpr void jmp(Label l) {
+	jump(jit_op_imm12(OP_JMP, INT64, 0, 0), l);
+    }
+    BUILD_JUMP(jnz, OP_JNZ, jit_reg_t)
+    BUILD_JUMP(jz, OP_JZ, jit_reg_t)
+    BUILD_JUMP(vjany, OP_VJANY, jit_vreg_t)
+    BUILD_JUMP(vjall, OP_VJALL, jit_vreg_t)
+
+    // resolve jumps, all labels used must be bound
+    constexpr void end() {
+	size_t f = 0;
+
+	for (f = 0; f < nfix_; f++) {
+	    const instr_t& p = code_[fix_at_[f]];
+	    int pos = lpos_[fix_label_[f]];
+	    if (pos < 0)
+		crash(__FILE__, __LINE__, (int) fix_label_[f]);
+	    code_[fix_at_[f]] = jit_op_imm12(p.op, p.type, p.rd,
+					     imm12(pos - (int)(fix_at_[f]+1)));
+	}
+	nfix_ = 0;
+	ended_ = true;
+    }
+
+    constexpr size_t size() const { return n_; }
+    constexpr bool ended() const { return ended_; }
+    constexpr const instr_t& operator[](size_t i) const { return code_[i]; }
+    const instr_t* code() const { return code_; }
+    instr_t* code() { return code_; }
+
+private:
+    constexpr void emit(instr_t p) {
+	if (n_ >= N)
+	    crash(__FILE__, __LINE__, (int) n_);
+	code_[n_++] = p;
+	ended_ = false;
+    }
+
+    constexpr void jump(instr_t p, Label l) {
+	if (l.id >= nlabels_)
+	    crash(__FILE__, __LINE__, (int) l.id);
+	fix_at_[nfix_] = n_;
+	fix_label_[nfix_] = l.id;
+	nfix_++;
+	emit(p);
+    }
+
+    static constexpr unsigned reg(unsigned r) {
+	if (r >= NUM_SCALAR_REGISTERS)
+	    crash(__FILE__, __LINE__, (int) r);
+	return r;
+    }
+
+    static constexpr int imm8(int imm) {
+	if ((imm < -128) || (imm > 127))
+	    crash(__FILE__, __LINE__, imm);
+	return imm;
+    }
+
+    static constexpr int imm12(int imm) {
+	if ((imm < -2048) || (imm > 2047))
+	    crash(__FILE__, __LINE__, imm);
+	return imm;
+    }
+
+    static constexpr void check_type(uint8_t t, int int_only) {
+	if ((t == VOID) ||
+	    (int_only && !JIT_IS_INT_TYPE(t)))
+	    crash(__FILE__, __LINE__, t);
+    }
+
+    static constexpr void check_half(uint8_t t) {
+	if ((t != FLOAT16) && (t != BFLOAT16))
+	    crash(__FILE__, __LINE__, t);
+    }
+
+    instr_t code_[N] = {};
+    size_t n_ = 0;
+    int lpos_[N+1] = {};         // label position, -1 when unbound
+    size_t nlabels_ = 0;
+    size_t fix_at_[N] = {};      // jump instruction
+    size_t fix_label_[N] = {};   // jump target label
+    size_t nfix_ = 0;
+    bool ended_ = false;
+};
+
+#undef BUILD_BIN
+#undef BUILD_SHIFT
+#undef BUILD_VSHIFT
+#undef BUILD_UNARY
+#undef BUILD_JUMP
+#undef JIT_IS_INT_TYPE
+
+#endif
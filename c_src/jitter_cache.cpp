@@ -0,0 +1,259 @@
+//
+// On disk machine code cache
+//
+
+#include <asmjit/x86.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+
+using namespace asmjit;
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_cache.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x00000100000001b3ULL
+
+// two unrelated load addresses used to check that code is relocatable
+#define PIC_BASE1  0x0000000010000000ULL
+#define PIC_BASE2  0x00007f5a3c5c0000ULL
+
+struct _jit_cache_t {
+    char* dir;
+    std::atomic<uint64_t> hit;
+    std::atomic<uint64_t> miss;
+    std::atomic<uint64_t> invalid;
+    std::atomic<uint64_t> store;
+    std::atomic<uint64_t> nopic;
+};
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t len)
+{
+    const uint8_t* ptr = (const uint8_t*) data;
+
+    while(len--) {
+	h ^= *ptr++;
+	h *= FNV_PRIME;
+    }
+    return h;
+}
+
+uint64_t jit_cache_key(instr_t* code, size_t n,
+		       uint32_t reg_mask, unsigned vec_mask)
+{
+    uint32_t v[4];
+    uint64_t h;
+
+    v[0] = JIT_CACHE_VERSION;
+    v[1] = ASMJIT_LIBRARY_VERSION;
+    v[2] = vec_mask;
+    v[3] = reg_mask;
+    h = fnv1a(FNV_OFFSET, v, sizeof(v));
+    return fnv1a(h, code, n*sizeof(instr_t));
+}
+
+static void cache_path(jit_cache_t* c, uint64_t key, char* path, size_t len)
+{
+    snprintf(path, len, "%s/%016llx.jit", c->dir, (unsigned long long) key);
+}
+
+jit_cache_t* jit_cache_open(const char* dir)
+{
+    struct stat st;
+    jit_cache_t* c;
+
+    if ((stat(dir, &st) < 0) || !S_ISDIR(st.st_mode) ||
+	(access(dir, R_OK|W_OK|X_OK) < 0))
+	return NULL;
+    c = new jit_cache_t;
+    c->dir = strdup(dir);
+    c->hit = 0;
+    c->miss = 0;
+    c->invalid = 0;
+    c->store = 0;
+    c->nopic = 0;
+    return c;
+}
+
+void jit_cache_close(jit_cache_t* c)
+{
+    free(c->dir);
+    delete c;
+}
+
+void jit_cache_stats(jit_cache_t* c, jit_cache_stats_t* sp)
+{
+    sp->hit     = c->hit.load();
+    sp->miss    = c->miss.load();
+    sp->invalid = c->invalid.load();
+    sp->store   = c->store.load();
+    sp->nopic   = c->nopic.load();
+}
+
+// check header and content of mapped entry, return code bytes or NULL
+static uint8_t* cache_check(uint8_t* ptr, size_t len, uint64_t key,
+			    instr_t* code, size_t n,
+			    uint32_t reg_mask, unsigned vec_mask)
+{
+    jit_cache_hdr_t* hp = (jit_cache_hdr_t*) ptr;
+    uint8_t* cp = ptr + sizeof(jit_cache_hdr_t);
+
+    if ((len < sizeof(jit_cache_hdr_t)) ||
+	(hp->magic != JIT_CACHE_MAGIC) ||
+	(hp->version != JIT_CACHE_VERSION) ||
+	(hp->asmjit != ASMJIT_LIBRARY_VERSION) ||
+	(hp->key != key) ||
+	(hp->vec_mask != vec_mask) ||
+	(hp->reg_mask != reg_mask) ||
+	(hp->n != n) || (hp->size == 0) ||
+	(len != sizeof(jit_cache_hdr_t) + n*sizeof(instr_t) + hp->size))
+	return NULL;
+    // same key but other program?
+    if (memcmp(cp, code, n*sizeof(instr_t)) != 0)
+	return NULL;
+    if (fnv1a(FNV_OFFSET, cp, len - sizeof(jit_cache_hdr_t)) != hp->check)
+	return NULL;
+    return cp + n*sizeof(instr_t);
+}
+
+// copy flattened code to bytes, 1 if the code does not change
+// with the load address
+int jit_cache_image(CodeHolder& ch, uint8_t* bytes, size_t size)
+{
+    uint8_t* other = (uint8_t*) calloc(1, size);
+    int res;
+
+    memset(bytes, 0, size);
+    ch.relocateToBase(PIC_BASE1);
+    ch.copyFlattenedData(bytes, size, CopySectionFlags::kPadTargetBufferSize);
+    ch.relocateToBase(PIC_BASE2);
+    ch.copyFlattenedData(other, size, CopySectionFlags::kPadTargetBufferSize);
+    res = (memcmp(bytes, other, size) == 0);
+    free(other);
+    return res;
+}
+
+// copy position independent code into runtime memory
+void* jit_cache_add(JitRuntime& rt, const uint8_t* bytes, size_t size)
+{
+    CodeHolder ch;
+    void* fn;
+
+    ch.init(rt.environment(), rt.cpuFeatures());
+    x86::Assembler a(&ch);
+    if ((a.embed(bytes, size) != kErrorOk) ||
+	(rt.add(&fn, &ch) != kErrorOk))
+	return NULL;
+    return fn;
+}
+
+void* jit_cache_load(jit_cache_t* c, JitRuntime& rt,
+		     instr_t* code, size_t n,
+		     uint32_t reg_mask, unsigned vec_mask,
+		     size_t* sizep)
+{
+    uint64_t key = jit_cache_key(code, n, reg_mask, vec_mask);
+    char path[1024];
+    struct stat st;
+    uint8_t* ptr;
+    uint8_t* bytes;
+    void* fn = NULL;
+    int fd;
+
+    cache_path(c, key, path, sizeof(path));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	c->miss++;
+	return NULL;
+    }
+    if ((fstat(fd, &st) < 0) || (st.st_size == 0)) {
+	close(fd);
+	c->invalid++;
+	return NULL;
+    }
+    ptr = (uint8_t*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+	c->invalid++;
+	return NULL;
+    }
+    if ((bytes = cache_check(ptr, st.st_size, key, code, n,
+			     reg_mask, vec_mask)) != NULL) {
+	fn = jit_cache_add(rt, bytes, ((jit_cache_hdr_t*) ptr)->size);
+	if (sizep != NULL)
+	    *sizep = ((jit_cache_hdr_t*) ptr)->size;
+    }
+    munmap(ptr, st.st_size);
+    if (fn == NULL)
+	c->invalid++;
+    else
+	c->hit++;
+    return fn;
+}
+
+int jit_cache_store(jit_cache_t* c, CodeHolder& ch,
+		    instr_t* code, size_t n,
+		    uint32_t reg_mask, unsigned vec_mask)
+{
+    uint64_t key = jit_cache_key(code, n, reg_mask, vec_mask);
+    size_t size = ch.codeSize();
+    size_t len = sizeof(jit_cache_hdr_t) + n*sizeof(instr_t) + size;
+    char path[1024];
+    char tmp[1100];
+    jit_cache_hdr_t* hp;
+    uint8_t* buf;
+    uint8_t* bytes;
+    int fd;
+    int res = 0;
+
+    if ((size == 0) || (size > 0xffffffff))
+	return 0;
+    buf = (uint8_t*) calloc(1, len);
+    hp = (jit_cache_hdr_t*) buf;
+    bytes = buf + sizeof(jit_cache_hdr_t) + n*sizeof(instr_t);
+
+    if (!jit_cache_image(ch, bytes, size)) {
+	c->nopic++;
+	goto done;
+    }
+    hp->magic = JIT_CACHE_MAGIC;
+    hp->version = JIT_CACHE_VERSION;
+    hp->asmjit = ASMJIT_LIBRARY_VERSION;
+    hp->vec_mask = vec_mask;
+    hp->reg_mask = reg_mask;
+    hp->n = n;
+    hp->size = size;
+    hp->key = key;
+    memcpy(buf + sizeof(jit_cache_hdr_t), code, n*sizeof(instr_t));
+    hp->check = fnv1a(FNV_OFFSET, buf + sizeof(jit_cache_hdr_t),
+		      len - sizeof(jit_cache_hdr_t));
+
+    // write to a unique temporary file and rename, readers never see
+    // partial data, also with several writers of the same key
+    cache_path(c, key, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0)
+	goto done;
+    if ((fchmod(fd, 0644) < 0) ||
+	(write(fd, buf, len) != (ssize_t) len)) {
+	close(fd);
+	unlink(tmp);
+	goto done;
+    }
+    close(fd);
+    if (rename(tmp, path) < 0) {
+	unlink(tmp);
+	goto done;
+    }
+    c->store++;
+    res = 1;
+done:
+    free(buf);
+    return res;
+}
@@ -0,0 +1,65 @@
+#ifndef __JITTER_CACHE_H__
+#define __JITTER_CACHE_H__
+
+#include <asmjit/x86.h>
+
+#include "jitter_types.h"
+#include "jitter.h"
+
+using namespace asmjit;
+
+// On disk cache of position independent machine code.
+// One file per kernel <dir>/<key>.jit, key is a hash of the program,
+// the register mask, the enabled vector features and the versions.
+
+#define JIT_CACHE_MAGIC   0x4354494a  // "JITC"
+#define JIT_CACHE_VERSION 2
+
+typedef struct {
+    uint32_t magic;     // JIT_CACHE_MAGIC
+    uint32_t version;   // JIT_CACHE_VERSION
+    uint32_t asmjit;    // ASMJIT_LIBRARY_VERSION
+    uint32_t vec_mask;  // enabled VEC_TYPE_xxx
+    uint32_t reg_mask;  // loaded registers
+    uint32_t n;         // number of instructions
+    uint32_t size;      // code size in bytes
+    uint32_t pad;
+    uint64_t key;       // jit_cache_key
+    uint64_t check;     // hash of instructions and code
+    // instr_t code[n];
+    // uint8_t bytes[size];
+} jit_cache_hdr_t;
+
+typedef struct {
+    uint64_t hit;       // loaded from disk
+    uint64_t miss;      // no entry
+    uint64_t invalid;   // bad entry, recompiled
+    uint64_t store;     // entries written
+    uint64_t nopic;     // code not position independent, not stored
+} jit_cache_stats_t;
+
+typedef struct _jit_cache_t jit_cache_t;
+
+// NULL if dir is not a usable directory
+extern jit_cache_t* jit_cache_open(const char* dir);
+extern void jit_cache_close(jit_cache_t* c);
+extern void jit_cache_stats(jit_cache_t* c, jit_cache_stats_t* sp);
+
+extern uint64_t jit_cache_key(instr_t* code, size_t n,
+			      uint32_t reg_mask, unsigned vec_mask);
+// add cached code to rt, NULL when missing or invalid,
+// code size in *sizep unless sizep is NULL
+extern void* jit_cache_load(jit_cache_t* c, JitRuntime& rt,
+			    instr_t* code, size_t n,
+			    uint32_t reg_mask, unsigned vec_mask,
+			    size_t* sizep);
+// flatten relocated code into bytes[size], 1 if position independent
+extern int jit_cache_image(CodeHolder& ch, uint8_t* bytes, size_t size);
+// copy position independent code into rt
+extern void* jit_cache_add(JitRuntime& rt, const uint8_t* bytes, size_t size);
+// store code already added with rt.add, 0 when not stored
+extern int jit_cache_store(jit_cache_t* c, CodeHolder& ch,
+			   instr_t* code, size_t n,
+			   uint32_t reg_mask, unsigned vec_mask);
+
+#endif
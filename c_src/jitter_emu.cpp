@@ -3,6 +3,8 @@
 // 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "jitter_types.h"
 #include "jitter.h"
 
@@ -584,6 +586,76 @@ void emu_vbnot(uint8_t type, vregfile_t* rfp, int d, int i)
     KFFVdi(vu64,vu64,d,i,op_bnot);
 }
 
+// any lane in vi is non zero
+int emu_vany(uint8_t type, vregfile_t* rfp, int i)
+{
+    unsigned k;
+    (void) type;
+    for (k = 0; k < VSIZE; k++)
+	if (rfp->v[i].vu8[k]) return 1;
+    return 0;
+}
+
+// all lanes (of type) in vi are non zero
+int emu_vall(uint8_t type, vregfile_t* rfp, int i)
+{
+    unsigned size = get_scalar_size(type);
+    unsigned k, l;
+    for (k = 0; k < VSIZE; k += size) {
+	for (l = 0; (l < size) && !rfp->v[i].vu8[k+l]; l++)
+	    ;
+	if (l == size) return 0;
+    }
+    return 1;
+}
+
+// select bits from vj where vi is set and from vk where vi is clear
+void emu_vsel(uint8_t type, vregfile_t* rfp, int d, int i, int j, int k)
+{
+    unsigned l;
+    (void) type;
+    for (l = 0; l < VSIZE/sizeof(uint64_t); l++) {
+	uint64_t m = rfp->v[i].vu64[l];
+	rfp->v[d].vu64[l] = (rfp->v[j].vu64[l] & m) |
+	    (rfp->v[k].vu64[l] & ~m);
+    }
+}
+
+// FLOAT16/BFLOAT16 lanes in lower half of vi => FLOAT32 lanes
+void emu_vcvt(uint8_t type, vregfile_t* rfp, int d, int i)
+{
+    float32_t r[VSIZE/sizeof(float32_t)];
+    unsigned k;
+
+    for (k = 0; k < VSIZE/sizeof(float32_t); k++) {
+	switch(type) {
+	case FLOAT16: r[k] = float16_to_float32(rfp->v[i].vf16[k]); break;
+	case BFLOAT16: r[k] = bfloat16_to_float32(rfp->v[i].vbf16[k]); break;
+	default: return;
+	}
+    }
+    for (k = 0; k < VSIZE/sizeof(float32_t); k++)
+	rfp->v[d].vf32[k] = r[k];
+}
+
+// FLOAT32 lanes => FLOAT16/BFLOAT16 lanes in lower half, upper half zero
+void emu_vcvtn(uint8_t type, vregfile_t* rfp, int d, int i)
+{
+    uint16_t r[VSIZE/sizeof(uint16_t)];
+    unsigned k;
+
+    memset(r, 0, sizeof(r));
+    for (k = 0; k < VSIZE/sizeof(float32_t); k++) {
+	switch(type) {
+	case FLOAT16: r[k] = float32_to_float16(rfp->v[i].vf32[k]); break;
+	case BFLOAT16: r[k] = float32_to_bfloat16(rfp->v[i].vf32[k]); break;
+	default: return;
+	}
+    }
+    for (k = 0; k < VSIZE/sizeof(uint16_t); k++)
+	rfp->v[d].vu16[k] = r[k];
+}
+
 void emu_add(uint8_t type, vregfile_t* rfp, int d, int i, int j)
 {
     EMU_XXX_rrr(type,d,i,j,op_add);     
@@ -943,11 +1015,204 @@ void emu_vcmpnei(uint8_t type, vregfile_t* rfp, int d, int i, int8_t imm)
 }
 
 
-void emulate(vregfile_t* rfp, instr_t* code, size_t n, int* ret)
+// superinstructions, fuse[i] tells how code[i] (and following) is run
+#define FUSE_NONE           0
+#define FUSE_CMP_JUMP       1  // cmp<x>[i] rd,..; jnz|jz rd,L
+#define FUSE_SUBI_JNZ       2  // subi rd,ri,imm; jnz rd,L
+#define FUSE_ADD_MOV        3  // add rd,ri,rj; mov rx,ry
+#define FUSE_ARITH_CMP_JUMP 4  // addi|subi ..; cmp<x>[i] rd,..; jnz|jz rd,L
+
+#define FCMPc(fld,ofld,ctype,c) do {					\
+	ctype x = rfp->r[p->ri].fld;					\
+	ctype y = (p->op & OP_IMM) ? (ctype) p->imm8 : rfp->r[p->rj].fld; \
+	switch(p->op & ~OP_IMM) {					\
+	case OP_CMPEQ: c = (x == y); break;				\
+	case OP_CMPNE: c = (x != y); break;				\
+	case OP_CMPLT: c = (x < y); break;				\
+	case OP_CMPLE: c = (x <= y); break;				\
+	case OP_CMPGT: c = (x > y); break;				\
+	case OP_CMPGE: c = (x >= y); break;				\
+	default: c = 0; break;						\
+	}								\
+	rfp->r[p->rd].ofld = -c;					\
+    } while(0)
+
+// integer compare, set rd and return condition as 0|1
+static int emu_cmp_cond(instr_t* p, vregfile_t* rfp)
+{
+    int c;
+    switch(p->type) {
+    case UINT8:  FCMPc(u8,i8,uint8_t,c); break;
+    case UINT16: FCMPc(u16,i16,uint16_t,c); break;
+    case UINT32: FCMPc(u32,i32,uint32_t,c); break;
+    case UINT64: FCMPc(u64,i64,uint64_t,c); break;
+    case INT8:   FCMPc(i8,i8,int8_t,c); break;
+    case INT16:  FCMPc(i16,i16,int16_t,c); break;
+    case INT32:  FCMPc(i32,i32,int32_t,c); break;
+    case INT64:  FCMPc(i64,i64,int64_t,c); break;
+    default: c = 0; break;
+    }
+    return c;
+}
+
+// integer subi, return 1 if result is non zero
+static int emu_subi_nz(instr_t* p, vregfile_t* rfp)
+{
+    switch(get_scalar_size(p->type)) {
+    case 1: return (rfp->r[p->rd].u8 = rfp->r[p->ri].u8 - p->imm8) != 0;
+    case 2: return (rfp->r[p->rd].u16 = rfp->r[p->ri].u16 - p->imm8) != 0;
+    case 4: return (rfp->r[p->rd].u32 = rfp->r[p->ri].u32 - p->imm8) != 0;
+    case 8: return (rfp->r[p->rd].u64 = rfp->r[p->ri].u64 - p->imm8) != 0;
+    default: return 0;
+    }
+}
+
+static int is_int_type(uint8_t type)
+{
+    return ((get_base_type(type) == INT) || (get_base_type(type) == UINT));
+}
+
+// scalar integer compare followed by jnz/jz on the result
+static int is_cmp_jump(instr_t* p)
+{
+    instr_t* q = p+1;
+    switch(p->op & ~OP_IMM) {
+    case OP_CMPEQ:
+    case OP_CMPNE:
+    case OP_CMPLT:
+    case OP_CMPLE:
+    case OP_CMPGT:
+    case OP_CMPGE: break;
+    default: return 0;
+    }
+    return ((q->op == OP_JNZ) || (q->op == OP_JZ)) && (q->rd == p->rd) &&
+	is_int_type(p->type) && is_int_type(q->type) &&
+	(get_scalar_size(p->type) == get_scalar_size(q->type));
+}
+
+// find instruction sequences that can run as one
+void emu_prepare(instr_t* code, size_t n, uint8_t* fuse)
+{
+    int i;
+
+    for (i = 0; i < (int)n; i++) {
+	instr_t* p = &code[i];
+	fuse[i] = FUSE_NONE;
+	if ((i+2 < (int)n) && ((p->op == OP_ADDI) || (p->op == OP_SUBI)) &&
+	    is_int_type(p->type) && is_cmp_jump(p+1))
+	    fuse[i] = FUSE_ARITH_CMP_JUMP;
+	else if ((i+1 < (int)n) && is_cmp_jump(p))
+	    fuse[i] = FUSE_CMP_JUMP;
+	else if ((i+1 < (int)n) && (p->op == OP_SUBI) &&
+		 (p[1].op == OP_JNZ) && (p[1].rd == p->rd) &&
+		 is_int_type(p->type) && is_int_type(p[1].type) &&
+		 (get_scalar_size(p->type) == get_scalar_size(p[1].type)))
+	    fuse[i] = FUSE_SUBI_JNZ;
+	else if ((i+1 < (int)n) && (p->op == OP_ADD) && (p[1].op == OP_MOV))
+	    fuse[i] = FUSE_ADD_MOV;
+    }
+}
+
+#ifdef EMU_PROFILE
+#define PROF_EXEC(q) do { if (prof) prof->count[(q)-code]++; } while(0)
+#define PROF_DISPATCH() do { if (prof) prof->dispatch++; } while(0)
+#define PROF_JUMP(q,t) do { if (prof) emu_prof_jump(prof,(q)-code,(t)); } while(0)
+
+static void emu_prof_jump(emu_prof_t* prof, int i, int taken)
+{
+    if (taken) {
+	prof->taken[i]++;
+	if (prof->code[i].imm12 < 0)
+	    prof->trip_run[i]++;
+    }
+    else if (prof->trip_run[i]) {
+	if (prof->trip_run[i] > prof->trip_max[i])
+	    prof->trip_max[i] = prof->trip_run[i];
+	prof->trip_run[i] = 0;
+    }
+}
+#else
+#define PROF_EXEC(q)
+#define PROF_DISPATCH()
+#define PROF_JUMP(q,t)
+#endif
+
+// take jump q, with budget a backward jump uses one unit of rfp->fuel
+// and yields, before the jump, when there is none left
+#define EMU_JUMP(q) do {						\
+	if (budget && ((q)->imm12 < 0) && (--rfp->fuel < 0)) {		\
+	    rfp->pc = ((q) - code) + 1 + (q)->imm12;			\
+	    rfp->status = EXEC_YIELD;					\
+	    return EXEC_YIELD;						\
+	}								\
+	(q) += (q)->imm12;						\
+    } while(0)
+
+// run code with fuse table from emu_prepare (NULL runs unfused), jump
+// offsets are still relative to the jump instruction. With budget the
+// run continues at rfp->pc when rfp->status is EXEC_YIELD.
+static int emu_run(vregfile_t* rfp, instr_t* code, size_t n, uint8_t* fuse,
+		   int* ret, emu_prof_t* prof, int budget)
 {
     instr_t* p = code;
+    int c;
+    (void) prof;
+
+    if (budget && (rfp->status == EXEC_YIELD)) {
+	if (rfp->pc >= n)
+	    goto done;
+	p = code + rfp->pc;
+    }
+    if (n == 0)
+	goto done;
     // instr_t* code_end = code + n;
 next:
+    PROF_DISPATCH();
+    switch(fuse ? fuse[p - code] : FUSE_NONE) {
+    case FUSE_NONE: break;
+    case FUSE_CMP_JUMP:
+	PROF_EXEC(p);
+	p++;
+	PROF_EXEC(p);
+	c = (emu_cmp_cond(p-1, rfp) == (p->op == OP_JNZ));
+	PROF_JUMP(p, c);
+	if (c)
+	    EMU_JUMP(p);
+	goto cont;
+    case FUSE_SUBI_JNZ:
+	PROF_EXEC(p);
+	p++;
+	PROF_EXEC(p);
+	c = emu_subi_nz(p-1, rfp);
+	PROF_JUMP(p, c);
+	if (c)
+	    EMU_JUMP(p);
+	goto cont;
+    case FUSE_ADD_MOV:
+	PROF_EXEC(p);
+	emu_add(p->type, rfp, p->rd, p->ri, p->rj);
+	p++;
+	PROF_EXEC(p);
+	emu_mov(p->type, rfp, p->rd, p->ri);
+	goto cont;
+    case FUSE_ARITH_CMP_JUMP:
+	PROF_EXEC(p);
+	PROF_EXEC(p+1);
+	PROF_EXEC(p+2);
+	if (p->op == OP_ADDI)
+	    emu_addi(p->type, rfp, p->rd, p->ri, p->imm8);
+	else
+	    emu_subi(p->type, rfp, p->rd, p->ri, p->imm8);
+	p += 2;
+	c = (emu_cmp_cond(p-1, rfp) == (p->op == OP_JNZ));
+	PROF_JUMP(p, c);
+	if (c)
+	    EMU_JUMP(p);
+	goto cont;
+    default: break;
+    }
+
+    PROF_EXEC(p);
     switch(p->op) {
     case OP_NOP:  break;
     case OP_MOVI: emu_movi(p->type, rfp, p->rd, p->imm12); break;	
@@ -961,6 +1226,9 @@ next:
     case OP_BNOT: emu_bnot(p->type, rfp, p->rd, p->ri); break;
     case OP_VBNOT: emu_vbnot(p->type, rfp, p->rd, p->ri); break;
 
+    case OP_VCVT: emu_vcvt(p->type, rfp, p->rd, p->ri); break;
+    case OP_VCVTN: emu_vcvtn(p->type, rfp, p->rd, p->ri); break;
+
     case OP_INV:  emu_inv(p->type, rfp, p->rd, p->ri); break;	
     case OP_VINV: emu_vinv(p->type, rfp, p->rd, p->ri); break;			
 
@@ -1049,50 +1317,211 @@ next:
     case OP_VCMPNE: emu_vcmpne(p->type, rfp, p->rd, p->ri, p->rj); break;
     case OP_VCMPNEI: emu_vcmpnei(p->type, rfp, p->rd, p->ri, p->imm8); break;
 
+    case OP_VSEL: emu_vsel(p->type, rfp, p->rd, p->ri, p->rj, p->rk); break;
+
     case OP_JNZ:
 	switch(p->type) {
 	case INT8:
-	case UINT8:  if (rfp->r[p->rd].u8 == 0) goto cont; break;
-	case FLOAT16:
+	case UINT8:  if (rfp->r[p->rd].u8 == 0) goto not_taken; break;
+	case FLOAT16: if ((rfp->r[p->rd].u16 & 0x7fff) == 0) goto not_taken; break;
 	case INT16:
-	case UINT16: if (rfp->r[p->rd].u16 == 0) goto cont; break;
-	case FLOAT32:	    
+	case UINT16: if (rfp->r[p->rd].u16 == 0) goto not_taken; break;
+	case FLOAT32: if (rfp->r[p->rd].f32 == 0) goto not_taken; break;
 	case INT32:
-	case UINT32: if (rfp->r[p->rd].u32 == 0) goto cont; break;
-	case FLOAT64:
+	case UINT32: if (rfp->r[p->rd].u32 == 0) goto not_taken; break;
+	case FLOAT64: if (rfp->r[p->rd].f64 == 0) goto not_taken; break;
 	case INT64:
-	case UINT64: if (rfp->r[p->rd].u64 == 0) goto cont; break;
-	default: goto cont;
+	case UINT64: if (rfp->r[p->rd].u64 == 0) goto not_taken; break;
+	default: goto not_taken;
 	}
-	p += p->imm12;
+	PROF_JUMP(p, 1);
+	EMU_JUMP(p);
 	break;
     case OP_JZ:
 	switch(p->type) {
 	case INT8:
-	case UINT8:  if (rfp->r[p->rd].u8 != 0) goto cont; break;
-	case FLOAT16:
+	case UINT8:  if (rfp->r[p->rd].u8 != 0) goto not_taken; break;
+	case FLOAT16: if ((rfp->r[p->rd].u16 & 0x7fff) != 0) goto not_taken; break;
 	case INT16:
-	case UINT16: if (rfp->r[p->rd].u16 != 0) goto cont; break;
-	case FLOAT32:	    
+	case UINT16: if (rfp->r[p->rd].u16 != 0) goto not_taken; break;
+	case FLOAT32: if (!(rfp->r[p->rd].f32 == 0)) goto not_taken; break;
 	case INT32:
-	case UINT32: if (rfp->r[p->rd].u32 != 0) goto cont; break;
-	case FLOAT64:
+	case UINT32: if (rfp->r[p->rd].u32 != 0) goto not_taken; break;
+	case FLOAT64: if (!(rfp->r[p->rd].f64 == 0)) goto not_taken; break;
 	case INT64:
-	case UINT64: if (rfp->r[p->rd].u64 != 0) goto cont; break;
-	default: goto cont;
+	case UINT64: if (rfp->r[p->rd].u64 != 0) goto not_taken; break;
+	default: goto not_taken;
 	}
-	p += p->imm12;
+	PROF_JUMP(p, 1);
+	EMU_JUMP(p);
+	break;
+    case OP_VJANY:
+	if (!emu_vany(p->type, rfp, p->rd)) goto not_taken;
+	PROF_JUMP(p, 1);
+	EMU_JUMP(p);
+	break;
+    case OP_VJALL:
+	if (!emu_vall(p->type, rfp, p->rd)) goto not_taken;
+	PROF_JUMP(p, 1);
+	EMU_JUMP(p);
 	break;
 	
-    case OP_JMP: p += p->imm12; break;
-    case OP_RET: *ret = p->rd; return;
-    case OP_VRET: *ret = p->rd; return;
+    case OP_JMP: PROF_JUMP(p, 1); EMU_JUMP(p); break;
+    case OP_RET: *ret = p->rd; goto done;
+    case OP_VRET: *ret = p->rd; goto done;
 
     default: break;
     }
+    goto cont;
+not_taken:
+    PROF_JUMP(p, 0);
 cont:
     p++;
-    if (p == code + n)
-	return;
-    goto next;
+    if (p != code + n)
+	goto next;
+done:
+    if (budget)
+	rfp->status = EXEC_DONE;
+    return EXEC_DONE;
+}
+
+void emulate_fused(vregfile_t* rfp, instr_t* code, size_t n, uint8_t* fuse,
+		   int* ret)
+{
+    emu_run(rfp, code, n, fuse, ret, NULL, 0);
+}
+
+// as emulate_fused, stop at a backward jump when rfp->fuel is used up.
+// Return EXEC_YIELD (state saved in rfp, call again to continue) or
+// EXEC_DONE, *ret is set as usual when done.
+int emulate_fused_budget(vregfile_t* rfp, instr_t* code, size_t n,
+			 uint8_t* fuse, int* ret)
+{
+    return emu_run(rfp, code, n, fuse, ret, NULL, 1);
+}
+
+#ifdef EMU_PROFILE
+extern const char* asm_opname(uint8_t op);
+extern const char* asm_typename(uint8_t type);
+extern void print_instr(FILE* f,instr_t* pc);
+
+// code must live as long as the profile
+emu_prof_t* emu_prof_new(instr_t* code, size_t n)
+{
+    emu_prof_t* prof = (emu_prof_t*) calloc(1, sizeof(emu_prof_t));
+
+    prof->code = code;
+    prof->n = n;
+    prof->count = (uint64_t*) calloc(n, sizeof(uint64_t));
+    prof->taken = (uint64_t*) calloc(n, sizeof(uint64_t));
+    prof->trip_run = (uint64_t*) calloc(n, sizeof(uint64_t));
+    prof->trip_max = (uint64_t*) calloc(n, sizeof(uint64_t));
+    return prof;
+}
+
+void emu_prof_delete(emu_prof_t* prof)
+{
+    free(prof->count);
+    free(prof->taken);
+    free(prof->trip_run);
+    free(prof->trip_max);
+    free(prof);
+}
+
+// as emulate_fused and count into prof (from emu_prof_new(code,n))
+void emulate_prof(vregfile_t* rfp, instr_t* code, size_t n, uint8_t* fuse,
+		  int* ret, emu_prof_t* prof)
+{
+    size_t i;
+
+    prof->runs++;
+    emu_run(rfp, code, n, fuse, ret, prof, 0);
+    for (i = 0; i < n; i++)  // loops left by ret
+	emu_prof_jump(prof, i, 0);
+}
+
+// per instruction counts with branch and loop statistics,
+// then executions per (op,type), most executed first
+void emu_prof_print(FILE* f, emu_prof_t* prof)
+{
+    uint16_t key[prof->n];
+    uint64_t sum[prof->n];
+    size_t i, j, nkey = 0;
+
+    fprintf(f, "runs=%lu\n", prof->runs);
+    for (i = 0; i < prof->n; i++) {
+	instr_t* p = &prof->code[i];
+	uint64_t c = prof->count[i];
+
+	fprintf(f, "%4lu %10lu  ", (unsigned long) i, c);
+	print_instr(f, p);
+	if (OP_IS_JUMP(p->op) && (c > 0)) {
+	    fprintf(f, "  taken=%lu not=%lu", prof->taken[i], c-prof->taken[i]);
+	    if ((p->imm12 < 0) && (c > prof->taken[i]))
+		fprintf(f, " trips avg=%.1f max=%lu",
+			(double) c / (c - prof->taken[i]),
+			prof->trip_max[i]+1);
+	}
+	fprintf(f, "\n");
+    }
+    for (i = 0; i < prof->n; i++) {
+	uint16_t k = (prof->code[i].op << 8) | prof->code[i].type;
+	for (j = 0; (j < nkey) && (key[j] != k); j++)
+	    ;
+	if (j == nkey) {
+	    key[nkey] = k;
+	    sum[nkey++] = 0;
+	}
+	sum[j] += prof->count[i];
+    }
+    for (i = 1; i < nkey; i++) {  // insertion sort, largest first
+	uint16_t k = key[i];
+	uint64_t s = sum[i];
+	for (j = i; (j > 0) && (sum[j-1] < s); j--) {
+	    key[j] = key[j-1];
+	    sum[j] = sum[j-1];
+	}
+	key[j] = k;
+	sum[j] = s;
+    }
+    for (i = 0; i < nkey; i++) {
+	char name[32];
+	if (sum[i] == 0)
+	    break;
+	snprintf(name, sizeof(name), "%s.%s", asm_opname(key[i] >> 8),
+		 asm_typename(key[i] & 0xff));
+	fprintf(f, "  %-12s %10lu\n", name, sum[i]);
+    }
+}
+#endif
+
+// single shot runs are not fused, callers that run code more than once
+// keep the table from emu_prepare and use emulate_fused
+void emulate(vregfile_t* rfp, instr_t* code, size_t n, int* ret)
+{
+    emu_run(rfp, code, n, NULL, ret, NULL, 0);
+}
+
+int emulate_budget(vregfile_t* rfp, instr_t* code, size_t n, int* ret)
+{
+    return emu_run(rfp, code, n, NULL, ret, NULL, 1);
+}
+
+extern int jit_narrow(instr64_t* wcode, size_t n, instr_t* code, size_t max);
+
+// emulate wide code, the scratch register used for large immediates
+// is clobbered, return -1 if the code can not be lowered (registers
+// 16-31 are not in vregfile_t)
+int emulate_wide(vregfile_t* rfp, instr64_t* wcode, size_t n, int* ret)
+{
+    instr_t* code;
+    int len;
+
+    if ((len = jit_narrow(wcode, n, NULL, 0)) < 0)
+	return -1;
+    code = (instr_t*) malloc((len+1)*sizeof(instr_t));
+    jit_narrow(wcode, n, code, len);
+    emulate(rfp, code, len, ret);
+    free(code);
+    return 0;
 }
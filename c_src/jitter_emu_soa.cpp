@@ -0,0 +1,464 @@
+//
+// Emulate one scalar program over SOA_WIDTH instances
+//
+// Register i of all instances is stored as one contiguous array of the
+// element type (soa_reg_t), each instruction is dispatched once and run
+// as a loop over the instances. The program must use one element size,
+// a register read at another size than it was written would see other
+// instances. When a jump
+// splits the instances, the lanes with the lowest pc are run (under a
+// lane mask) until they catch up with the others, so lanes join again
+// after if/else and loops.
+//
+// The per lane loops only pay off when vectorized, build with -O2 (see
+// bench_soa in jitter_test.cpp).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jitter_types.h"
+#include "jitter.h"
+
+// same as in jitter_emu.cpp
+#define op_nop(x) (x)
+#define op_neg(x) (-(x))
+#define op_inv(x) (1.0/(x))
+#define op_add(x,y) ((x)+(y))
+#define op_sub(x,y) ((x)-(y))
+#define op_mul(x,y) ((x)*(y))
+#define op_bnot(x) (~(x))
+#define op_bor(x,y) ((x)|(y))
+#define op_band(x,y) ((x)&(y))
+#define op_bandn(x,y) (~(x)&(y))
+#define op_bxor(x,y) ((x)^(y))
+#define op_cmpeq(x,y) (-((x)==(y)))
+#define op_cmplt(x,y) (-((x)<(y)))
+#define op_cmple(x,y) (-((x)<=(y)))
+#define op_cmpne(x,y) (-((x)!=(y)))
+#define op_cmpgt(x,y) (-((x)>(y)))
+#define op_cmpge(x,y) (-((x)>=(y)))
+#define op_sll(x,y) ((x)<<(y))
+#define op_srl(x,y) ((x)>>(y))
+#define op_sra(x,y) ((x)>>(y))
+
+// run stmt for every lane k, m == NULL means all lanes
+#define SOA_LOOP(m,stmt) do {						\
+	int k;								\
+	if ((m) == NULL) {						\
+	    for (k = 0; k < SOA_WIDTH; k++) { stmt; }			\
+	}								\
+	else {								\
+	    for (k = 0; k < SOA_WIDTH; k++) { if ((m)[k]) { stmt; } }	\
+	}								\
+    } while(0)
+
+// dst = src in lanes where m[k] is 1, a bitwise select on the unsigned
+// view of the element size, the loops vectorize where a conditional
+// store would not
+static void soa_merge(soa_reg_t* dst, const soa_reg_t* src,
+		      const uint8_t* m, int size)
+{
+    int k;
+
+    switch(size) {
+    case 1:
+	for (k = 0; k < SOA_WIDTH; k++) {
+	    uint8_t mk = -m[k];
+	    dst->u8[k] = (src->u8[k] & mk) | (dst->u8[k] & ~mk);
+	}
+	break;
+    case 2:
+	for (k = 0; k < SOA_WIDTH; k++) {
+	    uint16_t mk = -(uint16_t) m[k];
+	    dst->u16[k] = (src->u16[k] & mk) | (dst->u16[k] & ~mk);
+	}
+	break;
+    case 4:
+	for (k = 0; k < SOA_WIDTH; k++) {
+	    uint32_t mk = -(uint32_t) m[k];
+	    dst->u32[k] = (src->u32[k] & mk) | (dst->u32[k] & ~mk);
+	}
+	break;
+    default:
+	for (k = 0; k < SOA_WIDTH; k++) {
+	    uint64_t mk = -(uint64_t) m[k];
+	    dst->u64[k] = (src->u64[k] & mk) | (dst->u64[k] & ~mk);
+	}
+	break;
+    }
+}
+
+// register d = expr for lanes in m. expr goes to a local first, so the
+// loop does not depend on whether d is also a source, then it is copied
+// or merged under m.
+#define SOA_SET(m,d,fld,expr) do {					\
+	soa_reg_t t_;							\
+	int k;								\
+	for (k = 0; k < SOA_WIDTH; k++) t_.fld[k] = (expr);		\
+	if ((m) == NULL)						\
+	    memcpy(sp->r[(d)].fld, t_.fld, sizeof(t_.fld));		\
+	else								\
+	    soa_merge(&sp->r[(d)], &t_, (m), sizeof(t_.fld[0]));	\
+    } while(0)
+
+#define SR(x,fld) sp->r[(x)].fld[k]
+
+#define SOA_DIMM(ifld,ofld,ct,op) SOA_SET(m, d, ofld, op((ct)imm))
+#define SOA_DI(ifld,ofld,ct,op)   SOA_SET(m, d, ofld, op(SR(i,ifld)))
+#define SOA_DIJ(ifld,ofld,ct,op)  \
+    SOA_SET(m, d, ofld, op(SR(i,ifld),SR(j,ifld)))
+#define SOA_DI8(ifld,ofld,ct,op)  \
+    SOA_SET(m, d, ofld, op(SR(i,ifld),(ct)imm))
+#define SOA_D8I(ifld,ofld,ct,op)  \
+    SOA_SET(m, d, ofld, op((ct)imm,SR(i,ifld)))
+// all lanes, only those in m are used
+#define SOA_NZ(ifld,ofld,ct,op)   \
+    SOA_LOOP((uint8_t*)NULL, c[k] = (SR(d,ifld) != 0) ^ z)
+
+// integer types
+#define SOA_INT(t,F,op) do {						\
+	switch((t)) {							\
+	case UINT8:   F(u8,u8,uint8_t,op); break;			\
+	case UINT16:  F(u16,u16,uint16_t,op); break;			\
+	case UINT32:  F(u32,u32,uint32_t,op); break;			\
+	case UINT64:  F(u64,u64,uint64_t,op); break;			\
+	case INT8:    F(i8,i8,int8_t,op); break;			\
+	case INT16:   F(i16,i16,int16_t,op); break;			\
+	case INT32:   F(i32,i32,int32_t,op); break;			\
+	case INT64:   F(i64,i64,int64_t,op); break;			\
+	default: break;							\
+	}								\
+    } while(0)
+
+// integer and float types
+#define SOA_NUM(t,F,op) do {						\
+	switch((t)) {							\
+	case UINT8:   F(u8,u8,uint8_t,op); break;			\
+	case UINT16:  F(u16,u16,uint16_t,op); break;			\
+	case UINT32:  F(u32,u32,uint32_t,op); break;			\
+	case UINT64:  F(u64,u64,uint64_t,op); break;			\
+	case INT8:    F(i8,i8,int8_t,op); break;			\
+	case INT16:   F(i16,i16,int16_t,op); break;			\
+	case INT32:   F(i32,i32,int32_t,op); break;			\
+	case INT64:   F(i64,i64,int64_t,op); break;			\
+	case FLOAT32: F(f32,f32,float32_t,op); break;			\
+	case FLOAT64: F(f64,f64,float64_t,op); break;			\
+	default: break;							\
+	}								\
+    } while(0)
+
+// bits as unsigned integer of the same size (bit ops, logical shift)
+#define SOA_UNS(t,F,op) do {						\
+	switch((t)) {							\
+	case UINT8:   F(u8,u8,uint8_t,op); break;			\
+	case UINT16:  F(u16,u16,uint16_t,op); break;			\
+	case UINT32:  F(u32,u32,uint32_t,op); break;			\
+	case UINT64:  F(u64,u64,uint64_t,op); break;			\
+	case INT8:    F(u8,u8,uint8_t,op); break;			\
+	case INT16:   F(u16,u16,uint16_t,op); break;			\
+	case INT32:   F(u32,u32,uint32_t,op); break;			\
+	case INT64:   F(u64,u64,uint64_t,op); break;			\
+	case FLOAT32: F(u32,u32,uint32_t,op); break;			\
+	case FLOAT64: F(u64,u64,uint64_t,op); break;			\
+	default: break;							\
+	}								\
+    } while(0)
+
+// as signed integer of the same size (arithmetic shift)
+#define SOA_SGN(t,F,op) do {						\
+	switch((t)) {							\
+	case UINT8:   F(i8,i8,int8_t,op); break;			\
+	case UINT16:  F(i16,i16,int16_t,op); break;			\
+	case UINT32:  F(i32,i32,int32_t,op); break;			\
+	case UINT64:  F(i64,i64,int64_t,op); break;			\
+	case INT8:    F(i8,i8,int8_t,op); break;			\
+	case INT16:   F(i16,i16,int16_t,op); break;			\
+	case INT32:   F(i32,i32,int32_t,op); break;			\
+	case INT64:   F(i64,i64,int64_t,op); break;			\
+	default: break;							\
+	}								\
+    } while(0)
+
+// compare, result is a signed integer mask of the same size
+#define SOA_CMP(t,F,op) do {						\
+	switch((t)) {							\
+	case UINT8:   F(u8,i8,uint8_t,op); break;			\
+	case UINT16:  F(u16,i16,uint16_t,op); break;			\
+	case UINT32:  F(u32,i32,uint32_t,op); break;			\
+	case UINT64:  F(u64,i64,uint64_t,op); break;			\
+	case INT8:    F(i8,i8,int8_t,op); break;			\
+	case INT16:   F(i16,i16,int16_t,op); break;			\
+	case INT32:   F(i32,i32,int32_t,op); break;			\
+	case INT64:   F(i64,i64,int64_t,op); break;			\
+	case FLOAT32: F(f32,i32,float32_t,op); break;			\
+	case FLOAT64: F(f64,i64,float64_t,op); break;			\
+	default: break;							\
+	}								\
+    } while(0)
+
+static int soa_int_type(uint8_t type)
+{
+    switch(type) {
+    case UINT8: case UINT16: case UINT32: case UINT64:
+    case INT8: case INT16: case INT32: case INT64: return 1;
+    default: return 0;
+    }
+}
+
+static int soa_num_type(uint8_t type)
+{
+    return soa_int_type(type) || (type == FLOAT32) || (type == FLOAT64);
+}
+
+// 1 if emulate_soa can run code, vector instructions,
+// FLOAT8/FLOAT16/BFLOAT16 scalars and mixed element sizes are not
+// supported
+int emu_soa_check(instr_t* code, size_t n)
+{
+    size_t i;
+    int size = 0;
+
+    for (i = 0; i < n; i++) {
+	instr_t* p = &code[i];
+	switch(p->op) {
+	case OP_NOP:
+	case OP_JMP:
+	case OP_RET:
+	    continue;
+	case OP_INV:
+	    if ((p->type != FLOAT32) && (p->type != FLOAT64)) return 0;
+	    break;
+	case OP_MOVI: case OP_MOV: case OP_NEG: case OP_BNOT:
+	case OP_ADD: case OP_SUB: case OP_RSUB: case OP_MUL:
+	case OP_BOR: case OP_BAND: case OP_BXOR: case OP_BANDN:
+	case OP_CMPLT: case OP_CMPLE: case OP_CMPEQ:
+	case OP_CMPGT: case OP_CMPGE: case OP_CMPNE:
+	case OP_CMPLTI: case OP_CMPLEI: case OP_CMPEQI:
+	case OP_CMPGTI: case OP_CMPGEI: case OP_CMPNEI:
+	case OP_JNZ: case OP_JZ:
+	    if (!soa_num_type(p->type)) return 0;
+	    break;
+	case OP_ADDI: case OP_SUBI: case OP_RSUBI: case OP_MULI:
+	case OP_SLL: case OP_SLLI: case OP_SRL: case OP_SRLI:
+	case OP_SRA: case OP_SRAI:
+	case OP_BANDI: case OP_BORI: case OP_BXORI: case OP_BANDNI:
+	    if (!soa_int_type(p->type)) return 0;
+	    break;
+	default:
+	    return 0;
+	}
+	if (size == 0)
+	    size = get_scalar_size(p->type);
+	else if (size != get_scalar_size(p->type))
+	    return 0;
+    }
+    return 1;
+}
+
+// run a non jump instruction on lanes in m
+static void soa_exec(soa_regfile_t* sp, const uint8_t* m, instr_t* p)
+{
+    int d = p->rd;
+    int i = p->ri;
+    int j = p->rj;
+    int imm = p->imm8;
+
+    switch(p->op) {
+    case OP_MOVI: imm = p->imm12; SOA_NUM(p->type,SOA_DIMM,op_nop); break;
+    case OP_MOV:  SOA_NUM(p->type,SOA_DI,op_nop); break;
+    case OP_NEG:  SOA_NUM(p->type,SOA_DI,op_neg); break;
+    case OP_BNOT: SOA_UNS(p->type,SOA_DI,op_bnot); break;
+    case OP_INV:
+	if (p->type == FLOAT32) SOA_DI(f32,f32,float32_t,op_inv);
+	else if (p->type == FLOAT64) SOA_DI(f64,f64,float64_t,op_inv);
+	break;
+
+    case OP_ADD:   SOA_NUM(p->type,SOA_DIJ,op_add); break;
+    case OP_ADDI:  SOA_INT(p->type,SOA_DI8,op_add); break;
+    case OP_SUB:   SOA_NUM(p->type,SOA_DIJ,op_sub); break;
+    case OP_SUBI:  SOA_INT(p->type,SOA_DI8,op_sub); break;
+    case OP_RSUB:  j = p->ri; i = p->rj; SOA_NUM(p->type,SOA_DIJ,op_sub); break;
+    case OP_RSUBI: SOA_INT(p->type,SOA_D8I,op_sub); break;
+    case OP_MUL:   SOA_NUM(p->type,SOA_DIJ,op_mul); break;
+    case OP_MULI:  SOA_INT(p->type,SOA_DI8,op_mul); break;
+
+    case OP_SLL:  SOA_UNS(p->type,SOA_DIJ,op_sll); break;
+    case OP_SLLI: SOA_INT(p->type,SOA_DI8,op_sll); break;
+    case OP_SRL:  SOA_UNS(p->type,SOA_DIJ,op_srl); break;
+    case OP_SRLI: SOA_UNS(p->type,SOA_DI8,op_srl); break;
+    case OP_SRA:  SOA_SGN(p->type,SOA_DIJ,op_sra); break;
+    case OP_SRAI: SOA_SGN(p->type,SOA_DI8,op_sra); break;
+
+    case OP_BOR:    SOA_UNS(p->type,SOA_DIJ,op_bor); break;
+    case OP_BORI:   SOA_INT(p->type,SOA_DI8,op_bor); break;
+    case OP_BAND:   SOA_UNS(p->type,SOA_DIJ,op_band); break;
+    case OP_BANDI:  SOA_INT(p->type,SOA_DI8,op_band); break;
+    case OP_BANDN:  SOA_UNS(p->type,SOA_DIJ,op_bandn); break;
+    case OP_BANDNI: SOA_INT(p->type,SOA_DI8,op_bandn); break;
+    case OP_BXOR:   SOA_UNS(p->type,SOA_DIJ,op_bxor); break;
+    case OP_BXORI:  SOA_INT(p->type,SOA_DI8,op_bxor); break;
+
+    case OP_CMPLT:  SOA_CMP(p->type,SOA_DIJ,op_cmplt); break;
+    case OP_CMPLTI: SOA_CMP(p->type,SOA_DI8,op_cmplt); break;
+    case OP_CMPLE:  SOA_CMP(p->type,SOA_DIJ,op_cmple); break;
+    case OP_CMPLEI: SOA_CMP(p->type,SOA_DI8,op_cmple); break;
+    case OP_CMPEQ:  SOA_CMP(p->type,SOA_DIJ,op_cmpeq); break;
+    case OP_CMPEQI: SOA_CMP(p->type,SOA_DI8,op_cmpeq); break;
+    case OP_CMPGT:  SOA_CMP(p->type,SOA_DIJ,op_cmpgt); break;
+    case OP_CMPGTI: SOA_CMP(p->type,SOA_DI8,op_cmpgt); break;
+    case OP_CMPGE:  SOA_CMP(p->type,SOA_DIJ,op_cmpge); break;
+    case OP_CMPGEI: SOA_CMP(p->type,SOA_DI8,op_cmpge); break;
+    case OP_CMPNE:  SOA_CMP(p->type,SOA_DIJ,op_cmpne); break;
+    case OP_CMPNEI: SOA_CMP(p->type,SOA_DI8,op_cmpne); break;
+    default: break;
+    }
+}
+
+// jnz/jz condition per lane in m, return number of lanes taking the jump
+static int soa_cond(soa_regfile_t* sp, const uint8_t* m, instr_t* p,
+		    uint8_t* c)
+{
+    int d = p->rd;
+    int z = (p->op == OP_JZ);
+    int taken = 0;
+
+    SOA_NUM(p->type,SOA_NZ,op_nop);
+    if (m == NULL)
+	SOA_LOOP(m, taken += c[k]);
+    else
+	SOA_LOOP((uint8_t*)NULL, taken += m[k] & c[k]);
+    return taken;
+}
+
+// copy the scalar registers of instance k from/to a register file,
+// type is the element type of the program
+void soa_load(soa_regfile_t* sp, int k, vregfile_t* rfp, uint8_t type)
+{
+    int i;
+    for (i = 0; i < NUM_SCALAR_REGISTERS; i++) {
+	switch(get_scalar_size(type)) {
+	case 1: sp->r[i].u8[k] = rfp->r[i].u8; break;
+	case 2: sp->r[i].u16[k] = rfp->r[i].u16; break;
+	case 4: sp->r[i].u32[k] = rfp->r[i].u32; break;
+	default: sp->r[i].u64[k] = rfp->r[i].u64; break;
+	}
+    }
+}
+
+void soa_store(soa_regfile_t* sp, int k, vregfile_t* rfp, uint8_t type)
+{
+    int i;
+    for (i = 0; i < NUM_SCALAR_REGISTERS; i++) {
+	switch(get_scalar_size(type)) {
+	case 1: rfp->r[i].u8 = sp->r[i].u8[k]; break;
+	case 2: rfp->r[i].u16 = sp->r[i].u16[k]; break;
+	case 4: rfp->r[i].u32 = sp->r[i].u32[k]; break;
+	default: rfp->r[i].u64 = sp->r[i].u64[k]; break;
+	}
+    }
+}
+
+// run code on instances 0..count-1, sp->ret[k] is set to the register
+// returned by instance k. Return -1 (and do nothing) if code can not be
+// run, see emu_soa_check. Use count = SOA_WIDTH when possible, partial
+// batches always run masked.
+int emulate_soa(soa_regfile_t* sp, size_t count, instr_t* code, size_t n)
+{
+    uint8_t live[SOA_WIDTH];  // lane has not returned
+    uint8_t act[SOA_WIDTH];   // lane is at pc, when split
+    uint8_t c[SOA_WIDTH];     // jump condition
+    int pc[SOA_WIDTH];        // lane pc, when split
+    int split = 0;            // else all live lanes are at cpc
+    int cpc = 0;
+    int nlive = count;
+    int k;
+
+    if ((count > SOA_WIDTH) || !emu_soa_check(code, n))
+	return -1;
+    for (k = 0; k < SOA_WIDTH; k++) {
+	live[k] = (k < (int) count);
+	sp->ret[k] = -1;
+    }
+    while (nlive > 0) {
+	const uint8_t* m;
+	instr_t* p;
+	int i, lo = 0, hi, na, taken, rel;
+
+	// the per lane loops below select instead of branch to vectorize
+	if (split) {
+	    lo = n; hi = -1;
+	    for (k = 0; k < SOA_WIDTH; k++) {
+		int pl = live[k] ? pc[k] : (int) n;
+		int ph = live[k] ? pc[k] : -1;
+		lo = (pl < lo) ? pl : lo;
+		hi = (ph > hi) ? ph : hi;
+	    }
+	    if (lo == hi) {
+		split = 0;
+		cpc = lo;
+	    }
+	}
+	if (!split) {
+	    i = cpc;
+	    m = (nlive == SOA_WIDTH) ? NULL : live;
+	    na = nlive;
+	}
+	else {
+	    i = lo;
+	    na = 0;
+	    for (k = 0; k < SOA_WIDTH; k++) {
+		act[k] = live[k] & (pc[k] == lo);
+		na += act[k];
+	    }
+	    m = act;
+	}
+	if (i >= (int) n) {  // run past the end without ret
+	    SOA_LOOP(m, live[k] = 0);
+	    nlive -= na;
+	    continue;
+	}
+	p = &code[i];
+	switch(p->op) {
+	case OP_RET:
+	    SOA_LOOP(m, sp->ret[k] = p->rd; live[k] = 0);
+	    nlive -= na;
+	    continue;
+	case OP_JMP:
+	    taken = na;
+	    break;
+	case OP_JNZ:
+	case OP_JZ:
+	    taken = soa_cond(sp, m, p, c);
+	    break;
+	default:
+	    soa_exec(sp, m, p);
+	    taken = 0;
+	    break;
+	}
+	if ((taken == 0) || (taken == na)) {
+	    int next = (taken == 0) ? i+1 : i+1+p->imm12;
+	    if (!split)
+		cpc = next;
+	    else {
+		for (k = 0; k < SOA_WIDTH; k++)
+		    pc[k] = act[k] ? next : pc[k];
+	    }
+	}
+	else {
+	    if (!split) {
+		for (k = 0; k < SOA_WIDTH; k++) {
+		    pc[k] = cpc;
+		    act[k] = live[k];
+		}
+		split = 1;
+	    }
+	    rel = p->imm12;
+	    for (k = 0; k < SOA_WIDTH; k++) {
+		int next = i+1 + (c[k] ? rel : 0);
+		pc[k] = act[k] ? next : pc[k];
+	    }
+	}
+    }
+    return 0;
+}
@@ -0,0 +1,615 @@
+//
+// Fused element-wise expression compiler
+//
+
+#include <asmjit/x86.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+using namespace asmjit;
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_asm.h"
+#include "jitter_expr.h"
+
+extern void emit_instruction(ZAssembler &a, instr_t* p, uint32_t reg_mask,
+			     x86::Gp rfp);
+extern uint32_t instr_uses(instr_t* p);
+extern uint32_t instr_defs(instr_t* p);
+extern void emulate(vregfile_t* rfp, instr_t* code, size_t n, int* ret);
+
+// vector registers for inputs and temporaries, not the backend
+// temporaries (X_FREE_MASK in jitter_asm.h)
+#define EXPR_VREGS 0xc7ff
+#define EXPR_NOREG 255
+// max number of vectors per kernel run
+#define EXPR_UNROLL 4
+
+#define EXPR_ARRAY  1
+#define EXPR_SCALAR 2
+#define EXPR_OP     3
+
+struct _jit_expr_t {
+    uint8_t kind;
+    uint8_t op;      // EXPR_OP
+    uint8_t index;   // EXPR_ARRAY, EXPR_SCALAR
+    uint8_t nargs;
+    jit_expr_t* arg[3];
+};
+
+typedef struct {
+    instr_t* code;
+    size_t max;
+    size_t n;
+    uint8_t type;
+    uint16_t free;   // unused registers
+    uint16_t temp;   // registers holding inner node values
+    uint8_t* areg;
+    uint8_t* sreg;
+} expr_ctx_t;
+
+// out[b] = e(array[i][b],.., sv[i],..) for nblk blocks of
+// unroll*VSIZE bytes, sv[i] is scalar i broadcast to a vector
+typedef void (*expr_fun_t)(const void** array, const vscalar0_t* sv,
+			   void* out, size_t nblk);
+
+typedef struct {
+    instr_t* code;      // NULL if the shape can not be compiled
+    size_t n;
+    int unroll;
+    uint8_t areg[EXPR_UNROLL*NUM_VECTOR_REGISTERS];
+    uint8_t sreg[NUM_VECTOR_REGISTERS];
+    uint8_t oreg[EXPR_UNROLL];
+    unsigned calls;     // evaluations before fn is compiled
+    int tried;          // native compile done (fn may still be NULL)
+    expr_fun_t fn;
+} expr_entry_t;
+
+struct _jit_expr_cache_t {
+    JitRuntime rt;
+    unsigned threshold;
+    unsigned vec_mask;
+    std::mutex mtx;
+    std::unordered_map<std::string, expr_entry_t*> shapes;
+    jit_expr_stats_t stats;
+};
+
+class ExprErrorHandler : public ErrorHandler {
+public:
+    Error err;
+    ExprErrorHandler() { err = kErrorOk; }
+    void handleError(Error e, const char* message, BaseEmitter* origin) override {
+	(void) message; (void) origin;
+	if (err == kErrorOk) err = e;
+    }
+};
+
+static jit_expr_t* expr_new(uint8_t kind, uint8_t op, int index)
+{
+    jit_expr_t* e = new jit_expr_t;
+
+    e->kind = kind;
+    e->op = op;
+    e->index = index;
+    e->nargs = 0;
+    e->arg[0] = e->arg[1] = e->arg[2] = NULL;
+    return e;
+}
+
+jit_expr_t* jit_expr_array(int i)
+{
+    return expr_new(EXPR_ARRAY, OP_VNOP, i);
+}
+
+jit_expr_t* jit_expr_scalar(int i)
+{
+    return expr_new(EXPR_SCALAR, OP_VNOP, i);
+}
+
+jit_expr_t* jit_expr_op(uint8_t op, jit_expr_t* a, jit_expr_t* b,
+			jit_expr_t* c)
+{
+    jit_expr_t* e = expr_new(EXPR_OP, op, 0);
+
+    e->arg[0] = a;
+    e->arg[1] = b;
+    e->arg[2] = c;
+    e->nargs = (c != NULL) ? 3 : ((b != NULL) ? 2 : 1);
+    return e;
+}
+
+void jit_expr_delete(jit_expr_t* e)
+{
+    int i;
+
+    if (e == NULL)
+	return;
+    for (i = 0; i < 3; i++)
+	jit_expr_delete(e->arg[i]);
+    delete e;
+}
+
+// number of arguments of a supported op, 0 if not supported
+static int expr_op_arity(uint8_t op)
+{
+    switch(op) {
+    case OP_VNEG:
+    case OP_VBNOT:
+	return 1;
+    case OP_VADD:
+    case OP_VSUB:
+    case OP_VRSUB:
+    case OP_VMUL:
+    case OP_VBAND:
+    case OP_VBANDN:
+    case OP_VBOR:
+    case OP_VBXOR:
+    case OP_VCMPLT:
+    case OP_VCMPLE:
+    case OP_VCMPEQ:
+    case OP_VCMPGT:
+    case OP_VCMPGE:
+    case OP_VCMPNE:
+	return 2;
+    case OP_VSEL:
+	return 3;
+    default:
+	return 0;
+    }
+}
+
+// registers needed to evaluate e (leaves are preloaded)
+static int expr_need(jit_expr_t* e)
+{
+    int need[3];
+    int i, held = 0, n = 0;
+
+    if (e->kind != EXPR_OP)
+	return 0;
+    for (i = 0; i < e->nargs; i++)
+	need[i] = expr_need(e->arg[i]);
+    // arguments are evaluated in order of decreasing need
+    for (i = 0; i < e->nargs; i++) {
+	int j, k = -1;
+	for (j = 0; j < e->nargs; j++) {
+	    if ((need[j] >= 0) && ((k < 0) || (need[j] > need[k])))
+		k = j;
+	}
+	if (held + need[k] > n)
+	    n = held + need[k];
+	if (e->arg[k]->kind == EXPR_OP)
+	    held++;
+	need[k] = -1;
+    }
+    return (n > 1) ? n : 1;
+}
+
+// leaves get the lowest free registers, in order of first use
+static int expr_leaves(expr_ctx_t* x, jit_expr_t* e)
+{
+    uint8_t* rp;
+    int i, r;
+
+    switch(e->kind) {
+    case EXPR_ARRAY:
+    case EXPR_SCALAR:
+	if (e->index >= NUM_VECTOR_REGISTERS)
+	    return -1;
+	rp = (e->kind == EXPR_ARRAY) ? &x->areg[e->index] :
+	    &x->sreg[e->index];
+	if (*rp != EXPR_NOREG)
+	    return 0;
+	for (r = 0; r < NUM_VECTOR_REGISTERS; r++) {
+	    if (x->free & (1 << r)) {
+		x->free &= ~(1 << r);
+		*rp = r;
+		return 0;
+	    }
+	}
+	return -1;
+    case EXPR_OP:
+	if ((expr_op_arity(e->op) == 0) ||
+	    (expr_op_arity(e->op) != e->nargs))
+	    return -1;
+	for (i = 0; i < e->nargs; i++) {
+	    if ((e->arg[i] == NULL) || (expr_leaves(x, e->arg[i]) < 0))
+		return -1;
+	}
+	return 0;
+    default:
+	return -1;
+    }
+}
+
+static int expr_alloc(expr_ctx_t* x)
+{
+    int r;
+
+    for (r = NUM_VECTOR_REGISTERS-1; r >= 0; r--) {
+	if (x->free & (1 << r)) {
+	    x->free &= ~(1 << r);
+	    x->temp |= (1 << r);
+	    return r;
+	}
+    }
+    return -1;
+}
+
+static int expr_emit_instr(expr_ctx_t* x, uint8_t op, int d, int i,
+			   int j, int k)
+{
+    instr_t* p;
+
+    if (x->n >= x->max)
+	return -1;
+    p = &x->code[x->n++];
+    memset(p, 0, sizeof(instr_t));
+    p->op = op;
+    p->type = x->type;
+    p->rd = d;
+    p->ri = i;
+    p->rj = j;
+    p->rk = k;
+    return 0;
+}
+
+// emit code for e, return the register holding the value or -1
+static int expr_emit(expr_ctx_t* x, jit_expr_t* e)
+{
+    int need[3];
+    int reg[3] = { 0, 0, 0 };
+    int i, d;
+
+    if (e->kind == EXPR_ARRAY)
+	return x->areg[e->index];
+    else if (e->kind == EXPR_SCALAR)
+	return x->sreg[e->index];
+
+    for (i = 0; i < e->nargs; i++)
+	need[i] = expr_need(e->arg[i]);
+    for (i = 0; i < e->nargs; i++) {
+	int j, k = -1;
+	for (j = 0; j < e->nargs; j++) {
+	    if ((need[j] >= 0) && ((k < 0) || (need[j] > need[k])))
+		k = j;
+	}
+	if ((reg[k] = expr_emit(x, e->arg[k])) < 0)
+	    return -1;
+	need[k] = -1;
+    }
+    // the destination may reuse an argument register
+    for (i = 0; i < e->nargs; i++) {
+	if (x->temp & (1 << reg[i])) {
+	    x->temp &= ~(1 << reg[i]);
+	    x->free |= (1 << reg[i]);
+	}
+    }
+    if ((d = expr_alloc(x)) < 0)
+	return -1;
+    if (expr_emit_instr(x, e->op, d, reg[0], reg[1], reg[2]) < 0)
+	return -1;
+    return d;
+}
+
+int jit_expr_compile(jit_expr_t* e, uint8_t type, int unroll,
+		     instr_t* code, size_t max,
+		     uint8_t* areg, uint8_t* sreg, uint8_t* oreg)
+{
+    expr_ctx_t x;
+    int r, u;
+
+    x.code = code;
+    x.max = max;
+    x.n = 0;
+    x.type = type;
+    x.free = EXPR_VREGS;
+    x.temp = 0;
+    x.sreg = sreg;
+    memset(areg, EXPR_NOREG, unroll*NUM_VECTOR_REGISTERS);
+    memset(sreg, EXPR_NOREG, NUM_VECTOR_REGISTERS);
+
+    if ((e == NULL) || (unroll < 1))
+	return -1;
+    for (u = 0; u < unroll; u++) {
+	x.areg = &areg[u*NUM_VECTOR_REGISTERS];
+	if (expr_leaves(&x, e) < 0)
+	    return -1;
+    }
+    // the result of a copy stays allocated while the next is emitted
+    for (u = 0; u < unroll; u++) {
+	x.areg = &areg[u*NUM_VECTOR_REGISTERS];
+	if ((r = expr_emit(&x, e)) < 0)
+	    return -1;
+	if (e->kind != EXPR_OP) {  // never return an input register
+	    int d;
+	    if (((d = expr_alloc(&x)) < 0) ||
+		(expr_emit_instr(&x, OP_VMOV, d, r, 0, 0) < 0))
+		return -1;
+	    r = d;
+	}
+	x.temp &= ~(1 << r);
+	oreg[u] = r;
+    }
+    if (expr_emit_instr(&x, OP_VRET, r, 0, 0, 0) < 0)
+	return -1;
+    return x.n;
+}
+
+// pre-order op/kind/index bytes
+static void expr_shape(jit_expr_t* e, std::string& s)
+{
+    int i;
+
+    s.push_back(e->kind);
+    s.push_back((e->kind == EXPR_OP) ? e->op : e->index);
+    for (i = 0; i < e->nargs; i++)
+	expr_shape(e->arg[i], s);
+}
+
+// Loop kernel: scalars are loaded once, then each iteration loads the
+// arrays of all copies, runs the lowered code (without the vret) and
+// stores the result of each copy. Any register the backend spills for
+// a temporary is restored, so the loop registers survive the body.
+static void expr_assemble(ZAssembler &a, const Environment &env,
+			  expr_entry_t* ent)
+{
+    FuncDetail func;
+    FuncFrame frame;
+    x86::Gp parr = x86::rax;
+    x86::Gp psv = x86::rcx;
+    x86::Gp pout = x86::rdx;
+    x86::Gp nblk = x86::rdi;
+    x86::Gp offs = x86::r8;
+    x86::Gp ptr = x86::r9;
+    Label loop = a.newLabel();
+    Label done = a.newLabel();
+    int i, u;
+
+    func.init(FuncSignatureT<void, const void**, const void*, void*,
+	      size_t>(CallConvId::kHost), env);
+    frame.init(func);
+    a.set_func_frame(&frame);
+    frame.addDirtyRegs(parr);
+    frame.addDirtyRegs(psv);
+    frame.addDirtyRegs(pout);
+    frame.addDirtyRegs(nblk);
+    frame.addDirtyRegs(offs);
+    frame.addDirtyRegs(ptr);
+    for (i = 0; i < 16; i++) {
+	if (R_FREE_MASK & (1 << i))
+	    frame.addDirtyRegs(x86::Gpq(i));
+	if ((EXPR_VREGS|X_FREE_MASK) & (1 << i))
+	    frame.addDirtyRegs(x86::Xmm(i));
+    }
+    frame.setLocalStackSize(SPILL_SIZE);
+    frame.setLocalStackAlignment(16);
+    FuncArgsAssignment args(&func);
+    args.assignAll(parr, psv, pout, nblk);
+    args.updateFuncFrame(frame);
+    frame.finalize();
+
+    a.emitProlog(frame);
+    a.emitArgsAssignment(frame, args);
+
+    for (i = 0; i < NUM_VECTOR_REGISTERS; i++) {
+	if (ent->sreg[i] != EXPR_NOREG)
+	    a.movdqu(x86::Xmm(ent->sreg[i]), x86::ptr(psv, i*VSIZE));
+    }
+    a.xor_(offs, offs);
+    a.test(nblk, nblk);
+    a.jz(done);
+
+    a.bind(loop);
+    for (u = 0; u < ent->unroll; u++) {
+	for (i = 0; i < NUM_VECTOR_REGISTERS; i++) {
+	    uint8_t r = ent->areg[u*NUM_VECTOR_REGISTERS+i];
+	    if (r == EXPR_NOREG)
+		continue;
+	    a.mov(ptr, x86::ptr(parr, i*8));
+	    a.movdqu(x86::Xmm(r), x86::ptr(ptr, offs, 0, u*VSIZE));
+	}
+    }
+    for (i = 0; i < (int) ent->n-1; i++) {  // last is the vret
+	a.reg_pin(instr_uses(&ent->code[i]) | instr_defs(&ent->code[i]));
+	emit_instruction(a, &ent->code[i], 0, parr);
+    }
+    for (u = 0; u < ent->unroll; u++)
+	a.movdqu(x86::ptr(pout, offs, 0, u*VSIZE), x86::Xmm(ent->oreg[u]));
+    a.add(offs, ent->unroll*VSIZE);
+    a.dec(nblk);
+    a.jnz(loop);
+
+    a.bind(done);
+    a.emitEpilog(frame);
+    a.embed_const_pool();
+}
+
+static expr_fun_t expr_native(jit_expr_cache_t* c, expr_entry_t* ent)
+{
+    ExprErrorHandler eh;
+    CodeHolder code;
+    expr_fun_t fn;
+
+    code.init(c->rt.environment(), c->rt.cpuFeatures());
+    code.setErrorHandler(&eh);
+    ZAssembler a(&code, 1024);
+    a.disable(~0u);
+    a.enable(c->vec_mask);
+    expr_assemble(a, c->rt.environment(), ent);
+    if ((eh.err != kErrorOk) || (c->rt.add(&fn, &code) != kErrorOk))
+	return NULL;
+    return fn;
+}
+
+// same as the native kernel, one emulator run per block
+static void expr_emulate(expr_entry_t* ent, const void** array,
+			 const vscalar0_t* sv, void* out, size_t nblk)
+{
+    vregfile_t rf;
+    size_t b;
+    int i, u, ret;
+
+    memset(&rf, 0, sizeof(rf));
+    for (i = 0; i < NUM_VECTOR_REGISTERS; i++) {
+	if (ent->sreg[i] != EXPR_NOREG)
+	    rf.v[ent->sreg[i]] = sv[i];
+    }
+    for (b = 0; b < nblk; b++) {
+	size_t offs = b*ent->unroll*VSIZE;
+	for (u = 0; u < ent->unroll; u++) {
+	    for (i = 0; i < NUM_VECTOR_REGISTERS; i++) {
+		uint8_t r = ent->areg[u*NUM_VECTOR_REGISTERS+i];
+		if (r != EXPR_NOREG)
+		    memcpy(rf.v[r].vu8,
+			   (const uint8_t*)array[i] + offs + u*VSIZE, VSIZE);
+	    }
+	}
+	emulate(&rf, ent->code, ent->n, &ret);
+	for (u = 0; u < ent->unroll; u++)
+	    memcpy((uint8_t*)out + offs + u*VSIZE, rf.v[ent->oreg[u]].vu8,
+		   VSIZE);
+    }
+}
+
+jit_expr_cache_t* jit_expr_cache_new(unsigned threshold, unsigned vec_mask)
+{
+    jit_expr_cache_t* c = new jit_expr_cache_t;
+
+    c->threshold = threshold;
+    c->vec_mask = vec_mask;
+    memset(&c->stats, 0, sizeof(c->stats));
+    return c;
+}
+
+void jit_expr_cache_delete(jit_expr_cache_t* c)
+{
+    for (auto& s : c->shapes) {
+	expr_entry_t* ent = s.second;
+	if (ent->fn != NULL)
+	    c->rt.release(ent->fn);
+	delete [] ent->code;
+	delete ent;
+    }
+    delete c;
+}
+
+void jit_expr_cache_stats(jit_expr_cache_t* c, jit_expr_stats_t* sp)
+{
+    std::lock_guard<std::mutex> lock(c->mtx);
+    *sp = c->stats;
+}
+
+// entry of the shape, *fnp is its native kernel once called more than
+// threshold times, else NULL
+static expr_entry_t* expr_lookup(jit_expr_cache_t* c, jit_expr_t* e,
+				 uint8_t type, expr_fun_t* fnp)
+{
+    std::string shape;
+    expr_entry_t* ent;
+    instr_t code[4*EXPR_UNROLL*NUM_VECTOR_REGISTERS*NUM_VECTOR_REGISTERS];
+    int n = -1;
+
+    shape.push_back(type);
+    expr_shape(e, shape);
+
+    std::lock_guard<std::mutex> lock(c->mtx);
+    auto it = c->shapes.find(shape);
+    if (it != c->shapes.end()) {
+	c->stats.hit++;
+	ent = it->second;
+    }
+    else {
+	ent = new expr_entry_t;
+	ent->code = NULL;
+	ent->n = 0;
+	ent->calls = 0;
+	ent->tried = 0;
+	ent->fn = NULL;
+	// as many vectors per iteration as the registers allow
+	for (ent->unroll = EXPR_UNROLL; ent->unroll > 0; ent->unroll /= 2) {
+	    if ((n = jit_expr_compile(e, type, ent->unroll, code,
+				      sizeof(code)/sizeof(code[0]),
+				      ent->areg, ent->sreg, ent->oreg)) >= 0)
+		break;
+	}
+	if (n < 0)
+	    c->stats.failed++;
+	else {
+	    ent->code = new instr_t[n];
+	    memcpy(ent->code, code, n*sizeof(instr_t));
+	    ent->n = n;
+	    c->stats.miss++;
+	}
+	c->shapes[shape] = ent;
+    }
+    if ((ent->code != NULL) && !ent->tried &&
+	(++ent->calls > c->threshold)) {
+	ent->tried = 1;
+	if ((ent->fn = expr_native(c, ent)) != NULL)
+	    c->stats.native++;
+    }
+    *fnp = ent->fn;
+    return ent;
+}
+
+static void expr_run(expr_entry_t* ent, expr_fun_t fn, const void** array,
+		     const vscalar0_t* sv, void* out, size_t nblk)
+{
+    if (fn != NULL)
+	fn(array, sv, out, nblk);
+    else
+	expr_emulate(ent, array, sv, out, nblk);
+}
+
+int jit_expr_eval(jit_expr_cache_t* c, jit_expr_t* e, uint8_t type,
+		  size_t n, const void** array, const void** scalar,
+		  void* out)
+{
+    expr_entry_t* ent;
+    expr_fun_t fn;
+    vscalar0_t sv[NUM_VECTOR_REGISTERS];
+    size_t es = get_scalar_size(type);
+    size_t len = n*es;
+    size_t bsize, nblk, rest;
+    int i, j;
+
+    if ((e == NULL) || ((ent = expr_lookup(c, e, type, &fn)) == NULL) ||
+	(ent->code == NULL))
+	return -1;
+
+    for (i = 0; i < NUM_VECTOR_REGISTERS; i++) {
+	if (ent->sreg[i] == EXPR_NOREG)
+	    continue;
+	for (j = 0; j < (int)(VSIZE/es); j++)
+	    memcpy(&sv[i].vu8[j*es], scalar[i], es);
+    }
+
+    bsize = ent->unroll*VSIZE;
+    nblk = len / bsize;
+    if (nblk > 0)
+	expr_run(ent, fn, array, sv, out, nblk);
+
+    // the last partial block runs on zero padded copies
+    if ((rest = len - nblk*bsize) > 0) {
+	uint8_t tail[NUM_VECTOR_REGISTERS][EXPR_UNROLL*VSIZE];
+	uint8_t tout[EXPR_UNROLL*VSIZE];
+	const void* tarr[NUM_VECTOR_REGISTERS];
+
+	for (i = 0; i < NUM_VECTOR_REGISTERS; i++) {
+	    tarr[i] = NULL;
+	    if (ent->areg[i] == EXPR_NOREG)  // copies use the same arrays
+		continue;
+	    memcpy(tail[i], (const uint8_t*)array[i] + nblk*bsize, rest);
+	    memset(tail[i] + rest, 0, bsize - rest);
+	    tarr[i] = tail[i];
+	}
+	expr_run(ent, fn, tarr, sv, tout, 1);
+	memcpy((uint8_t*)out + nblk*bsize, tout, rest);
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef __JITTER_EXPR_H__
+#define __JITTER_EXPR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jitter_types.h"
+#include "jitter.h"
+
+// Fused element-wise expressions over arrays
+//
+// An expression tree over input arrays and scalars is lowered to one
+// vector program: array i and scalar i are loaded into their own vector
+// registers (scalars broadcast once per call), inner nodes use the
+// remaining registers and the result is returned with vret. Evaluation
+// is a single pass instead of one pass and one temporary array per
+// operator. The program is unrolled to as many copies as the registers
+// allow (up to 4), each on the next VSIZE bytes of the inputs.
+//
+// The native kernel is a loop over the arrays: it loads the inputs of
+// all copies, runs the program and stores the results, unroll*VSIZE
+// bytes per iteration, so one call covers the whole length. The last
+// partial block runs on zero padded copies. Until a shape has been
+// evaluated threshold times (and if it can not be assembled) the
+// program runs in the emulator, one run per block.
+//
+// Programs are cached by expression shape (operators, leaves and
+// element type), so the same expression over other arrays, scalar
+// values or lengths reuses the compiled kernel.
+
+typedef struct _jit_expr_t jit_expr_t;
+typedef struct _jit_expr_cache_t jit_expr_cache_t;
+
+typedef struct {
+    uint64_t hit;       // shape found in cache
+    uint64_t miss;      // shape compiled
+    uint64_t failed;    // shape can not be compiled
+    uint64_t native;    // shape has a native loop kernel
+} jit_expr_stats_t;
+
+// leaves, index < NUM_VECTOR_REGISTERS
+extern jit_expr_t* jit_expr_array(int i);
+extern jit_expr_t* jit_expr_scalar(int i);
+// op is a vector register op: OP_VNEG, OP_VBNOT (a), OP_VADD, OP_VSUB,
+// OP_VRSUB, OP_VMUL, OP_VBAND, OP_VBANDN, OP_VBOR, OP_VBXOR, OP_VCMPxx
+// (a, b) or OP_VSEL (a = mask, b, c). The node owns its arguments, a
+// node can only be used once.
+extern jit_expr_t* jit_expr_op(uint8_t op, jit_expr_t* a, jit_expr_t* b,
+			       jit_expr_t* c);
+extern void jit_expr_delete(jit_expr_t* e);
+
+// lower unroll copies of e to code[0..max-1], areg[u*NUM_VECTOR_REGISTERS+i]
+// is the register of array i in copy u, sreg[i] the register of scalar i
+// (255 if not used) and oreg[u] the result of copy u, the last one is
+// returned with vret. Return number of instructions or -1 when e is
+// invalid or needs more registers than available
+extern int jit_expr_compile(jit_expr_t* e, uint8_t type, int unroll,
+			    instr_t* code, size_t max,
+			    uint8_t* areg, uint8_t* sreg, uint8_t* oreg);
+
+// a shape is assembled when it is evaluated more than threshold times
+// (0 on first use), vec_mask limit VEC_TYPE_xxx used
+extern jit_expr_cache_t* jit_expr_cache_new(unsigned threshold,
+					    unsigned vec_mask);
+extern void jit_expr_cache_delete(jit_expr_cache_t* c);
+extern void jit_expr_cache_stats(jit_expr_cache_t* c, jit_expr_stats_t* sp);
+
+// out[i] = e(array[0][i],.., *scalar[0],..) for i < n, all elements are
+// of type, return 0 or -1 if e can not be compiled
+extern int jit_expr_eval(jit_expr_cache_t* c, jit_expr_t* e, uint8_t type,
+			 size_t n, const void** array, const void** scalar,
+			 void* out);
+
+#endif
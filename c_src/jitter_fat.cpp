@@ -0,0 +1,286 @@
+//
+// Fat kernels, one bundle with code for several instruction set levels
+//
+
+#include <asmjit/x86.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace asmjit;
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_asm.h"
+#include "jitter_cache.h"
+#include "jitter_fat.h"
+
+extern void assemble(ZAssembler &a, const Environment &env,
+		     uint32_t reg_mask,
+		     x86::Mem save_ptr,
+		     instr_t* code, size_t n);
+extern void emulate(vregfile_t* rfp, instr_t* code, size_t n, int* ret);
+
+typedef void* (*fat_fun_t)(vregfile_t* rfp);
+
+#define VEC_TYPE_SSE4_2_ALL \
+    (VEC_TYPE_SSE|VEC_TYPE_SSE2|VEC_TYPE_SSE3|VEC_TYPE_SSSE3|	\
+     VEC_TYPE_SSE4_1|VEC_TYPE_SSE4_2)
+
+// variants in increasing order of preference (AVX-512 not supported)
+static const unsigned fat_isa[] = {
+    VEC_TYPE_SSE|VEC_TYPE_SSE2,
+    VEC_TYPE_SSE4_2_ALL,
+    VEC_TYPE_SSE4_2_ALL|VEC_TYPE_AVX,
+    VEC_TYPE_SSE4_2_ALL|VEC_TYPE_AVX|VEC_TYPE_AVX2|VEC_TYPE_F16C,
+};
+
+#define NUM_FAT_ISA (sizeof(fat_isa)/sizeof(fat_isa[0]))
+
+static const struct {
+    unsigned vec;
+    uint32_t id;
+} fat_feature[] = {
+    { VEC_TYPE_SSE,    CpuFeatures::X86::kSSE },
+    { VEC_TYPE_SSE2,   CpuFeatures::X86::kSSE2 },
+    { VEC_TYPE_SSE3,   CpuFeatures::X86::kSSE3 },
+    { VEC_TYPE_SSSE3,  CpuFeatures::X86::kSSSE3 },
+    { VEC_TYPE_SSE4_1, CpuFeatures::X86::kSSE4_1 },
+    { VEC_TYPE_SSE4_2, CpuFeatures::X86::kSSE4_2 },
+    { VEC_TYPE_AVX,    CpuFeatures::X86::kAVX },
+    { VEC_TYPE_AVX2,   CpuFeatures::X86::kAVX2 },
+    { VEC_TYPE_F16C,   CpuFeatures::X86::kF16C },
+};
+
+#define NUM_FAT_FEATURE (sizeof(fat_feature)/sizeof(fat_feature[0]))
+
+class FatErrorHandler : public ErrorHandler {
+public:
+    Error err;
+    FatErrorHandler() { err = kErrorOk; }
+    void handleError(Error e, const char* message, BaseEmitter* origin) override {
+	(void) message; (void) origin;
+	if (err == kErrorOk) err = e;
+    }
+};
+
+// compile for cpu with exactly the features in vec_mask
+static uint8_t* fat_compile(instr_t* code, size_t n, uint32_t reg_mask,
+			    unsigned vec_mask, size_t* sizep)
+{
+    Environment env = Environment::host();
+    FatErrorHandler eh;
+    CpuFeatures features;
+    CodeHolder ch;
+    Section* data;
+    Label save_label;
+    uint8_t* image;
+    size_t size;
+    size_t i;
+
+    features.x86().add(CpuFeatures::X86::kFXSR);
+    for (i = 0; i < NUM_FAT_FEATURE; i++) {
+	if (vec_mask & fat_feature[i].vec)
+	    features.x86().add(fat_feature[i].id);
+    }
+    ch.init(env, features);
+    ch.setErrorHandler(&eh);
+    ch.newSection(&data, ".data", 5, SectionFlags::kNone, 128);
+    ZAssembler a(&ch, 1024);
+
+    save_label = a.newLabel();
+    assemble(a, env, reg_mask, x86::ptr(save_label), code, n);
+    a.section(data);
+    a.bind(save_label);
+    a.embedDataArray(TypeId::kUInt8, "\0", 1, 512);
+
+    if ((eh.err != kErrorOk) ||
+	(ch.flatten() != kErrorOk) ||
+	(ch.resolveUnresolvedLinks() != kErrorOk))
+	return NULL;
+    size = ch.codeSize();
+    image = (uint8_t*) malloc(size);
+    if (!jit_cache_image(ch, image, size)) {
+	free(image);
+	return NULL;
+    }
+    *sizep = size;
+    return image;
+}
+
+// features of the running cpu that the code generator knows about
+static unsigned fat_host_mask(JitRuntime& rt)
+{
+    CodeHolder ch;
+
+    ch.init(rt.environment(), rt.cpuFeatures());
+    ZAssembler a(&ch, 64);
+    return a.enabled();
+}
+
+static int fat_check(uint8_t* fat, size_t len, jit_fat_hdr_t** hpp,
+		     instr_t** codep, jit_fat_variant_t** vpp)
+{
+    jit_fat_hdr_t* hp = (jit_fat_hdr_t*) fat;
+    jit_fat_variant_t* vp;
+    size_t hlen;
+    uint32_t i;
+
+    if ((len < sizeof(jit_fat_hdr_t)) ||
+	(hp->magic != JIT_FAT_MAGIC) ||
+	(hp->version != JIT_FAT_VERSION) ||
+	(hp->asmjit != ASMJIT_LIBRARY_VERSION) ||
+	(hp->n == 0) || (hp->nvariants > NUM_FAT_ISA))
+	return 0;
+    hlen = sizeof(jit_fat_hdr_t) + hp->n*sizeof(instr_t) +
+	hp->nvariants*sizeof(jit_fat_variant_t);
+    if (len < hlen)
+	return 0;
+    vp = (jit_fat_variant_t*) (fat + sizeof(jit_fat_hdr_t) +
+			       hp->n*sizeof(instr_t));
+    for (i = 0; i < hp->nvariants; i++) {
+	if ((vp[i].offset < hlen) || (vp[i].size == 0) ||
+	    ((size_t)vp[i].offset + vp[i].size > len))
+	    return 0;
+    }
+    *hpp = hp;
+    *codep = (instr_t*) (fat + sizeof(jit_fat_hdr_t));
+    *vpp = vp;
+    return 1;
+}
+
+uint8_t* jit_fat_build(instr_t* code, size_t n, uint32_t reg_mask,
+		       size_t* lenp)
+{
+    uint8_t* image[NUM_FAT_ISA];
+    size_t size[NUM_FAT_ISA];
+    jit_fat_hdr_t* hp;
+    jit_fat_variant_t* vp;
+    size_t len, offs;
+    uint8_t* fat = NULL;
+    size_t i;
+
+    len = sizeof(jit_fat_hdr_t) + n*sizeof(instr_t) +
+	NUM_FAT_ISA*sizeof(jit_fat_variant_t);
+    for (i = 0; i < NUM_FAT_ISA; i++) {
+	if ((image[i] = fat_compile(code, n, reg_mask, fat_isa[i],
+				    &size[i])) == NULL)
+	    goto done;
+	len = ((len + 63) & ~63) + size[i];
+    }
+    fat = (uint8_t*) calloc(1, len);
+    hp = (jit_fat_hdr_t*) fat;
+    hp->magic = JIT_FAT_MAGIC;
+    hp->version = JIT_FAT_VERSION;
+    hp->asmjit = ASMJIT_LIBRARY_VERSION;
+    hp->reg_mask = reg_mask;
+    hp->n = n;
+    hp->nvariants = NUM_FAT_ISA;
+    memcpy(fat + sizeof(jit_fat_hdr_t), code, n*sizeof(instr_t));
+    vp = (jit_fat_variant_t*) (fat + sizeof(jit_fat_hdr_t) +
+			       n*sizeof(instr_t));
+    offs = sizeof(jit_fat_hdr_t) + n*sizeof(instr_t) +
+	NUM_FAT_ISA*sizeof(jit_fat_variant_t);
+    for (i = 0; i < NUM_FAT_ISA; i++) {
+	offs = (offs + 63) & ~63;
+	vp[i].vec_mask = fat_isa[i];
+	vp[i].flags = 0;
+	vp[i].offset = offs;
+	vp[i].size = size[i];
+	memcpy(fat + offs, image[i], size[i]);
+	offs += size[i];
+    }
+    *lenp = len;
+done:
+    while(i--)
+	free(image[i]);
+    return fat;
+}
+
+int jit_fat_verify(uint8_t* fat, size_t len, vregfile_t* rfp)
+{
+    jit_fat_hdr_t* hp;
+    jit_fat_variant_t* vp;
+    instr_t* code;
+    instr_t* rp;
+    JitRuntime rt;
+    vregfile_t rf_emu;
+    unsigned host;
+    size_t cmp_size;
+    uint8_t* remu;
+    int failed = 0;
+    int ret = -1;
+    uint32_t i;
+
+    if (!fat_check(fat, len, &hp, &code, &vp))
+	return -1;
+    rp = &code[hp->n-1];
+    if ((rp->op != OP_RET) && (rp->op != OP_VRET))
+	return -1;
+    memcpy(&rf_emu, rfp, sizeof(vregfile_t));
+    emulate(&rf_emu, code, hp->n, &ret);
+    if (rp->op == OP_VRET) {
+	remu = (uint8_t*) &rf_emu.v[rp->rd];
+	cmp_size = sizeof(vscalar0_t);
+    }
+    else {
+	remu = (uint8_t*) &rf_emu.r[rp->rd];
+	cmp_size = get_scalar_size(rp->type);
+    }
+
+    host = fat_host_mask(rt);
+    for (i = 0; i < hp->nvariants; i++) {
+	vregfile_t rf;
+	fat_fun_t fn;
+	uint8_t* rexe;
+
+	if ((vp[i].vec_mask & ~host) != 0)
+	    continue;  // can not run here
+	fn = (fat_fun_t) jit_cache_add(rt, fat+vp[i].offset, vp[i].size);
+	if (fn == NULL) {
+	    vp[i].flags = JIT_FAT_FAILED;
+	    failed++;
+	    continue;
+	}
+	memcpy(&rf, rfp, sizeof(vregfile_t));
+	fn(&rf);
+	rt.release((void*)fn);
+	if (rp->op == OP_VRET)
+	    rexe = (uint8_t*) &rf.v[rp->rd];
+	else
+	    rexe = (uint8_t*) &rf.r[rp->rd];
+	if (memcmp(remu, rexe, cmp_size) == 0)
+	    vp[i].flags = JIT_FAT_VERIFIED;
+	else {
+	    vp[i].flags = JIT_FAT_FAILED;
+	    failed++;
+	}
+    }
+    return failed;
+}
+
+void* jit_fat_load(JitRuntime& rt, uint8_t* fat, size_t len,
+		   unsigned* vec_mask)
+{
+    jit_fat_hdr_t* hp;
+    jit_fat_variant_t* vp;
+    instr_t* code;
+    unsigned host;
+    int i;
+
+    if (!fat_check(fat, len, &hp, &code, &vp))
+	return NULL;
+    host = fat_host_mask(rt);
+    for (i = (int)hp->nvariants-1; i >= 0; i--) {
+	void* fn;
+	if (((vp[i].vec_mask & ~host) != 0) ||
+	    (vp[i].flags & JIT_FAT_FAILED))
+	    continue;
+	if ((fn = jit_cache_add(rt, fat+vp[i].offset, vp[i].size)) != NULL) {
+	    if (vec_mask != NULL)
+		*vec_mask = vp[i].vec_mask;
+	    return fn;
+	}
+    }
+    return NULL;
+}
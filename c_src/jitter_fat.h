@@ -0,0 +1,53 @@
+#ifndef __JITTER_FAT_H__
+#define __JITTER_FAT_H__
+
+#include <asmjit/x86.h>
+
+#include "jitter_types.h"
+#include "jitter.h"
+
+using namespace asmjit;
+
+// Fat kernel: one program compiled for several vector instruction set
+// levels, packed in a single position independent bundle. The best
+// variant for the running cpu is selected when the bundle is loaded.
+//
+// bundle layout:
+//   jit_fat_hdr_t
+//   instr_t code[n]
+//   jit_fat_variant_t variant[nvariants]
+//   machine code for each variant (64 byte aligned)
+
+#define JIT_FAT_MAGIC    0x4654494a  // "JITF"
+#define JIT_FAT_VERSION  1
+
+#define JIT_FAT_VERIFIED 0x01  // variant matches emulate()
+#define JIT_FAT_FAILED   0x02  // variant does not match emulate()
+
+typedef struct {
+    uint32_t magic;      // JIT_FAT_MAGIC
+    uint32_t version;    // JIT_FAT_VERSION
+    uint32_t asmjit;     // ASMJIT_LIBRARY_VERSION
+    uint32_t reg_mask;   // loaded registers
+    uint32_t n;          // number of instructions
+    uint32_t nvariants;
+} jit_fat_hdr_t;
+
+typedef struct {
+    uint32_t vec_mask;   // VEC_TYPE_xxx used by variant
+    uint32_t flags;      // JIT_FAT_xxx
+    uint32_t offset;     // from start of bundle
+    uint32_t size;
+} jit_fat_variant_t;
+
+// compile code for all variants, return malloc:ed bundle, size in *lenp
+extern uint8_t* jit_fat_build(instr_t* code, size_t n, uint32_t reg_mask,
+			      size_t* lenp);
+// run variants supported by this cpu on rfp and compare with emulate,
+// update variant flags, return number of failed variants or -1
+extern int jit_fat_verify(uint8_t* fat, size_t len, vregfile_t* rfp);
+// add best (not failed) variant for rt cpu to rt, NULL if none
+extern void* jit_fat_load(JitRuntime& rt, uint8_t* fat, size_t len,
+			  unsigned* vec_mask);
+
+#endif
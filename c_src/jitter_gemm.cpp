@@ -0,0 +1,469 @@
+//
+// GEMM microkernel generator and blocked driver
+//
+
+#include <asmjit/x86.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace asmjit;
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_asm.h"
+#include "jitter_gemm.h"
+
+#define GEMM_MR   6     // rows of the C block
+#define GEMM_NV   2     // vectors per row of the C block
+#define GEMM_KC   256   // k per packed panel, keeps B panel in L2
+
+// accumulators 0..MR*NV-1, then B vectors, broadcast and temporary
+#define ACC(i,j) ((i)*GEMM_NV+(j))
+#define VB(j)    (GEMM_MR*GEMM_NV+(j))
+#define VBC      (GEMM_MR*GEMM_NV+GEMM_NV)
+#define VTMP     (VBC+1)
+
+// kernel: C[mr x nr] += Apanel[k x mr] * Bpanel[k x nr], ldc in bytes
+typedef void (*gemm_fun_t)(const void* a, const void* b, void* c,
+			   size_t k, size_t ldc);
+
+struct _jit_gemm_t {
+    JitRuntime rt;
+    uint8_t type;
+    int es;         // element size
+    int vsize;      // vector size, 16 (xmm) or 32 (ymm)
+    int vex;        // ymm VEX code, else legacy SSE xmm
+    int fma;
+    int mr;
+    int nr;
+    gemm_fun_t fn;
+};
+
+class GemmErrorHandler : public ErrorHandler {
+public:
+    Error err;
+    GemmErrorHandler() { err = kErrorOk; }
+    void handleError(Error e, const char* message, BaseEmitter* origin) override {
+	(void) message; (void) origin;
+	if (err == kErrorOk) err = e;
+    }
+};
+
+static void vex_zero(ZAssembler &a, uint8_t type, x86::Ymm r)
+{
+    switch(type) {
+    case FLOAT32: a.vxorps(r, r, r); break;
+    case FLOAT64: a.vxorpd(r, r, r); break;
+    case INT32:   a.vpxor(r, r, r); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void vex_load(ZAssembler &a, uint8_t type, x86::Ymm r, x86::Mem m)
+{
+    switch(type) {
+    case FLOAT32: a.vmovups(r, m); break;
+    case FLOAT64: a.vmovupd(r, m); break;
+    case INT32:   a.vmovdqu(r, m); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void vex_store(ZAssembler &a, uint8_t type, x86::Mem m, x86::Ymm r)
+{
+    switch(type) {
+    case FLOAT32: a.vmovups(m, r); break;
+    case FLOAT64: a.vmovupd(m, r); break;
+    case INT32:   a.vmovdqu(m, r); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void vex_bcast(ZAssembler &a, uint8_t type, x86::Ymm r, x86::Mem m)
+{
+    switch(type) {
+    case FLOAT32: a.vbroadcastss(r, m); break;
+    case FLOAT64: a.vbroadcastsd(r, m); break;
+    case INT32:   a.vpbroadcastd(r, m); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void vex_add(ZAssembler &a, uint8_t type, x86::Ymm d, x86::Ymm s)
+{
+    switch(type) {
+    case FLOAT32: a.vaddps(d, d, s); break;
+    case FLOAT64: a.vaddpd(d, d, s); break;
+    case INT32:   a.vpaddd(d, d, s); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+// d += b*bc, tmp is clobbered without fma
+static void vex_madd(ZAssembler &a, uint8_t type, int fma,
+		     x86::Ymm d, x86::Ymm b, x86::Ymm bc, x86::Ymm tmp)
+{
+    switch(type) {
+    case FLOAT32:
+	if (fma)
+	    a.vfmadd231ps(d, b, bc);
+	else {
+	    a.vmulps(tmp, b, bc);
+	    a.vaddps(d, d, tmp);
+	}
+	break;
+    case FLOAT64:
+	if (fma)
+	    a.vfmadd231pd(d, b, bc);
+	else {
+	    a.vmulpd(tmp, b, bc);
+	    a.vaddpd(d, d, tmp);
+	}
+	break;
+    case INT32:
+	a.vpmulld(tmp, b, bc);
+	a.vpaddd(d, d, tmp);
+	break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void sse_zero(ZAssembler &a, uint8_t type, x86::Xmm r)
+{
+    switch(type) {
+    case FLOAT32: a.xorps(r, r); break;
+    case FLOAT64: a.xorpd(r, r); break;
+    case INT32:   a.pxor(r, r); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void sse_load(ZAssembler &a, uint8_t type, x86::Xmm r, x86::Mem m)
+{
+    switch(type) {
+    case FLOAT32: a.movups(r, m); break;
+    case FLOAT64: a.movupd(r, m); break;
+    case INT32:   a.movdqu(r, m); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void sse_store(ZAssembler &a, uint8_t type, x86::Mem m, x86::Xmm r)
+{
+    switch(type) {
+    case FLOAT32: a.movups(m, r); break;
+    case FLOAT64: a.movupd(m, r); break;
+    case INT32:   a.movdqu(m, r); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void sse_bcast(ZAssembler &a, uint8_t type, x86::Xmm r, x86::Mem m)
+{
+    switch(type) {
+    case FLOAT32:
+	a.movss(r, m);
+	a.shufps(r, r, 0);
+	break;
+    case FLOAT64:
+	a.movsd(r, m);
+	a.unpcklpd(r, r);
+	break;
+    case INT32:
+	a.movd(r, m);
+	a.pshufd(r, r, 0);
+	break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+static void sse_add(ZAssembler &a, uint8_t type, x86::Xmm d, x86::Xmm s)
+{
+    switch(type) {
+    case FLOAT32: a.addps(d, s); break;
+    case FLOAT64: a.addpd(d, s); break;
+    case INT32:   a.paddd(d, s); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+// d += b*bc, tmp is clobbered
+static void sse_madd(ZAssembler &a, uint8_t type,
+		     x86::Xmm d, x86::Xmm b, x86::Xmm bc, x86::Xmm tmp)
+{
+    switch(type) {
+    case FLOAT32:
+	a.movaps(tmp, b);
+	a.mulps(tmp, bc);
+	a.addps(d, tmp);
+	break;
+    case FLOAT64:
+	a.movapd(tmp, b);
+	a.mulpd(tmp, bc);
+	a.addpd(d, tmp);
+	break;
+    case INT32:
+	a.movdqa(tmp, b);
+	a.pmulld(tmp, bc);
+	a.paddd(d, tmp);
+	break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+// generate the mr x nr kernel
+static void gemm_assemble(ZAssembler &a, const Environment &env,
+			  jit_gemm_t* g)
+{
+    FuncDetail func;
+    FuncFrame frame;
+    x86::Gp pa = x86::rax;
+    x86::Gp pb = x86::rcx;
+    x86::Gp pc = x86::rdx;
+    x86::Gp pk = x86::r8;
+    x86::Gp ldc = x86::r9;
+    x86::Gp row = x86::r10;
+    Label loop = a.newLabel();
+    Label store = a.newLabel();
+    int i, j;
+
+    func.init(FuncSignatureT<void, const void*, const void*, void*,
+	      size_t, size_t>(CallConvId::kHost), env);
+    frame.init(func);
+    frame.addDirtyRegs(pa);
+    frame.addDirtyRegs(pb);
+    frame.addDirtyRegs(pc);
+    frame.addDirtyRegs(pk);
+    frame.addDirtyRegs(ldc);
+    frame.addDirtyRegs(row);
+    for (i = 0; i <= VTMP; i++)
+	frame.addDirtyRegs(x86::Xmm(i));
+    if (g->vex) {
+	frame.setAvxEnabled();
+	frame.setAvxCleanup();   // vzeroupper in epilog
+    }
+    FuncArgsAssignment args(&func);
+    args.assignAll(pa, pb, pc, pk, ldc);
+    args.updateFuncFrame(frame);
+    frame.finalize();
+
+    a.emitProlog(frame);
+    a.emitArgsAssignment(frame, args);
+
+    for (i = 0; i < GEMM_MR; i++) {
+	for (j = 0; j < GEMM_NV; j++) {
+	    if (g->vex)
+		vex_zero(a, g->type, x86::Ymm(ACC(i,j)));
+	    else
+		sse_zero(a, g->type, x86::Xmm(ACC(i,j)));
+	}
+    }
+    a.test(pk, pk);
+    a.jz(store);
+
+    a.bind(loop);
+    for (j = 0; j < GEMM_NV; j++) {
+	x86::Mem m = x86::ptr(pb, j*g->vsize);
+	if (g->vex)
+	    vex_load(a, g->type, x86::Ymm(VB(j)), m);
+	else
+	    sse_load(a, g->type, x86::Xmm(VB(j)), m);
+    }
+    for (i = 0; i < GEMM_MR; i++) {
+	x86::Mem m = x86::ptr(pa, i*g->es);
+	if (g->vex)
+	    vex_bcast(a, g->type, x86::Ymm(VBC), m);
+	else
+	    sse_bcast(a, g->type, x86::Xmm(VBC), m);
+	for (j = 0; j < GEMM_NV; j++) {
+	    if (g->vex)
+		vex_madd(a, g->type, g->fma, x86::Ymm(ACC(i,j)),
+			 x86::Ymm(VB(j)), x86::Ymm(VBC), x86::Ymm(VTMP));
+	    else
+		sse_madd(a, g->type, x86::Xmm(ACC(i,j)),
+			 x86::Xmm(VB(j)), x86::Xmm(VBC), x86::Xmm(VTMP));
+	}
+    }
+    a.add(pa, GEMM_MR*g->es);
+    a.add(pb, g->nr*g->es);
+    a.dec(pk);
+    a.jnz(loop);
+
+    // C += block
+    a.bind(store);
+    a.mov(row, pc);
+    for (i = 0; i < GEMM_MR; i++) {
+	for (j = 0; j < GEMM_NV; j++) {
+	    x86::Mem m = x86::ptr(row, j*g->vsize);
+	    if (g->vex) {
+		vex_load(a, g->type, x86::Ymm(VTMP), m);
+		vex_add(a, g->type, x86::Ymm(ACC(i,j)), x86::Ymm(VTMP));
+		vex_store(a, g->type, m, x86::Ymm(ACC(i,j)));
+	    }
+	    else {
+		sse_load(a, g->type, x86::Xmm(VTMP), m);
+		sse_add(a, g->type, x86::Xmm(ACC(i,j)), x86::Xmm(VTMP));
+		sse_store(a, g->type, m, x86::Xmm(ACC(i,j)));
+	    }
+	}
+	if (i < GEMM_MR-1)
+	    a.add(row, ldc);
+    }
+    a.emitEpilog(frame);
+}
+
+// pick the kernel variant from the enabled tier, 0 if not supported
+static int gemm_select(jit_gemm_t* g, unsigned vec_mask)
+{
+    CodeHolder code;
+
+    code.init(g->rt.environment(), g->rt.cpuFeatures());
+    ZAssembler a(&code, 64);
+    a.disable(~0u);
+    a.enable(vec_mask);
+
+    switch(g->type) {
+    case FLOAT32: g->es = 4; break;
+    case FLOAT64: g->es = 8; break;
+    case INT32:   g->es = 4; break;
+    default: return 0;
+    }
+    if ((g->type == INT32) ? a.use_avx2() : a.use_avx()) {
+	g->vex = 1;
+	g->vsize = 32;
+	g->fma = (g->type != INT32) && a.use_fma();
+    }
+    else if ((g->type == INT32) ? a.use_sse4_1() : a.use_sse2()) {
+	g->vex = 0;
+	g->vsize = 16;
+	g->fma = 0;
+    }
+    else
+	return 0;
+    g->mr = GEMM_MR;
+    g->nr = GEMM_NV*(g->vsize / g->es);
+    return 1;
+}
+
+jit_gemm_t* jit_gemm_new(uint8_t type, unsigned vec_mask)
+{
+    jit_gemm_t* g = new jit_gemm_t;
+    GemmErrorHandler eh;
+    CodeHolder code;
+
+    g->type = type;
+    g->fn = NULL;
+    if (!gemm_select(g, vec_mask)) {
+	delete g;
+	return NULL;
+    }
+    code.init(g->rt.environment(), g->rt.cpuFeatures());
+    code.setErrorHandler(&eh);
+    ZAssembler a(&code, 1024);
+    gemm_assemble(a, g->rt.environment(), g);
+    if ((eh.err != kErrorOk) || (g->rt.add(&g->fn, &code) != kErrorOk)) {
+	delete g;
+	return NULL;
+    }
+    return g;
+}
+
+void jit_gemm_delete(jit_gemm_t* g)
+{
+    g->rt.release(g->fn);
+    delete g;
+}
+
+void jit_gemm_blocking(jit_gemm_t* g, int* mr, int* nr, int* vsize)
+{
+    *mr = g->mr;
+    *nr = g->nr;
+    *vsize = g->vsize;
+}
+
+// c[0..mb-1][0..nb-1] += tile, tile is mr x nr
+static void gemm_add_tile(jit_gemm_t* g, uint8_t* c, size_t ldc,
+			  const uint8_t* tile, size_t mb, size_t nb)
+{
+    size_t i, j;
+
+    for (i = 0; i < mb; i++) {
+	void* cp = c + i*ldc*g->es;
+	const void* tp = tile + i*g->nr*g->es;
+	for (j = 0; j < nb; j++) {
+	    switch(g->type) {
+	    case FLOAT32: ((float32_t*)cp)[j] += ((float32_t*)tp)[j]; break;
+	    case FLOAT64: ((float64_t*)cp)[j] += ((float64_t*)tp)[j]; break;
+	    case INT32:
+		((uint32_t*)cp)[j] += ((uint32_t*)tp)[j];
+		break;
+	    default: crash(__FILE__, __LINE__, g->type); break;
+	    }
+	}
+    }
+}
+
+void jit_gemm(jit_gemm_t* g, size_t m, size_t n, size_t k,
+	      const void* a, size_t lda,
+	      const void* b, size_t ldb,
+	      void* c, size_t ldc)
+{
+    size_t es = g->es;
+    size_t mr = g->mr;
+    size_t nr = g->nr;
+    size_t npanel = (n + nr - 1) / nr;
+    size_t kc = (k < GEMM_KC) ? k : GEMM_KC;
+    uint8_t* bpack = (uint8_t*) malloc(npanel*kc*nr*es);
+    uint8_t* apack = (uint8_t*) malloc(kc*mr*es);
+    uint8_t* tile = (uint8_t*) malloc(mr*nr*es);
+    const uint8_t* ap = (const uint8_t*) a;
+    const uint8_t* bp = (const uint8_t*) b;
+    uint8_t* cp = (uint8_t*) c;
+    size_t i, p, p0, i0, j0;
+
+    for (i = 0; i < m; i++)
+	memset(cp + i*ldc*es, 0, n*es);
+
+    for (p0 = 0; p0 < k; p0 += kc) {
+	size_t kb = ((k - p0) < kc) ? (k - p0) : kc;
+
+	// B panels: [panel][p][0..nr-1]
+	for (j0 = 0; j0 < n; j0 += nr) {
+	    size_t nb = ((n - j0) < nr) ? (n - j0) : nr;
+	    uint8_t* dst = bpack + (j0/nr)*kb*nr*es;
+	    for (p = 0; p < kb; p++) {
+		memcpy(dst + p*nr*es, bp + ((p0+p)*ldb + j0)*es, nb*es);
+		memset(dst + (p*nr + nb)*es, 0, (nr-nb)*es);
+	    }
+	}
+
+	for (i0 = 0; i0 < m; i0 += mr) {
+	    size_t mb = ((m - i0) < mr) ? (m - i0) : mr;
+
+	    // A panel: [p][0..mr-1]
+	    memset(apack, 0, kb*mr*es);
+	    for (i = 0; i < mb; i++) {
+		for (p = 0; p < kb; p++)
+		    memcpy(apack + (p*mr + i)*es,
+			   ap + ((i0+i)*lda + p0+p)*es, es);
+	    }
+	    for (j0 = 0; j0 < n; j0 += nr) {
+		size_t nb = ((n - j0) < nr) ? (n - j0) : nr;
+		uint8_t* bpanel = bpack + (j0/nr)*kb*nr*es;
+		uint8_t* cblock = cp + (i0*ldc + j0)*es;
+
+		if ((mb == mr) && (nb == nr))
+		    g->fn(apack, bpanel, cblock, kb, ldc*es);
+		else {
+		    memset(tile, 0, mr*nr*es);
+		    g->fn(apack, bpanel, tile, kb, nr*es);
+		    gemm_add_tile(g, cblock, ldc, tile, mb, nb);
+		}
+	    }
+	}
+    }
+    free(tile);
+    free(apack);
+    free(bpack);
+}
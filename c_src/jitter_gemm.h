@@ -0,0 +1,36 @@
+#ifndef __JITTER_GEMM_H__
+#define __JITTER_GEMM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jitter_types.h"
+
+// Matrix multiply with a generated register blocked microkernel
+//
+// C = A*B, row major, A is m x k, B is k x n and C is m x n, the leading
+// dimensions are in elements. A is packed in panels of mr rows and B in
+// panels of nr columns (zero padded), the kernel keeps an mr x nr block
+// of C in vector registers: per step one row of the B panel is loaded
+// (nr/lanes vectors), each A element is broadcast and multiplied into
+// one row of the block, with FMA when available.
+//
+// Blocking from the enabled tier: ymm with AVX (AVX2 for INT32), xmm
+// with SSE2 (SSE4.1 for INT32). mr = 6, nr = two vectors, that is 12
+// accumulators + 2 B vectors + broadcast + temporary = 16 registers.
+// AVX-512 (zmm, 32 registers) is not supported by the assembler tiers.
+
+typedef struct _jit_gemm_t jit_gemm_t;
+
+// type FLOAT32, FLOAT64 or INT32, vec_mask limit VEC_TYPE_xxx used,
+// NULL if the type is not supported by the tier
+extern jit_gemm_t* jit_gemm_new(uint8_t type, unsigned vec_mask);
+extern void jit_gemm_delete(jit_gemm_t* g);
+// block size and vector size in bytes of the kernel
+extern void jit_gemm_blocking(jit_gemm_t* g, int* mr, int* nr, int* vsize);
+extern void jit_gemm(jit_gemm_t* g, size_t m, size_t n, size_t k,
+		     const void* a, size_t lda,
+		     const void* b, size_t ldb,
+		     void* c, size_t ldc);
+
+#endif
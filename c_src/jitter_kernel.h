@@ -0,0 +1,81 @@
+#ifndef __JITTER_KERNEL_H__
+#define __JITTER_KERNEL_H__
+
+#include <string.h>
+#include <stdint.h>
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_asm.h"
+#include "jitter_builder.h"
+
+// Typed native kernels: the code is assembled as a plain C function,
+// arguments arrive in rdi/rsi/.. and xmm0.. and are moved to registers
+// 0..nargs-1, the ret register is returned in rax/xmm0. No register
+// file is involved.
+//
+//   Kernel<float(float,float)> k(rt, code, n);
+//   if (k.ok()) r = k(1.0, 2.0);
+
+extern void assemble_native(ZAssembler &a, const Environment &env,
+			    const jit_proto_t* proto,
+			    instr_t* code, size_t n);
+
+class KernelErrorHandler : public ErrorHandler {
+public:
+    Error err;
+    KernelErrorHandler() { err = kErrorOk; }
+    void handleError(Error e, const char* message, BaseEmitter* origin) override {
+	(void) message; (void) origin;
+	if (err == kErrorOk) err = e;
+    }
+};
+
+template<typename F> class Kernel;
+
+template<typename R, typename... A>
+class Kernel<R(A...)> {
+public:
+    typedef R (*fun_t)(A...);
+
+    // assemble code, vec_mask limits the VEC_TYPE_xxx used
+    Kernel(JitRuntime& rt, instr_t* code, size_t n, unsigned vec_mask = ~0u)
+	: rt_(rt), fn_(NULL) {
+	static_assert(sizeof...(A) <= JIT_MAX_ARGS, "too many arguments");
+	const uint8_t types[] = { jit_type_of<A>::value..., VOID };
+	KernelErrorHandler eh;
+	CodeHolder holder;
+	jit_proto_t proto;
+
+	proto.ret = jit_type_of<R>::value;
+	proto.nargs = sizeof...(A);
+	memcpy(proto.arg, types, proto.nargs);
+
+	holder.init(rt.environment(), rt.cpuFeatures());
+	holder.setErrorHandler(&eh);
+	ZAssembler a(&holder, 1024);
+	a.disable(~0u);
+	a.enable(vec_mask);
+	assemble_native(a, rt.environment(), &proto, code, n);
+	if ((eh.err != kErrorOk) || (rt.add(&fn_, &holder) != kErrorOk))
+	    fn_ = NULL;
+    }
+
+    ~Kernel() {
+	if (fn_ != NULL)
+	    rt_.release(fn_);
+    }
+
+    bool ok() const { return fn_ != NULL; }
+    fun_t fn() const { return fn_; }
+    R operator()(A... args) const { return fn_(args...); }
+
+private:
+    Kernel(const Kernel&);
+    Kernel& operator=(const Kernel&);
+
+    JitRuntime& rt_;
+    fun_t fn_;
+};
+
+#endif
@@ -0,0 +1,636 @@
+//
+// Global optimizer for jitter code
+//
+// Basic blocks are split at jump targets and after jumps/ret (as the
+// labels in assemble). Passes:
+//   sparse conditional constant propagation, constant folding to movi,
+//   constant branches and unreachable block removal
+//   global copy propagation
+//   dead code elimination
+// Only the register returned by ret/vret is observable, other registers
+// in the register file may differ from the unoptimized code.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jitter_types.h"
+#include "jitter.h"
+
+extern void emulate(vregfile_t* rfp, instr_t* code, size_t n, int* ret);
+
+// register id: 0-15 vector registers, 16-31 scalar registers
+#define NUM_REG_ID 32
+#define VREG_ID(r) (r)
+#define SREG_ID(r) ((r)+16)
+#define IS_VREG_ID(x) ((x) < 16)
+
+#define LAT_TOP   0  // no value yet
+#define LAT_CONST 1  // constant value
+#define LAT_BOT   2  // not constant
+
+typedef struct {
+    uint8_t state;
+    uint8_t type;       // type of instruction that defined value
+    uint8_t value[16];  // scalar use first 8 bytes
+} lat_t;
+
+typedef struct {
+    int8_t  src[NUM_REG_ID];   // rd is copy of src or -1
+    uint8_t type[NUM_REG_ID];  // type of mov
+} copy_t;
+
+#define FLD_RD 0
+#define FLD_RI 1
+#define FLD_RJ 2
+#define FLD_RK 3
+
+typedef struct {
+    size_t n;         // number of instructions
+    int nblocks;
+    int* block;       // block of instruction [n]
+    int* start;       // first instruction in block [nblocks+1]
+} cfg_t;
+
+static int is_float(uint8_t type)
+{
+    return get_base_type(type) >= FLOAT01;
+}
+
+static void set_field(instr_t* p, int fld, int r)
+{
+    switch(fld) {
+    case FLD_RD: p->rd = r; break;
+    case FLD_RI: p->ri = r; break;
+    case FLD_RJ: p->rj = r; break;
+    case FLD_RK: p->rk = r; break;
+    default: break;
+    }
+}
+
+// source operands, field and register id, return number of sources
+static int opt_srcs(instr_t* p, int* fld, int* id)
+{
+    int base = (p->op & OP_VEC) ? 0 : 16;
+
+    switch(p->op) {
+    case OP_NOP:
+    case OP_VNOP:
+    case OP_JMP:
+    case OP_MOVI:
+    case OP_VMOVI:
+	return 0;
+    case OP_RET:
+    case OP_VRET:
+    case OP_JNZ:
+    case OP_JZ:
+    case OP_VJANY:
+    case OP_VJALL:
+	fld[0] = FLD_RD; id[0] = base + p->rd;
+	return 1;
+    case OP_VSEL:
+	fld[0] = FLD_RI; id[0] = VREG_ID(p->ri);
+	fld[1] = FLD_RJ; id[1] = VREG_ID(p->rj);
+	fld[2] = FLD_RK; id[2] = VREG_ID(p->rk);
+	return 3;
+    case OP_VSLL:
+    case OP_VSRL:
+    case OP_VSRA:  // shift amount in scalar register
+	fld[0] = FLD_RI; id[0] = VREG_ID(p->ri);
+	fld[1] = FLD_RJ; id[1] = SREG_ID(p->rj);
+	return 2;
+    default:
+	break;
+    }
+    fld[0] = FLD_RI; id[0] = base + p->ri;
+    if ((p->op & OP_BIN) && !(p->op & OP_IMM)) {
+	fld[1] = FLD_RJ; id[1] = base + p->rj;
+	return 2;
+    }
+    return 1;
+}
+
+// register id written or -1
+static int opt_def(instr_t* p)
+{
+    if (OP_IS_JUMP(p->op))
+	return -1;
+    switch(p->op) {
+    case OP_NOP:
+    case OP_VNOP:
+    case OP_RET:
+    case OP_VRET:
+	return -1;
+    default:
+	return (p->op & OP_VEC) ? VREG_ID(p->rd) : SREG_ID(p->rd);
+    }
+}
+
+// def overwrites all bytes of register
+static int opt_full_def(instr_t* p, int d)
+{
+    return IS_VREG_ID(d) || (get_scalar_size(p->type) == 8);
+}
+
+static int opt_succ(cfg_t* g, instr_t* code, int i, int* succ)
+{
+    instr_t* p = &code[i];
+    int k = 0, j;
+
+    if ((p->op == OP_RET) || (p->op == OP_VRET))
+	return 0;
+    if ((p->op != OP_JMP) && (i+1 < (int)g->n))
+	succ[k++] = i+1;
+    if (OP_IS_JUMP(p->op) && ((j = i+1+p->imm12) < (int)g->n) &&
+	((k == 0) || (succ[0] != j)))
+	succ[k++] = j;
+    return k;
+}
+
+static void cfg_build(cfg_t* g, instr_t* code, size_t n)
+{
+    uint8_t leader[n+1];
+    int i, b;
+
+    memset(leader, 0, n+1);
+    leader[0] = 1;
+    for (i = 0; i < (int)n; i++) {
+	instr_t* p = &code[i];
+	if (OP_IS_JUMP(p->op)) {
+	    leader[i+1+p->imm12] = 1;
+	    leader[i+1] = 1;
+	}
+	else if ((p->op == OP_RET) || (p->op == OP_VRET))
+	    leader[i+1] = 1;
+    }
+    g->n = n;
+    g->block = (int*) malloc(n*sizeof(int));
+    g->start = (int*) malloc((n+1)*sizeof(int));
+    b = -1;
+    for (i = 0; i < (int)n; i++) {
+	if (leader[i])
+	    g->start[++b] = i;
+	g->block[i] = b;
+    }
+    g->nblocks = b+1;
+    g->start[g->nblocks] = n;
+}
+
+static void cfg_free(cfg_t* g)
+{
+    free(g->block);
+    free(g->start);
+}
+
+// remove instructions with keep[i]=0 and remap jump offsets
+static size_t opt_compact(instr_t* code, size_t n, uint8_t* keep)
+{
+    int map[n+1];
+    int i, k;
+
+    k = 0;
+    for (i = 0; i < (int)n; i++) {
+	map[i] = k;
+	if (keep[i]) k++;
+    }
+    map[n] = k;
+    k = 0;
+    for (i = 0; i < (int)n; i++) {
+	if (!keep[i])
+	    continue;
+	code[k] = code[i];
+	if (OP_IS_JUMP(code[k].op))
+	    code[k].imm12 = map[i+1+code[i].imm12] - (k+1);
+	k++;
+    }
+    return k;
+}
+
+// load constant operands and run instruction in the emulator with two
+// different initial register files, constant if both agree
+static void opt_eval(instr_t* p, lat_t* s, lat_t* out)
+{
+    int fld[3], id[3];
+    int ns = opt_srcs(p, fld, id);
+    int d = opt_def(p);
+    size_t size = IS_VREG_ID(d) ? 16 : get_scalar_size(p->type);
+    uint8_t res[2][16];
+    int i, k, ret;
+
+    out->state = LAT_BOT;
+    if (!IS_VREG_ID(d) && is_float(p->type))
+	return;  // scalar float registers differs between jit and emu
+    for (i = 0; i < ns; i++) {
+	if (s[id[i]].state != LAT_CONST)
+	    return;
+	if (!IS_VREG_ID(id[i]) && (s[id[i]].type != p->type))
+	    return;
+	if (IS_VREG_ID(d) != IS_VREG_ID(id[i]))
+	    return;  // vsll etc
+    }
+    for (k = 0; k < 2; k++) {
+	vregfile_t rf;
+	instr_t prog[2];
+
+	memset(&rf, k ? 0xff : 0, sizeof(rf));
+	for (i = 0; i < ns; i++) {
+	    if (IS_VREG_ID(id[i]))
+		memcpy(&rf.v[id[i]], s[id[i]].value, 16);
+	    else
+		memcpy(&rf.r[id[i]-16], s[id[i]].value, 8);
+	}
+	prog[0] = *p;
+	prog[1].op = IS_VREG_ID(d) ? OP_VRET : OP_RET;
+	prog[1].type = p->type;
+	prog[1].rd = p->rd;
+	emulate(&rf, prog, 2, &ret);
+	if (IS_VREG_ID(d))
+	    memcpy(res[k], &rf.v[p->rd], 16);
+	else
+	    memcpy(res[k], &rf.r[p->rd], 8);
+    }
+    if (memcmp(res[0], res[1], size) != 0)
+	return;
+    out->state = LAT_CONST;
+    out->type = p->type;
+    memset(out->value, 0, 16);
+    memcpy(out->value, res[0], size);
+}
+
+static void opt_transfer(instr_t* p, lat_t* s)
+{
+    int d = opt_def(p);
+    lat_t v;
+
+    if (d < 0)
+	return;
+    opt_eval(p, s, &v);
+    s[d] = v;
+}
+
+// 1 = jump taken, 0 = not taken, -1 = unknown
+static int opt_branch(instr_t* p, lat_t* s)
+{
+    int fld[1], id[1];
+    int r[2];
+    int k;
+
+    if (p->op == OP_JMP)
+	return 1;
+    opt_srcs(p, fld, id);
+    if ((s[id[0]].state != LAT_CONST) ||
+	(!IS_VREG_ID(id[0]) &&
+	 (is_float(p->type) || (s[id[0]].type != p->type))))
+	return -1;
+    for (k = 0; k < 2; k++) {
+	vregfile_t rf;
+	instr_t prog[3];
+
+	memset(&rf, k ? 0xff : 0, sizeof(rf));
+	if (IS_VREG_ID(id[0]))
+	    memcpy(&rf.v[id[0]], s[id[0]].value, 16);
+	else
+	    memcpy(&rf.r[id[0]-16], s[id[0]].value, 8);
+	prog[0] = *p;
+	prog[0].imm12 = 1;
+	prog[0].rd = p->rd;
+	prog[1].op = OP_RET; prog[1].type = INT8; prog[1].rd = 0;
+	prog[2].op = OP_RET; prog[2].type = INT8; prog[2].rd = 1;
+	emulate(&rf, prog, 3, &r[k]);
+    }
+    return (r[0] == r[1]) ? r[0] : -1;
+}
+
+static int opt_join(lat_t* dst, lat_t* src)
+{
+    int changed = 0;
+    int x;
+
+    for (x = 0; x < NUM_REG_ID; x++) {
+	if ((src[x].state == LAT_TOP) || (dst[x].state == LAT_BOT))
+	    continue;
+	if (dst[x].state == LAT_TOP) {
+	    dst[x] = src[x];
+	    changed = 1;
+	}
+	else if ((src[x].state != LAT_CONST) ||
+		 (src[x].type != dst[x].type) ||
+		 (memcmp(src[x].value, dst[x].value, 16) != 0)) {
+	    dst[x].state = LAT_BOT;
+	    changed = 1;
+	}
+    }
+    return changed;
+}
+
+static int64_t lane_value(uint8_t type, uint8_t* ptr)
+{
+    scalar0_t v;
+
+    memcpy(&v, ptr, sizeof(v));
+    switch(type) {
+    case UINT8:  return v.u8;
+    case UINT16: return v.u16;
+    case UINT32: return v.u32;
+    case UINT64: return (int64_t) v.u64;
+    case INT8:   return v.i8;
+    case INT16:  return v.i16;
+    case INT32:  return v.i32;
+    case INT64:  return v.i64;
+    default: return 0x10000;  // never fit imm12
+    }
+}
+
+// replace p with movi/vmovi if it loads the same constant
+static int opt_fold(instr_t* p, lat_t* v)
+{
+    size_t lsize = get_scalar_size(p->type);
+    int vec = (p->op & OP_VEC) != 0;
+    int64_t x;
+    instr_t q;
+    lat_t w;
+    size_t i;
+
+    if ((p->op == OP_MOVI) || (p->op == OP_VMOVI) || is_float(p->type))
+	return 0;
+    x = lane_value(get_scalar_type(p->type), v->value);
+    if ((x < -2048) || (x > 2047))
+	return 0;
+    if (vec) {
+	for (i = lsize; i < 16; i += lsize)
+	    if (memcmp(v->value, v->value+i, lsize) != 0)
+		return 0;
+    }
+    q.op = vec ? OP_VMOVI : OP_MOVI;
+    q.type = p->type;
+    q.rd = p->rd;
+    q.imm12 = x;
+    opt_eval(&q, NULL, &w);
+    if ((w.state != LAT_CONST) ||
+	(memcmp(w.value, v->value, vec ? 16 : lsize) != 0))
+	return 0;
+    *p = q;
+    return 1;
+}
+
+// sparse conditional constant propagation
+static size_t opt_sccp(instr_t* code, size_t n)
+{
+    cfg_t g;
+    lat_t* in;
+    uint8_t* reach;
+    int* work;
+    uint8_t keep[n];
+    int nwork = 0;
+    int b, i, x;
+
+    cfg_build(&g, code, n);
+    in = (lat_t*) calloc(g.nblocks*NUM_REG_ID, sizeof(lat_t));
+    reach = (uint8_t*) calloc(g.nblocks, 1);
+    work = (int*) malloc((g.nblocks+1)*sizeof(int));
+
+    for (x = 0; x < NUM_REG_ID; x++)
+	in[x].state = LAT_BOT;  // program input
+    reach[0] = 1;
+    work[nwork++] = 0;
+    while(nwork > 0) {
+	lat_t s[NUM_REG_ID];
+	int last, t, k, succ[2], ns;
+
+	b = work[--nwork];
+	memcpy(s, &in[b*NUM_REG_ID], sizeof(s));
+	last = g.start[b+1]-1;
+	for (i = g.start[b]; i <= last; i++)
+	    opt_transfer(&code[i], s);
+	ns = opt_succ(&g, code, last, succ);
+	if (OP_IS_JUMP(code[last].op) &&
+	    ((t = opt_branch(&code[last], s)) >= 0)) {
+	    if (t == 1) {  // only jump target
+		int j = last+1+code[last].imm12;
+		ns = 0;
+		if (j < (int)n) succ[ns++] = j;
+	    }
+	    else if ((ns > 0) && (succ[0] == last+1))
+		ns = 1;    // only fall through
+	    else
+		ns = 0;
+	}
+	for (k = 0; k < ns; k++) {
+	    int sb = g.block[succ[k]];
+	    int c;
+	    int j;
+	    c = opt_join(&in[sb*NUM_REG_ID], s);
+	    if (c || !reach[sb]) {
+		reach[sb] = 1;
+		for (j = 0; (j < nwork) && (work[j] != sb); j++) ;
+		if (j == nwork)
+		    work[nwork++] = sb;
+	    }
+	}
+    }
+
+    // rewrite reachable code
+    for (b = 0; b < g.nblocks; b++) {
+	lat_t s[NUM_REG_ID];
+	memcpy(s, &in[b*NUM_REG_ID], sizeof(s));
+	for (i = g.start[b]; i < g.start[b+1]; i++) {
+	    instr_t* p = &code[i];
+	    int d;
+	    keep[i] = reach[b];
+	    if (!reach[b])
+		continue;
+	    if (OP_IS_JUMP(p->op)) {
+		int t = opt_branch(p, s);
+		if (t == 0)
+		    keep[i] = 0;
+		else if (t == 1)
+		    p->op = OP_JMP;
+		if (p->imm12 == 0)
+		    keep[i] = 0;  // jump to next
+		continue;
+	    }
+	    if ((p->op == OP_NOP) || (p->op == OP_VNOP)) {
+		keep[i] = 0;
+		continue;
+	    }
+	    if ((d = opt_def(p)) >= 0) {
+		lat_t v;
+		opt_eval(p, s, &v);
+		if (v.state == LAT_CONST)
+		    opt_fold(p, &v);
+		s[d] = v;
+	    }
+	}
+    }
+    free(work);
+    free(reach);
+    free(in);
+    cfg_free(&g);
+    return opt_compact(code, n, keep);
+}
+
+static void copy_transfer(instr_t* p, copy_t* s)
+{
+    int d = opt_def(p);
+    int x;
+
+    if (d < 0)
+	return;
+    for (x = 0; x < NUM_REG_ID; x++)
+	if (s->src[x] == d) s->src[x] = -1;
+    s->src[d] = -1;
+    if ((p->op == OP_MOV) && (SREG_ID(p->ri) != d)) {
+	s->src[d] = SREG_ID(p->ri);
+	s->type[d] = p->type;
+    }
+    else if ((p->op == OP_VMOV) && (VREG_ID(p->ri) != d)) {
+	s->src[d] = VREG_ID(p->ri);
+	s->type[d] = p->type;
+    }
+}
+
+static int copy_join(copy_t* dst, uint8_t* seen, copy_t* src)
+{
+    int changed = 0;
+    int x;
+
+    if (!*seen) {
+	*dst = *src;
+	*seen = 1;
+	return 1;
+    }
+    for (x = 0; x < NUM_REG_ID; x++) {
+	if ((dst->src[x] >= 0) &&
+	    ((dst->src[x] != src->src[x]) || (dst->type[x] != src->type[x]))) {
+	    dst->src[x] = -1;
+	    changed = 1;
+	}
+    }
+    return changed;
+}
+
+// global copy propagation, replace uses of copies with the source
+static void opt_copy(instr_t* code, size_t n)
+{
+    cfg_t g;
+    copy_t* in;
+    uint8_t* seen;
+    int changed;
+    int b, i, x;
+
+    cfg_build(&g, code, n);
+    in = (copy_t*) calloc(g.nblocks, sizeof(copy_t));
+    seen = (uint8_t*) calloc(g.nblocks, 1);
+    for (x = 0; x < NUM_REG_ID; x++)
+	in[0].src[x] = -1;
+    seen[0] = 1;
+    do {
+	changed = 0;
+	for (b = 0; b < g.nblocks; b++) {
+	    copy_t s;
+	    int succ[2], ns, k, last;
+	    if (!seen[b])
+		continue;
+	    s = in[b];
+	    last = g.start[b+1]-1;
+	    for (i = g.start[b]; i <= last; i++)
+		copy_transfer(&code[i], &s);
+	    ns = opt_succ(&g, code, last, succ);
+	    for (k = 0; k < ns; k++) {
+		int sb = g.block[succ[k]];
+		changed |= copy_join(&in[sb], &seen[sb], &s);
+	    }
+	}
+    } while(changed);
+
+    for (b = 0; b < g.nblocks; b++) {
+	copy_t s = in[b];
+	if (!seen[b])
+	    continue;
+	for (i = g.start[b]; i < g.start[b+1]; i++) {
+	    instr_t* p = &code[i];
+	    int fld[3], id[3];
+	    int k, ns = opt_srcs(p, fld, id);
+	    if ((p->op == OP_RET) || (p->op == OP_VRET))
+		ns = 0;  // keep the returned register
+	    for (k = 0; k < ns; k++) {
+		int y = s.src[id[k]];
+		if ((y >= 0) && (s.type[id[k]] == p->type))
+		    set_field(p, fld[k], IS_VREG_ID(y) ? y : y-16);
+	    }
+	    copy_transfer(p, &s);
+	}
+    }
+    free(seen);
+    free(in);
+    cfg_free(&g);
+}
+
+// dead code elimination, partial (scalar < 64 bit) defs do not kill
+static size_t opt_dce(instr_t* code, size_t n)
+{
+    cfg_t g;
+    uint32_t live[n];
+    uint8_t keep[n];
+    int changed;
+    int i, k;
+
+    g.n = n;
+    for (i = 0; i < (int)n; i++)
+	live[i] = 0;
+    do {
+	changed = 0;
+	for (i = (int)n-1; i >= 0; i--) {
+	    int succ[2], ns = opt_succ(&g, code, i, succ);
+	    uint32_t out = 0;
+	    for (k = 0; k < ns; k++) {
+		instr_t* q = &code[succ[k]];
+		int fld[3], id[3];
+		int j, nq = opt_srcs(q, fld, id);
+		int d = opt_def(q);
+		uint32_t m = live[succ[k]];
+		if ((d >= 0) && opt_full_def(q, d))
+		    m &= ~(1 << d);
+		for (j = 0; j < nq; j++)
+		    m |= (1 << id[j]);
+		out |= m;
+	    }
+	    if (out != live[i]) {
+		live[i] = out;
+		changed = 1;
+	    }
+	}
+    } while(changed);
+
+    changed = 0;
+    for (i = 0; i < (int)n; i++) {
+	int d = opt_def(&code[i]);
+	keep[i] = !((d >= 0) && !(live[i] & (1 << d)));
+	if (!keep[i]) changed = 1;
+    }
+    if (!changed)
+	return n;
+    return opt_compact(code, n, keep);
+}
+
+// optimize code in place, return new length
+size_t optimize(instr_t* code, size_t n)
+{
+    size_t n0;
+
+    do {
+	n0 = n;
+	if ((n = opt_sccp(code, n)) == 0)
+	    break;
+	opt_copy(code, n);
+	n = opt_dce(code, n);
+    } while((n < n0) && (n > 0));
+    if (n == 0) {  // no ret reached, keep one instruction
+	code[0].op = OP_NOP;
+	code[0].type = 0;
+	code[0].rd = 0;
+	code[0].imm12 = 0;
+	n = 1;
+    }
+    return n;
+}
@@ -0,0 +1,274 @@
+//
+// Linux perf support, perf map and jitdump files
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <mutex>
+
+#include "jitter_perf.h"
+
+// jitdump format, see linux tools/perf/Documentation/jitdump-specification.txt
+#define JITDUMP_MAGIC     0x4A695444  // "JiTD"
+#define JITDUMP_VERSION   1
+#define JIT_CODE_LOAD       0
+#define JIT_CODE_DEBUG_INFO 2
+#define JIT_CODE_CLOSE      3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;  // size of header
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} jitdump_hdr_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t total_size;  // size of record, with name and code
+    uint64_t timestamp;
+} jitdump_rec_t;
+
+typedef struct {
+    jitdump_rec_t p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    // char name[];
+    // uint8_t code[code_size];
+} jitdump_load_t;
+
+typedef struct {
+    jitdump_rec_t p;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+    // jitdump_entry_t entry[nr_entry];
+} jitdump_debug_t;
+
+typedef struct {
+    uint64_t addr;
+    int32_t lineno;
+    int32_t discrim;
+    // char name[];  "\xff" = same file as previous entry
+} jitdump_entry_t;
+
+struct _jit_perf_t {
+    std::mutex mtx;
+    FILE* map;           // perf map or NULL
+    FILE* dump;          // jitdump or NULL
+    FILE* src;           // instruction map or NULL
+    void* marker;        // mapping of dump file that perf record notices
+    size_t marker_size;
+    uint64_t index;      // next code_index
+};
+
+// same clock as perf record -k mono
+static uint64_t perf_timestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static FILE* perf_dump_open(jit_perf_t* p, const char* dir)
+{
+    char path[1024];
+    jitdump_hdr_t hdr;
+    FILE* f;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/jit-%d.dump",
+	     (dir != NULL) ? dir : "/tmp", getpid());
+    if ((fd = open(path, O_CREAT|O_TRUNC|O_RDWR, 0666)) < 0)
+	return NULL;
+    // perf record finds the dump file through this executable mapping
+    p->marker_size = sysconf(_SC_PAGESIZE);
+    p->marker = mmap(NULL, p->marker_size, PROT_READ|PROT_EXEC,
+		     MAP_PRIVATE, fd, 0);
+    if (p->marker == MAP_FAILED) {
+	p->marker = NULL;
+	close(fd);
+	return NULL;
+    }
+    if ((f = fdopen(fd, "w")) == NULL) {
+	munmap(p->marker, p->marker_size);
+	p->marker = NULL;
+	close(fd);
+	return NULL;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = JITDUMP_MAGIC;
+    hdr.version = JITDUMP_VERSION;
+    hdr.total_size = sizeof(hdr);
+    hdr.elf_mach = EM_X86_64;
+    hdr.pid = getpid();
+    hdr.timestamp = perf_timestamp();
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fflush(f);
+    return f;
+}
+
+jit_perf_t* jit_perf_open(unsigned flags, const char* dir)
+{
+    jit_perf_t* p = new jit_perf_t;
+
+    p->map = NULL;
+    p->dump = NULL;
+    p->src = NULL;
+    p->marker = NULL;
+    p->marker_size = 0;
+    p->index = 0;
+    if (flags & JIT_PERF_MAP) {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+	p->map = fopen(path, "a");
+    }
+    if (flags & JIT_PERF_DUMP)
+	p->dump = perf_dump_open(p, dir);
+    if (flags & JIT_PERF_SRC) {
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/jit-%d.src",
+		 (dir != NULL) ? dir : "/tmp", getpid());
+	p->src = fopen(path, "w");
+    }
+    if (((flags & JIT_PERF_MAP) && (p->map == NULL)) ||
+	((flags & JIT_PERF_DUMP) && (p->dump == NULL)) ||
+	((flags & JIT_PERF_SRC) && (p->src == NULL))) {
+	jit_perf_close(p);
+	return NULL;
+    }
+    return p;
+}
+
+void jit_perf_close(jit_perf_t* p)
+{
+    if (p->map != NULL)
+	fclose(p->map);
+    if (p->dump != NULL) {
+	jitdump_rec_t rec;
+	rec.id = JIT_CODE_CLOSE;
+	rec.total_size = sizeof(rec);
+	rec.timestamp = perf_timestamp();
+	fwrite(&rec, sizeof(rec), 1, p->dump);
+	fclose(p->dump);
+    }
+    if (p->src != NULL)
+	fclose(p->src);
+    if (p->marker != NULL)
+	munmap(p->marker, p->marker_size);
+    delete p;
+}
+
+// debug info record, must come before the load record of the code
+static void perf_dump_debug(jit_perf_t* p, const char* name, uint64_t addr,
+			    size_t n, const uint32_t* map)
+{
+    jitdump_debug_t rec;
+    jitdump_entry_t ent;
+    char file[256];
+    size_t file_len;
+    size_t i, nent = 0;
+
+    for (i = 0; i < n; i++)
+	if (map[i] < map[i+1]) nent++;
+    if (nent == 0)
+	return;
+    snprintf(file, sizeof(file), "%s.jas", name);
+    file_len = strlen(file) + 1;
+    rec.p.id = JIT_CODE_DEBUG_INFO;
+    rec.p.total_size = sizeof(rec) + nent*sizeof(ent) + file_len + (nent-1)*2;
+    rec.p.timestamp = perf_timestamp();
+    rec.code_addr = addr;
+    rec.nr_entry = nent;
+    fwrite(&rec, sizeof(rec), 1, p->dump);
+    for (i = 0; i < n; i++) {
+	if (map[i] >= map[i+1])  // no code of its own
+	    continue;
+	ent.addr = addr + map[i];
+	ent.lineno = i+1;
+	ent.discrim = 0;
+	fwrite(&ent, sizeof(ent), 1, p->dump);
+	if (file_len > 0) {
+	    fwrite(file, file_len, 1, p->dump);
+	    file_len = 0;
+	}
+	else
+	    fwrite("\xff", 2, 1, p->dump);
+    }
+}
+
+// "code <name> <addr> <size> <n>" then per instruction
+// "<offs> <instr_t bytes>", last "epilog <offs>"
+static void perf_src(jit_perf_t* p, const char* name, uint64_t addr,
+		     size_t size, instr_t* icode, size_t n,
+		     const uint32_t* map)
+{
+    size_t i, j;
+
+    fprintf(p->src, "code %s %lx %lx %lu\n", name,
+	    (unsigned long) addr, (unsigned long) size, (unsigned long) n);
+    for (i = 0; i < n; i++) {
+	uint8_t* ip = (uint8_t*) &icode[i];
+	fprintf(p->src, "%x ", map[i]);
+	for (j = 0; j < sizeof(instr_t); j++)
+	    fprintf(p->src, "%02x", ip[j]);
+	fprintf(p->src, "\n");
+    }
+    fprintf(p->src, "epilog %x\n", map[n]);
+    fflush(p->src);
+}
+
+void jit_perf_add(jit_perf_t* p, const char* name,
+		  const void* code, size_t size)
+{
+    jit_perf_add_map(p, name, code, size, NULL, 0, NULL);
+}
+
+void jit_perf_add_map(jit_perf_t* p, const char* name,
+		      const void* code, size_t size,
+		      instr_t* icode, size_t n, const uint32_t* map)
+{
+    std::lock_guard<std::mutex> lock(p->mtx);
+
+    if (p->map != NULL) {
+	fprintf(p->map, "%lx %lx %s\n",
+		(unsigned long) code, (unsigned long) size, name);
+	fflush(p->map);
+    }
+    if ((p->src != NULL) && (map != NULL))
+	perf_src(p, name, (uint64_t) code, size, icode, n, map);
+    if (p->dump != NULL) {
+	jitdump_load_t rec;
+	size_t name_len = strlen(name) + 1;
+
+	if (map != NULL)
+	    perf_dump_debug(p, name, (uint64_t) code, n, map);
+
+	rec.p.id = JIT_CODE_LOAD;
+	rec.p.total_size = sizeof(rec) + name_len + size;
+	rec.p.timestamp = perf_timestamp();
+	rec.pid = getpid();
+	rec.tid = syscall(SYS_gettid);
+	rec.vma = (uint64_t) code;
+	rec.code_addr = (uint64_t) code;
+	rec.code_size = size;
+	rec.code_index = p->index++;
+	fwrite(&rec, sizeof(rec), 1, p->dump);
+	fwrite(name, name_len, 1, p->dump);
+	fwrite(code, size, 1, p->dump);
+	fflush(p->dump);
+    }
+}
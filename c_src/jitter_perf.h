@@ -0,0 +1,40 @@
+#ifndef __JITTER_PERF_H__
+#define __JITTER_PERF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jitter_types.h"
+#include "jitter.h"
+
+// Tell linux perf about generated code.
+//
+// JIT_PERF_MAP  append "start size name" lines to /tmp/perf-<pid>.map,
+//               used by perf report/top to name the code
+// JIT_PERF_DUMP write <dir>/jit-<pid>.dump in jitdump format with the
+//               code bytes, record with "perf record -k mono" and run
+//               "perf inject --jit" to annotate the native code
+// JIT_PERF_SRC  write <dir>/jit-<pid>.src with the instructions and their
+//               code offsets, samples are folded per instruction by jfold
+//
+// With an instruction map (from assemble_map) the jitdump also gets
+// debug info, line <i+1> of "<name>.jas" is instruction i.
+
+#define JIT_PERF_MAP  0x01
+#define JIT_PERF_DUMP 0x02
+#define JIT_PERF_SRC  0x04
+
+typedef struct _jit_perf_t jit_perf_t;
+
+// dir is where the jitdump file is written (NULL = /tmp)
+extern jit_perf_t* jit_perf_open(unsigned flags, const char* dir);
+extern void jit_perf_close(jit_perf_t* p);
+// register code[size] under name, may be called from any thread
+extern void jit_perf_add(jit_perf_t* p, const char* name,
+			 const void* code, size_t size);
+// as jit_perf_add, map[0..n] is the code offset of each instruction
+extern void jit_perf_add_map(jit_perf_t* p, const char* name,
+			     const void* code, size_t size,
+			     instr_t* icode, size_t n, const uint32_t* map);
+
+#endif
@@ -0,0 +1,294 @@
+//
+// List scheduler for jitter code
+//
+// Instructions are reordered inside basic blocks (split as the labels
+// in assemble) so that long latency sequences, like the emulated vector
+// multiplies, overlap with independent instructions. Each instruction
+// is emitted by assemble with its own reg_alloc_reset so scratch and
+// spill registers never live across instructions and may be moved freely,
+// only the program registers give dependencies.
+// The jump ending a block, and the compare (and addi/subi) feeding it,
+// are kept last so that assemble and emu_prepare still fuse them.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <asmjit/x86.h>
+
+using namespace asmjit;
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_asm.h"
+
+extern uint32_t instr_uses(instr_t* p);
+extern uint32_t instr_defs(instr_t* p);
+
+#define SCHED_WINDOW 64   // max number of instructions scheduled together
+
+// instruction classes
+#define SC_MOVE    0   // mov, movi, nop
+#define SC_ALU     1   // scalar integer
+#define SC_MUL     2   // scalar integer multiply
+#define SC_FALU    3   // scalar float add/sub/cmp/neg
+#define SC_FMUL    4   // scalar float multiply
+#define SC_VALU    5   // vector integer add/sub/logic/cmp
+#define SC_VFALU   6   // vector float add/sub/cmp
+#define SC_VFMUL   7   // vector float multiply
+#define SC_VMUL8   8   // vector 8 bit multiply (emulated)
+#define SC_VMUL16  9
+#define SC_VMUL32  10
+#define SC_VMUL64  11  // vector 64 bit multiply (emulated)
+#define SC_VSHIFT  12  // vector shift by register
+#define SC_VSHIFT8 13  // vector 8 bit shift (emulated)
+#define SC_VSEL    14
+#define SC_VCVT    15  // half float conversion
+#define NUM_SC     16
+
+// isa tiers
+#define ST_NONE    0   // no sse2, vectors lane by lane
+#define ST_SSE2    1
+#define ST_SSE4_1  2
+#define ST_AVX     3
+#define NUM_ST     4
+
+typedef struct {
+    uint8_t lat;   // cycles until result is available
+    uint8_t cost;  // cycles the issue slot is busy (reciprocal throughput)
+} sched_cost_t;
+
+// {lat,cost} per tier for classes SC_MOVE .. SC_VCVT
+static const sched_cost_t sched_cost[NUM_ST][NUM_SC] = {
+    // ST_NONE
+    { {1,1}, {1,1}, {3,1}, {4,1}, {4,1}, {4,8}, {8,8}, {8,8},
+      {12,16}, {8,8}, {8,4}, {6,4}, {4,8}, {4,16}, {4,8}, {40,40} },
+    // ST_SSE2
+    { {1,1}, {1,1}, {3,1}, {4,1}, {4,1}, {1,1}, {4,1}, {4,1},
+      {14,10}, {5,1}, {10,2}, {14,12}, {2,2}, {4,5}, {3,3}, {20,20} },
+    // ST_SSE4_1
+    { {1,1}, {1,1}, {3,1}, {4,1}, {4,1}, {1,1}, {4,1}, {4,1},
+      {14,10}, {5,1}, {10,2}, {14,12}, {2,2}, {4,5}, {2,2}, {20,20} },
+    // ST_AVX
+    { {1,1}, {1,1}, {3,1}, {4,1}, {4,1}, {1,1}, {4,1}, {4,1},
+      {13,10}, {5,1}, {10,2}, {11,9}, {2,2}, {4,5}, {2,2}, {20,20} },
+};
+
+static int sched_tier(unsigned vec_mask)
+{
+    if (vec_mask & VEC_TYPE_AVX) return ST_AVX;
+    if (vec_mask & VEC_TYPE_SSE4_1) return ST_SSE4_1;
+    if (vec_mask & VEC_TYPE_SSE2) return ST_SSE2;
+    return ST_NONE;
+}
+
+static int is_float(uint8_t type)
+{
+    return get_base_type(type) >= FLOAT01;
+}
+
+static int sched_class(instr_t* p)
+{
+    int fp = is_float(p->type);
+    int size = get_scalar_size(p->type);
+
+    switch(p->op) {
+    case OP_NOP:
+    case OP_VNOP:
+    case OP_MOV:
+    case OP_MOVI:
+    case OP_VMOV:
+    case OP_VMOVI:
+	return SC_MOVE;
+    case OP_MUL:
+    case OP_MULI:
+	return fp ? SC_FMUL : SC_MUL;
+    case OP_VMUL:
+    case OP_VMULI:
+	if (fp) return SC_VFMUL;
+	switch(size) {
+	case 1: return SC_VMUL8;
+	case 2: return SC_VMUL16;
+	case 4: return SC_VMUL32;
+	default: return SC_VMUL64;
+	}
+    case OP_VSLL:
+    case OP_VSRL:
+    case OP_VSRA:
+	return (size == 1) ? SC_VSHIFT8 : SC_VSHIFT;
+    case OP_VSLLI:
+    case OP_VSRLI:
+    case OP_VSRAI:
+	return (size == 1) ? SC_VSHIFT8 : SC_VALU;
+    case OP_VSEL:
+	return SC_VSEL;
+    case OP_VCVT:
+    case OP_VCVTN:
+	return SC_VCVT;
+    default:
+	break;
+    }
+    if (p->op & OP_VEC)
+	return fp ? SC_VFALU : SC_VALU;
+    return fp ? SC_FALU : SC_ALU;
+}
+
+static void sched_instr_cost(instr_t* p, unsigned vec_mask,
+			     int* lat, int* cost)
+{
+    int c = sched_class(p);
+    const sched_cost_t* sp = &sched_cost[sched_tier(vec_mask)][c];
+
+    if ((c == SC_VCVT) && (vec_mask & VEC_TYPE_F16C)) {
+	*lat = 4;
+	*cost = 1;
+	return;
+    }
+    *lat = sp->lat;
+    *cost = sp->cost;
+}
+
+// register masks, scalar floats are kept in xmm registers by assemble
+// and conflict with the vector register with the same number
+static void sched_regs(instr_t* p, uint32_t* uses, uint32_t* defs)
+{
+    uint32_t u = instr_uses(p);
+    uint32_t d = instr_defs(p);
+
+    if (!(p->op & OP_VEC) && is_float(p->type)) {
+	u |= (u >> 16);
+	d |= (d >> 16);
+    }
+    *uses = u;
+    *defs = d;
+}
+
+// number of instructions at end of block [s,e) that must stay in place
+static int sched_tail(instr_t* code, int s, int e)
+{
+    instr_t* q = &code[e-1];
+    int k = 1;
+
+    if (!OP_IS_JUMP(q->op) && (q->op != OP_RET) && (q->op != OP_VRET))
+	return 0;
+    if (((q->op == OP_JNZ) || (q->op == OP_JZ)) && (e-2 >= s) &&
+	(instr_defs(&code[e-2]) & instr_uses(q))) {
+	instr_t* p = &code[e-2];
+	k++;
+	// addi/subi + cmp + jump
+	if ((e-3 >= s) && (p->op & OP_BIN) &&
+	    ((code[e-3].op == OP_ADDI) || (code[e-3].op == OP_SUBI)) &&
+	    (instr_defs(&code[e-3]) & instr_uses(p)))
+	    k++;
+    }
+    return k;
+}
+
+// list schedule code[s..e), at most SCHED_WINDOW instructions
+static void sched_window(instr_t* code, int s, int e, unsigned vec_mask)
+{
+    int m = e - s;
+    instr_t save[SCHED_WINDOW];
+    uint32_t uses[SCHED_WINDOW], defs[SCHED_WINDOW];
+    int8_t dep[SCHED_WINDOW][SCHED_WINDOW];  // edge latency or -1
+    int lat[SCHED_WINDOW], cost[SCHED_WINDOW];
+    int prio[SCHED_WINDOW], npred[SCHED_WINDOW], ready[SCHED_WINDOW];
+    uint8_t done[SCHED_WINDOW];
+    int cycle = 0;
+    int i, j, k;
+
+    if (m < 2)
+	return;
+    for (i = 0; i < m; i++) {
+	save[i] = code[s+i];
+	sched_regs(&save[i], &uses[i], &defs[i]);
+	sched_instr_cost(&save[i], vec_mask, &lat[i], &cost[i]);
+	npred[i] = 0;
+	ready[i] = 0;
+	done[i] = 0;
+    }
+    for (i = 0; i < m; i++) {
+	for (j = 0; j < m; j++) {
+	    int d = -1;
+	    if (j > i) {
+		if (defs[i] & uses[j])
+		    d = lat[i];       // read after write
+		else if (defs[i] & defs[j])
+		    d = 1;            // write after write
+		else if (uses[i] & defs[j])
+		    d = 0;            // write after read
+	    }
+	    dep[i][j] = d;
+	    if (d >= 0) npred[j]++;
+	}
+    }
+    // priority is the longest latency path to the end of the window
+    for (i = m-1; i >= 0; i--) {
+	prio[i] = lat[i];
+	for (j = i+1; j < m; j++) {
+	    if ((dep[i][j] >= 0) && (dep[i][j] + prio[j] > prio[i]))
+		prio[i] = dep[i][j] + prio[j];
+	}
+    }
+    for (k = 0; k < m; k++) {
+	int best = -1;
+	int first = -1;
+	for (i = 0; i < m; i++) {
+	    if (done[i] || npred[i])
+		continue;
+	    if ((first < 0) || (ready[i] < ready[first]))
+		first = i;
+	    if ((ready[i] <= cycle) &&
+		((best < 0) || (prio[i] > prio[best])))
+		best = i;
+	}
+	if (best < 0) {  // stall until first instruction is ready
+	    best = first;
+	    cycle = ready[first];
+	}
+	done[best] = 1;
+	code[s+k] = save[best];
+	for (j = 0; j < m; j++) {
+	    if (dep[best][j] >= 0) {
+		npred[j]--;
+		if (cycle + dep[best][j] > ready[j])
+		    ready[j] = cycle + dep[best][j];
+	    }
+	}
+	cycle += cost[best];
+    }
+}
+
+// reorder instructions within basic blocks, code size and jump
+// offsets are not changed
+void schedule(instr_t* code, size_t n, unsigned vec_mask)
+{
+    uint8_t leader[n+1];
+    int s, e, i;
+
+    memset(leader, 0, n+1);
+    leader[0] = 1;
+    leader[n] = 1;
+    for (i = 0; i < (int)n; i++) {
+	instr_t* p = &code[i];
+	if (OP_IS_JUMP(p->op)) {
+	    leader[i+1+p->imm12] = 1;
+	    leader[i+1] = 1;
+	}
+	else if ((p->op == OP_RET) || (p->op == OP_VRET))
+	    leader[i+1] = 1;
+    }
+    s = 0;
+    while(s < (int)n) {
+	e = s+1;
+	while(!leader[e])
+	    e++;
+	i = e - sched_tail(code, s, e);
+	while(s < i) {
+	    int w = (i - s > SCHED_WINDOW) ? SCHED_WINDOW : (i - s);
+	    sched_window(code, s, s+w, vec_mask);
+	    s += w;
+	}
+	s = e;
+    }
+}
@@ -2,12 +2,28 @@
 
 #include <asmjit/x86.h>
 #include <iostream>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <thread>
+#include <vector>
+#include <type_traits>
+#include <utility>
+#include <math.h>
 
 using namespace asmjit;
 
 #include "jitter_types.h"
 #include "jitter.h"
 #include "jitter_asm.h"
+#include "jitter_tier.h"
+#include "jitter_cache.h"
+#include "jitter_fat.h"
+#include "jitter_perf.h"
+#include "jitter_kernel.h"
+#include "jitter_builder.h"
+#include "jitter_gemm.h"
+#include "jitter_expr.h"
 
 // A simple error handler implementation, extend according to your needs.
 class MyErrorHandler : public ErrorHandler {
@@ -22,8 +38,41 @@ extern void assemble(ZAssembler &a, const Environment &env,
 		     uint32_t reg_mask,
 		     x86::Mem save_ptr,
 		     instr_t* code, size_t n);
+extern void assemble_stats(ZAssembler &a, const Environment &env,
+			   uint32_t reg_mask,
+			   x86::Mem save_ptr,
+			   instr_t* code, size_t n, jit_stats_t* sp);
+extern void print_stats(FILE* f, jit_stats_t* sp);
+extern void assemble_map(ZAssembler &a, const Environment &env,
+			 uint32_t reg_mask,
+			 x86::Mem save_ptr,
+			 instr_t* code, size_t n, uint32_t* map);
+extern int pc_map_lookup(const uint32_t* map, size_t n, uint32_t offs);
 
 extern void emulate(vregfile_t* rfp, instr_t* code, size_t n, int* ret);
+extern int emulate_budget(vregfile_t* rfp, instr_t* code, size_t n, int* ret);
+extern int emulate_wide(vregfile_t* rfp, instr64_t* wcode, size_t n, int* ret);
+extern int jit_narrow(instr64_t* wcode, size_t n, instr_t* code, size_t max);
+extern void jit_widen(instr_t* code, size_t n, instr64_t* wcode);
+extern void emu_prepare(instr_t* code, size_t n, uint8_t* fuse);
+extern void emulate_fused(vregfile_t* rfp, instr_t* code, size_t n,
+			  uint8_t* fuse, int* ret);
+extern int emulate_fused_budget(vregfile_t* rfp, instr_t* code, size_t n,
+				uint8_t* fuse, int* ret);
+#ifdef EMU_PROFILE
+extern emu_prof_t* emu_prof_new(instr_t* code, size_t n);
+extern void emu_prof_delete(emu_prof_t* prof);
+extern void emulate_prof(vregfile_t* rfp, instr_t* code, size_t n,
+			 uint8_t* fuse, int* ret, emu_prof_t* prof);
+extern void emu_prof_print(FILE* f, emu_prof_t* prof);
+#endif
+extern int emulate_soa(soa_regfile_t* sp, size_t count, instr_t* code, size_t n);
+extern void soa_load(soa_regfile_t* sp, int k, vregfile_t* rfp,
+		     uint8_t type);
+extern void soa_store(soa_regfile_t* sp, int k, vregfile_t* rfp,
+		      uint8_t type);
+extern size_t optimize(instr_t* code, size_t n);
+extern void schedule(instr_t* code, size_t n, unsigned vec_mask);
 
 extern void sprint(FILE* f,uint8_t type, scalar0_t v);
 extern int  scmp(uint8_t type, scalar0_t v1, scalar0_t v2);
@@ -44,12 +93,14 @@ extern int  vcmp(uint8_t type, vector_t v1, vector_t v2);
 extern void set_element_int64(jitter_type_t type, vector_t &r, int i, int64_t v);
 extern void set_element_float64(jitter_type_t type, vector_t &r, int i, float64_t v);
 
+#define OPdijk(o,d,i,j,k) \
+    {.op = (o),.type=INT64,.rd=(d),.ri=(i),.rj=(j),.rk=(k)}
 #define OPdij(o,d,i,j) \
-    {.op = (o),.type=INT64,.rd=(d),.ri=(i),.rj=(j),.pad=0}
+    {.op = (o),.type=INT64,.rd=(d),.ri=(i),.rj=(j),.rk=0}
 #define OPdi(o,d,i) \
-    {.op = (o),.type=INT64,.rd=(d),.ri=(i),.rj=0,.pad=0}
+    {.op = (o),.type=INT64,.rd=(d),.ri=(i),.rj=0,.rk=0}
 #define OPd(o,d) \
-    {.op = (o),.type=INT64,.rd=(d),.ri=0,.rj=0,.pad=0}
+    {.op = (o),.type=INT64,.rd=(d),.ri=0,.rj=0,.rk=0}
 #define OPdiimm8(o,d,i,imm)				\
     {.op = (o),.type=INT64,.rd=(d),.ri=(i),.imm8=(imm)}
 
@@ -176,6 +227,8 @@ int load_vreg(jitter_type_t type, int j, int jval,
 	    set_element_int64(type, vreg[r2], i, value_u16_2[i]);
 	}
 	break;
+    case FLOAT16:
+    case BFLOAT16:
     case INT16:
 	for (i = 0; i < 8; i++) {
 	    set_element_int64(type, vreg[r0], i, value_i16_0[i]);
@@ -278,6 +331,7 @@ int load_reg(jitter_type_t type, int i, int j, int jval,
 }
 
 unsigned vec_enable_mask =  0;
+int spill_all = 0;  // no free scratch registers, all temporaries spill
 
 void vec_enable(unsigned mask)
 {
@@ -303,6 +357,8 @@ void vec_setup(ZAssembler& a)
 		 VEC_TYPE_SSE4_1|VEC_TYPE_SSE4_2);
     if (vec_enable_mask & VEC_TYPE_AVX) a.enable(VEC_TYPE_AVX);
     if (vec_enable_mask & VEC_TYPE_AVX2) a.enable(VEC_TYPE_AVX|VEC_TYPE_AVX2);
+    if (vec_enable_mask & VEC_TYPE_F16C) a.enable(VEC_TYPE_F16C);
+    if (spill_all) a.reg_scratch(0, 0);
 }
 		 
 static int verbose = 1;
@@ -310,9 +366,68 @@ static int debug   = 0;
 static int exit_on_fail = 0;
 static int debug_on_fail = 0;
 
+// Batch mode: test_icode/test_vcode only record the case, batch_run
+// compiles all recorded cases into one code buffer, runs emulator and
+// native code on all cores and then compares the results.
+typedef struct {
+    jitter_type_t itype;
+    jitter_type_t otype;
+    int i;
+    int jval;
+    int vec;
+    int spill;
+    uint32_t reg_mask;
+    std::vector<instr_t> code;
+    vregfile_t rf;          // input registers
+    Label entry;
+    fun1_t fn;
+    int ret;                // register returned by emulator
+    scalar0_t semu, sexe;
+    vector_t vemu, vexe;
+} test_case_t;
+
+static int batch = 0;
+static std::vector<test_case_t> batch_cases;
+
+static void batch_add(jitter_type_t itype, jitter_type_t otype,
+		      int i, int jval, int vec, uint32_t reg_mask,
+		      vregfile_t* rfp, instr_t* icode, size_t code_len)
+{
+    test_case_t c;
+
+    set_type(itype, icode, code_len);
+    c.itype = itype;
+    c.otype = otype;
+    c.i = i;
+    c.jval = jval;
+    c.vec = vec;
+    c.spill = spill_all;
+    c.reg_mask = reg_mask;
+    c.code.assign(icode, icode + code_len);
+    memcpy(&c.rf, rfp, sizeof(vregfile_t));
+    c.fn = NULL;
+    batch_cases.push_back(c);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
 int test_icode(jitter_type_t itype, jitter_type_t otype, int i, int jval,
 	       instr_t* icode, size_t code_len)
 {
+    if (batch) {
+	vregfile_t rf;
+	memset(&rf, 0, sizeof(rf));
+	load_reg(itype, i, icode->rj, jval, rf.r, 0, 1, 2);
+	load_vreg(itype, icode->rj, jval, (vector_t*)rf.v, 0, 1, 2);
+	batch_add(itype, otype, i, jval, 0, (1 << 16) | (1 << 17) | (1 << 18),
+		  &rf, icode, code_len);
+	return 0;
+    }
     JitRuntime rt;           // Runtime designed for JIT code execution
     MyErrorHandler myErrorHandler;
     CodeHolder code;         // Holds code and relocation information
@@ -479,13 +594,6 @@ int test_code(jitter_type_t itype, jitter_type_t otype, int jval, instr_t* icode
 int test_vcode(jitter_type_t itype, jitter_type_t otype, int jval,
 	       instr_t* icode, size_t code_len)
 {
-    JitRuntime rt;           // Runtime designed for JIT code execution
-    MyErrorHandler myErrorHandler;    
-    CodeHolder code;         // Holds code and relocation information
-    int i, res;
-    FileLogger logger(stderr);
-    Label save_label;
-    Section* xmm_data;
     // register must be passed in order! xmm 0...15 gp 0...15
     uint32_t reg_mask;
 
@@ -494,6 +602,23 @@ int test_vcode(jitter_type_t itype, jitter_type_t otype, int jval,
     else
 	reg_mask = (1 << 0) | (1 << 1) | (1 << 2); 
 
+    if (batch) {
+	vregfile_t rf;
+	memset(&rf, 0, sizeof(rf));
+	load_reg(itype, 0, icode->rj, jval, rf.r, 0, 1, 2);
+	load_vreg(itype, icode->rj, jval, (vector_t*)rf.v, 0, 1, 2);
+	batch_add(itype, otype, 0, jval, 1, reg_mask, &rf, icode, code_len);
+	return 0;
+    }
+
+    JitRuntime rt;           // Runtime designed for JIT code execution
+    MyErrorHandler myErrorHandler;    
+    CodeHolder code;         // Holds code and relocation information
+    int i, res;
+    FileLogger logger(stderr);
+    Label save_label;
+    Section* xmm_data;
+
     // Initialize to the same arch as JIT runtime
     code.init(rt.environment(), rt.cpuFeatures());
     code.newSection(&xmm_data, ".data", 5, SectionFlags::kNone, 128);
@@ -650,6 +775,125 @@ int test_vcode(jitter_type_t itype, jitter_type_t otype, int jval,
 }
 
 
+// run cases c, c+step, ... in emulator and native code
+static void batch_worker(size_t c, size_t step)
+{
+    for (; c < batch_cases.size(); c += step) {
+	test_case_t* tp = &batch_cases[c];
+	vregfile_t rf;
+
+	memcpy(&rf, &tp->rf, sizeof(rf));
+	emulate(&rf, tp->code.data(), tp->code.size(), &tp->ret);
+	memcpy(&tp->semu, &rf.r[tp->ret], sizeof(scalar0_t));
+	memcpy(&tp->vemu, &rf.v[tp->ret], sizeof(vector_t));
+
+	memcpy(&rf, &tp->rf, sizeof(rf));
+	tp->fn(&rf);
+	memcpy(&tp->sexe, &rf.r[2], sizeof(scalar0_t));
+	memcpy(&tp->vexe, &rf.v[2].v, sizeof(vector_t));
+    }
+}
+
+// compile, run and compare all recorded cases, return number of failures
+int batch_run(const char* name)
+{
+    JitRuntime rt;
+    MyErrorHandler myErrorHandler;
+    CodeHolder code;
+    Section* xmm_data;
+    Label save_label;
+    void* base;
+    std::vector<std::thread> threads;
+    size_t c, nthreads = std::thread::hardware_concurrency();
+    double t0, t1, t2, t3;
+    int failed = 0;
+
+    t0 = now();
+    code.init(rt.environment(), rt.cpuFeatures());
+    code.newSection(&xmm_data, ".data", 5, SectionFlags::kNone, 128);
+    code.setErrorHandler(&myErrorHandler);
+    ZAssembler a(&code, 1024);
+    vec_setup(a);
+
+    // the fxsave64 dump is only looked at by test_icode/test_vcode,
+    // all cases share one save area
+    save_label = a.newLabel();
+    for (c = 0; c < batch_cases.size(); c++) {
+	test_case_t* tp = &batch_cases[c];
+	if (tp->spill)
+	    a.reg_scratch(0, 0);
+	else
+	    a.reg_scratch(R_FREE_MASK, X_FREE_MASK);
+	tp->entry = a.newLabel();
+	a.align(AlignMode::kCode, 16);
+	a.bind(tp->entry);
+	assemble(a, rt.environment(), tp->reg_mask, x86::ptr(save_label),
+		 tp->code.data(), tp->code.size());
+    }
+    a.section(xmm_data);
+    a.bind(save_label);
+    a.embedDataArray(TypeId::kUInt8, "\0", 1, 512);
+    if (rt.add(&base, &code) != kErrorOk) {
+	fprintf(stderr, "rt.add ERROR\n");
+	batch_cases.clear();
+	return 1;
+    }
+    for (c = 0; c < batch_cases.size(); c++) {
+	test_case_t* tp = &batch_cases[c];
+	tp->fn = (fun1_t) ((uint8_t*) base + code.labelOffsetFromBase(tp->entry));
+    }
+    t1 = now();
+
+    if (nthreads == 0)
+	nthreads = 1;
+    for (c = 0; c < nthreads; c++)
+	threads.push_back(std::thread(batch_worker, c, nthreads));
+    for (c = 0; c < nthreads; c++)
+	threads[c].join();
+    t2 = now();
+
+    batch = 0;
+    for (c = 0; c < batch_cases.size(); c++) {
+	test_case_t* tp = &batch_cases[c];
+	int res;
+
+	if (tp->vec)
+	    res = vcmp(tp->otype, tp->vemu, tp->vexe);
+	else
+	    res = scmp(tp->otype, tp->semu, tp->sexe);
+	if (res == 0) {
+	    if (verbose) {
+		fprintf(stderr, "TEST ");
+		print_instr(stderr, &tp->code[0]);
+		if (tp->jval >= 0) fprintf(stderr, " jval=%d", tp->jval);
+		fprintf(stderr, " OK\n");
+	    }
+	    continue;
+	}
+	// run again alone, prints the details
+	failed++;
+	spill_all = tp->spill;
+	if (tp->vec)
+	    res = test_vcode(tp->itype, tp->otype, tp->jval,
+			     tp->code.data(), tp->code.size());
+	else
+	    res = test_icode(tp->itype, tp->otype, tp->i, tp->jval,
+			     tp->code.data(), tp->code.size());
+	spill_all = 0;
+	if (res == 0)
+	    fprintf(stderr, "batch FAIL, OK when run alone\n");
+    }
+    t3 = now();
+    rt.release(base);
+
+    printf("%s: %lu cases, %d failed, %lu threads, "
+	   "compile %.2fs, run %.2fs, compare %.2fs\n",
+	   name, batch_cases.size(), failed, nthreads,
+	   t1-t0, t2-t1, t3-t2);
+    batch_cases.clear();
+    return failed;
+}
+
 #define CODE_LEN(code) (sizeof((code))/sizeof((code)[0]))
 
 int test_ts_code(uint8_t* ts, int td, int vec, int jval,
@@ -727,180 +971,2195 @@ int test_unary(uint8_t op, uint8_t* ts, uint8_t otype)
     return failed;
 }
 
-int test_imm8(uint8_t op, uint8_t* ts, uint8_t otype)
+// native op v1, v0; vret v1 on the register file
+static fun1_t half_fun(JitRuntime& rt, uint8_t op, uint8_t type)
 {
-    instr_t code[2];
-    int i, imm;
+    instr_t code[2] = { OPdi(op,1,0), OPd(OP_VRET,1) };
+    uint32_t reg_mask = (1 << 0) | (1 << 1);
+    CodeHolder holder;
+    Section* data;
+    Label save_label;
+    fun1_t fn;
+
+    code[0].type = code[1].type = type;
+    holder.init(rt.environment(), rt.cpuFeatures());
+    holder.newSection(&data, ".data", 5, SectionFlags::kNone, 128);
+    ZAssembler a(&holder, 1024);
+    vec_setup(a);
+    save_label = a.newLabel();
+    assemble(a, rt.environment(), reg_mask, x86::ptr(save_label), code, 2);
+    a.section(data);
+    a.bind(save_label);
+    a.embedDataArray(TypeId::kUInt8, "\0", 1, 512);
+    if (rt.add(&fn, &holder) != kErrorOk)
+	return NULL;
+    return fn;
+}
+
+// every FLOAT16/BFLOAT16 encoding through vcvt and back through vcvtn,
+// plus a stride of float32 values through vcvtn, bit for bit against
+// the scalar helpers, native and emulated
+int test_half_all(uint8_t type)
+{
+    const unsigned nl = VSIZE/sizeof(float32_t);  // lanes per run
+    instr_t code[2] = { OPdi(OP_VCVT,1,0), OPd(OP_VRET,1) };
+    JitRuntime rt;
+    fun1_t cvt = half_fun(rt, OP_VCVT, type);
+    fun1_t cvtn = half_fun(rt, OP_VCVTN, type);
+    uint64_t x;
+    unsigned k;
     int failed = 0;
-    int vec = (op & OP_VEC) != 0;
 
     printf("+------------------------------\n");
-    printf("| %s\n", asm_opname(op));
+    printf("| %s all values\n", asm_typename(type));
     printf("+------------------------------\n");
-        
-    code[0].op = op;
-    code[1].op = vec ? OP_VRET : OP_RET;
-    code[1].rd = 2;
-    code[0].rd = 2;
 
-    for (i = 0; i <= 2; i++) {
-	code[0].ri = i;
-	for (imm = -128; imm < 128; imm += 27) {
-	    code[0].imm8 = imm;
-	    failed += test_ts_code(ts, otype, vec, -1,  code, 2);
+    if ((cvt == NULL) || (cvtn == NULL))
+	return 1;
+    code[0].type = code[1].type = type;
+    for (x = 0; (x < 0x10000) && !failed; x += nl) {
+	vregfile_t rf, rf_emu;
+	int ret;
+
+	memset(&rf, 0, sizeof(rf));
+	for (k = 0; k < nl; k++)
+	    rf.v[0].vu16[k] = x + k;
+	memcpy(&rf_emu, &rf, sizeof(rf));
+	cvt(&rf);
+	code[0].op = OP_VCVT;
+	emulate(&rf_emu, code, 2, &ret);
+	for (k = 0; k < nl; k++) {
+	    float32_bits_t want;
+	    want.f = (type == FLOAT16) ? float16_to_float32(x + k) :
+		bfloat16_to_float32(x + k);
+	    if ((rf.v[1].vu32[k] != want.u) ||
+		(rf_emu.v[1].vu32[k] != want.u)) {
+		fprintf(stderr, "%s vcvt %04x FAIL\n",
+			asm_typename(type), (unsigned)(x + k));
+		failed++;
+		break;
+	    }
+	}
+    }
+    // all halves widened, then every 4099th float32 bit pattern
+    for (x = 0; (x < 0x10000 + 0x100000000ULL/4099) && !failed; x += nl) {
+	vregfile_t rf, rf_emu;
+	int ret;
+
+	memset(&rf, 0, sizeof(rf));
+	for (k = 0; k < nl; k++) {
+	    uint64_t y = x + k;
+	    if (y < 0x10000) {
+		rf.v[0].vf32[k] = (type == FLOAT16) ? float16_to_float32(y) :
+		    bfloat16_to_float32(y);
+	    }
+	    else
+		rf.v[0].vu32[k] = (uint32_t)((y - 0x10000) * 4099);
+	}
+	memcpy(&rf_emu, &rf, sizeof(rf));
+	cvtn(&rf);
+	code[0].op = OP_VCVTN;
+	emulate(&rf_emu, code, 2, &ret);
+	for (k = 0; k < nl; k++) {
+	    uint16_t want = (type == FLOAT16) ?
+		float32_to_float16(rf.v[0].vf32[k]) :
+		float32_to_bfloat16(rf.v[0].vf32[k]);
+	    if ((rf.v[1].vu16[k] != want) || (rf_emu.v[1].vu16[k] != want) ||
+		(rf.v[1].vu16[k+nl] != 0)) {
+		fprintf(stderr, "%s vcvtn %08x FAIL\n",
+			asm_typename(type), rf.v[0].vu32[k]);
+		failed++;
+		break;
+	    }
 	}
     }
+    rt.release(cvt);
+    rt.release(cvtn);
     return failed;
 }
 
-int test_imm12(uint8_t op, uint8_t* ts, uint8_t otype)
+// vcmpgt vm, v1, v2; vsel v2, vm, vi, vj; vret v2
+int test_select(uint8_t* ts, uint8_t otype)
 {
-    instr_t code[2];
-    int imm;
+    instr_t code[3] = { OPdij(OP_VCMPGT,0,1,2),
+			OPdijk(OP_VSEL,2,0,0,0),
+			OPd(OP_VRET,2) };
+    int m, i, j;
     int failed = 0;
-    int vec = (op & OP_VEC) != 0;
 
     printf("+------------------------------\n");
-    printf("| %s\n", asm_opname(op));
+    printf("| %s\n", asm_opname(OP_VSEL));
     printf("+------------------------------\n");
-    
-    code[0].op = op;
-    code[1].op = vec ? OP_VRET : OP_RET;
-    code[1].rd = 2;
-    code[0].rd = 2;
 
-    for (imm = -2048; imm < 2048; imm += 511) {
-	code[0].imm12 = imm;
-	failed += test_ts_code(ts, otype, vec, -1, code, 2);
+    for (m = 0; m <= 3; m += 3) {  // mask in v0 or in v3
+	code[0].rd = m;
+	code[1].ri = m;
+	for (i = 0; i <= 2; i++) {
+	    code[1].rj = i;
+	    for (j = 0; j <= 2; j++) {
+		code[1].rk = j;
+		failed += test_ts_code(ts, otype, 1, -1, code, 3);
+	    }
+	}
+    }
+    // any mask bits, not only all ones or all zeros lanes
+    for (m = 0; m <= 2; m++) {
+	instr_t bits[2] = { OPdijk(OP_VSEL,2,0,0,0), OPd(OP_VRET,2) };
+	bits[0].ri = m;
+	bits[0].rj = (m+1) % 3;
+	bits[0].rk = (m+2) % 3;
+	failed += test_ts_code(ts, otype, 1, -1, bits, 2);
     }
     return failed;
 }
 
-int test_shift(uint8_t op, uint8_t* ts, uint8_t otype)
+// compare and branch on result (fused by assemble)
+int test_cmp_jump(uint8_t jop, uint8_t* ts, uint8_t otype)
 {
-    instr_t code[2];
+    instr_t code[6] = { OPdij(OP_CMPLT,2,0,1),
+			OPimm12d(jop,2,2),
+			OPimm12d(OP_MOVI,2,1),
+			OPimm12(OP_JMP,1),
+			OPimm12d(OP_MOVI,2,2),
+			OPd(OP_RET,2) };
+    uint8_t cmp[] = { OP_CMPLT, OP_CMPLE, OP_CMPGT, OP_CMPGE,
+		      OP_CMPEQ, OP_CMPNE, OP_CMPLTI, OP_CMPGEI };
+    unsigned c;
     int i;
     int failed = 0;
-    int vec = (op & OP_VEC) != 0;
 
     printf("+------------------------------\n");
-    printf("| %s\n", asm_opname(op));
+    printf("| cmp+%s\n", asm_opname(jop));
     printf("+------------------------------\n");
-    
-    code[0].op = op;
-    code[1].op = vec ? OP_VRET : OP_RET;
-    code[1].rd = 2;
-    code[0].rd = 2;
 
-    for (i = 0; i <= 2; i++) {
-	uint8_t* ts1 = ts;
-	code[0].ri = i;
-	while(*ts1 != VOID) {
-	    int imm;
-	    size_t n = (1 << get_scalar_exp_bit_size(*ts1));
-	    for (imm = 0; imm < (int)n; imm++) {
-		uint8_t tv[2];
-		code[0].imm8 = imm;
-		tv[0] = *ts1; tv[1] = VOID;
-		failed += test_ts_code(tv, otype, vec, -1, code, 2); 
+    for (c = 0; c < sizeof(cmp); c++) {
+	code[0].op = cmp[c];
+	for (i = 0; i <= 2; i++) {
+	    code[0].ri = i;
+	    if (cmp[c] & OP_IMM)
+		code[0].imm8 = 3;
+	    else
+		code[0].rj = 1;
+	    failed += test_ts_code(ts, otype, 0, -1, code, 6);
+	}
+    }
+    return failed;
+}
+
+// loops using add+mov, subi+jnz and addi+cmplti+jnz sequences
+int test_loop(uint8_t* ts, uint8_t otype)
+{
+    instr_t code[12] = { OPdij(OP_ADD,2,0,1),
+			 OPdi(OP_MOV,1,2),
+			 OPimm12d(OP_MOVI,3,3),
+			 OPdij(OP_ADD,2,2,1),
+			 OPdiimm8(OP_SUBI,3,3,1),
+			 OPimm12d(OP_JNZ,3,-3),
+			 OPimm12d(OP_MOVI,3,0),
+			 OPdij(OP_ADD,2,2,0),
+			 OPdiimm8(OP_ADDI,3,3,1),
+			 OPdiimm8(OP_CMPLTI,1,3,4),
+			 OPimm12d(OP_JNZ,1,-4),
+			 OPd(OP_RET,2) };
+
+    printf("+------------------------------\n");
+    printf("| loop\n");
+    printf("+------------------------------\n");
+
+    return test_ts_code(ts, otype, 0, -1, code, 12);
+}
+
+#ifdef EMU_PROFILE
+// instruction, jump and loop counts from the emulator, fused
+// instructions must count as their parts
+int test_emu_prof(uint8_t* ts)
+{
+    instr_t code[12] = { OPdij(OP_ADD,2,0,1),
+			 OPdi(OP_MOV,1,2),
+			 OPimm12d(OP_MOVI,3,3),
+			 OPdij(OP_ADD,2,2,1),
+			 OPdiimm8(OP_SUBI,3,3,1),
+			 OPimm12d(OP_JNZ,3,-3),
+			 OPimm12d(OP_MOVI,3,0),
+			 OPdij(OP_ADD,2,2,0),
+			 OPdiimm8(OP_ADDI,3,3,1),
+			 OPdiimm8(OP_CMPLTI,1,3,4),
+			 OPimm12d(OP_JNZ,1,-4),
+			 OPd(OP_RET,2) };
+    // expected executions per run
+    static const uint64_t count[12] = { 1,1,1,3,3,3,1,4,4,4,4,1 };
+    // add+mov, 3 x subi+jnz and 4 x addi+cmplti+jnz are one dispatch
+    const uint64_t dispatch = 30 - 1 - 3 - 4*2;
+    uint64_t fused = 0, unfused = 0;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| emu_prof\n");
+    printf("+------------------------------\n");
+
+    while(*ts != VOID) {
+	uint8_t fuse[12];
+	emu_prof_t* prof;
+	int i, r, ret, fail = 0;
+
+	set_type(*ts, code, 12);
+	emu_prepare(code, 12, fuse);
+	prof = emu_prof_new(code, 12);
+	for (r = 0; r < 5; r++) {
+	    vregfile_t rf;
+	    memset(&rf, 0, sizeof(rf));
+	    load_reg(*ts, r, 1, -1, rf.r, 0, 1, 2);
+	    emulate_prof(&rf, code, 12, fuse, &ret, prof);
+	}
+	fused = prof->dispatch;
+	{
+	    emu_prof_t* uprof = emu_prof_new(code, 12);
+	    for (r = 0; r < 5; r++) {
+		vregfile_t rf;
+		memset(&rf, 0, sizeof(rf));
+		load_reg(*ts, r, 1, -1, rf.r, 0, 1, 2);
+		emulate_prof(&rf, code, 12, NULL, &ret, uprof);
 	    }
-	    ts1++;
-	}	    
+	    unfused = uprof->dispatch;
+	    emu_prof_delete(uprof);
+	}
+	if ((fused != 5*dispatch) || (unfused != 5*30))
+	    fail++;
+	if (debug)
+	    emu_prof_print(stderr, prof);
+	for (i = 0; i < 12; i++) {
+	    if (prof->count[i] != 5*count[i])
+		fail++;
+	}
+	if ((prof->runs != 5) ||
+	    (prof->taken[5] != 10) || (prof->trip_max[5] != 2) ||
+	    (prof->taken[10] != 15) || (prof->trip_max[10] != 3))
+	    fail++;
+	if (fail) {
+	    fprintf(stderr, "emu_prof %s FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	emu_prof_delete(prof);
+	ts++;
     }
+    printf("emu dispatch per run: fused %lu, unfused %lu\n",
+	   fused/5, unfused/5);
     return failed;
 }
+#endif
 
-// test shift operations using registers
-int test_bshift(uint8_t op, uint8_t* ts, uint8_t otype)
+// emu_prepare+emulate_fused and emulate_fused_budget must match the
+// unfused emulate(), including jumps into the middle of a sequence
+int test_fuse(uint8_t* ts)
 {
-    instr_t code[2];
-    int i, j;
+    // add+mov, subi+jnz, addi+cmplti+jnz
+    instr_t loop[12] = { OPdij(OP_ADD,2,0,1),
+			 OPdi(OP_MOV,1,2),
+			 OPimm12d(OP_MOVI,3,3),
+			 OPdij(OP_ADD,2,2,1),
+			 OPdiimm8(OP_SUBI,3,3,1),
+			 OPimm12d(OP_JNZ,3,-3),
+			 OPimm12d(OP_MOVI,3,0),
+			 OPdij(OP_ADD,2,2,0),
+			 OPdiimm8(OP_ADDI,3,3,1),
+			 OPdiimm8(OP_CMPLTI,1,3,4),
+			 OPimm12d(OP_JNZ,1,-4),
+			 OPd(OP_RET,2) };
+    // cmp+jz, cmpi+jnz, subi+cmpgt+jz
+    instr_t cmp[13] = { OPdij(OP_CMPLT,2,0,1),
+			OPimm12d(OP_JZ,2,2),
+			OPimm12d(OP_MOVI,3,1),
+			OPimm12(OP_JMP,1),
+			OPimm12d(OP_MOVI,3,2),
+			OPdiimm8(OP_CMPGEI,4,0,3),
+			OPimm12d(OP_JNZ,4,1),
+			OPdiimm8(OP_ADDI,3,3,4),
+			OPdiimm8(OP_SUBI,5,3,1),
+			OPdij(OP_CMPGT,4,5,1),
+			OPimm12d(OP_JZ,4,1),
+			OPdiimm8(OP_ADDI,3,3,1),
+			OPd(OP_RET,3) };
+    // jump to the jnz of a subi+jnz pair
+    instr_t mid[7] = { OPimm12d(OP_MOVI,3,3),
+		       OPimm12d(OP_MOVI,2,0),
+		       OPimm12(OP_JMP,2),
+		       OPdiimm8(OP_ADDI,2,2,5),
+		       OPdiimm8(OP_SUBI,3,3,1),
+		       OPimm12d(OP_JNZ,3,-3),
+		       OPd(OP_RET,2) };
+    struct { instr_t* code; size_t n; } prog[3] = {
+	{ loop, 12 }, { cmp, 13 }, { mid, 7 } };
     int failed = 0;
-    int vec = (op & OP_VEC) != 0;
 
     printf("+------------------------------\n");
-    printf("| %s\n", asm_opname(op));
+    printf("| fuse\n");
     printf("+------------------------------\n");
-    
-    code[0].op = op;
-    code[1].op = vec ? OP_VRET : OP_RET;
-    code[1].rd = 2;
-    code[0].rd = 2;
 
-    for (i = 0; i <= 2; i++) {
-	code[0].ri = i;	
-	for (j = 0; j <= 2; j++) {
-	    uint8_t* ts1 = ts;
-	    code[0].rj = j;
-	    // load shift value
-	    while(*ts1 != VOID) {
-		int imm;
-		size_t n = (1 << get_scalar_exp_bit_size(*ts1));
-		for (imm = 0; imm < (int)n; imm++) {
-		    uint8_t tv[2];
-		    tv[0] = *ts1; tv[1] = VOID;
-		    failed += test_ts_code(tv, otype, vec, imm, code, 2);
+    while(*ts != VOID) {
+	int p, v, fail = 0;
+
+	for (p = 0; p < 3; p++) {
+	    instr_t* code = prog[p].code;
+	    size_t n = prog[p].n;
+	    uint8_t fuse[n];
+
+	    set_type(*ts, code, n);
+	    emu_prepare(code, n, fuse);
+	    for (v = 0; v < 16; v++) {
+		vregfile_t rf, rf_fused, rf_budget;
+		int ret, ret_fused, ret_budget, yields = 0;
+
+		memset(&rf, 0, sizeof(rf));
+		load_reg(*ts, v, 1, -1, rf.r, 0, 1, 2);
+		memcpy(&rf_fused, &rf, sizeof(rf));
+		memcpy(&rf_budget, &rf, sizeof(rf));
+		emulate(&rf, code, n, &ret);
+		emulate_fused(&rf_fused, code, n, fuse, &ret_fused);
+		rf_budget.fuel = 1;
+		while (emulate_fused_budget(&rf_budget, code, n, fuse,
+					    &ret_budget) == EXEC_YIELD) {
+		    rf_budget.fuel = 1;
+		    yields++;
 		}
-		ts1++;	    
+		if ((ret != ret_fused) || (ret != ret_budget) ||
+		    (memcmp(rf.r, rf_fused.r, sizeof(rf.r)) != 0) ||
+		    (memcmp(rf.r, rf_budget.r, sizeof(rf.r)) != 0) ||
+		    ((p != 1) && (yields == 0)))
+		    fail++;
 	    }
 	}
+	if (fail) {
+	    fprintf(stderr, "fuse %s FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	ts++;
     }
     return failed;
 }
 
-void format_reg(String& sb, x86::Reg reg)
+// time code (INT32) on SOA_WIDTH instances, emulate per instance
+// against one emulate_soa call. r0 = k takes another path per lane,
+// uniform runs all lanes with r0 = 5.
+static int bench_soa(instr_t* code, size_t n, int uniform)
 {
-    sb.reset();
-    Formatter::formatOperand(sb, FormatFlags::kNone, NULL, Arch::kX64, reg);
+    static soa_regfile_t soa;
+    static vregfile_t rf[SOA_WIDTH];
+    int nrun = 2000;
+    double t0, t_emu, t_soa;
+    int k, r, ret;
+
+    for (k = 0; k < SOA_WIDTH; k++) {
+	memset(&rf[k], 0, sizeof(vregfile_t));
+	rf[k].r[0].i32 = uniform ? 5 : k;
+	rf[k].r[1].i32 = 3;
+    }
+    t0 = now();
+    for (r = 0; r < nrun; r++) {
+	for (k = 0; k < SOA_WIDTH; k++) {
+	    rf[k].r[0].i32 = uniform ? 5 : k;
+	    emulate(&rf[k], code, n, &ret);
+	}
+    }
+    t_emu = now() - t0;
+    t0 = now();
+    for (r = 0; r < nrun; r++) {
+	for (k = 0; k < SOA_WIDTH; k++) {
+	    soa.r[0].i32[k] = uniform ? 5 : k;
+	    soa.r[1].i32[k] = 3;
+	}
+	if (emulate_soa(&soa, SOA_WIDTH, code, n) < 0)
+	    return 1;
+    }
+    t_soa = now() - t0;
+    for (k = 0; k < SOA_WIDTH; k++) {
+	if ((soa.ret[k] != ret) || (soa.r[ret].i32[k] != rf[k].r[ret].i32))
+	    return 1;
+    }
+    printf("soa %s: emulate %.1f ns, emulate_soa %.1f ns per instance "
+	   "(%.1fx)\n", uniform ? "uniform" : "divergent",
+	   1e9*t_emu/(nrun*SOA_WIDTH), 1e9*t_soa/(nrun*SOA_WIDTH),
+	   t_emu/t_soa);
+    return 0;
 }
 
-void test_alloc()
+// run data dependent loops and branches over SOA_WIDTH instances
+int test_soa(uint8_t* ts)
 {
-    JitRuntime rt;
-    CodeHolder code;
-    int r;
-    int r1, r2, r3, r4;
-    int x1, x2, x3, x4;
-    String s;
-    
-    code.init(rt.environment(), rt.cpuFeatures());
-    ZAssembler a(&code, 1024);
+    instr_t code[13] = { OPimm12d(OP_MOVI,2,0),
+			 OPdi(OP_MOV,3,0),
+			 OPdiimm8(OP_BANDI,3,3,7),
+			 OPimm12d(OP_JZ,3,3),
+			 OPdij(OP_ADD,2,2,1),
+			 OPdiimm8(OP_SUBI,3,3,1),
+			 OPimm12d(OP_JNZ,3,-3),
+			 OPdiimm8(OP_CMPGTI,4,2,5),
+			 OPimm12d(OP_JZ,4,2),
+			 OPdij(OP_SUB,2,2,0),
+			 OPimm12d(OP_JMP,0,1),
+			 OPdij(OP_ADD,2,2,1),
+			 OPd(OP_RET,2) };
+    instr_t vcode[2] = { OPdij(OP_VADD,2,0,1), OPd(OP_VRET,2) };
+    static soa_regfile_t soa;
+    int failed = 0;
 
-    r = -1;
-    while((r = a.reg_next(r)) >= 0) {
-	format_reg(s, reg(r));
-	printf("Free: %s\n", s.data());
+    printf("+------------------------------\n");
+    printf("| soa\n");
+    printf("+------------------------------\n");
+
+    while(*ts != VOID) {
+	uint8_t otype = int_type(*ts);
+	size_t count;
+	int k, fail = 0;
+
+	set_type(*ts, code, 13);
+	// full and partial batch
+	for (count = SOA_WIDTH; count >= SOA_WIDTH-3; count -= 3) {
+	    memset(&soa, 0, sizeof(soa));
+	    for (k = 0; k < (int) count; k++) {
+		vregfile_t rf;
+		memset(&rf, 0, sizeof(rf));
+		load_reg(*ts, k % 16, 1, -1, rf.r, 0, 1, 2);
+		rf.r[0].u8 += k;
+		soa_load(&soa, k, &rf, *ts);
+	    }
+	    if (emulate_soa(&soa, count, code, 13) < 0) {
+		fail++;
+		break;
+	    }
+	    for (k = 0; k < SOA_WIDTH; k++) {
+		vregfile_t rf, rf_soa;
+		int ret;
+		if (k >= (int) count) {
+		    if (soa.ret[k] != -1) fail++;
+		    continue;
+		}
+		memset(&rf, 0, sizeof(rf));
+		load_reg(*ts, k % 16, 1, -1, rf.r, 0, 1, 2);
+		rf.r[0].u8 += k;
+		emulate(&rf, code, 13, &ret);
+		memset(&rf_soa, 0, sizeof(rf_soa));
+		soa_store(&soa, k, &rf_soa, *ts);
+		if ((soa.ret[k] != ret) ||
+		    (scmp(otype, rf.r[ret], rf_soa.r[ret]) != 0))
+		    fail++;
+	    }
+	}
+	if (fail) {
+	    fprintf(stderr, "soa %s FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	ts++;
     }
-    r = -1;
-    while((r = a.xreg_next(r)) >= 0) {
-	format_reg(s, xreg(r));
-	printf("Free: %s\n", s.data());
+    if (emulate_soa(&soa, SOA_WIDTH, vcode, 2) != -1) {
+	fprintf(stderr, "soa vector code FAIL\n");
+	failed++;
     }
+    set_type(INT32, code, 13);
+    code[1] = OPdi(OP_MOV,3,0);   // a mixed size program is rejected
+    code[1].type = INT8;
+    if (emulate_soa(&soa, SOA_WIDTH, code, 13) != -1) {
+	fprintf(stderr, "soa mixed size FAIL\n");
+	failed++;
+    }
+    code[1].type = INT32;
+    failed += bench_soa(code, 13, 1);
+    failed += bench_soa(code, 13, 0);
+    return failed;
+}
 
-    r1 = a.reg_alloc();
-    format_reg(s, reg(r1));
-    printf("Alloc [%d] %s\n", r1, s.data());
-    
-    r2 = a.reg_alloc();
-    format_reg(s, reg(r2));
-    printf("Alloc [%d] %s\n", r2, s.data());
-
-    r3 = a.reg_alloc();
-    format_reg(s, reg(r3));
-    printf("Alloc [%d] %s\n", r3, s.data());
-
-    r4 = a.reg_alloc();
-    format_reg(s, reg(r4));
-    printf("alloc [%d] %s\n", r4, s.data());
+// branch on scalar float, r15 (xmm15, the first register spilled for
+// a temporary) is live over the jump. Scalar floats are passed in xmm
+// by the native prototype only, so this runs through assemble_native.
+int test_fjump(uint8_t jop, uint8_t* ts)
+{
+    instr_t code[6] = { OPdi(OP_MOV,15,1),
+			OPimm12d(jop,0,2),
+			OPdij(OP_SUB,2,15,0),
+			OPimm12(OP_JMP,1),
+			OPdij(OP_ADD,2,15,0),
+			OPd(OP_RET,2) };
+    float64_t x0[4] = { 0.0, -0.0, 1.5, NAN };
+    int failed = 0;
 
-    a.reg_release(r1);
-    a.reg_release(r2);
-    a.reg_release(r3);
-    a.reg_release(r4);
+    printf("+------------------------------\n");
+    printf("| float %s\n", asm_opname(jop));
+    printf("+------------------------------\n");
 
-    x1 = a.xreg_alloc();
-    format_reg(s, xreg(x1));
-    printf("Alloc [%d] %s\n", x1, s.data());
+    while(*ts != VOID) {
+	JitRuntime rt;
+	CodeHolder holder;
+	jit_proto_t proto;
+	void* fn;
+	int i;
+
+	set_type(*ts, code, 6);
+	proto.ret = *ts;
+	proto.nargs = 2;
+	proto.arg[0] = proto.arg[1] = *ts;
+	holder.init(rt.environment(), rt.cpuFeatures());
+	ZAssembler a(&holder, 1024);
+	vec_setup(a);
+	assemble_native(a, rt.environment(), &proto, code, 6);
+	if (rt.add(&fn, &holder) != kErrorOk) {
+	    failed++;
+	    ts++;
+	    continue;
+	}
+	for (i = 0; i < 4; i++) {
+	    vregfile_t rf;
+	    float64_t got, want;
+	    int r;
+
+	    memset(&rf, 0, sizeof(rf));
+	    if (*ts == FLOAT32) {
+		rf.r[0].f32 = x0[i];
+		rf.r[1].f32 = 2.5;
+		emulate(&rf, code, 6, &r);
+		want = rf.r[r].f32;
+		got = ((float32_t (*)(float32_t,float32_t)) fn)(x0[i], 2.5);
+	    }
+	    else {
+		rf.r[0].f64 = x0[i];
+		rf.r[1].f64 = 2.5;
+		emulate(&rf, code, 6, &r);
+		want = rf.r[r].f64;
+		got = ((float64_t (*)(float64_t,float64_t)) fn)(x0[i], 2.5);
+	    }
+	    if ((got != want) && !(isnan(got) && isnan(want))) {
+		fprintf(stderr, "float %s %s x=%g: %g != %g FAIL\n",
+			asm_opname(jop), asm_typename(*ts), x0[i], got, want);
+		failed++;
+	    }
+	}
+	rt.release(fn);
+	ts++;
+    }
+    return failed;
+}
+
+// branch on vector compare result
+int test_vjump(uint8_t op, uint8_t* ts, uint8_t otype)
+{
+    instr_t code[6] = { OPdij(OP_VCMPGT,3,0,0),
+			OPimm12d(op,3,2),
+			OPimm12d(OP_VMOVI,2,1),
+			OPimm12(OP_JMP,1),
+			OPimm12d(OP_VMOVI,2,2),
+			OPd(OP_VRET,2) };
+    uint8_t cmp[] = { OP_VCMPGT, OP_VCMPGE };
+    int c, i, j;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| %s\n", asm_opname(op));
+    printf("+------------------------------\n");
+
+    for (c = 0; c < 2; c++) {
+	code[0].op = cmp[c];
+	for (i = 0; i <= 2; i++) {
+	    code[0].ri = i;
+	    for (j = 0; j <= 2; j++) {
+		code[0].rj = j;
+		failed += test_ts_code(ts, otype, 1, -1, code, 6);
+	    }
+	}
+    }
+    return failed;
+}
+
+// run loop through the tiered runtime, compare with emulator
+// before and after the kernel is moved to native code
+int test_tier(uint8_t* ts)
+{
+    instr_t code[12] = { OPdij(OP_ADD,2,0,1),
+			 OPdi(OP_MOV,1,2),
+			 OPimm12d(OP_MOVI,3,3),
+			 OPdij(OP_ADD,2,2,1),
+			 OPdiimm8(OP_SUBI,3,3,1),
+			 OPimm12d(OP_JNZ,3,-3),
+			 OPimm12d(OP_MOVI,3,0),
+			 OPdij(OP_ADD,2,2,0),
+			 OPdiimm8(OP_ADDI,3,3,1),
+			 OPdiimm8(OP_CMPLTI,1,3,4),
+			 OPimm12d(OP_JNZ,1,-4),
+			 OPd(OP_RET,2) };
+    jit_tier_t* t;
+    jit_tier_stats_t st;
+    int failed = 0;
+    int ntypes = 0;
+
+    printf("+------------------------------\n");
+    printf("| tier\n");
+    printf("+------------------------------\n");
+
+    t = jit_tier_new(4, vec_enable_mask);
+    while(*ts != VOID) {
+	uint8_t otype = int_type(*ts);
+	jit_kernel_t* k;
+	int i, r, ret;
+
+	set_type(*ts, code, 12);
+	k = jit_kernel_new(t, code, 12);
+	for (i = 0; i < 16; i++) {
+	    vregfile_t rf, rf_emu;
+	    memset(&rf, 0, sizeof(rf));
+	    load_reg(*ts, i, 1, -1, rf.r, 0, 1, 2);
+	    memcpy(&rf_emu, &rf, sizeof(rf));
+	    emulate(&rf_emu, code, 12, &ret);
+	    if (i == 8)
+		jit_tier_wait(t);
+	    r = jit_kernel_run(k, &rf);
+	    if ((r != ret) || (scmp(otype, rf.r[r], rf_emu.r[ret]) != 0)) {
+		fprintf(stderr, "tier %s i=%d native=%d FAIL\n",
+			asm_typename(*ts), i, jit_kernel_is_native(k));
+		failed++;
+	    }
+	}
+	if (!jit_kernel_is_native(k)) {
+	    fprintf(stderr, "tier %s not native FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	jit_kernel_tier_down(k);
+	if (jit_kernel_is_native(k))
+	    failed++;
+	ntypes++;
+	ts++;
+    }
+    jit_tier_stats(t, &st);
+    printf("calls=%lu emulated=%lu native=%lu up=%lu down=%lu failed=%lu\n",
+	   st.calls, st.emulated, st.native,
+	   st.tier_up, st.tier_down, st.failed);
+    if ((st.tier_up != (uint64_t)ntypes) || (st.tier_down != (uint64_t)ntypes) ||
+	(st.failed != 0))
+	failed++;
+    jit_tier_delete(t);
+    return failed;
+}
+
+// run kernels with the disk cache, second pass should load all
+// stored kernels, third pass runs on corrupted entries
+int test_cache(uint8_t* ts)
+{
+    instr_t code[3] = { OPdij(OP_ADD,2,0,1),
+			OPdij(OP_MUL,2,2,0),
+			OPd(OP_RET,2) };
+    char dir[] = "/tmp/jitter_cacheXXXXXX";
+    jit_cache_stats_t st;
+    jit_cache_t* c;
+    int failed = 0;
+    int pass;
+
+    printf("+------------------------------\n");
+    printf("| cache\n");
+    printf("+------------------------------\n");
+
+    if ((mkdtemp(dir) == NULL) || ((c = jit_cache_open(dir)) == NULL)) {
+	fprintf(stderr, "cache: can not create %s\n", dir);
+	return 1;
+    }
+    for (pass = 0; pass < 3; pass++) {
+	jit_tier_t* t = jit_tier_new(0, vec_enable_mask);
+	uint8_t* tp;
+
+	jit_tier_set_cache(t, c);
+	for (tp = ts; *tp != VOID; tp++) {
+	    vregfile_t rf, rf_emu;
+	    jit_kernel_t* k;
+	    int r, ret;
+
+	    set_type(*tp, code, 3);
+	    k = jit_kernel_new(t, code, 3);
+	    memset(&rf, 0, sizeof(rf));
+	    load_reg(*tp, pass, 1, -1, rf.r, 0, 1, 2);
+	    jit_kernel_run(k, &rf);
+	    jit_tier_wait(t);
+	    memset(&rf, 0, sizeof(rf));
+	    load_reg(*tp, pass, 1, -1, rf.r, 0, 1, 2);
+	    memcpy(&rf_emu, &rf, sizeof(rf));
+	    emulate(&rf_emu, code, 3, &ret);
+	    r = jit_kernel_run(k, &rf);
+	    if (!jit_kernel_is_native(k) ||
+		(scmp(int_type(*tp), rf.r[r], rf_emu.r[ret]) != 0)) {
+		fprintf(stderr, "cache %s pass=%d FAIL\n",
+			asm_typename(*tp), pass);
+		failed++;
+	    }
+	}
+	jit_tier_delete(t);
+	jit_cache_stats(c, &st);
+	if ((pass == 1) && (st.hit != st.store))
+	    failed++;
+	if (pass == 1) {  // flip a byte in all entries
+	    DIR* d = opendir(dir);
+	    struct dirent* de;
+	    while((d != NULL) && ((de = readdir(d)) != NULL)) {
+		char path[1024];
+		FILE* f;
+		if (de->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if ((f = fopen(path, "r+")) != NULL) {
+		    int ch;
+		    fseek(f, -1, SEEK_END);
+		    ch = fgetc(f);
+		    fseek(f, -1, SEEK_END);
+		    fputc(~ch & 0xff, f);
+		    fclose(f);
+		}
+	    }
+	    if (d != NULL) closedir(d);
+	}
+    }
+    printf("hit=%lu miss=%lu invalid=%lu store=%lu nopic=%lu\n",
+	   st.hit, st.miss, st.invalid, st.store, st.nopic);
+    if ((st.store > 0) && (st.invalid == 0))
+	failed++;
+
+    // tiers on several threads store the same new key at once, no
+    // temporary files are left and the entry loads
+    {
+	instr_t scode[3] = { OPdij(OP_SUB,2,0,1),
+			     OPdij(OP_MUL,2,2,0),
+			     OPd(OP_RET,2) };
+	std::vector<std::thread> th;
+	jit_cache_stats_t st0, st1;
+	DIR* d;
+	struct dirent* de;
+	int i, ntmp = 0;
+
+	set_type(INT32, scode, 3);
+	jit_cache_stats(c, &st0);
+	for (i = 0; i < 4; i++) {
+	    th.push_back(std::thread([c, &scode]() {
+		jit_tier_t* t = jit_tier_new(0, vec_enable_mask);
+		vregfile_t rf;
+		jit_tier_set_cache(t, c);
+		memset(&rf, 0, sizeof(rf));
+		jit_kernel_run(jit_kernel_new(t, scode, 3), &rf);
+		jit_tier_wait(t);
+		jit_tier_delete(t);
+	    }));
+	}
+	for (auto& x : th)
+	    x.join();
+	d = opendir(dir);
+	while((d != NULL) && ((de = readdir(d)) != NULL)) {
+	    if (strstr(de->d_name, ".jit.") != NULL)
+		ntmp++;
+	}
+	if (d != NULL) closedir(d);
+	{
+	    jit_tier_t* t = jit_tier_new(0, vec_enable_mask);
+	    vregfile_t rf;
+	    jit_tier_set_cache(t, c);
+	    memset(&rf, 0, sizeof(rf));
+	    jit_kernel_run(jit_kernel_new(t, scode, 3), &rf);
+	    jit_tier_wait(t);
+	    jit_tier_delete(t);
+	}
+	jit_cache_stats(c, &st1);
+	if ((ntmp != 0) || (st1.store == st0.store) ||
+	    (st1.invalid != st0.invalid) || (st1.hit == st0.hit)) {
+	    fprintf(stderr, "cache concurrent store FAIL\n");
+	    failed++;
+	}
+    }
+    jit_cache_close(c);
+    {
+	DIR* d = opendir(dir);
+	struct dirent* de;
+	while((d != NULL) && ((de = readdir(d)) != NULL)) {
+	    char path[1024];
+	    if (de->d_name[0] == '.') continue;
+	    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	    unlink(path);
+	}
+	if (d != NULL) closedir(d);
+	rmdir(dir);
+    }
+    return failed;
+}
+
+// kernels compiled by the tier show up in the perf map and jitdump
+int test_perf(uint8_t* ts)
+{
+    instr_t code[3] = { OPdij(OP_ADD,2,0,1),
+			OPdij(OP_MUL,2,2,0),
+			OPd(OP_RET,2) };
+    char dir[] = "/tmp/jitter_perfXXXXXX";
+    char map_path[64];
+    char dump_path[1024];
+    char src_path[1024];
+    jit_tier_stats_t st;
+    jit_perf_t* p;
+    jit_tier_t* t;
+    FILE* f;
+    int nmap = 0, nload = 0, nclose = 0, nsrc = 0;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| perf\n");
+    printf("+------------------------------\n");
+
+    snprintf(map_path, sizeof(map_path), "/tmp/perf-%d.map", getpid());
+    unlink(map_path);
+    if ((mkdtemp(dir) == NULL) ||
+	((p = jit_perf_open(JIT_PERF_MAP|JIT_PERF_DUMP|JIT_PERF_SRC,
+			     dir)) == NULL)) {
+	fprintf(stderr, "perf: can not create %s\n", dir);
+	return 1;
+    }
+    snprintf(dump_path, sizeof(dump_path), "%s/jit-%d.dump", dir, getpid());
+    snprintf(src_path, sizeof(src_path), "%s/jit-%d.src", dir, getpid());
+    t = jit_tier_new(0, vec_enable_mask);
+    jit_tier_set_perf(t, p);
+    while(*ts != VOID) {
+	vregfile_t rf;
+	jit_kernel_t* k;
+	set_type(*ts, code, 3);
+	k = jit_kernel_new(t, code, 3);
+	memset(&rf, 0, sizeof(rf));
+	jit_kernel_run(k, &rf);
+	ts++;
+    }
+    jit_tier_wait(t);
+    jit_tier_stats(t, &st);
+    jit_tier_delete(t);
+    jit_perf_close(p);
+
+    if ((f = fopen(map_path, "r")) != NULL) {
+	char line[256];
+	while(fgets(line, sizeof(line), f) != NULL) {
+	    if (strstr(line, " jitter_") != NULL)
+		nmap++;
+	}
+	fclose(f);
+    }
+    if ((f = fopen(src_path, "r")) != NULL) {
+	char line[256];
+	while(fgets(line, sizeof(line), f) != NULL) {
+	    if (strncmp(line, "code jitter_", 12) == 0)
+		nsrc++;
+	}
+	fclose(f);
+    }
+    if ((f = fopen(dump_path, "r")) != NULL) {
+	uint32_t hdr[10];   // jitdump header, 40 bytes
+	uint32_t rec[4];    // id, total_size, timestamp
+	if ((fread(hdr, sizeof(hdr), 1, f) == 1) && (hdr[0] == 0x4A695444)) {
+	    while(fread(rec, sizeof(rec), 1, f) == 1) {
+		if (rec[0] == 0) nload++;        // JIT_CODE_LOAD
+		else if (rec[0] == 3) nclose++;  // JIT_CODE_CLOSE
+		fseek(f, rec[1] - sizeof(rec), SEEK_CUR);
+	    }
+	}
+	fclose(f);
+    }
+    printf("tier_up=%lu map=%d load=%d close=%d src=%d\n",
+	   st.tier_up, nmap, nload, nclose, nsrc);
+    if ((st.tier_up == 0) || (nmap != (int)st.tier_up) ||
+	(nload != (int)st.tier_up) || (nclose != 1) ||
+	(nsrc != (int)st.tier_up))
+	failed++;
+    unlink(map_path);
+    unlink(dump_path);
+    unlink(src_path);
+    rmdir(dir);
+    return failed;
+}
+
+// native kernels count their calls and cycles
+int test_prof(uint8_t* ts)
+{
+    instr_t code[3] = { OPdij(OP_ADD,2,0,1),
+			OPdij(OP_MUL,2,2,0),
+			OPd(OP_RET,2) };
+    jit_tier_t* t = jit_tier_new(0, vec_enable_mask);
+    jit_prof_t sum;
+    int failed = 0;
+    int nk = 0;
+
+    printf("+------------------------------\n");
+    printf("| prof\n");
+    printf("+------------------------------\n");
+
+    jit_tier_set_prof(t, PROF_TSC);
+    while(*ts != VOID) {
+	vregfile_t rf, rf_emu;
+	jit_kernel_t* k;
+	jit_prof_t kp;
+	int i, r, ret;
+
+	set_type(*ts, code, 3);
+	k = jit_kernel_new(t, code, 3);
+	memset(&rf, 0, sizeof(rf));
+	jit_kernel_run(k, &rf);
+	jit_tier_wait(t);
+	for (i = 0; i < 10; i++) {
+	    memset(&rf, 0, sizeof(rf));
+	    load_reg(*ts, i, 1, -1, rf.r, 0, 1, 2);
+	    memcpy(&rf_emu, &rf, sizeof(rf));
+	    emulate(&rf_emu, code, 3, &ret);
+	    r = jit_kernel_run(k, &rf);
+	    if (scmp(int_type(*ts), rf.r[r], rf_emu.r[ret]) != 0)
+		failed++;
+	}
+	jit_kernel_prof(k, &kp);
+	if (debug)
+	    fprintf(stderr, "%s calls=%lu cycles=%lu\n", asm_typename(*ts),
+		    kp.calls, kp.cycles);
+	if (!jit_kernel_is_native(k) || (kp.calls != 10) || (kp.cycles == 0)) {
+	    fprintf(stderr, "prof %s FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	// no thread runs k, the code is released but its counters kept
+	jit_kernel_tier_down(k);
+	jit_kernel_prof(k, &kp);
+	if (jit_kernel_is_native(k) || (kp.calls != 10)) {
+	    fprintf(stderr, "prof %s tier down FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	nk++;
+	ts++;
+    }
+    jit_tier_prof(t, &sum);
+    printf("calls=%lu cycles=%lu\n", sum.calls, sum.cycles);
+    if (sum.calls != (uint64_t)(10*nk))
+	failed++;
+    jit_tier_delete(t);
+    return failed;
+}
+
+// run loops with a small budget, yield in the emulator and continue
+// in native code, the result must match an unlimited run
+// scalar float loop with accumulators in r5/r6 (xmm5/xmm6, not loaded
+// from rfp) that are live when the kernel yields. The tier does not
+// compile scalar float code, so assemble with fuel directly.
+static int test_budget_float(uint8_t type)
+{
+    instr_t code[9] = { OPimm12d(OP_MOVI,3,4),
+			OPdi(OP_MOV,5,0),
+			OPdi(OP_MOV,6,1),
+			OPdij(OP_ADD,6,6,5),
+			OPdij(OP_ADD,5,5,5),
+			OPdiimm8(OP_SUBI,3,3,1),
+			OPimm12d(OP_JNZ,3,-4),
+			OPdi(OP_MOV,2,6),
+			OPd(OP_RET,2) };
+    uint32_t reg_mask = (1 << 0) | (1 << 1);  // r0, r1 in xmm0, xmm1
+    JitRuntime rt;
+    CodeHolder holder;
+    Section* data;
+    Label save_label;
+    fxsave64_1_t* save;
+    vregfile_t rf;
+    fun1_t fn;
+    int i, r, yields = 0;
+    int failed = 0;
+
+    for (i = 0; i < 9; i++)
+	code[i].type = type;
+    code[0].type = code[5].type = code[6].type = INT32;
+
+    holder.init(rt.environment(), rt.cpuFeatures());
+    holder.newSection(&data, ".data", 5, SectionFlags::kNone, 128);
+    ZAssembler a(&holder, 1024);
+    vec_setup(a);
+    a.set_fuel(1);
+    save_label = a.newLabel();
+    assemble(a, rt.environment(), reg_mask, x86::ptr(save_label), code, 9);
+    a.section(data);
+    a.bind(save_label);
+    a.embedDataArray(TypeId::kUInt8, "\0", 1, 512);
+    if (rt.add(&fn, &holder) != kErrorOk)
+	return 1;
+
+    memset(&rf, 0, sizeof(rf));
+    if (type == FLOAT32) {
+	rf.v[0].vf32[0] = 1.5;
+	rf.v[1].vf32[0] = 0.25;
+    }
+    else {
+	rf.v[0].vf64[0] = 1.5;
+	rf.v[1].vf64[0] = 0.25;
+    }
+    do {
+	rf.fuel = 1;
+	save = (fxsave64_1_t*) fn(&rf);
+	if (rf.status == EXEC_YIELD)
+	    yields++;
+    } while ((rf.status == EXEC_YIELD) && (yields < 10));
+    rt.release(fn);
+
+    // emulator keeps scalar floats in rf.r
+    {
+	vregfile_t rf_emu;
+	float64_t got, want;
+
+	memset(&rf_emu, 0, sizeof(rf_emu));
+	if (type == FLOAT32) {
+	    rf_emu.r[0].f32 = 1.5;
+	    rf_emu.r[1].f32 = 0.25;
+	    emulate(&rf_emu, code, 9, &r);
+	    want = rf_emu.r[r].f32;
+	    got = ((float32_t*) &save->xmm[2])[0];
+	}
+	else {
+	    rf_emu.r[0].f64 = 1.5;
+	    rf_emu.r[1].f64 = 0.25;
+	    emulate(&rf_emu, code, 9, &r);
+	    want = rf_emu.r[r].f64;
+	    got = ((float64_t*) &save->xmm[2])[0];
+	}
+	if ((yields == 0) || (rf.status != EXEC_DONE) || (got != want)) {
+	    fprintf(stderr, "budget float %s: %g != %g, yields=%d FAIL\n",
+		    asm_typename(type), got, want, yields);
+	    failed++;
+	}
+    }
+    return failed;
+}
+
+int test_budget(uint8_t* ts)
+{
+    instr_t code[12] = { OPdij(OP_ADD,2,0,1),
+			 OPdi(OP_MOV,1,2),
+			 OPimm12d(OP_MOVI,3,3),
+			 OPdij(OP_ADD,2,2,1),
+			 OPdiimm8(OP_SUBI,3,3,1),
+			 OPimm12d(OP_JNZ,3,-3),
+			 OPimm12d(OP_MOVI,3,0),
+			 OPdij(OP_ADD,2,2,0),
+			 OPdiimm8(OP_ADDI,3,3,1),
+			 OPdiimm8(OP_CMPLTI,1,3,4),
+			 OPimm12d(OP_JNZ,1,-4),
+			 OPd(OP_RET,2) };
+    instr_t spin[3] = { OPdiimm8(OP_ADDI,2,2,1),
+			OPimm12d(OP_JMP,0,-2),
+			OPd(OP_RET,2) };
+    jit_tier_t* t = jit_tier_new(0, vec_enable_mask);
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| budget\n");
+    printf("+------------------------------\n");
+
+    jit_tier_set_budget(t, 1);
+    while(*ts != VOID) {
+	vregfile_t rf, rf_emu, rf_spin;
+	jit_kernel_t* k;
+	jit_kernel_t* ks;
+	int r, ret, yields, fail = 0;
+
+	set_type(*ts, code, 12);
+	set_type(*ts, spin, 3);
+	k = jit_kernel_new(t, code, 12);
+	ks = jit_kernel_new(t, spin, 3);
+
+	// 5 backward jumps, one per run
+	memset(&rf, 0, sizeof(rf));
+	load_reg(*ts, 3, 1, -1, rf.r, 0, 1, 2);
+	memcpy(&rf_emu, &rf, sizeof(rf));
+	emulate(&rf_emu, code, 12, &ret);
+	yields = 0;
+	rf.fuel = 1;
+	while (emulate_budget(&rf, code, 12, &r) == EXEC_YIELD) {
+	    rf.fuel = 1;
+	    yields++;
+	}
+	if ((yields != 2) || (scmp(int_type(*ts), rf.r[r], rf_emu.r[ret]) != 0))
+	    fail++;
+
+	// first run is emulated, then continue native
+	memset(&rf, 0, sizeof(rf));
+	load_reg(*ts, 3, 1, -1, rf.r, 0, 1, 2);
+	rf.fuel = 1;
+	yields = 0;
+	if ((r = jit_kernel_run(k, &rf)) == -1)
+	    yields++;
+	memset(&rf_spin, 0, sizeof(rf_spin));
+	jit_kernel_run(ks, &rf_spin);  // queue
+	jit_tier_wait(t);
+	while (r == -1) {
+	    rf.fuel = 1;
+	    if ((r = jit_kernel_run(k, &rf)) == -1)
+		yields++;
+	}
+	if (!jit_kernel_is_native(k) || (yields != 2) ||
+	    (scmp(int_type(*ts), rf.r[r], rf_emu.r[ret]) != 0))
+	    fail++;
+
+	// endless loop stops after fuel+1 rounds, in both
+	memset(&rf, 0, sizeof(rf));
+	memset(&rf_emu, 0, sizeof(rf_emu));
+	rf.fuel = rf_emu.fuel = 10;
+	if ((jit_kernel_run(ks, &rf) != -1) ||
+	    (emulate_budget(&rf_emu, spin, 3, &ret) != EXEC_YIELD) ||
+	    (rf.status != EXEC_YIELD) || (rf.pc != 0) || (rf_emu.pc != 0) ||
+	    (rf.r[2].u8 != 11) || (rf_emu.r[2].u8 != 11))
+	    fail++;
+	if (fail) {
+	    fprintf(stderr, "budget %s FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	ts++;
+    }
+    jit_tier_delete(t);
+    failed += test_budget_float(FLOAT32);
+    failed += test_budget_float(FLOAT64);
+    return failed;
+}
+
+// native kernels called as plain C functions with typed arguments
+int test_native()
+{
+    instr_t icode[3] = { OPdij(OP_ADD,2,0,1),
+			 OPdij(OP_MUL,2,2,0),
+			 OPd(OP_RET,2) };
+    instr_t fcode[3] = { OPdij(OP_ADD,2,0,1),
+			 OPdij(OP_MUL,2,2,0),
+			 OPd(OP_RET,2) };
+    instr_t lcode[5] = { OPimm12d(OP_MOVI,1,0),
+			 OPdij(OP_ADD,1,1,0),
+			 OPdiimm8(OP_SUBI,0,0,1),
+			 OPimm12d(OP_JNZ,0,-3),
+			 OPd(OP_RET,1) };
+    instr_t dcode[4] = { OPdij(OP_ADD,0,0,1),
+			 OPdij(OP_MUL,2,2,3),
+			 OPdij(OP_SUB,0,0,2),
+			 OPd(OP_RET,0) };
+    JitRuntime rt;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| native\n");
+    printf("+------------------------------\n");
+
+    set_type(INT32, icode, 3);
+    set_type(FLOAT32, fcode, 3);
+    set_type(UINT64, lcode, 5);
+    set_type(FLOAT64, dcode, 4);
+    {
+	Kernel<int32_t(int32_t,int32_t)> k(rt, icode, 3);
+	if (!k.ok() || (k(3, 4) != 21) || (k(-5, 2) != 15)) {
+	    fprintf(stderr, "native int32 FAIL\n");
+	    failed++;
+	}
+    }
+    {
+	Kernel<float(float,float)> k(rt, fcode, 3);
+	if (!k.ok() || (k(1.5f, 2.0f) != 5.25f)) {
+	    fprintf(stderr, "native float32 FAIL\n");
+	    failed++;
+	}
+    }
+    {
+	Kernel<uint64_t(uint64_t)> k(rt, lcode, 5);
+	if (!k.ok() || (k(10) != 55) || (k(100000) != 5000050000ULL)) {
+	    fprintf(stderr, "native uint64 FAIL\n");
+	    failed++;
+	}
+    }
+    {
+	Kernel<double(double,double,double,double)> k(rt, dcode, 4);
+	if (!k.ok() || (k(1.0, 2.0, 3.0, 4.0) != -9.0)) {
+	    fprintf(stderr, "native float64 FAIL\n");
+	    failed++;
+	}
+    }
+    return failed;
+}
+
+// sum r0 + (r0-1) + .. + 1 in r2, with a forward and a backward jump
+static constexpr Program<8> builder_sum(uint8_t t)
+{
+    Program<8> p;
+    p.movi(t, r2, 0);
+    auto loop = p.label();
+    auto done = p.new_label();
+    p.jz(t, r0, done);
+    p.add(t, r2, r2, r0);
+    p.subi(t, r0, r0, 1);
+    p.jmp(loop);
+    p.bind(done);
+    p.ret(t, r2);
+    p.end();
+    return p;
+}
+
+static constexpr Program<8> builder_sum32 = builder_sum(INT32);
+static_assert(builder_sum32.size() == 6, "builder size");
+static_assert(builder_sum32[1].imm12 == 3, "builder forward jump");
+static_assert(builder_sum32[4].imm12 == -4, "builder backward jump");
+
+// vector shift by register takes a scalar shift amount only
+template<typename J, typename = void>
+struct builder_has_vsll : std::false_type {};
+template<typename J>
+struct builder_has_vsll<J, std::void_t<decltype(
+    std::declval<Program<4>&>().vsll(INT32, v0, v1, std::declval<J>()))>>
+    : std::true_type {};
+static_assert(builder_has_vsll<jit_reg_t>::value, "builder vsll v,v,r");
+static_assert(!builder_has_vsll<jit_vreg_t>::value, "builder vsll v,v,v");
+
+// builder encoding must match the OP macros, constexpr code must run
+int test_builder(uint8_t* ts)
+{
+    instr_t code[6] = { OPimm12d(OP_MOVI,2,0),
+			OPimm12d(OP_JZ,0,3),
+			OPdij(OP_ADD,2,2,0),
+			OPdiimm8(OP_SUBI,0,0,1),
+			OPimm12(OP_JMP,-4),
+			OPd(OP_RET,2) };
+    JitRuntime rt;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| builder\n");
+    printf("+------------------------------\n");
+
+    while(*ts != VOID) {
+	Program<8> p = builder_sum(*ts);
+	size_t i;
+
+	set_type(*ts, code, 6);
+	code[4].type = INT64;  // jmp
+	for (i = 0; i < 6; i++) {
+	    instr_t* q = &p.code()[i];
+	    if ((q->op != code[i].op) || (q->type != code[i].type) ||
+		(q->rd != code[i].rd) ||
+		(OP_IS_JUMP(q->op) || (q->op == OP_MOVI) ?
+		 (q->imm12 != code[i].imm12) :
+		 ((q->ri != code[i].ri) ||
+		  ((q->op & OP_IMM) ? (q->imm8 != code[i].imm8) :
+		   (q->rj != code[i].rj))))) {
+		fprintf(stderr, "builder %s instr %zu FAIL\n",
+			asm_typename(*ts), i);
+		failed++;
+		break;
+	    }
+	}
+	ts++;
+    }
+    {
+	Program<8> p = builder_sum32;
+	vregfile_t rf;
+	int ret;
+	Kernel<int32_t(int32_t)> k(rt, p.code(), p.size());
+
+	memset(&rf, 0, sizeof(rf));
+	rf.r[0].i32 = 10;
+	emulate(&rf, p.code(), p.size(), &ret);
+	if (!k.ok() || (k(10) != 55) || (rf.r[ret].i32 != 55)) {
+	    fprintf(stderr, "builder run FAIL\n");
+	    failed++;
+	}
+    }
+    return failed;
+}
+
+// wide code: large immediates in loops, round trip of narrow code and
+// code that can not be lowered
+int test_wide(uint8_t* ts)
+{
+    instr_t code[6] = { OPimm12d(OP_MOVI,2,0),
+			OPimm12d(OP_JZ,0,3),
+			OPdij(OP_ADD,2,2,0),
+			OPdiimm8(OP_SUBI,0,0,1),
+			OPimm12(OP_JMP,-4),
+			OPd(OP_RET,2) };
+    instr64_t wcode[8];
+    instr64_t far[4206];
+    instr_t ncode[8*WIDE_EXPAND];
+    JitRuntime rt;
+    int failed = 0;
+    int i, len;
+
+    printf("+------------------------------\n");
+    printf("| wide\n");
+    printf("+------------------------------\n");
+
+    memset(wcode, 0, sizeof(wcode));
+    wcode[0].op = OP_MOVI;  wcode[0].rd = 2; wcode[0].imm32 = 100000;
+    wcode[1].op = OP_ADDI;  wcode[1].rd = 1; wcode[1].ri = 0;
+    wcode[1].imm32 = 70000;
+    wcode[2].op = OP_ADDI;  wcode[2].rd = 1; wcode[2].ri = 1;
+    wcode[2].imm32 = -300;  // rd == ri, scratch register
+    wcode[3].op = OP_SUBI;  wcode[3].rd = 0; wcode[3].ri = 0;
+    wcode[3].imm32 = 1;
+    wcode[4].op = OP_JNZ;   wcode[4].rd = 0; wcode[4].imm24 = -3;
+    wcode[5].op = OP_ADD;   wcode[5].rd = 2; wcode[5].ri = 2; wcode[5].rj = 1;
+    wcode[6].op = OP_MOVI;  wcode[6].rd = 3; wcode[6].imm32 = -123456789;
+    wcode[7].op = OP_RET;   wcode[7].rd = 2;
+
+    while(*ts != VOID) {
+	vregfile_t rf, rf_wide;
+	int ret, ret_wide;
+	instr64_t wsum[6];
+
+	set_type(*ts, code, 6);
+	memset(&rf, 0, sizeof(rf));
+	load_reg(*ts, 3, 1, -1, rf.r, 0, 1, 2);
+	memcpy(&rf_wide, &rf, sizeof(rf));
+	jit_widen(code, 6, wsum);
+	emulate(&rf, code, 6, &ret);
+	if ((jit_narrow(wsum, 6, ncode, 6) != 6) ||
+	    (emulate_wide(&rf_wide, wsum, 6, &ret_wide) != 0) ||
+	    (scmp(int_type(*ts), rf.r[ret], rf_wide.r[ret_wide]) != 0)) {
+	    fprintf(stderr, "wide %s round trip FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	ts++;
+    }
+
+    for (i = 0; i < 8; i++)
+	wcode[i].type = INT64;
+    len = jit_narrow(wcode, 8, ncode, 8*WIDE_EXPAND);
+    {
+	vregfile_t rf;
+	int ret;
+	Kernel<int64_t(int64_t)> k(rt, ncode, (len < 0) ? 0 : len);
+
+	memset(&rf, 0, sizeof(rf));
+	rf.r[0].i64 = 5;
+	if ((len < 0) || (emulate_wide(&rf, wcode, 8, &ret) != 0) ||
+	    (rf.r[ret].i64 != 168505) || (rf.r[3].i64 != -123456789) ||
+	    !k.ok() || (k(5) != 168505)) {
+	    fprintf(stderr, "wide imm32 FAIL\n");
+	    failed++;
+	}
+    }
+
+    wcode[5].rj = 17;  // no register 17 in the backend or vregfile_t
+    {
+	vregfile_t rf;
+	int ret;
+	memset(&rf, 0, sizeof(rf));
+	if ((jit_narrow(wcode, 8, ncode, 8*WIDE_EXPAND) != -1) ||
+	    (emulate_wide(&rf, wcode, 8, &ret) != -1)) {
+	    fprintf(stderr, "wide register 17 FAIL\n");
+	    failed++;
+	}
+    }
+    wcode[5].rj = 1;
+    wcode[0].type = FLOAT32;  // float constant out of imm12
+    if (jit_narrow(wcode, 8, ncode, 8*WIDE_EXPAND) != -1)
+	failed++;
+
+    // jumps over 2048 instructions go through jump islands
+    memset(far, 0, sizeof(far));
+    for (i = 0; i < 4203; i++) {
+	far[i].op = OP_ADDI;
+	far[i].type = INT64;
+	far[i].rd = 2;
+	far[i].ri = 2;
+	far[i].imm32 = 1;
+    }
+    far[0].op = OP_MOVI;   far[0].rd = 3; far[0].imm32 = 3;
+    far[1].op = OP_MOVI;   far[1].rd = 2; far[1].imm32 = 0;
+    far[2].op = OP_JMP;    far[2].imm24 = 2100;  // skip 2100 addi
+    far[4203].op = OP_SUBI; far[4203].rd = 3; far[4203].ri = 3;
+    far[4203].imm32 = 1;
+    far[4204].op = OP_JNZ; far[4204].rd = 3; far[4204].imm24 = -4203;
+    far[4205].op = OP_RET; far[4205].rd = 2;
+    for (i = 4203; i < 4206; i++)
+	far[i].type = INT64;
+    len = jit_narrow(far, 4206, NULL, 0);
+    {
+	instr_t* nfar = (instr_t*) malloc((len+1)*sizeof(instr_t));
+	vregfile_t rf;
+	int ret;
+
+	if (len > 0)
+	    jit_narrow(far, 4206, nfar, len);
+	Kernel<int64_t()> k(rt, nfar, (len < 0) ? 0 : len);
+	memset(&rf, 0, sizeof(rf));
+	if ((len < 4206) || (emulate_wide(&rf, far, 4206, &ret) != 0) ||
+	    (rf.r[ret].i64 != 3*2100) || !k.ok() || (k() != 3*2100)) {
+	    fprintf(stderr, "wide far jump FAIL\n");
+	    failed++;
+	}
+	free(nfar);
+    }
+    return failed;
+}
+
+// reference C = A*B, int32 wraps
+static void gemm_ref(uint8_t type, size_t m, size_t n, size_t k,
+		     const void* a, const void* b, void* c)
+{
+    size_t i, j, p;
+
+    for (i = 0; i < m; i++) {
+	for (j = 0; j < n; j++) {
+	    float64_t fs = 0;
+	    uint32_t is = 0;
+	    for (p = 0; p < k; p++) {
+		switch(type) {
+		case FLOAT32:
+		    fs += ((float32_t*)a)[i*k+p] * ((float32_t*)b)[p*n+j];
+		    break;
+		case FLOAT64:
+		    fs += ((float64_t*)a)[i*k+p] * ((float64_t*)b)[p*n+j];
+		    break;
+		case INT32:
+		    is += ((uint32_t*)a)[i*k+p] * ((uint32_t*)b)[p*n+j];
+		    break;
+		default: break;
+		}
+	    }
+	    switch(type) {
+	    case FLOAT32: ((float32_t*)c)[i*n+j] = fs; break;
+	    case FLOAT64: ((float64_t*)c)[i*n+j] = fs; break;
+	    case INT32:   ((uint32_t*)c)[i*n+j] = is; break;
+	    default: break;
+	    }
+	}
+    }
+}
+
+static void gemm_fill(uint8_t type, void* x, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	int v = (int)(rand() % 19) - 9;
+	switch(type) {
+	case FLOAT32: ((float32_t*)x)[i] = v * 0.25f; break;
+	case FLOAT64: ((float64_t*)x)[i] = v * 0.25; break;
+	case INT32:   ((int32_t*)x)[i] = v * 1000003; break;
+	default: break;
+	}
+    }
+}
+
+static int gemm_cmp(uint8_t type, const void* x, const void* y, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	switch(type) {
+	case FLOAT32:
+	    if (fabs(((float32_t*)x)[i] - ((float32_t*)y)[i]) > 1e-3)
+		return -1;
+	    break;
+	case FLOAT64:
+	    if (fabs(((float64_t*)x)[i] - ((float64_t*)y)[i]) > 1e-9)
+		return -1;
+	    break;
+	case INT32:
+	    if (((uint32_t*)x)[i] != ((uint32_t*)y)[i])
+		return -1;
+	    break;
+	default: return -1;
+	}
+    }
+    return 0;
+}
+
+// odd sizes to hit the edge tiles, k > 256 to hit the k blocking
+// copy rows x cols elements between leading dimensions lds and ldd
+static void gemm_copy(uint8_t type, void* d, size_t ldd,
+		      const void* s, size_t lds, size_t rows, size_t cols)
+{
+    size_t es = get_scalar_size(type);
+    size_t i;
+
+    for (i = 0; i < rows; i++)
+	memcpy((uint8_t*)d + i*ldd*es, (const uint8_t*)s + i*lds*es, cols*es);
+}
+
+// run the dims on the kernel for vec_mask, with tight and with padded
+// leading dimensions
+static int test_gemm_mask(unsigned vec_mask)
+{
+    uint8_t types[] = { FLOAT32, FLOAT64, INT32, VOID };
+    size_t dims[][3] = { {37, 29, 41}, {6, 16, 1}, {13, 50, 300}, {1, 1, 0} };
+    size_t nd = sizeof(dims)/sizeof(dims[0]);
+    uint8_t* ts;
+    int failed = 0;
+
+    for (ts = types; *ts != VOID; ts++) {
+	jit_gemm_t* g = jit_gemm_new(*ts, vec_mask);
+	size_t es = get_scalar_size(*ts);
+	int mr, nr, vsize;
+	size_t d, i;
+
+	if (g == NULL) {
+	    printf("gemm %s not supported\n", asm_typename(*ts));
+	    continue;
+	}
+	jit_gemm_blocking(g, &mr, &nr, &vsize);
+	printf("gemm %s: %dx%d block, %d byte vectors\n",
+	       asm_typename(*ts), mr, nr, vsize);
+	for (d = 0; d < nd; d++) {
+	    size_t m = dims[d][0], n = dims[d][1], k = dims[d][2];
+	    size_t lda = k+3, ldb = n+5, ldc = n+7;
+	    double a[m*k+1], b[k*n+1], c[m*n], r[m*n];
+	    double pa[m*lda+1], pb[k*ldb+1], pc[m*ldc];
+	    uint8_t pad[8*8];
+
+	    gemm_fill(*ts, a, m*k);
+	    gemm_fill(*ts, b, k*n);
+	    memset(c, 0xff, sizeof(c));
+	    gemm_ref(*ts, m, n, k, a, b, r);
+	    jit_gemm(g, m, n, k, a, k, b, n, c, n);
+	    if (gemm_cmp(*ts, c, r, m*n) != 0) {
+		fprintf(stderr, "gemm %s %zux%zux%zu FAIL\n",
+			asm_typename(*ts), m, n, k);
+		failed++;
+	    }
+
+	    memset(pa, 0x7f, sizeof(pa));
+	    memset(pb, 0x7f, sizeof(pb));
+	    memset(pc, 0xff, sizeof(pc));
+	    memset(pad, 0xff, sizeof(pad));
+	    gemm_copy(*ts, pa, lda, a, k, m, k);
+	    gemm_copy(*ts, pb, ldb, b, n, k, n);
+	    jit_gemm(g, m, n, k, pa, lda, pb, ldb, pc, ldc);
+	    for (i = 0; i < m; i++) {
+		uint8_t* row = (uint8_t*)pc + i*ldc*es;
+		if ((gemm_cmp(*ts, row, (uint8_t*)r + i*n*es, n) != 0) ||
+		    (memcmp(row + n*es, pad, (ldc-n)*es) != 0)) {
+		    fprintf(stderr, "gemm %s %zux%zux%zu ld %zu,%zu,%zu FAIL\n",
+			    asm_typename(*ts), m, n, k, lda, ldb, ldc);
+		    failed++;
+		    break;
+		}
+	    }
+	}
+	jit_gemm_delete(g);
+    }
+    return failed;
+}
+
+int test_gemm()
+{
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| gemm\n");
+    printf("+------------------------------\n");
+
+    failed += test_gemm_mask(~0u);
+    failed += test_gemm_mask(VEC_TYPE_VEC);  // xmm kernel on AVX hosts
+
+    {
+	size_t n = 256;
+	float32_t* a = (float32_t*) malloc(n*n*sizeof(float32_t));
+	float32_t* b = (float32_t*) malloc(n*n*sizeof(float32_t));
+	float32_t* c = (float32_t*) malloc(n*n*sizeof(float32_t));
+	jit_gemm_t* g = jit_gemm_new(FLOAT32, ~0u);
+	double t0, t1, t2;
+
+	gemm_fill(FLOAT32, a, n*n);
+	gemm_fill(FLOAT32, b, n*n);
+	t0 = now();
+	gemm_ref(FLOAT32, n, n, n, a, b, c);
+	t1 = now();
+	if (g != NULL) {
+	    jit_gemm(g, n, n, n, a, n, b, n, c, n);
+	    t2 = now();
+	    printf("gemm float32 %zu: naive %.2f GFLOP/s, jit %.2f GFLOP/s\n",
+		   n, 2.0*n*n*n/(t1-t0)*1e-9, 2.0*n*n*n/(t2-t1)*1e-9);
+	    jit_gemm_delete(g);
+	}
+	free(c);
+	free(b);
+	free(a);
+    }
+    return failed;
+}
+
+// a*b + c*d - e, d scalar, fused into one kernel
+static jit_expr_t* expr_axpy()
+{
+    return jit_expr_op(OP_VSUB,
+		       jit_expr_op(OP_VADD,
+				   jit_expr_op(OP_VMUL, jit_expr_array(0),
+					       jit_expr_array(1), NULL),
+				   jit_expr_op(OP_VMUL, jit_expr_array(2),
+					       jit_expr_scalar(0), NULL),
+				   NULL),
+		       jit_expr_array(3), NULL);
+}
+
+int test_expr()
+{
+    jit_expr_cache_t* c = jit_expr_cache_new(1, ~0u);
+    jit_expr_t* e = expr_axpy();
+    jit_expr_t* mx;
+    jit_expr_t* chain;
+    jit_expr_stats_t st;
+    float32_t fa[4][37], fout[37], fd = 2.5;
+    int32_t ia[4][37], iout[37], id = -3;
+    const void* farr[4] = { fa[0], fa[1], fa[2], fa[3] };
+    const void* iarr[4] = { ia[0], ia[1], ia[2], ia[3] };
+    const void* fsc[1] = { &fd };
+    const void* isc[1] = { &id };
+    int failed = 0;
+    int i, j, pass;
+
+    printf("+------------------------------\n");
+    printf("| expr\n");
+    printf("+------------------------------\n");
+
+    for (i = 0; i < 4; i++) {
+	for (j = 0; j < 37; j++) {
+	    fa[i][j] = (j*(i+3) % 11) - 5 + 0.5*i;
+	    ia[i][j] = (j*(i+5) % 13) - 6;
+	}
+    }
+    // first pass is emulated, the second reuses the cached shapes
+    // with other lengths in native loop kernels
+    for (pass = 0; pass < 2; pass++) {
+	int n = pass ? 37 : 29;
+	if ((jit_expr_eval(c, e, FLOAT32, n, farr, fsc, fout) != 0) ||
+	    (jit_expr_eval(c, e, INT32, n, iarr, isc, iout) != 0)) {
+	    fprintf(stderr, "expr eval FAIL\n");
+	    failed++;
+	    continue;
+	}
+	for (j = 0; j < n; j++) {
+	    float32_t fr = fa[0][j]*fa[1][j] + fa[2][j]*fd - fa[3][j];
+	    int32_t ir = ia[0][j]*ia[1][j] + ia[2][j]*id - ia[3][j];
+	    if ((fout[j] != fr) || (iout[j] != ir)) {
+		fprintf(stderr, "expr pass %d elem %d FAIL\n", pass, j);
+		failed++;
+		break;
+	    }
+	}
+    }
+
+    // max(a,b) with vcmpgt and vsel
+    mx = jit_expr_op(OP_VSEL,
+		     jit_expr_op(OP_VCMPGT, jit_expr_array(0),
+				 jit_expr_array(1), NULL),
+		     jit_expr_array(0), jit_expr_array(1));
+    for (pass = 0; pass < 2; pass++) {  // unroll 4, emulated then native
+	if (jit_expr_eval(c, mx, INT32, 37, iarr, NULL, iout) != 0) {
+	    failed++;
+	    continue;
+	}
+	for (j = 0; j < 37; j++) {
+	    if (iout[j] != ((ia[0][j] > ia[1][j]) ? ia[0][j] : ia[1][j])) {
+		fprintf(stderr, "expr max pass %d FAIL\n", pass);
+		failed++;
+		break;
+	    }
+	}
+    }
+
+    // 14 arrays do not fit the vector registers
+    chain = jit_expr_array(0);
+    for (i = 1; i < 14; i++)
+	chain = jit_expr_op(OP_VADD, jit_expr_array(i), chain, NULL);
+    if (jit_expr_eval(c, chain, INT32, 1, iarr, NULL, iout) != -1)
+	failed++;
+
+    // copies per kernel run are limited by the input registers
+    {
+	instr_t code[256];
+	uint8_t areg[4*NUM_VECTOR_REGISTERS], sreg[NUM_VECTOR_REGISTERS];
+	uint8_t oreg[4];
+	if ((jit_expr_compile(mx, INT32, 4, code, 256, areg, sreg, oreg) < 0) ||
+	    (oreg[0] == oreg[3]) ||
+	    (jit_expr_compile(e, INT32, 2, code, 256, areg, sreg, oreg) < 0) ||
+	    (jit_expr_compile(e, INT32, 4, code, 256, areg, sreg, oreg) != -1)) {
+	    fprintf(stderr, "expr unroll FAIL\n");
+	    failed++;
+	}
+    }
+
+    jit_expr_cache_stats(c, &st);
+    printf("expr cache: hit=%lu, miss=%lu, failed=%lu, native=%lu\n",
+	   st.hit, st.miss, st.failed, st.native);
+    if ((st.miss != 3) || (st.hit != 3) || (st.failed != 1) ||
+	(st.native != 3)) {
+	fprintf(stderr, "expr cache stats FAIL\n");
+	failed++;
+    }
+    jit_expr_delete(chain);
+    jit_expr_delete(mx);
+    jit_expr_delete(e);
+    jit_expr_cache_delete(c);
+    return failed;
+}
+
+// build fat kernels, verify variants and run the selected one
+int test_fat(uint8_t* ts)
+{
+    instr_t vcode[3] = { OPdij(OP_VCMPGT,3,0,1),
+			 OPdijk(OP_VSEL,2,3,0,1),
+			 OPd(OP_VRET,2) };
+    uint32_t reg_mask = (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3);
+    JitRuntime rt;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| fat\n");
+    printf("+------------------------------\n");
+
+    while(*ts != VOID) {
+	vregfile_t rf, rf_emu;
+	unsigned vec_mask = 0;
+	uint8_t* fat;
+	size_t len;
+	fun1_t fn;
+	int ret, res;
+
+	set_type(*ts, vcode, 3);
+	memset(&rf, 0, sizeof(rf));
+	load_vreg(*ts, -1, -1, (vector_t*)rf.v, 0, 1, 2);
+	if ((fat = jit_fat_build(vcode, 3, reg_mask, &len)) == NULL) {
+	    fprintf(stderr, "fat %s build FAIL\n", asm_typename(*ts));
+	    failed++;
+	    ts++;
+	    continue;
+	}
+	if ((res = jit_fat_verify(fat, len, &rf)) != 0) {
+	    fprintf(stderr, "fat %s verify %d FAIL\n", asm_typename(*ts), res);
+	    failed++;
+	}
+	if ((fn = (fun1_t) jit_fat_load(rt, fat, len, &vec_mask)) == NULL) {
+	    fprintf(stderr, "fat %s load FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	else {
+	    memcpy(&rf_emu, &rf, sizeof(rf));
+	    emulate(&rf_emu, vcode, 3, &ret);
+	    fn(&rf);
+	    if (memcmp(&rf.v[2], &rf_emu.v[ret], sizeof(rf.v[2])) != 0) {
+		fprintf(stderr, "fat %s vec_mask=%x FAIL\n",
+			asm_typename(*ts), vec_mask);
+		failed++;
+	    }
+	    rt.release(fn);
+	}
+	free(fat);
+	ts++;
+    }
+    return failed;
+}
+
+// optimize constant branch, dead code and loop programs, optimized
+// code must return the same value as the original and still assemble
+int test_opt(uint8_t* ts)
+{
+    instr_t code1[8] = { OPimm12d(OP_MOVI,3,5),
+			 OPdij(OP_ADD,2,0,1),
+			 OPdi(OP_MOV,1,0),
+			 OPdiimm8(OP_CMPGTI,2,3,3),
+			 OPimm12d(OP_JNZ,2,1),
+			 OPdij(OP_SUB,2,0,0),
+			 OPdij(OP_ADD,2,1,3),
+			 OPd(OP_RET,2) };
+    instr_t code2[12] = { OPdij(OP_ADD,2,0,1),
+			  OPdi(OP_MOV,1,2),
+			  OPimm12d(OP_MOVI,3,3),
+			  OPdij(OP_ADD,2,2,1),
+			  OPdiimm8(OP_SUBI,3,3,1),
+			  OPimm12d(OP_JNZ,3,-3),
+			  OPimm12d(OP_MOVI,3,0),
+			  OPdij(OP_ADD,2,2,0),
+			  OPdiimm8(OP_ADDI,3,3,1),
+			  OPdiimm8(OP_CMPLTI,1,3,4),
+			  OPimm12d(OP_JNZ,1,-4),
+			  OPd(OP_RET,2) };
+    struct { instr_t* code; size_t n; } prog[2] = {
+	{ code1, 8 }, { code2, 12 } };
+    int failed = 0;
+    int p;
+
+    printf("+------------------------------\n");
+    printf("| opt\n");
+    printf("+------------------------------\n");
+
+    for (p = 0; p < 2; p++) {
+	uint8_t* tp = ts;
+	while(*tp != VOID) {
+	    uint8_t otype = int_type(*tp);
+	    instr_t opt[12];
+	    size_t n = prog[p].n;
+	    size_t m;
+	    int i;
+
+	    set_type(*tp, prog[p].code, n);
+	    memcpy(opt, prog[p].code, n*sizeof(instr_t));
+	    m = optimize(opt, n);
+	    if (debug) {
+		print_code(stderr, opt, m);
+	    }
+	    if ((p == 0) && (m >= n)) {
+		fprintf(stderr, "opt %s size %lu FAIL\n",
+			asm_typename(*tp), m);
+		failed++;
+	    }
+	    for (i = 0; i < 16; i++) {
+		vregfile_t rf, rf_opt;
+		int ret, ret_opt;
+		memset(&rf, 0, sizeof(rf));
+		load_reg(*tp, i, 1, -1, rf.r, 0, 1, 2);
+		memcpy(&rf_opt, &rf, sizeof(rf));
+		emulate(&rf, prog[p].code, n, &ret);
+		emulate(&rf_opt, opt, m, &ret_opt);
+		if (scmp(otype, rf.r[ret], rf_opt.r[ret_opt]) != 0) {
+		    fprintf(stderr, "opt %s i=%d FAIL\n",
+			    asm_typename(*tp), i);
+		    failed++;
+		}
+	    }
+	    if (test_code(*tp, otype, -1, opt, m) < 0)
+		failed++;
+	    tp++;
+	}
+    }
+    return failed;
+}
+
+// independent vadd should be moved in between the dependent multiplies
+int test_sched(uint8_t* ts)
+{
+    instr_t code[6] = { OPdij(OP_VMUL,2,0,1),
+			OPdij(OP_VMUL,3,2,0),
+			OPdij(OP_VADD,1,1,0),
+			OPdij(OP_VSUB,0,0,1),
+			OPdij(OP_VADD,2,3,1),
+			OPd(OP_VRET,2) };
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| sched\n");
+    printf("+------------------------------\n");
+
+    while(*ts != VOID) {
+	instr_t sched[6];
+	int i;
+
+	set_type(*ts, code, 6);
+	memcpy(sched, code, sizeof(code));
+	schedule(sched, 6, vec_enable_mask);
+	if (debug) {
+	    print_code(stderr, sched, 6);
+	}
+	if ((sched[1].op != OP_VADD) || (sched[5].op != OP_VRET)) {
+	    fprintf(stderr, "sched %s order FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	for (i = 0; i < 4; i++) {
+	    vregfile_t rf, rf_sched;
+	    int ret, ret_sched;
+	    memset(&rf, 0, sizeof(rf));
+	    load_vreg(*ts, -1, -1, (vector_t*)rf.v, 0, 1, 2);
+	    rf.v[0].vu8[0] += i;
+	    memcpy(&rf_sched, &rf, sizeof(rf));
+	    emulate(&rf, code, 6, &ret);
+	    emulate(&rf_sched, sched, 6, &ret_sched);
+	    if (memcmp(&rf.v, &rf_sched.v, sizeof(rf.v)) != 0) {
+		fprintf(stderr, "sched %s i=%d FAIL\n", asm_typename(*ts), i);
+		failed++;
+	    }
+	}
+	if (test_vcode(*ts, *ts, -1, sched, 6) < 0)
+	    failed++;
+	ts++;
+    }
+    return failed;
+}
+
+// compile statistics, emulated 8 and 64 bit multiply expand to more
+// native instructions than add
+int test_stats(uint8_t* ts)
+{
+    instr_t code[3] = { OPdij(OP_VADD,2,0,1),
+			OPdij(OP_VMUL,2,2,1),
+			OPd(OP_VRET,2) };
+    uint32_t reg_mask = (1 << 0) | (1 << 1) | (1 << 2);
+    JitRuntime rt;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| stats\n");
+    printf("+------------------------------\n");
+
+    while(*ts != VOID) {
+	CodeHolder ch;
+	Section* data;
+	Label save_label;
+	jit_stats_t st;
+	int size = get_scalar_size(*ts);
+
+	ch.init(rt.environment(), rt.cpuFeatures());
+	ch.newSection(&data, ".data", 5, SectionFlags::kNone, 128);
+	ZAssembler a(&ch, 1024);
+	vec_setup(a);
+	set_type(*ts, code, 3);
+	save_label = a.newLabel();
+	assemble_stats(a, rt.environment(), reg_mask, x86::ptr(save_label),
+		       code, 3, &st);
+	if (debug)
+	    print_stats(stderr, &st);
+	if ((st.nops != 3) || (st.code_size == 0) ||
+	    (st.op_count[OP_VADD] != 1) || (st.op_count[OP_VMUL] != 1) ||
+	    (st.op_native[OP_VADD] == 0) ||
+	    (st.ninstr < st.op_native[OP_VADD] + st.op_native[OP_VMUL])) {
+	    fprintf(stderr, "stats %s FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	if (((size == 1) || (size == 8)) &&
+	    ((st.op_native[OP_VMUL] <= st.op_native[OP_VADD]) ||
+	     (st.xmm_peak < 2))) {
+	    fprintf(stderr, "stats %s vmul FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	ts++;
+    }
+    return failed;
+}
+
+// code offsets per instruction, fused compare and jump share the
+// compare code
+int test_srcmap(uint8_t* ts)
+{
+    instr_t code[12] = { OPdij(OP_ADD,2,0,1),
+			 OPdi(OP_MOV,1,2),
+			 OPimm12d(OP_MOVI,3,3),
+			 OPdij(OP_ADD,2,2,1),
+			 OPdiimm8(OP_SUBI,3,3,1),
+			 OPimm12d(OP_JNZ,3,-3),
+			 OPimm12d(OP_MOVI,3,0),
+			 OPdij(OP_ADD,2,2,0),
+			 OPdiimm8(OP_ADDI,3,3,1),
+			 OPdiimm8(OP_CMPLTI,1,3,4),
+			 OPimm12d(OP_JNZ,1,-4),
+			 OPd(OP_RET,2) };
+    uint32_t reg_mask = ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3)) << 16;
+    JitRuntime rt;
+    int failed = 0;
+
+    printf("+------------------------------\n");
+    printf("| srcmap\n");
+    printf("+------------------------------\n");
+
+    while(*ts != VOID) {
+	CodeHolder ch;
+	Section* data;
+	Label save_label;
+	uint32_t map[13];
+	size_t size;
+	int i, fail = 0;
+
+	ch.init(rt.environment(), rt.cpuFeatures());
+	ch.newSection(&data, ".data", 5, SectionFlags::kNone, 128);
+	ZAssembler a(&ch, 1024);
+	vec_setup(a);
+	set_type(*ts, code, 12);
+	save_label = a.newLabel();
+	assemble_map(a, rt.environment(), reg_mask, x86::ptr(save_label),
+		     code, 12, map);
+	size = ch.textSection()->bufferSize();
+	if ((map[0] == 0) || (map[12] >= size) ||
+	    (pc_map_lookup(map, 12, 0) != -1) ||
+	    (pc_map_lookup(map, 12, map[12]) != 12) ||
+	    (map[10] != map[11]) ||
+	    (pc_map_lookup(map, 12, map[10]-1) != 9))
+	    fail++;
+	for (i = 0; i < 12; i++) {
+	    if ((map[i] > map[i+1]) ||
+		((map[i] < map[i+1]) &&
+		 ((pc_map_lookup(map, 12, map[i]) != i) ||
+		  (pc_map_lookup(map, 12, map[i+1]-1) != i))))
+		fail++;
+	}
+	if (debug) {
+	    for (i = 0; i < 12; i++) {
+		fprintf(stderr, "%4x ", map[i]);
+		print_instr(stderr, &code[i]);
+		fprintf(stderr, "\n");
+	    }
+	}
+	if (fail) {
+	    fprintf(stderr, "srcmap %s FAIL\n", asm_typename(*ts));
+	    failed++;
+	}
+	ts++;
+    }
+    return failed;
+}
+
+int test_imm8(uint8_t op, uint8_t* ts, uint8_t otype)
+{
+    instr_t code[2];
+    int i, imm;
+    int failed = 0;
+    int vec = (op & OP_VEC) != 0;
+
+    printf("+------------------------------\n");
+    printf("| %s\n", asm_opname(op));
+    printf("+------------------------------\n");
+        
+    code[0].op = op;
+    code[1].op = vec ? OP_VRET : OP_RET;
+    code[1].rd = 2;
+    code[0].rd = 2;
+
+    for (i = 0; i <= 2; i++) {
+	code[0].ri = i;
+	for (imm = -128; imm < 128; imm += 27) {
+	    code[0].imm8 = imm;
+	    failed += test_ts_code(ts, otype, vec, -1,  code, 2);
+	}
+    }
+    return failed;
+}
+
+int test_imm12(uint8_t op, uint8_t* ts, uint8_t otype)
+{
+    instr_t code[2];
+    int imm;
+    int failed = 0;
+    int vec = (op & OP_VEC) != 0;
+
+    printf("+------------------------------\n");
+    printf("| %s\n", asm_opname(op));
+    printf("+------------------------------\n");
+    
+    code[0].op = op;
+    code[1].op = vec ? OP_VRET : OP_RET;
+    code[1].rd = 2;
+    code[0].rd = 2;
+
+    for (imm = -2048; imm < 2048; imm += 511) {
+	code[0].imm12 = imm;
+	failed += test_ts_code(ts, otype, vec, -1, code, 2);
+    }
+    return failed;
+}
+
+int test_shift(uint8_t op, uint8_t* ts, uint8_t otype)
+{
+    instr_t code[2];
+    int i;
+    int failed = 0;
+    int vec = (op & OP_VEC) != 0;
+
+    printf("+------------------------------\n");
+    printf("| %s\n", asm_opname(op));
+    printf("+------------------------------\n");
+    
+    code[0].op = op;
+    code[1].op = vec ? OP_VRET : OP_RET;
+    code[1].rd = 2;
+    code[0].rd = 2;
+
+    for (i = 0; i <= 2; i++) {
+	uint8_t* ts1 = ts;
+	code[0].ri = i;
+	while(*ts1 != VOID) {
+	    int imm;
+	    size_t n = (1 << get_scalar_exp_bit_size(*ts1));
+	    for (imm = 0; imm < (int)n; imm++) {
+		uint8_t tv[2];
+		code[0].imm8 = imm;
+		tv[0] = *ts1; tv[1] = VOID;
+		failed += test_ts_code(tv, otype, vec, -1, code, 2); 
+	    }
+	    ts1++;
+	}	    
+    }
+    return failed;
+}
+
+// test shift operations using registers
+int test_bshift(uint8_t op, uint8_t* ts, uint8_t otype)
+{
+    instr_t code[2];
+    int i, j;
+    int failed = 0;
+    int vec = (op & OP_VEC) != 0;
+
+    printf("+------------------------------\n");
+    printf("| %s\n", asm_opname(op));
+    printf("+------------------------------\n");
+    
+    code[0].op = op;
+    code[1].op = vec ? OP_VRET : OP_RET;
+    code[1].rd = 2;
+    code[0].rd = 2;
+
+    for (i = 0; i <= 2; i++) {
+	code[0].ri = i;	
+	for (j = 0; j <= 2; j++) {
+	    uint8_t* ts1 = ts;
+	    code[0].rj = j;
+	    // load shift value
+	    while(*ts1 != VOID) {
+		int imm;
+		size_t n = (1 << get_scalar_exp_bit_size(*ts1));
+		for (imm = 0; imm < (int)n; imm++) {
+		    uint8_t tv[2];
+		    tv[0] = *ts1; tv[1] = VOID;
+		    failed += test_ts_code(tv, otype, vec, imm, code, 2);
+		}
+		ts1++;	    
+	    }
+	}
+    }
+    return failed;
+}
+
+void format_reg(String& sb, x86::Reg reg)
+{
+    sb.reset();
+    Formatter::formatOperand(sb, FormatFlags::kNone, NULL, Arch::kX64, reg);
+}
+
+void test_alloc()
+{
+    JitRuntime rt;
+    CodeHolder code;
+    int r;
+    int r1, r2, r3, r4;
+    int x1, x2, x3, x4;
+    String s;
+    
+    code.init(rt.environment(), rt.cpuFeatures());
+    ZAssembler a(&code, 1024);
+
+    r = -1;
+    while((r = a.reg_next(r)) >= 0) {
+	format_reg(s, reg(r));
+	printf("Free: %s\n", s.data());
+    }
+    r = -1;
+    while((r = a.xreg_next(r)) >= 0) {
+	format_reg(s, xreg(r));
+	printf("Free: %s\n", s.data());
+    }
+
+    r1 = a.reg_alloc();
+    format_reg(s, reg(r1));
+    printf("Alloc [%d] %s\n", r1, s.data());
+    
+    r2 = a.reg_alloc();
+    format_reg(s, reg(r2));
+    printf("Alloc [%d] %s\n", r2, s.data());
+
+    r3 = a.reg_alloc();
+    format_reg(s, reg(r3));
+    printf("Alloc [%d] %s\n", r3, s.data());
+
+    r4 = a.reg_alloc();
+    format_reg(s, reg(r4));
+    printf("alloc [%d] %s\n", r4, s.data());
+
+    a.reg_release(r1);
+    a.reg_release(r2);
+    a.reg_release(r3);
+    a.reg_release(r4);
+
+    x1 = a.xreg_alloc();
+    format_reg(s, xreg(x1));
+    printf("Alloc [%d] %s\n", x1, s.data());
     
     x2 = a.xreg_alloc();
     format_reg(s, xreg(x2));
@@ -932,57 +3191,12 @@ void test_alloc()
     
 }
 
-int main()
+// op x type x value matrix, cases are batched when batch is set
+int test_ops(uint8_t* int_types, uint8_t* half_types, uint8_t* all_types)
 {
-    printf("VSIZE = %d\n", VSIZE);
-    printf("sizeof(vector_t) = %ld\n", sizeof(vector_t));
-    printf("sizeof(scalar0_t) = %ld\n", sizeof(scalar0_t));
-    printf("sizeof(vscalar0_t) = %ld\n", sizeof(vscalar0_t));
-    printf("sizeof(instr_t) = %ld\n", sizeof(instr_t));
-
-    x86_info();
-
-//    test_alloc();
-//    exit(0);
-
-    vec_enable(VEC_TYPE_SSE|VEC_TYPE_SSE2);
-    // vec_enable(VEC_TYPE_AVX);
-
+    uint8_t float_types[] = { FLOAT32, FLOAT64, VOID };
     int failed = 0;  // number of failed cases
-/*    
-    instr_t code_sum[] = {
-	OPimm12d(OP_MOVI, 0, 0),     // SUM=0 // OPdij(OP_BXOR, 0, 0, 0),
-	OPimm12d(OP_MOVI, 1, 13),    // I=13  OPdij(OP_BXOR, 0, 0, 0),
-	OPdij(OP_ADD, 0, 1, 0),      // SUM += I
-	OPimm12d(OP_SUBI, 1, 1),    // I -= 1
-	OPimm12d(OP_JNZ, 1, -3),
-	OPd(OP_RET, 0)
-    };
-*/  
-    uint8_t int_types[] =
-	{ UINT8, UINT16, UINT32, UINT64, INT8, INT16, INT32, INT64, VOID };
-//    uint8_t float_types[] =
-//	{ FLOAT32, FLOAT64, VOID };
-    uint8_t all_types[] =
-	{ UINT8, UINT16, UINT32, UINT64, INT8, INT16, INT32, INT64,
-	  //FLOAT16
-	  FLOAT32, FLOAT64, VOID };
-    
-//    uint8_t int_type[] = { INT8, VOID };
 
-//    debug = 1;
-    exit_on_fail = 1;
-    debug_on_fail = 1;
-//    instr_t code1[] = { OPdij(OP_CMPLT,2,0,2), OPd(OP_RET, 2) };
-//    code1[0].type = UINT64;
-//    code1[1].type = UINT64;
-//    test_code(UINT64, INT64, code1, 2);    
-//    exit(0);
-//////////////////
-    //failed += test_bshift(OP_SLL, int_types, INT);    
-//////////////////     
-    // exit(0);
-    
     failed += test_unary(OP_NOP, int_types, VOID); 
     failed += test_imm12(OP_MOVI, int_types, INT);
     failed += test_unary(OP_MOV, int_types, VOID); // fixme: float registers!
@@ -1028,12 +3242,20 @@ int main()
     failed += test_imm8(OP_CMPGEI, int_types, INT);    
     failed += test_imm8(OP_CMPEQI, int_types, INT);
     failed += test_imm8(OP_CMPNEI, int_types, INT);    
+    failed += test_cmp_jump(OP_JNZ, int_types, INT);
+    failed += test_cmp_jump(OP_JZ, int_types, INT);
+    failed += test_loop(int_types, INT);
+    failed += test_opt(int_types);
 
     // vectors
     failed += test_unary(OP_VMOV, all_types, VOID);
     failed += test_imm12(OP_VMOVI, int_types, INT);
     failed += test_unary(OP_VNEG, all_types, VOID);    
     failed += test_unary(OP_VBNOT, all_types, INT);
+    failed += test_unary(OP_VCVT, half_types, VOID);
+    failed += test_unary(OP_VCVTN, half_types, VOID);
+    failed += test_half_all(FLOAT16);
+    failed += test_half_all(BFLOAT16);
 
     failed += test_binary(OP_VADD, all_types, VOID);
     failed += test_binary(OP_VSUB, all_types, VOID);
@@ -1052,6 +3274,12 @@ int main()
     failed += test_binary(OP_VCMPGT, all_types, INT);
     failed += test_binary(OP_VCMPGE, all_types, INT);    
     failed += test_binary(OP_VCMPNE, all_types, INT);    
+    failed += test_select(all_types, INT);
+    failed += test_sched(all_types);
+    failed += test_vjump(OP_VJANY, int_types, INT);
+    failed += test_vjump(OP_VJALL, int_types, INT);
+    failed += test_fjump(OP_JNZ, float_types);
+    failed += test_fjump(OP_JZ, float_types);
 
     failed += test_imm8(OP_VADDI, int_types, INT);
     failed += test_imm8(OP_VSUBI, int_types, INT);
@@ -1070,6 +3298,132 @@ int main()
     failed += test_imm8(OP_VCMPGTI, all_types, INT);
     failed += test_imm8(OP_VCMPGEI, all_types, INT);    
     failed += test_imm8(OP_VCMPNEI, all_types, INT);    
+
+    // temporaries from spilled registers
+    spill_all = 1;
+    failed += test_bshift(OP_SLL, int_types, INT);
+    failed += test_binary(OP_CMPLT, int_types, INT);
+    failed += test_cmp_jump(OP_JNZ, int_types, INT);
+    failed += test_fjump(OP_JNZ, float_types);
+    failed += test_fjump(OP_JZ, float_types);
+    failed += test_binary(OP_VMUL, all_types, VOID);
+    failed += test_bshift(OP_VSRA, int_types, INT);
+    failed += test_binary(OP_VCMPLE, all_types, INT);
+    failed += test_select(all_types, INT);
+    failed += test_vjump(OP_VJALL, int_types, INT);
+    failed += test_unary(OP_VCVTN, half_types, VOID);
+    spill_all = 0;
+    
+    return failed;
+}
+
+// all available vector tiers are tested in one run
+static int tier_available(unsigned mask)
+{
+    JitRuntime rt;
+    CodeHolder code;
+
+    code.init(rt.environment(), rt.cpuFeatures());
+    ZAssembler a(&code, 64);
+    return (a.enabled() & mask) == mask;
+}
+
+int main()
+{
+    printf("VSIZE = %d\n", VSIZE);
+    printf("sizeof(vector_t) = %ld\n", sizeof(vector_t));
+    printf("sizeof(scalar0_t) = %ld\n", sizeof(scalar0_t));
+    printf("sizeof(vscalar0_t) = %ld\n", sizeof(vscalar0_t));
+    printf("sizeof(instr_t) = %ld\n", sizeof(instr_t));
+
+    x86_info();
+
+//    test_alloc();
+//    exit(0);
+
+    vec_enable(VEC_TYPE_SSE|VEC_TYPE_SSE2);
+    // vec_enable(VEC_TYPE_AVX);
+
+    int failed = 0;  // number of failed cases
+/*    
+    instr_t code_sum[] = {
+	OPimm12d(OP_MOVI, 0, 0),     // SUM=0 // OPdij(OP_BXOR, 0, 0, 0),
+	OPimm12d(OP_MOVI, 1, 13),    // I=13  OPdij(OP_BXOR, 0, 0, 0),
+	OPdij(OP_ADD, 0, 1, 0),      // SUM += I
+	OPimm12d(OP_SUBI, 1, 1),    // I -= 1
+	OPimm12d(OP_JNZ, 1, -3),
+	OPd(OP_RET, 0)
+    };
+*/  
+    uint8_t int_types[] =
+	{ UINT8, UINT16, UINT32, UINT64, INT8, INT16, INT32, INT64, VOID };
+//    uint8_t float_types[] =
+//	{ FLOAT32, FLOAT64, VOID };
+    uint8_t half_types[] = { FLOAT16, BFLOAT16, VOID };
+    uint8_t all_types[] =
+	{ UINT8, UINT16, UINT32, UINT64, INT8, INT16, INT32, INT64,
+	  //FLOAT16
+	  FLOAT32, FLOAT64, VOID };
+    
+//    uint8_t int_type[] = { INT8, VOID };
+
+//    debug = 1;
+    exit_on_fail = 1;
+    debug_on_fail = 1;
+//    instr_t code1[] = { OPdij(OP_CMPLT,2,0,2), OPd(OP_RET, 2) };
+//    code1[0].type = UINT64;
+//    code1[1].type = UINT64;
+//    test_code(UINT64, INT64, code1, 2);    
+//    exit(0);
+//////////////////
+    //failed += test_bshift(OP_SLL, int_types, INT);    
+//////////////////     
+    // exit(0);
+    
+    static const struct {
+	const char* name;
+	unsigned mask;
+    } tier[] = {
+	{ "sse2", VEC_TYPE_SSE|VEC_TYPE_SSE2 },
+	{ "avx2", VEC_TYPE_SSE|VEC_TYPE_SSE2|VEC_TYPE_SSE3|VEC_TYPE_SSSE3|
+	  VEC_TYPE_SSE4_1|VEC_TYPE_SSE4_2|VEC_TYPE_AVX|VEC_TYPE_AVX2|
+	  VEC_TYPE_F16C },
+    };
+    double t0 = now();
+    size_t t;
+
+    for (t = 0; t < sizeof(tier)/sizeof(tier[0]); t++) {
+	if (!tier_available(tier[t].mask)) {
+	    printf("%s: not available\n", tier[t].name);
+	    continue;
+	}
+	vec_enable(tier[t].mask);
+	batch = 1;
+	failed += test_ops(int_types, half_types, all_types);
+	failed += batch_run(tier[t].name);
+	batch = 0;
+    }
+
+    vec_enable(VEC_TYPE_SSE|VEC_TYPE_SSE2);
+#ifdef EMU_PROFILE
+    failed += test_emu_prof(int_types);
+#endif
+    failed += test_fuse(int_types);
+    failed += test_tier(int_types);
+    failed += test_cache(int_types);
+    failed += test_perf(int_types);
+    failed += test_prof(int_types);
+    failed += test_fat(all_types);
+    failed += test_stats(int_types);
+    failed += test_srcmap(int_types);
+    failed += test_soa(int_types);
+    failed += test_budget(int_types);
+    failed += test_native();
+    failed += test_builder(int_types);
+    failed += test_wide(int_types);
+    failed += test_gemm();
+    failed += test_expr();
+    printf("wall time %.2fs\n", now() - t0);
     
     if (failed) {
 	printf("ERROR: %d cases failed\n", failed);
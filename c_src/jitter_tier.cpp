@@ -0,0 +1,511 @@
+//
+// Tiered runtime, emulate first then swap in native code
+//
+
+#include <asmjit/x86.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+using namespace asmjit;
+
+#include "jitter_types.h"
+#include "jitter.h"
+#include "jitter_asm.h"
+#include "jitter_tier.h"
+#include "jitter_cache.h"
+#include "jitter_perf.h"
+
+extern void assemble(ZAssembler &a, const Environment &env,
+		     uint32_t reg_mask,
+		     x86::Mem save_ptr,
+		     instr_t* code, size_t n);
+extern void assemble_map(ZAssembler &a, const Environment &env,
+			 uint32_t reg_mask,
+			 x86::Mem save_ptr,
+			 instr_t* code, size_t n, uint32_t* map);
+extern jit_prof_t* prof_block(ZAssembler &a, void* fn);
+extern int prof_pmc_available(void);
+extern void emu_prepare(instr_t* code, size_t n, uint8_t* fuse);
+extern void emulate_fused(vregfile_t* rfp, instr_t* code, size_t n,
+			  uint8_t* fuse, int* ret);
+extern int emulate_fused_budget(vregfile_t* rfp, instr_t* code, size_t n,
+				uint8_t* fuse, int* ret);
+extern uint32_t instr_uses(instr_t* p);
+extern uint32_t instr_defs(instr_t* p);
+
+typedef void* (*tier_fun_t)(vregfile_t* rfp);
+
+#define TIER_EMULATE 0  // running in emulator
+#define TIER_QUEUED  1  // waiting for compiler
+#define TIER_NATIVE  2  // native code installed
+#define TIER_FAILED  3  // can not compile, stay in emulator
+
+struct _jit_kernel_t {
+    jit_tier_t* tier;
+    instr_t* code;
+    uint8_t* fuse;
+    size_t n;
+    uint32_t reg_mask;
+    int ret;
+    std::atomic<uint64_t> count;
+    std::atomic<int> state;
+    std::atomic<tier_fun_t> entry;
+    std::atomic<int> active;        // threads in jit_kernel_run native path
+    std::vector<jit_prof_t*> prof;  // counters of live code (t->mtx)
+    jit_prof_t* entry_prof;         // counters in entry or NULL (t->mtx)
+    jit_prof_t prof_sum;            // counters of released code (t->mtx)
+};
+
+typedef struct {
+    jit_kernel_t* k;
+    tier_fun_t fn;
+    jit_prof_t* prof;  // counters in fn or NULL
+} tier_retired_t;
+
+struct _jit_tier_t {
+    unsigned threshold;
+    unsigned vec_mask;
+    unsigned vec_enabled;  // vec_mask & available
+    std::atomic<jit_cache_t*> cache;
+    std::atomic<jit_perf_t*> perf;
+    std::atomic<int> prof;
+    std::atomic<int> budget;
+    JitRuntime rt;
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cond;  // queue changed
+    std::deque<jit_kernel_t*> queue;
+    std::vector<jit_kernel_t*> kernels;
+    std::vector<tier_retired_t> retired; // released by tier_sweep
+    int busy;
+    int quit;
+
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> emulated;
+    std::atomic<uint64_t> native;
+    std::atomic<uint64_t> tier_up;
+    std::atomic<uint64_t> tier_down;
+    std::atomic<uint64_t> failed;
+};
+
+class TierErrorHandler : public ErrorHandler {
+public:
+    Error err;
+    TierErrorHandler() { err = kErrorOk; }
+    void handleError(Error e, const char* message, BaseEmitter* origin) override {
+	(void) message; (void) origin;
+	if (err == kErrorOk) err = e;
+    }
+};
+
+// Check that native code will match the emulator: a single ret last,
+// no scalar float (kept in xmm by assemble), no registers that are
+// reserved (rsp, rfp) or used as scratch by the code generator.
+static int tier_check(instr_t* code, size_t n, uint32_t* reg_mask, int* ret)
+{
+    uint32_t mask = 0;
+    int i;
+
+    if ((n == 0) ||
+	((code[n-1].op != OP_RET) && (code[n-1].op != OP_VRET)))
+	return 0;
+    for (i = 0; i < (int)n; i++) {
+	instr_t* p = &code[i];
+	if ((i < (int)n-1) && ((p->op == OP_RET) || (p->op == OP_VRET)))
+	    return 0;
+	if ((p->op == OP_NOP) || (p->op == OP_VNOP) || (p->op == OP_JMP))
+	    continue;
+	if (!(p->op & OP_VEC) && (get_base_type(p->type) >= FLOAT01))
+	    return 0;
+	mask |= instr_uses(p) | instr_defs(p);
+    }
+    if (mask & ((R_FREE_MASK|(1<<4)|(1<<7)) << 16))
+	return 0;
+    if (mask & X_FREE_MASK)
+	return 0;
+    *reg_mask = mask;
+    *ret = code[n-1].rd;
+    return 1;
+}
+
+// map is NULL for code loaded from the cache
+static void tier_perf(jit_tier_t* t, jit_perf_t* perf, jit_kernel_t* k,
+		      tier_fun_t fn, size_t size, const uint32_t* map)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "jitter_%016lx",
+	     (unsigned long) jit_cache_key(k->code, k->n, k->reg_mask,
+					   t->vec_enabled));
+    jit_perf_add_map(perf, name, (const void*) fn, size,
+		     k->code, k->n, map);
+}
+
+static tier_fun_t tier_compile(jit_tier_t* t, jit_kernel_t* k,
+			       jit_prof_t** pp)
+{
+    TierErrorHandler eh;
+    CodeHolder code;
+    std::vector<uint32_t> map;
+    jit_cache_t* cache = t->cache.load();
+    jit_perf_t* perf = t->perf.load();
+    int prof = t->prof.load();
+    int budget = t->budget.load();
+    tier_fun_t fn;
+    size_t size;
+
+    *pp = NULL;
+    if ((cache != NULL) && (prof == PROF_NONE) && !budget &&
+	((fn = (tier_fun_t) jit_cache_load(cache, t->rt, k->code, k->n,
+					   k->reg_mask,
+					   t->vec_enabled, &size)) != NULL)) {
+	if (perf != NULL)
+	    tier_perf(t, perf, k, fn, size, NULL);
+	return fn;
+    }
+
+    code.init(t->rt.environment(), t->rt.cpuFeatures());
+    code.setErrorHandler(&eh);
+    ZAssembler a(&code, 1024);
+
+    a.disable(~0u);
+    a.enable(t->vec_mask);
+    a.set_prof(prof);
+    a.set_fuel(budget);
+    a.set_dump(0);  // no shared fxsave area, kernels run concurrently
+
+    if (perf != NULL) {
+	map.resize(k->n+1);
+	assemble_map(a, t->rt.environment(), k->reg_mask, x86::Mem(),
+		     k->code, k->n, map.data());
+    }
+    else
+	assemble(a, t->rt.environment(), k->reg_mask, x86::Mem(),
+		 k->code, k->n);
+
+    if (eh.err != kErrorOk)
+	return NULL;
+    if (t->rt.add(&fn, &code) != kErrorOk)
+	return NULL;
+    if (prof != PROF_NONE)
+	*pp = prof_block(a, (void*) fn);
+    else if ((cache != NULL) && !budget)
+	jit_cache_store(cache, code, k->code, k->n, k->reg_mask,
+			t->vec_enabled);
+    if (perf != NULL)
+	tier_perf(t, perf, k, fn, code.codeSize(), map.data());
+    return fn;
+}
+
+// Release retired code that no thread can be running, the caller holds
+// t->mtx. A thread counts itself in k->active before it loads k->entry,
+// so once entry is swapped out and active is seen as zero no thread can
+// still be in (or about to enter) the old code. Counters inside the
+// released code are folded into k->prof_sum.
+static void tier_sweep(jit_tier_t* t)
+{
+    size_t i, j;
+
+    for (i = 0, j = 0; i < t->retired.size(); i++) {
+	tier_retired_t* r = &t->retired[i];
+	jit_kernel_t* k = r->k;
+
+	if (k->active.load() != 0) {
+	    t->retired[j++] = *r;
+	    continue;
+	}
+	if (r->prof != NULL) {
+	    size_t m;
+	    k->prof_sum.calls += r->prof->calls;
+	    k->prof_sum.cycles += r->prof->cycles;
+	    for (m = 0; m < k->prof.size(); m++) {
+		if (k->prof[m] == r->prof) {
+		    k->prof.erase(k->prof.begin() + m);
+		    break;
+		}
+	    }
+	}
+	t->rt.release(r->fn);
+    }
+    t->retired.resize(j);
+}
+
+static unsigned tier_vec_enabled(jit_tier_t* t)
+{
+    CodeHolder code;
+
+    code.init(t->rt.environment(), t->rt.cpuFeatures());
+    ZAssembler a(&code, 64);
+    a.disable(~0u);
+    a.enable(t->vec_mask);
+    return a.enabled();
+}
+
+static void tier_worker(jit_tier_t* t)
+{
+    std::unique_lock<std::mutex> lock(t->mtx);
+
+    while (1) {
+	jit_kernel_t* k;
+	jit_prof_t* prof;
+	tier_fun_t fn;
+	int state;
+
+	while (t->queue.empty() && !t->quit)
+	    t->cond.wait(lock);
+	if (t->quit)
+	    break;
+	k = t->queue.front();
+	t->queue.pop_front();
+	if (k->state.load() != TIER_QUEUED)
+	    continue;  // tier down while queued
+	t->busy = 1;
+	lock.unlock();
+
+	fn = tier_compile(t, k, &prof);
+
+	lock.lock();
+	t->busy = 0;
+	state = TIER_QUEUED;
+	if (fn == NULL) {
+	    k->state.compare_exchange_strong(state, TIER_FAILED);
+	    t->failed++;
+	}
+	else if (k->state.compare_exchange_strong(state, TIER_NATIVE)) {
+	    k->entry.store(fn, std::memory_order_release);
+	    k->entry_prof = prof;
+	    if (prof != NULL)
+		k->prof.push_back(prof);
+	    t->tier_up++;
+	}
+	else
+	    t->rt.release(fn);
+	tier_sweep(t);
+	t->cond.notify_all();
+    }
+}
+
+jit_tier_t* jit_tier_new(unsigned threshold, unsigned vec_mask)
+{
+    jit_tier_t* t = new jit_tier_t;
+
+    t->threshold = threshold;
+    t->vec_mask = vec_mask;
+    t->vec_enabled = tier_vec_enabled(t);
+    t->cache = NULL;
+    t->perf = NULL;
+    t->prof = PROF_NONE;
+    t->budget = 0;
+    t->busy = 0;
+    t->quit = 0;
+    t->calls = 0;
+    t->emulated = 0;
+    t->native = 0;
+    t->tier_up = 0;
+    t->tier_down = 0;
+    t->failed = 0;
+    t->worker = std::thread(tier_worker, t);
+    return t;
+}
+
+void jit_tier_delete(jit_tier_t* t)
+{
+    size_t i;
+
+    {
+	std::lock_guard<std::mutex> lock(t->mtx);
+	t->quit = 1;
+	t->cond.notify_all();
+    }
+    t->worker.join();
+
+    for (i = 0; i < t->kernels.size(); i++) {
+	jit_kernel_t* k = t->kernels[i];
+	tier_fun_t fn = k->entry.load();
+	if (fn != NULL)
+	    t->rt.release(fn);
+	delete [] k->code;
+	delete [] k->fuse;
+	delete k;
+    }
+    for (i = 0; i < t->retired.size(); i++)
+	t->rt.release(t->retired[i].fn);
+    delete t;
+}
+
+// cache is owned by caller and must outlive the tier
+void jit_tier_set_cache(jit_tier_t* t, jit_cache_t* c)
+{
+    std::lock_guard<std::mutex> lock(t->mtx);
+    t->cache = c;
+}
+
+// perf is owned by caller and must outlive the tier
+void jit_tier_set_perf(jit_tier_t* t, jit_perf_t* p)
+{
+    std::lock_guard<std::mutex> lock(t->mtx);
+    t->perf = p;
+}
+
+void jit_tier_set_prof(jit_tier_t* t, int mode)
+{
+    std::lock_guard<std::mutex> lock(t->mtx);
+    if ((mode == PROF_PMC) && !prof_pmc_available())
+	mode = PROF_TSC;
+    t->prof = mode;
+}
+
+void jit_tier_set_budget(jit_tier_t* t, int on)
+{
+    std::lock_guard<std::mutex> lock(t->mtx);
+    t->budget = on;
+}
+
+void jit_tier_wait(jit_tier_t* t)
+{
+    std::unique_lock<std::mutex> lock(t->mtx);
+
+    while (!t->queue.empty() || t->busy)
+	t->cond.wait(lock);
+}
+
+void jit_tier_stats(jit_tier_t* t, jit_tier_stats_t* sp)
+{
+    sp->calls     = t->calls.load();
+    sp->emulated  = t->emulated.load();
+    sp->native    = t->native.load();
+    sp->tier_up   = t->tier_up.load();
+    sp->tier_down = t->tier_down.load();
+    sp->failed    = t->failed.load();
+}
+
+jit_kernel_t* jit_kernel_new(jit_tier_t* t, instr_t* code, size_t n)
+{
+    jit_kernel_t* k = new jit_kernel_t;
+
+    k->tier = t;
+    k->n = n;
+    k->code = new instr_t[n];
+    memcpy(k->code, code, n*sizeof(instr_t));
+    k->fuse = new uint8_t[n];
+    emu_prepare(k->code, n, k->fuse);
+    k->count = 0;
+    k->entry = NULL;
+    k->active = 0;
+    k->entry_prof = NULL;
+    memset(&k->prof_sum, 0, sizeof(jit_prof_t));
+    k->reg_mask = 0;
+    k->ret = -1;
+    if (tier_check(k->code, n, &k->reg_mask, &k->ret))
+	k->state = TIER_EMULATE;
+    else {
+	k->state = TIER_FAILED;
+	t->failed++;
+    }
+    std::lock_guard<std::mutex> lock(t->mtx);
+    t->kernels.push_back(k);
+    return k;
+}
+
+int jit_kernel_run(jit_kernel_t* k, vregfile_t* rfp)
+{
+    jit_tier_t* t = k->tier;
+    tier_fun_t fn;
+    int budget = t->budget.load(std::memory_order_relaxed);
+    int ret = -1;
+
+    t->calls++;
+    // count in before entry is loaded, see tier_sweep
+    k->active.fetch_add(1);
+    if ((fn = k->entry.load()) != NULL) {
+	t->native++;
+	fn(rfp);
+	k->active.fetch_sub(1, std::memory_order_release);
+	if (budget && (rfp->status == EXEC_YIELD))
+	    return -1;
+	return k->ret;
+    }
+    k->active.fetch_sub(1, std::memory_order_release);
+    t->emulated++;
+    if (budget) {
+	if (emulate_fused_budget(rfp, k->code, k->n, k->fuse, &ret) ==
+	    EXEC_YIELD)
+	    ret = -1;
+    }
+    else
+	emulate_fused(rfp, k->code, k->n, k->fuse, &ret);
+
+    if (k->count.fetch_add(1)+1 >= t->threshold) {
+	int state = TIER_EMULATE;
+	if (k->state.compare_exchange_strong(state, TIER_QUEUED)) {
+	    std::lock_guard<std::mutex> lock(t->mtx);
+	    t->queue.push_back(k);
+	    t->cond.notify_all();
+	}
+    }
+    return ret;
+}
+
+int jit_kernel_is_native(jit_kernel_t* k)
+{
+    return k->entry.load() != NULL;
+}
+
+static void prof_add(jit_kernel_t* k, jit_prof_t* sum)
+{
+    size_t i;
+
+    sum->calls += k->prof_sum.calls;
+    sum->cycles += k->prof_sum.cycles;
+    for (i = 0; i < k->prof.size(); i++) {
+	sum->calls += k->prof[i]->calls;
+	sum->cycles += k->prof[i]->cycles;
+    }
+}
+
+void jit_kernel_prof(jit_kernel_t* k, jit_prof_t* sum)
+{
+    std::lock_guard<std::mutex> lock(k->tier->mtx);
+
+    memset(sum, 0, sizeof(jit_prof_t));
+    prof_add(k, sum);
+}
+
+void jit_tier_prof(jit_tier_t* t, jit_prof_t* sum)
+{
+    std::lock_guard<std::mutex> lock(t->mtx);
+    size_t i;
+
+    memset(sum, 0, sizeof(jit_prof_t));
+    for (i = 0; i < t->kernels.size(); i++)
+	prof_add(t->kernels[i], sum);
+}
+
+void jit_kernel_tier_down(jit_kernel_t* k)
+{
+    jit_tier_t* t = k->tier;
+    std::lock_guard<std::mutex> lock(t->mtx);
+    tier_fun_t fn;
+
+    if ((fn = k->entry.exchange(NULL)) != NULL) {
+	// other threads may still run fn, release it in tier_sweep
+	tier_retired_t r;
+	r.k = k;
+	r.fn = fn;
+	r.prof = k->entry_prof;
+	t->retired.push_back(r);
+	k->entry_prof = NULL;
+	t->tier_down++;
+    }
+    tier_sweep(t);
+    if (k->state.load() != TIER_FAILED) {
+	k->state = TIER_EMULATE;
+	k->count = 0;
+    }
+}
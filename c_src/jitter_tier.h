@@ -0,0 +1,67 @@
+#ifndef __JITTER_TIER_H__
+#define __JITTER_TIER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jitter_types.h"
+#include "jitter.h"
+
+// Tiered execution: kernels start in the (fused) emulator and are
+// queued for assemble() on a background thread once they have been
+// called threshold times. The native entry is swapped in atomically.
+//
+// Only the register returned by the (single, last) ret/vret instruction
+// is defined in the register file after jit_kernel_run.
+// Native kernels keep no state of their own, several threads may run
+// the same kernel at once, each with its own register file.
+
+typedef struct _jit_tier_t   jit_tier_t;
+typedef struct _jit_kernel_t jit_kernel_t;
+typedef struct _jit_cache_t  jit_cache_t;
+typedef struct _jit_perf_t   jit_perf_t;
+
+typedef struct {
+    uint64_t calls;      // number of jit_kernel_run
+    uint64_t emulated;   // runs in emulator
+    uint64_t native;     // runs in native code
+    uint64_t tier_up;    // native code installed
+    uint64_t tier_down;  // native code removed
+    uint64_t failed;     // kernels that can not be compiled
+} jit_tier_stats_t;
+
+// threshold = 0 compile on first call, vec_mask limit VEC_TYPE_xxx used
+extern jit_tier_t* jit_tier_new(unsigned threshold, unsigned vec_mask);
+extern void jit_tier_delete(jit_tier_t* t);
+// load/store compiled kernels in disk cache (see jitter_cache.h)
+extern void jit_tier_set_cache(jit_tier_t* t, jit_cache_t* c);
+// report native kernels to perf (see jitter_perf.h)
+extern void jit_tier_set_perf(jit_tier_t* t, jit_perf_t* p);
+// count calls and cycles in native code, PROF_xxx from jitter.h,
+// PROF_PMC falls back to PROF_TSC when user rdpmc is not allowed.
+// Set before kernels are compiled, profiled code is not cached.
+extern void jit_tier_set_prof(jit_tier_t* t, int mode);
+// limit backward jumps per run to vregfile_t.fuel, a run that runs out
+// returns -1 with status EXEC_YIELD, run it again (emulated or native)
+// with new fuel to continue. Set before kernels are compiled, code
+// with fuel checks is not cached.
+extern void jit_tier_set_budget(jit_tier_t* t, int on);
+// block until the compile queue is empty
+extern void jit_tier_wait(jit_tier_t* t);
+extern void jit_tier_stats(jit_tier_t* t, jit_tier_stats_t* sp);
+
+// code is copied, kernel is owned by the tier
+extern jit_kernel_t* jit_kernel_new(jit_tier_t* t, instr_t* code, size_t n);
+// run kernel, return index of returned register (-1 when yielded)
+extern int  jit_kernel_run(jit_kernel_t* k, vregfile_t* rfp);
+// 1 if native code is installed
+extern int  jit_kernel_is_native(jit_kernel_t* k);
+// counters summed over all native code installed for the kernel
+extern void jit_kernel_prof(jit_kernel_t* k, jit_prof_t* sum);
+// counters summed over all kernels
+extern void jit_tier_prof(jit_tier_t* t, jit_prof_t* sum);
+// drop native code and restart the invocation counter, the old code is
+// released once no thread is running it
+extern void jit_kernel_tier_down(jit_kernel_t* k);
+
+#endif
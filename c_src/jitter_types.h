@@ -44,7 +44,8 @@ typedef struct { uint64_t hi; uint64_t lo; } uint128_t;
 #endif
 
 typedef uint8_t float8_t; // simulated
-typedef uint16_t float16_t; // simulated
+typedef uint16_t float16_t; // storage only, converted to/from float32
+typedef uint16_t bfloat16_t; // storage only, upper half of float32
 
 #if VSIZE == 1
 #define VELEMS(t) 1
@@ -226,6 +227,7 @@ typedef float64_t vfloat64_t __attribute__ ((vector_size (VSIZE)));
 #define    FLOAT16 make_scalar_type(ELEM_SIZE16,FLOAT)
 #define    FLOAT32 make_scalar_type(ELEM_SIZE32,FLOAT)
 #define    FLOAT64 make_scalar_type(ELEM_SIZE64,FLOAT)
+#define    BFLOAT16 make_scalar_type(ELEM_SIZE16,FLOAT01)
 #define    VOID    255
 
 typedef uint32_t  jitter_type_t;
@@ -278,6 +280,83 @@ static inline jitter_type_t int_type(jitter_type_t type)
     return (type & ~BASE_TYPE_MASK) | INT;
 }
 
+typedef union {
+    float32_t f;
+    uint32_t  u;
+} float32_bits_t;
+
+// half precision to float32, exact, signaling NaN are quieted (as F16C)
+static inline float32_t float16_to_float32(float16_t h)
+{
+    float32_bits_t r;
+    uint32_t sign = ((uint32_t)(h & 0x8000)) << 16;
+    uint32_t e = (h >> 10) & 0x1f;
+    uint32_t m = h & 0x3ff;
+
+    if (e == 0x1f)
+	r.u = sign | 0x7f800000 | (m << 13) | (m ? 0x00400000 : 0);
+    else if (e == 0) {
+	if (m == 0)
+	    r.u = sign;
+	else {  // subnormal, normalize
+	    e = 113;
+	    while(!(m & 0x400)) { m <<= 1; e--; }
+	    r.u = sign | (e << 23) | ((m & 0x3ff) << 13);
+	}
+    }
+    else
+	r.u = sign | ((e + 112) << 23) | (m << 13);
+    return r.f;
+}
+
+// float32 to half precision, round to nearest even (as vcvtps2ph imm=0)
+static inline float16_t float32_to_float16(float32_t f)
+{
+    float32_bits_t x;
+    uint32_t sign, ax, r, rem, half;
+    x.f = f;
+    sign = (x.u >> 16) & 0x8000;
+    ax = x.u & 0x7fffffff;
+
+    if (ax > 0x7f800000)  // NaN, keep upper payload and make quiet
+	return sign | 0x7e00 | ((ax >> 13) & 0x3ff);
+    if (ax >= 0x477ff000) // >= 65520 round to infinity
+	return sign | 0x7c00;
+    if (ax < 0x38800000) { // subnormal half
+	int shift;
+	if (ax <= 0x33000000) // <= 2^-25 round to zero
+	    return sign;
+	shift = 126 - (int)(ax >> 23);
+	ax = (ax & 0x7fffff) | 0x800000;
+	r = ax >> shift;
+	rem = ax & ((1 << shift)-1);
+	half = 1 << (shift-1);
+	if ((rem > half) || ((rem == half) && (r & 1))) r++;
+	return sign | r;
+    }
+    r = (ax - 0x38000000) >> 13;
+    rem = ax & 0x1fff;
+    if ((rem > 0x1000) || ((rem == 0x1000) && (r & 1))) r++;
+    return sign | r;
+}
+
+static inline float32_t bfloat16_to_float32(bfloat16_t h)
+{
+    float32_bits_t r;
+    r.u = ((uint32_t) h) << 16;
+    return r.f;
+}
+
+// float32 to brain float, round to nearest even, NaN => 0x7fc0
+static inline bfloat16_t float32_to_bfloat16(float32_t f)
+{
+    float32_bits_t x;
+    x.f = f;
+    if ((x.u & 0x7fffffff) > 0x7f800000)
+	return 0x7fc0;
+    return (x.u + 0x7fff + ((x.u >> 16) & 1)) >> 16;
+}
+
 typedef vint8_t vector_t;
 // various x86 
 typedef uint8_t st_t[10];
@@ -305,6 +384,7 @@ typedef union {
     int64_t   i64;
     float8_t  f8;
     float16_t f16;
+    bfloat16_t bf16;
     float32_t f32;
     float64_t f64;
 } scalar0_t;
@@ -321,6 +401,7 @@ typedef union {
     int64_t  vi64[VSIZE/sizeof(int64_t)];
     float8_t vf8[VSIZE/sizeof(float8_t)];    
     float16_t vf16[VSIZE/sizeof(float16_t)];
+    bfloat16_t vbf16[VSIZE/sizeof(bfloat16_t)];
     float32_t vf32[VSIZE/sizeof(float32_t)];
     float64_t vf64[VSIZE/sizeof(float64_t)];
     vector_t v;
@@ -377,12 +458,44 @@ typedef union {
 #define NUM_FLOAT_REGISTERS   16
 #define NUM_SCALAR_REGISTERS  16
 
+// status after a run with execution budget (emulate_budget, code
+// assembled with set_fuel), EXEC_YIELD runs continue at pc when run again
+#define EXEC_DONE   0
+#define EXEC_YIELD  1
+
 typedef struct
 {
     vscalar0_t v[NUM_VECTOR_REGISTERS];
     scalar0_t  r[NUM_SCALAR_REGISTERS];
+    int64_t    fuel;    // backward jumps left before yield
+    uint32_t   pc;      // instruction to resume at
+    uint32_t   status;  // EXEC_xxx
 } vregfile_t;
 
+// scalar registers of SOA_WIDTH instances, r[i].u32[k] is register i
+// of instance k as uint32, each register is one contiguous array of the
+// element type used by the program, see emulate_soa
+#define SOA_WIDTH 64
+
+typedef union {
+    uint8_t   u8[SOA_WIDTH];
+    uint16_t  u16[SOA_WIDTH];
+    uint32_t  u32[SOA_WIDTH];
+    uint64_t  u64[SOA_WIDTH];
+    int8_t    i8[SOA_WIDTH];
+    int16_t   i16[SOA_WIDTH];
+    int32_t   i32[SOA_WIDTH];
+    int64_t   i64[SOA_WIDTH];
+    float32_t f32[SOA_WIDTH];
+    float64_t f64[SOA_WIDTH];
+} soa_reg_t;
+
+typedef struct
+{
+    soa_reg_t  r[NUM_SCALAR_REGISTERS];
+    int        ret[SOA_WIDTH];   // returned register, -1 if none
+} soa_regfile_t;
+
 
 typedef void (*unary_op_t)(void* src, void* dst);
 typedef void (*binary_op_t)(void* src1, void* src2, void* dst);
@@ -10,6 +10,8 @@ const char* asm_opname(uint8_t op)
     case OP_JMP:   return "jmp";
     case OP_JNZ:   return "jnz";
     case OP_JZ:    return "jz";		
+    case OP_VJANY: return "vjany";
+    case OP_VJALL: return "vjall";
     case OP_RET:   return "ret";
     case OP_NEG:   return "neg";
     case OP_BNOT:  return "bnot";
@@ -109,6 +111,9 @@ const char* asm_opname(uint8_t op)
     case OP_VNEG:  return "vneg";	
     case OP_VBNOT:  return "vbnot";
     case OP_VINV:  return "vinv";
+    case OP_VSEL:  return "vsel";
+    case OP_VCVT:  return "vcvt";
+    case OP_VCVTN:  return "vcvtn";
 
     default: return "?????";
     }
@@ -127,6 +132,7 @@ const char* asm_typename(uint8_t type)
     case INT64:  return "i64";
     case FLOAT8: return "f8"; 	
     case FLOAT16: return "f16"; 
+    case BFLOAT16: return "bf16";
     case FLOAT32: return "f32"; 
     case FLOAT64: return "f64";
     default: return "??";
@@ -153,6 +159,22 @@ static const char* asm_regname(uint8_t op, uint8_t r)
 	case 13: return "v13";
 	case 14: return "v14";
 	case 15: return "v15";
+	case 16: return "v16";
+	case 17: return "v17";
+	case 18: return "v18";
+	case 19: return "v19";
+	case 20: return "v20";
+	case 21: return "v21";
+	case 22: return "v22";
+	case 23: return "v23";
+	case 24: return "v24";
+	case 25: return "v25";
+	case 26: return "v26";
+	case 27: return "v27";
+	case 28: return "v28";
+	case 29: return "v29";
+	case 30: return "v30";
+	case 31: return "v31";
 	default: return "v?";
 	}
     }
@@ -174,6 +196,22 @@ static const char* asm_regname(uint8_t op, uint8_t r)
 	case 13: return "r13";
 	case 14: return "r14";
 	case 15: return "r15";
+	case 16: return "r16";
+	case 17: return "r17";
+	case 18: return "r18";
+	case 19: return "r19";
+	case 20: return "r20";
+	case 21: return "r21";
+	case 22: return "r22";
+	case 23: return "r23";
+	case 24: return "r24";
+	case 25: return "r25";
+	case 26: return "r26";
+	case 27: return "r27";
+	case 28: return "r28";
+	case 29: return "r29";
+	case 30: return "r30";
+	case 31: return "r31";
 	default: return "r?";
 	}
     }
@@ -184,12 +222,21 @@ void print_instr(FILE* f,instr_t* pc)
     if (pc->op == OP_JMP) {
 	fprintf(f, "%s %d", asm_opname(pc->op), pc->imm12);
     }
-    else if ((pc->op == OP_JNZ) || (pc->op == OP_JZ)) {
+    else if (OP_IS_JUMP(pc->op)) {
 	fprintf(f, "%s.%s %s, %d",
 		asm_opname(pc->op),
 		asm_typename(pc->type),
 		asm_regname(pc->op,pc->rd), pc->imm12);
     }
+    else if (pc->op == OP_VSEL) {
+	fprintf(f, "%s.%s, %s, %s, %s, %s",
+		asm_opname(pc->op),
+		asm_typename(pc->type),
+		asm_regname(pc->op,pc->rd),
+		asm_regname(pc->op,pc->ri),
+		asm_regname(pc->op,pc->rj),
+		asm_regname(pc->op,pc->rk));
+    }
     else if (pc->op & OP_BIN) {
 	if (pc->op & OP_IMM) {
 	    fprintf(f, "%s.%s, %s, %s, %d",
@@ -241,6 +288,69 @@ void print_instr(FILE* f,instr_t* pc)
     }
 }
 
+// print wide instruction, same format as print_instr
+void print_instr64(FILE* f,instr64_t* pc)
+{
+    if (pc->op == OP_JMP) {
+	fprintf(f, "%s %d", asm_opname(pc->op), pc->imm24);
+    }
+    else if (OP_IS_JUMP(pc->op)) {
+	fprintf(f, "%s.%s %s, %d",
+		asm_opname(pc->op),
+		asm_typename(pc->type),
+		asm_regname(pc->op,pc->rd), pc->imm24);
+    }
+    else if (pc->op == OP_VSEL) {
+	fprintf(f, "%s.%s, %s, %s, %s, %s",
+		asm_opname(pc->op),
+		asm_typename(pc->type),
+		asm_regname(pc->op,pc->rd),
+		asm_regname(pc->op,pc->ri),
+		asm_regname(pc->op,pc->rj),
+		asm_regname(pc->op,pc->rk));
+    }
+    else if (pc->op & OP_BIN) {
+	if (pc->op & OP_IMM) {
+	    fprintf(f, "%s.%s, %s, %s, %d",
+		    asm_opname(pc->op),
+		    asm_typename(pc->type),
+		    asm_regname(pc->op,pc->rd),
+		    asm_regname(pc->op,pc->ri),
+		    pc->imm32);
+	}
+	else {
+	    fprintf(f, "%s.%s, %s, %s, %s",
+		    asm_opname(pc->op),
+		    asm_typename(pc->type),
+		    asm_regname(pc->op,pc->rd),
+		    asm_regname(pc->op,pc->ri),
+		    asm_regname(pc->op,pc->rj));
+	}
+    }
+    else if ((pc->op == OP_MOVI)||(pc->op == OP_VMOVI)) {
+	fprintf(f, "%s.%s %s, %d",
+		asm_opname(pc->op),
+		asm_typename(pc->type),
+		asm_regname(pc->op,pc->rd), pc->imm32);
+    }
+    else if ((pc->op & OP_MASK) == OP_NOP) {
+	fprintf(f, "%s", asm_opname(OP_NOP));
+    }
+    else if ((pc->op & OP_MASK) == OP_RET) {
+	fprintf(f, "%s.%s %s",
+		asm_opname(pc->op),
+		asm_typename(pc->type),
+		asm_regname(pc->op,pc->rd));
+    }
+    else {
+	fprintf(f, "%s.%s, %s, %s",
+		asm_opname(pc->op),
+		asm_typename(pc->type),
+		asm_regname(pc->op,pc->rd),
+		asm_regname(pc->op,pc->ri));
+    }
+}
+
 void print_code(FILE* f, instr_t* code, size_t len)
 {
     int i;
@@ -251,6 +361,110 @@ void print_code(FILE* f, instr_t* code, size_t len)
     }
 }
 
+// find instruction covering code offset offs in map[0..n] from
+// assemble_map, -1 = prolog, n = epilog
+int pc_map_lookup(const uint32_t* map, size_t n, uint32_t offs)
+{
+    int lo = 0, hi = n+1;
+
+    if (offs < map[0])
+	return -1;
+    while(lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (map[mid] <= offs)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+    return lo-1;
+}
+
+// register masks as reg_mask in assemble:
+// bit 0-15 vector registers, bit 16-31 scalar registers
+#define VREG_BIT(r) (1 << (r))
+#define SREG_BIT(r) (1 << ((r)+16))
+
+static uint32_t instr_reg_bit(uint8_t op, int r)
+{
+    return (op & OP_VEC) ? VREG_BIT(r) : SREG_BIT(r);
+}
+
+// registers read by instruction
+uint32_t instr_uses(instr_t* p)
+{
+    switch(p->op) {
+    case OP_NOP:
+    case OP_VNOP:
+    case OP_JMP:
+    case OP_MOVI:
+    case OP_VMOVI:
+	return 0;
+    case OP_RET:
+    case OP_VRET:
+    case OP_JNZ:
+    case OP_JZ:
+    case OP_VJANY:
+    case OP_VJALL:
+	return instr_reg_bit(p->op, p->rd);
+    case OP_VSEL:
+	return VREG_BIT(p->ri) | VREG_BIT(p->rj) | VREG_BIT(p->rk);
+    case OP_VSLL:
+    case OP_VSRL:
+    case OP_VSRA:  // shift amount in scalar register
+	return VREG_BIT(p->ri) | SREG_BIT(p->rj);
+    default:
+	break;
+    }
+    if ((p->op & OP_BIN) && !(p->op & OP_IMM))
+	return instr_reg_bit(p->op, p->ri) | instr_reg_bit(p->op, p->rj);
+    return instr_reg_bit(p->op, p->ri);
+}
+
+// registers written by instruction
+uint32_t instr_defs(instr_t* p)
+{
+    if (OP_IS_JUMP(p->op))
+	return 0;
+    switch(p->op) {
+    case OP_NOP:
+    case OP_VNOP:
+    case OP_RET:
+    case OP_VRET:
+	return 0;
+    default:
+	return instr_reg_bit(p->op, p->rd);
+    }
+}
+
+// calculate registers live after each instruction
+void instr_liveness(instr_t* code, size_t n, uint32_t* live_out)
+{
+    int i, changed;
+
+    for (i = 0; i < (int)n; i++)
+	live_out[i] = 0;
+    do {
+	changed = 0;
+	for (i = (int)n-1; i >= 0; i--) {
+	    instr_t* p = &code[i];
+	    uint32_t out = 0;
+	    int k;
+	    if ((p->op == OP_RET) || (p->op == OP_VRET))
+		continue;
+	    if ((p->op != OP_JMP) && ((k = i+1) < (int)n))
+		out |= instr_uses(&code[k]) |
+		    (live_out[k] & ~instr_defs(&code[k]));
+	    if (OP_IS_JUMP(p->op) && ((k = i+1+p->imm12) < (int)n))
+		out |= instr_uses(&code[k]) |
+		    (live_out[k] & ~instr_defs(&code[k]));
+	    if (out != live_out[i]) {
+		live_out[i] = out;
+		changed = 1;
+	    }
+	}
+    } while(changed);
+}
+
 void set_vuint8(vuint8_t &r, int i, uint8_t v) { r[i] = v; }
 void set_vuint16(vuint16_t &r, int i, uint16_t v) { r[i] = v; }
 void set_vuint32(vuint32_t &r, int i, uint32_t v) { r[i] = v; }
@@ -275,6 +489,8 @@ void set_element_uint64(jitter_type_t type, vector_t &r, int i, uint64_t v)
     case INT64: set_vint64((vint64_t&)r, i, (int64_t) v); break;
     case FLOAT32: set_vfloat32((vfloat32_t&)r, i, (float32_t) v); break;
     case FLOAT64: set_vfloat64((vfloat64_t&)r, i, (float64_t) v); break;
+    case FLOAT16: set_vuint16((vuint16_t&)r, i, float32_to_float16((float32_t) v)); break;
+    case BFLOAT16: set_vuint16((vuint16_t&)r, i, float32_to_bfloat16((float32_t) v)); break;
     default: break;
     }
 }
@@ -292,6 +508,8 @@ void set_element_int64(jitter_type_t type, vector_t &r, int i, int64_t v)
     case INT64:   set_vint64((vint64_t&)r,   i, (int64_t) v); break;
     case FLOAT32: set_vfloat32((vfloat32_t&)r, i, (float32_t) v); break;
     case FLOAT64: set_vfloat64((vfloat64_t&)r, i, (float64_t) v); break;
+    case FLOAT16: set_vuint16((vuint16_t&)r, i, float32_to_float16((float32_t) v)); break;
+    case BFLOAT16: set_vuint16((vuint16_t&)r, i, float32_to_bfloat16((float32_t) v)); break;
     default: break;
     }
 }
@@ -309,6 +527,8 @@ void set_element_float64(jitter_type_t type, vector_t &r, int i, float64_t v)
     case INT64: set_vint64((vint64_t&)r, i, (int64_t) v); break;
     case FLOAT32: set_vfloat32((vfloat32_t&)r, i, (float32_t) v); break;
     case FLOAT64: set_vfloat64((vfloat64_t&)r, i, (float64_t) v); break;
+    case FLOAT16: set_vuint16((vuint16_t&)r, i, float32_to_float16((float32_t) v)); break;
+    case BFLOAT16: set_vuint16((vuint16_t&)r, i, float32_to_bfloat16((float32_t) v)); break;
     default: break;
     }
 }
@@ -337,6 +557,8 @@ int64_t get_element_int64(jitter_type_t type, vector_t r, int i)
     case INT64: return   get_vint64((vint64_t)r, i);
     case FLOAT32: return get_vfloat32((vfloat32_t)r, i);
     case FLOAT64: return get_vfloat64((vfloat64_t)r, i);
+    case FLOAT16: return float16_to_float32(get_vuint16((vuint16_t)r, i));
+    case BFLOAT16: return bfloat16_to_float32(get_vuint16((vuint16_t)r, i));
     default: return 0;
     }
 }
@@ -354,6 +576,8 @@ uint64_t get_element_uint64(jitter_type_t type, vector_t r, int i)
     case INT64: return get_vint64((vint64_t)r, i);
     case FLOAT32: return get_vfloat32((vfloat32_t)r, i);
     case FLOAT64: return get_vfloat64((vfloat64_t)r, i);
+    case FLOAT16: return float16_to_float32(get_vuint16((vuint16_t)r, i));
+    case BFLOAT16: return bfloat16_to_float32(get_vuint16((vuint16_t)r, i));
     default: return 0;	
     }
 }
@@ -371,6 +595,8 @@ float64_t get_elemen_float64(jitter_type_t type, vector_t r, int i)
     case INT64: return get_vint64((vint64_t)r, i);
     case FLOAT32: return get_vfloat32((vfloat32_t)r, i);
     case FLOAT64: return get_vfloat64((vfloat64_t)r, i);
+    case FLOAT16: return float16_to_float32(get_vuint16((vuint16_t)r, i));
+    case BFLOAT16: return bfloat16_to_float32(get_vuint16((vuint16_t)r, i));
     default: return 0;
     }
 }
@@ -437,6 +663,24 @@ void print_vfloat64(FILE* f,vfloat64_t r)
 	   r[0], r[1]);
 }
 
+void print_vfloat16(FILE* f,vuint16_t r)
+{
+    fprintf(f,"{%f,%f,%f,%f,%f,%f,%f,%f}",
+	    float16_to_float32(r[0]), float16_to_float32(r[1]),
+	    float16_to_float32(r[2]), float16_to_float32(r[3]),
+	    float16_to_float32(r[4]), float16_to_float32(r[5]),
+	    float16_to_float32(r[6]), float16_to_float32(r[7]));
+}
+
+void print_vbfloat16(FILE* f,vuint16_t r)
+{
+    fprintf(f,"{%f,%f,%f,%f,%f,%f,%f,%f}",
+	    bfloat16_to_float32(r[0]), bfloat16_to_float32(r[1]),
+	    bfloat16_to_float32(r[2]), bfloat16_to_float32(r[3]),
+	    bfloat16_to_float32(r[4]), bfloat16_to_float32(r[5]),
+	    bfloat16_to_float32(r[6]), bfloat16_to_float32(r[7]));
+}
+
 void vprint(FILE* f, uint8_t type, vector_t v)
 {
     switch(type) {
@@ -448,6 +692,8 @@ void vprint(FILE* f, uint8_t type, vector_t v)
     case INT16: print_vint16(f,(vint16_t) v); break;
     case INT32: print_vint32(f,(vint32_t) v); break;
     case INT64: print_vint64(f,(vint64_t) v); break;
+    case FLOAT16: print_vfloat16(f,(vuint16_t) v); break;
+    case BFLOAT16: print_vbfloat16(f,(vuint16_t) v); break;
     case FLOAT32: print_vfloat32(f,(vfloat32_t) v); break;
     case FLOAT64: print_vfloat64(f,(vfloat64_t) v); break;
     default: break;
@@ -466,7 +712,8 @@ void sprint(FILE* f, uint8_t type, scalar0_t v)
     case INT32: fprintf(f, "%d", v.i32); break;
     case INT64: fprintf(f, "%ld", v.i64); break;
     case FLOAT8: fprintf(f, "%u", v.f8);break;
-    case FLOAT16: fprintf(f, "%u", v.f16);break;		
+    case FLOAT16: fprintf(f, "%f", float16_to_float32(v.f16));break;
+    case BFLOAT16: fprintf(f, "%f", bfloat16_to_float32(v.bf16));break;
     case FLOAT32: fprintf(f, "%f", v.f32);break;
     case FLOAT64: fprintf(f, "%f", v.f64);break;
     default: break;
@@ -503,6 +750,8 @@ int vcmp(uint8_t type, vector_t v1, vector_t v2)
     case INT16:  return cmp_vint16((vint16_t) v1, (vint16_t) v2);
     case INT32:  return cmp_vint32((vint32_t) v1, (vint32_t) v2);
     case INT64:  return cmp_vint64((vint64_t) v1, (vint64_t) v2);
+    case FLOAT16:
+    case BFLOAT16: return cmp_vuint16((vuint16_t) v1, (vuint16_t) v2);
     case FLOAT32: return cmp_vfloat32((vfloat32_t) v1, (vfloat32_t) v2);
     case FLOAT64: return cmp_vfloat64((vfloat64_t) v1, (vfloat64_t) v2);
     default: break;
@@ -523,6 +772,8 @@ int scmp(uint8_t type, scalar0_t v1, scalar0_t v2)
     case INT16:  return CMP(v1.i16, v2.i16);
     case INT32:  return CMP(v1.i32, v2.i32);
     case INT64:  return CMP(v1.i64, v2.i64); 
+    case FLOAT16: return CMP(v1.f16, v2.f16);
+    case BFLOAT16: return CMP(v1.bf16, v2.bf16);
     case FLOAT32: return CMP(v1.f32, v2.f32); 
     case FLOAT64: return CMP(v1.f64, v2.f64); 
     default: break;
@@ -0,0 +1,310 @@
+//
+// Wide 64-bit instruction encoding
+//
+// jit_narrow lowers instr64_t code to instr_t. Immediates that do not
+// fit imm8 (alu) or imm12 (movi) are built with movi/slli/bori, in the
+// destination register or in a scratch register not used by the code,
+// and jump offsets are relocated. The x86 backend maps register i to
+// gp/xmm register i and the register file has 16 of each, so code
+// using registers 16-31 is rejected. Jumps that are out of imm12 range
+// after lowering are chained through jump islands, a jmp to the target
+// placed within range and guarded by a jmp over it.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jitter_types.h"
+#include "jitter.h"
+
+// register bits: 0-31 vector registers, 32-63 scalar registers
+#define WREG_V(r) ((uint64_t)1 << (r))
+#define WREG_S(r) ((uint64_t)1 << ((r)+32))
+#define WREG_HIGH 0xffff0000ffff0000ULL
+
+// scratch candidates, not rsp, rdi and not the backend temporaries
+// (R_FREE_MASK/X_FREE_MASK in jitter_asm.h)
+#define WIDE_SCRATCH_R 0x936f
+#define WIDE_SCRATCH_V 0xc7ff
+
+#define FITS_IMM8(v)  (((v) >= -128) && ((v) <= 127))
+#define FITS_IMM12(v) (((v) >= -2048) && ((v) <= 2047))
+
+static int is_vshift(uint8_t op)
+{
+    return (op == OP_VSLL) || (op == OP_VSRL) || (op == OP_VSRA);
+}
+
+static int is_movi(uint8_t op)
+{
+    return (op == OP_MOVI) || (op == OP_VMOVI);
+}
+
+// registers used by p
+static uint64_t wide_regs(instr64_t* p)
+{
+    int vec = (p->op & OP_VEC) != 0;
+#define reg(r) (vec ? WREG_V(r) : WREG_S(r))
+
+    if (p->op == OP_JMP)
+	return 0;
+    else if (OP_IS_JUMP(p->op) || is_movi(p->op))
+	return reg(p->rd);
+    else if (p->op == OP_VSEL)
+	return reg(p->rd) | reg(p->ri) | reg(p->rj) | reg(p->rk);
+    else if (p->op & OP_BIN) {
+	if (p->op & OP_IMM)
+	    return reg(p->rd) | reg(p->ri);
+	else if (is_vshift(p->op))
+	    return reg(p->rd) | reg(p->ri) | WREG_S(p->rj);
+	return reg(p->rd) | reg(p->ri) | reg(p->rj);
+    }
+    else if ((p->op & OP_MASK) == OP_NOP)
+	return 0;
+    else if ((p->op & OP_MASK) == OP_RET)
+	return reg(p->rd);
+    return reg(p->rd) | reg(p->ri);
+#undef reg
+}
+
+static void set_rr(instr_t* q, uint8_t op, uint8_t type, int d, int i, int j, int k)
+{
+    memset(q, 0, sizeof(instr_t));
+    q->op = op;
+    q->type = type;
+    q->rd = d;
+    q->ri = i;
+    q->rj = j;
+    q->rk = k;
+}
+
+static void set_imm8(instr_t* q, uint8_t op, uint8_t type, int d, int i, int imm)
+{
+    memset(q, 0, sizeof(instr_t));
+    q->op = op;
+    q->type = type;
+    q->rd = d;
+    q->ri = i;
+    q->imm8 = imm;
+}
+
+static void set_imm12(instr_t* q, uint8_t op, uint8_t type, int d, int imm)
+{
+    memset(q, 0, sizeof(instr_t));
+    q->op = op;
+    q->type = type;
+    q->rd = d;
+    q->imm12 = imm;
+}
+
+// build constant v in register x, top 11 bits with movi and then
+// 7 bits at the time (bori imm8 is sign extended)
+static int wide_const(instr_t* q, int vec, uint8_t type, int x, int32_t v)
+{
+    int n = 0;
+    int s;
+
+    if (FITS_IMM12(v)) {
+	set_imm12(&q[n++], vec ? OP_VMOVI : OP_MOVI, type, x, v);
+	return n;
+    }
+    set_imm12(&q[n++], vec ? OP_VMOVI : OP_MOVI, type, x, v >> 21);
+    for (s = 14; s >= 0; s -= 7) {
+	set_imm8(&q[n++], vec ? OP_VSLLI : OP_SLLI, type, x, x, 7);
+	if ((v >> s) & 0x7f)
+	    set_imm8(&q[n++], vec ? OP_VBORI : OP_BORI, type, x, x,
+		     (v >> s) & 0x7f);
+    }
+    return n;
+}
+
+static int pick_scratch(uint64_t used, int vec)
+{
+    uint32_t mask = vec ? WIDE_SCRATCH_V : WIDE_SCRATCH_R;
+    int r;
+
+    for (r = 15; r >= 0; r--) {
+	if ((mask & (1 << r)) &&
+	    !(used & (vec ? WREG_V(r) : WREG_S(r))))
+	    return r;
+    }
+    return -1;
+}
+
+// lower p into q[0..WIDE_EXPAND-1], jump offsets are left 0
+// return number of instructions or -1
+static int wide_lower(instr64_t* p, instr_t* q, uint64_t used)
+{
+    int vec = (p->op & OP_VEC) != 0;
+    int is_int = (get_base_type(p->type) <= INT);
+
+    if (OP_IS_JUMP(p->op)) {
+	set_imm12(q, p->op, p->type, p->rd, 0);
+	return 1;
+    }
+    else if (is_movi(p->op)) {
+	if (!FITS_IMM12(p->imm32) && !is_int)
+	    return -1;
+	return wide_const(q, vec, p->type, p->rd, p->imm32);
+    }
+    else if ((p->op & OP_BIN) && (p->op & OP_IMM)) {
+	int op = p->op & ~OP_IMM;
+	int svec = vec && !is_vshift(op);  // class of the register operand
+	int x, n;
+
+	if (FITS_IMM8(p->imm32)) {
+	    set_imm8(q, p->op, p->type, p->rd, p->ri, p->imm32);
+	    return 1;
+	}
+	if (!is_int)
+	    return -1;
+	if ((p->rd != p->ri) && (svec == vec))
+	    x = p->rd;
+	else if ((x = pick_scratch(used, svec)) < 0)
+	    return -1;
+	n = wide_const(q, svec, p->type, x, p->imm32);
+	set_rr(&q[n++], op, p->type, p->rd, p->ri, x, 0);
+	return n;
+    }
+    set_rr(q, p->op, p->type, p->rd, p->ri, p->rj, p->rk);
+    return 1;
+}
+
+// jump islands are placed this far from the jump, leaving room for
+// the code between them to grow by other islands
+#define WIDE_ISLAND 2000
+
+// insert an island before q: jmp over it and jmp to target
+static void wide_island(instr_t* code, int* target, int len, int q, int t,
+			uint8_t type)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+	if (target[i] >= q)
+	    target[i] += 2;
+    }
+    memmove(&code[q+2], &code[q], (len-q)*sizeof(instr_t));
+    memmove(&target[q+2], &target[q], (len-q)*sizeof(int));
+    set_imm12(&code[q], OP_JMP, type, 0, 0);
+    target[q] = q+2;
+    set_imm12(&code[q+1], OP_JMP, type, 0, 0);
+    target[q+1] = (t >= q) ? t+2 : t;
+}
+
+// lower wide code to at most max instructions, return the number of
+// instructions or -1 if the code uses registers 16-31, an immediate
+// that can not be built or does not fit max. With code NULL only the
+// number of instructions is returned.
+int jit_narrow(instr64_t* wcode, size_t n, instr_t* code, size_t max)
+{
+    instr_t tmp[WIDE_EXPAND];
+    int start[n+1];
+    uint64_t used = 0;
+    size_t size = n*WIDE_EXPAND + 1;
+    instr_t* ncode;
+    int* target;
+    size_t i;
+    int len = 0;
+
+    for (i = 0; i < n; i++)
+	used |= wide_regs(&wcode[i]);
+    if (used & WREG_HIGH)
+	return -1;
+
+    ncode = (instr_t*) malloc(size*sizeof(instr_t));
+    target = (int*) malloc(size*sizeof(int));
+    for (i = 0; i < n; i++) {
+	int m, k;
+	start[i] = len;
+	if ((m = wide_lower(&wcode[i], tmp, used)) < 0)
+	    goto error;
+	memcpy(&ncode[len], tmp, m*sizeof(instr_t));
+	for (k = 0; k < m; k++)
+	    target[len+k] = -1;
+	len += m;
+    }
+    start[n] = len;
+
+    for (i = 0; i < n; i++) {
+	if (OP_IS_JUMP(wcode[i].op)) {
+	    int j = (int)(i+1) + wcode[i].imm24;
+	    if ((j < 0) || (j > (int) n))
+		goto error;
+	    target[start[i]] = start[j];
+	}
+    }
+
+    // chain jumps out of range through islands, inserting an island
+    // may put other jumps out of range, so rescan until all fit
+    i = 0;
+    while (i < (size_t) len) {
+	int offs = target[i] - ((int)i+1);
+	int q, t;
+
+	if ((target[i] < 0) || FITS_IMM12(offs)) {
+	    i++;
+	    continue;
+	}
+	if ((size_t)(len + 2) > size) {
+	    size *= 2;
+	    ncode = (instr_t*) realloc(ncode, size*sizeof(instr_t));
+	    target = (int*) realloc(target, size*sizeof(int));
+	}
+	t = target[i];
+	q = (offs > 0) ? (int)i + WIDE_ISLAND : (int)i - WIDE_ISLAND;
+	wide_island(ncode, target, len, q, t, ncode[i].type);
+	len += 2;
+	if (offs > 0)
+	    target[i] = q+1;
+	else
+	    target[i+2] = q+1;
+	i = 0;
+    }
+
+    if (code != NULL) {
+	if ((size_t) len > max)
+	    goto error;
+	for (i = 0; i < (size_t) len; i++) {
+	    code[i] = ncode[i];
+	    if (target[i] >= 0)
+		code[i].imm12 = target[i] - ((int)i+1);
+	}
+    }
+    free(ncode);
+    free(target);
+    return len;
+error:
+    free(ncode);
+    free(target);
+    return -1;
+}
+
+// convert instr_t code to the wide encoding
+void jit_widen(instr_t* code, size_t n, instr64_t* wcode)
+{
+    size_t i;
+
+    memset(wcode, 0, n*sizeof(instr64_t));
+    for (i = 0; i < n; i++) {
+	instr_t* p = &code[i];
+	instr64_t* q = &wcode[i];
+
+	q->op = p->op;
+	q->type = p->type;
+	q->rd = p->rd;
+	if (OP_IS_JUMP(p->op))
+	    q->imm24 = p->imm12;
+	else if (is_movi(p->op))
+	    q->imm32 = p->imm12;
+	else if (p->op & OP_IMM) {
+	    q->ri = p->ri;
+	    q->imm32 = p->imm8;
+	}
+	else {
+	    q->ri = p->ri;
+	    q->rj = p->rj;
+	    q->rk = p->rk;
+	}
+    }
+}
@@ -1,6 +1,7 @@
 #include <asmjit/x86.h>
 #include <iostream>
 #include <assert.h>
+#include <atomic>
 
 using namespace asmjit;
 
@@ -19,6 +20,12 @@ using namespace asmjit;
 #define CMP_GT    6
 #define CMP_ORD   7
 
+extern void instr_liveness(instr_t* code, size_t n, uint32_t* live_out);
+extern uint32_t instr_uses(instr_t* p);
+extern uint32_t instr_defs(instr_t* p);
+extern const char* asm_opname(uint8_t op);
+extern int jit_narrow(instr64_t* wcode, size_t n, instr_t* code, size_t max);
+
 // xreg/reg to id
 static int regno(x86::Reg reg)
 {
@@ -61,12 +68,21 @@ void crash(const char* filename, int line, int code)
     assert(0);
 }
 
+// when free registers run out a register not used by the current
+// instruction is saved in the spill area and restored on release
 x86::Xmm alloc_xmm(ZAssembler &a)
 {
     int r;
     if ((r = a.xreg_alloc()) >= 0) {
 	x86::Xmm xr = xreg(r);
 	a.add_dirty_reg(xr);
+	a.xmm_used(1);
+	return xr;
+    }
+    if ((r = a.xreg_spill()) >= 0) {
+	x86::Xmm xr = xreg(r);
+	a.movdqu(a.xreg_spill_mem(r), xr);
+	a.xmm_used(1);
 	return xr;
     }
     crash(__FILE__, __LINE__, -1);
@@ -76,7 +92,13 @@ x86::Xmm alloc_xmm(ZAssembler &a)
 void release_xmm(ZAssembler &a, x86::Xmm rr)
 {
     int r = regno(rr);
-    a.xreg_release(r);
+    a.xmm_used(-1);
+    if (a.xreg_spill_slot(r) >= 0) {
+	a.movdqu(rr, a.xreg_spill_mem(r));
+	a.xreg_unspill(r);
+    }
+    else
+	a.xreg_release(r);
 }
 
 x86::Gp alloc_gp(ZAssembler &a)
@@ -85,6 +107,13 @@ x86::Gp alloc_gp(ZAssembler &a)
     if ((r = a.reg_alloc()) >= 0) {
 	x86::Gp rr = reg(r);
 	a.add_dirty_reg(rr);
+	a.gp_used(1);
+	return rr;
+    }
+    if ((r = a.reg_spill()) >= 0) {
+	x86::Gp rr = reg(r);
+	a.mov(a.reg_spill_mem(r), rr);
+	a.gp_used(1);
 	return rr;
     }
     crash(__FILE__, __LINE__, -1);
@@ -94,7 +123,13 @@ x86::Gp alloc_gp(ZAssembler &a)
 void release_gp(ZAssembler &a, x86::Gp rr)
 {
     int r = regno(rr);
-    a.reg_release(r);
+    a.gp_used(-1);
+    if (a.reg_spill_slot(r) >= 0) {
+	a.mov(rr, a.reg_spill_mem(r));
+	a.reg_unspill(r);
+    }
+    else
+	a.reg_release(r);
 }
     
 static void emit_save(ZAssembler &a)
@@ -2416,13 +2451,432 @@ static void emit_vcmplei(ZAssembler &a, uint8_t type,
     release_xmm(a, t0);        
 }
 
+static void emit_vsel_avx(ZAssembler &a, uint8_t type,
+			  int dst, int mask, int src1, int src2)
+{
+    x86::Xmm t0 = alloc_xmm(a);
+    (void) type;
+    a.vpand(t0, xreg(mask), SRC1);
+    a.vpandn(DST, xreg(mask), SRC2);
+    a.vpor(DST, DST, t0);
+    release_xmm(a, t0);
+}
+
+static void emit_vsel_sse2(ZAssembler &a, uint8_t type,
+			   int dst, int mask, int src1, int src2)
+{
+    x86::Xmm t0 = alloc_xmm(a);
+    x86::Xmm t1 = alloc_xmm(a);
+    (void) type;
+    a.movdqa(t0, xreg(mask));
+    a.pand(t0, SRC1);
+    a.movdqa(t1, xreg(mask));
+    a.pandn(t1, SRC2);
+    a.por(t0, t1);
+    a.movdqa(DST, t0);
+    release_xmm(a, t1);
+    release_xmm(a, t0);
+}
+
+// dst = (src1 & mask) | (src2 & ~mask), bitwise like the emulator, not
+// blendv that selects on the sign bit of each lane
+static void emit_vsel(ZAssembler &a, uint8_t type,
+		      int dst, int mask, int src1, int src2)
+{
+    if (a.use_avx())
+	emit_vsel_avx(a, type, dst, mask, src1, src2);
+    else if (a.use_sse2())
+	emit_vsel_sse2(a, type, dst, mask, src1, src2);
+    else
+	crash(__FILE__, __LINE__, type);
+}
+
+// FLOAT16 lanes (lower half) => FLOAT32 lanes, no F16C
+// zero extend halfs then scale exponent with a multiply, fixup inf/nan
+static void emit_vcvt_f16_sse2(ZAssembler &a, int dst, int src)
+{
+    x86::Xmm t0 = alloc_xmm(a);
+    x86::Xmm t1 = alloc_xmm(a);
+    x86::Xmm t2 = alloc_xmm(a);
+
+    a.pxor(t0, t0);
+    a.movdqa(t1, SRC);
+    a.punpcklwd(t1, t0);                    // t1 = h
+    a.movdqa(t2, t1);
+    a.pand(t2, a.add_vuint32(0x7fff));      // t2 = exp|mant
+    a.pxor(t1, t2);
+    a.pslld(t1, 16);                        // t1 = sign
+    a.movdqa(t0, t2);
+    a.pslld(t0, 13);
+    a.mulps(t0, a.add_vuint32(0x77800000)); // 2^112
+    a.por(t1, t0);
+    a.movdqa(t0, t2);
+    a.pcmpgtd(t0, a.add_vuint32(0x7bff));   // inf or nan
+    a.pand(t0, a.add_vuint32(0x7f800000));
+    a.por(t1, t0);
+    a.pcmpgtd(t2, a.add_vuint32(0x7c00));   // nan => quiet
+    a.pand(t2, a.add_vuint32(0x00400000));
+    a.por(t1, t2);
+    a.movdqa(DST, t1);
+    
+    release_xmm(a, t2);
+    release_xmm(a, t1);
+    release_xmm(a, t0);
+}
+
+// FLOAT32 lanes => FLOAT16 lanes (lower half), no F16C
+// round to nearest even, same result as vcvtps2ph imm=0
+static void emit_vcvtn_f16_sse2(ZAssembler &a, int dst, int src)
+{
+    x86::Xmm t0 = alloc_xmm(a);
+    x86::Xmm t1 = alloc_xmm(a);
+    x86::Xmm t2 = alloc_xmm(a);
+    x86::Mem abs_mask = a.add_vuint32(0x7fffffff);
+    x86::Mem magic = a.add_vuint32(0x3f000000);
+
+    a.movdqa(t0, SRC);                      // t0 = f, src may be dst
+    // normal result
+    a.movdqa(DST, t0);
+    a.pand(DST, abs_mask);
+    a.movdqa(t1, DST);
+    a.pslld(t1, 18);
+    a.psrad(t1, 31);                        // -1 when result mantissa is odd
+    a.paddd(DST, a.add_vuint32(0xc8000fff));
+    a.psubd(DST, t1);
+    a.psrld(DST, 13);
+    // subnormal result
+    a.movdqa(t1, t0);
+    a.pand(t1, abs_mask);
+    a.addps(t1, magic);
+    a.psubd(t1, magic);
+    // select on abs(f) >= 2^-14
+    a.movdqa(t2, t0);
+    a.pand(t2, abs_mask);
+    a.pcmpgtd(t2, a.add_vuint32(0x387fffff));
+    a.pand(DST, t2);
+    a.pandn(t2, t1);
+    a.por(DST, t2);
+    // inf or nan result
+    a.movdqa(t1, t0);
+    a.cmpps(t1, t1, CMP_UNORD);
+    a.movdqa(t2, t0);
+    a.psrld(t2, 13);
+    a.pand(t2, a.add_vuint32(0x3ff));
+    a.por(t2, a.add_vuint32(0x200));
+    a.pand(t2, t1);
+    a.por(t2, a.add_vuint32(0x7c00));
+    // select on abs(f) >= 65520
+    a.movdqa(t1, t0);
+    a.pand(t1, abs_mask);
+    a.pcmpgtd(t1, a.add_vuint32(0x477fefff));
+    a.pand(t2, t1);
+    a.pandn(t1, DST);
+    a.por(t1, t2);
+    // add sign as 0xffff8000 and pack
+    a.psrad(t0, 31);
+    a.pslld(t0, 15);
+    a.por(t1, t0);
+    a.packssdw(t1, t1);
+    a.movq(DST, t1);
+
+    release_xmm(a, t2);
+    release_xmm(a, t1);
+    release_xmm(a, t0);
+}
+
+// BFLOAT16 lanes (lower half) => FLOAT32 lanes
+static void emit_vcvt_bf16_sse2(ZAssembler &a, int dst, int src)
+{
+    x86::Xmm t0 = alloc_xmm(a);
+
+    a.pxor(t0, t0);
+    a.punpcklwd(t0, SRC);
+    a.movdqa(DST, t0);
+    release_xmm(a, t0);
+}
+
+// FLOAT32 lanes => BFLOAT16 lanes (lower half), round to nearest even
+static void emit_vcvtn_bf16_sse2(ZAssembler &a, int dst, int src)
+{
+    x86::Xmm t0 = alloc_xmm(a);
+    x86::Xmm t1 = alloc_xmm(a);
+
+    a.movdqa(t0, SRC);
+    a.psrld(t0, 16);
+    a.pand(t0, a.add_vuint32(1));
+    a.paddd(t0, a.add_vuint32(0x7fff));
+    a.paddd(t0, SRC);
+    a.psrld(t0, 16);
+    a.movdqa(t1, SRC);
+    a.cmpps(t1, t1, CMP_UNORD);
+    a.movdqa(DST, t1);
+    a.pand(DST, a.add_vuint32(0x7fc0));
+    a.pandn(t1, t0);
+    a.por(t1, DST);
+    a.pslld(t1, 16);
+    a.psrad(t1, 16);
+    a.packssdw(t1, t1);
+    a.movq(DST, t1);
+
+    release_xmm(a, t1);
+    release_xmm(a, t0);
+}
+
+// convert FLOAT16/BFLOAT16 lanes to FLOAT32
+static void emit_vcvt(ZAssembler &a, uint8_t type, int dst, int src)
+{
+    switch(type) {
+    case FLOAT16:
+	if (a.use_f16c())
+	    a.vcvtph2ps(DST, SRC);
+	else if (a.use_sse2())
+	    emit_vcvt_f16_sse2(a, dst, src);
+	else
+	    crash(__FILE__, __LINE__, type);
+	break;
+    case BFLOAT16:
+	if (a.use_sse2())
+	    emit_vcvt_bf16_sse2(a, dst, src);
+	else
+	    crash(__FILE__, __LINE__, type);
+	break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+// convert FLOAT32 lanes to FLOAT16/BFLOAT16
+static void emit_vcvtn(ZAssembler &a, uint8_t type, int dst, int src)
+{
+    switch(type) {
+    case FLOAT16:
+	if (a.use_f16c())
+	    a.vcvtps2ph(DST, SRC, 0);
+	else if (a.use_sse2())
+	    emit_vcvtn_f16_sse2(a, dst, src);
+	else
+	    crash(__FILE__, __LINE__, type);
+	break;
+    case BFLOAT16:
+	if (a.use_sse2())
+	    emit_vcvtn_bf16_sse2(a, dst, src);
+	else
+	    crash(__FILE__, __LINE__, type);
+	break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+// jump if src != 0, float nan is not zero
+static void emit_jnz(ZAssembler &a, uint8_t type, int src, Label lbl)
+{
+    switch(type) {
+    case INT8:
+    case UINT8:	 a.cmp(reg(src).r8(), 0); break;
+    case INT16:
+    case UINT16: a.cmp(reg(src).r16(), 0); break;
+    case INT32:	    
+    case UINT32: a.cmp(reg(src).r32(), 0); break;
+    case INT64:	    
+    case UINT64: a.cmp(reg(src).r64(), 0); break;
+    case FLOAT16: a.test(reg(src).r16(), 0x7fff); break;
+    case FLOAT32:
+    case FLOAT64: {
+	x86::Xmm t0 = alloc_xmm(a);
+	a.xorps(t0, t0);
+	if (type == FLOAT32)
+	    a.ucomiss(SRC, t0);
+	else
+	    a.ucomisd(SRC, t0);
+	release_xmm(a, t0);  // before the jumps, a spill restore keeps flags
+	a.jp(lbl);  // unordered
+	break;
+    }
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+    a.jnz(lbl);
+}
+
+// jump if src == 0, float -0.0 is zero
+static void emit_jz(ZAssembler &a, uint8_t type, int src, Label lbl)
+{
+    switch(type) {
+    case INT8:
+    case UINT8:	 a.cmp(reg(src).r8(), 0); break;
+    case INT16:
+    case UINT16: a.cmp(reg(src).r16(), 0); break;
+    case INT32:	    
+    case UINT32: a.cmp(reg(src).r32(), 0); break;
+    case INT64:	    
+    case UINT64: a.cmp(reg(src).r64(), 0); break;
+    case FLOAT16: a.test(reg(src).r16(), 0x7fff); break;
+    case FLOAT32:
+    case FLOAT64: {
+	x86::Xmm t0 = alloc_xmm(a);
+	Label skip = a.newLabel();
+	a.xorps(t0, t0);
+	if (type == FLOAT32)
+	    a.ucomiss(SRC, t0);
+	else
+	    a.ucomisd(SRC, t0);
+	release_xmm(a, t0);  // before the jumps, a spill restore keeps flags
+	a.jp(skip);  // unordered
+	a.jz(lbl);
+	a.bind(skip);
+	return;
+    }
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+    a.jz(lbl);
+}
+
+// jump if any lane is non zero (any bit is set)
+static void emit_vjany(ZAssembler &a, uint8_t type, int src, Label lbl)
+{
+    if (a.use_avx())
+	a.vptest(SRC, SRC);
+    else if (a.use_sse4_1())
+	a.ptest(SRC, SRC);
+    else if (a.use_sse2()) {
+	x86::Xmm t0 = alloc_xmm(a);
+	x86::Gp t1 = alloc_gp(a);
+	a.pxor(t0, t0);
+	a.pcmpeqb(t0, SRC);
+	a.pmovmskb(t1.r32(), t0);
+	a.cmp(t1.r32(), 0xffff);
+	release_gp(a, t1);
+	release_xmm(a, t0);
+    }
+    else
+	crash(__FILE__, __LINE__, type);
+    a.jnz(lbl);
+}
+
+// jump if all lanes are non zero, that is no lane is equal to zero
+static void emit_vjall(ZAssembler &a, uint8_t type, int src, Label lbl)
+{
+    x86::Xmm t0 = alloc_xmm(a);
+
+    if (!a.use_sse2())
+	crash(__FILE__, __LINE__, type);
+    a.pxor(t0, t0);
+    switch(type) {  // t0 = lanes equal to zero
+    case INT8:
+    case UINT8:    a.pcmpeqb(t0, SRC); break;
+    case INT16:
+    case UINT16:
+    case FLOAT16:
+    case BFLOAT16: a.pcmpeqw(t0, SRC); break;
+    case INT32:
+    case UINT32:
+    case FLOAT32:  a.pcmpeqd(t0, SRC); break;
+    case INT64:
+    case UINT64:
+    case FLOAT64:
+	if (a.use_sse4_1())
+	    a.pcmpeqq(t0, SRC);
+	else {
+	    x86::Xmm t1 = alloc_xmm(a);
+	    a.pcmpeqd(t0, SRC);
+	    a.pshufd(t1, t0, 0xb1);  // swap low/high dword
+	    a.pand(t0, t1);
+	    release_xmm(a, t1);
+	}
+	break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+    if (a.use_sse4_1())
+	a.ptest(t0, t0);
+    else {
+	x86::Gp t1 = alloc_gp(a);
+	a.pmovmskb(t1.r32(), t0);
+	a.test(t1.r32(), t1.r32());
+	release_gp(a, t1);
+    }
+    release_xmm(a, t0);
+    a.jz(lbl);
+}
+
+// condition code matching cmp operation or -1
+static int cmp_code(uint8_t op)
+{
+    switch(op & ~OP_IMM) {
+    case OP_CMPEQ: return CMP_EQ;
+    case OP_CMPNE: return CMP_NEQ;
+    case OP_CMPLT: return CMP_LT;
+    case OP_CMPLE: return CMP_LE;
+    case OP_CMPGT: return CMP_GT;
+    case OP_CMPGE: return CMP_GE;
+    default: return -1;
+    }
+}
+
+static int cmp_negate(int cmp)
+{
+    switch(cmp) {
+    case CMP_EQ: return CMP_NEQ;
+    case CMP_NEQ: return CMP_EQ;
+    case CMP_LT: return CMP_GE;
+    case CMP_GE: return CMP_LT;
+    case CMP_LE: return CMP_GT;
+    case CMP_GT: return CMP_LE;
+    default: crash(__FILE__, __LINE__, cmp); return cmp;
+    }
+}
+
+// jump to lbl if condition code (matching cmp) is set
+static void emit_jcc(ZAssembler &a, int cmp, uint8_t type, Label lbl)
+{
+    int uns = (get_base_type(type) == UINT);
+    switch(cmp) {
+    case CMP_EQ: a.je(lbl); break;
+    case CMP_NEQ: a.jne(lbl); break;
+    case CMP_LT: if (uns) a.jb(lbl); else a.jl(lbl); break;
+    case CMP_LE: if (uns) a.jbe(lbl); else a.jle(lbl); break;
+    case CMP_GT: if (uns) a.ja(lbl); else a.jg(lbl); break;
+    case CMP_GE: if (uns) a.jae(lbl); else a.jge(lbl); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
+// integer compare followed by jnz/jz on the compare result, where
+// the result is not used after the jump
+static int is_cmp_jump(instr_t* p, uint32_t live_out)
+{
+    instr_t* q = p+1;
+    if ((cmp_code(p->op) < 0) || (p->op & OP_VEC))
+	return 0;
+    if ((q->op != OP_JNZ) && (q->op != OP_JZ))
+	return 0;
+    if ((q->rd != p->rd) || (live_out & (1 << (p->rd+16))))
+	return 0;
+    if ((get_base_type(p->type) != INT) && (get_base_type(p->type) != UINT))
+	return 0;
+    if ((get_base_type(q->type) != INT) && (get_base_type(q->type) != UINT))
+	return 0;
+    if (get_scalar_size(p->type) != get_scalar_size(q->type))
+	return 0;
+    return 1;
+}
+
+// emit cmp + jcc for compare p and jump p+1
+static void emit_cmp_jump(ZAssembler &a, instr_t* p, Label lbl)
+{
+    int cmp = cmp_code(p->op);
+    if (p->op & OP_IMM)
+	emit_cmpi(a, p->type, p->ri, p->imm8);
+    else
+	emit_cmp(a, p->type, p->ri, p->rj);
+    if (p[1].op == OP_JZ)
+	cmp = cmp_negate(cmp);
+    emit_jcc(a, cmp, p->type, lbl);
+}
+
 // Helper function to generate instructions based on type and operation
-void emit_instruction(ZAssembler &a, instr_t* p, uint32_t reg_mask, x86::Gp rfp)
+static void emit_instruction_switch(ZAssembler &a, instr_t* p,
+				    uint32_t reg_mask, x86::Gp rfp)
 {
     int i;
 
-    a.reg_alloc_reset();  // reset allocation for every instruction
-    
     switch(p->op) {
     case OP_NOP: a.nop(); break;
     case OP_VNOP: a.nop(); break;
@@ -2450,6 +2904,9 @@ void emit_instruction(ZAssembler &a, instr_t* p, uint32_t reg_mask, x86::Gp rfp)
 
     case OP_BNOT: emit_bnot(a, p->type, p->rd, p->ri); break;
     case OP_VBNOT: emit_vbnot(a, p->type, p->rd, p->ri); break;		
+
+    case OP_VCVT: emit_vcvt(a, p->type, p->rd, p->ri); break;
+    case OP_VCVTN: emit_vcvtn(a, p->type, p->rd, p->ri); break;
 	
     case OP_ADD: emit_add(a, p->type, p->rd, p->ri, p->rj); break;
     case OP_ADDI: emit_addi(a, p->type, p->rd, p->ri, p->imm8); break;
@@ -2535,20 +2992,355 @@ void emit_instruction(ZAssembler &a, instr_t* p, uint32_t reg_mask, x86::Gp rfp)
     case OP_CMPNEI: emit_cmpnei(a, p->type, p->rd, p->ri, p->imm8); break;
     case OP_VCMPNE: emit_vcmpne(a,p->type,p->rd,p->ri,p->rj); break;
     case OP_VCMPNEI: emit_vcmpnei(a, p->type, p->rd, p->ri, p->imm8); break;	
+
+    case OP_VSEL: emit_vsel(a, p->type, p->rd, p->ri, p->rj, p->rk); break;
 	
     default: crash(__FILE__, __LINE__, p->type); break;
     }
 }
 
+// Emitter tables, one function per (op,type) with the vector isa
+// choice (avx/sse4.1/sse2/f16c) resolved when the table is built.
+// Tables are shared by all assemblers with the same features.
+
+typedef void (*emit_fn_t)(ZAssembler &a, instr_t* p,
+			  uint32_t reg_mask, x86::Gp rfp);
+
+typedef struct {
+    emit_fn_t fn[256][NUM_TYPES];
+} emit_table_t;
+
+#define EMIT_DI(f)							\
+    static void op_##f(ZAssembler &a, instr_t* p, uint32_t, x86::Gp) \
+    { f(a, p->type, p->rd, p->ri); }
+#define EMIT_DIJ(f)							\
+    static void op_##f(ZAssembler &a, instr_t* p, uint32_t, x86::Gp) \
+    { f(a, p->type, p->rd, p->ri, p->rj); }
+#define EMIT_DIJK(f)							\
+    static void op_##f(ZAssembler &a, instr_t* p, uint32_t, x86::Gp) \
+    { f(a, p->type, p->rd, p->ri, p->rj, p->rk); }
+#define EMIT_DIIMM8(f)							\
+    static void op_##f(ZAssembler &a, instr_t* p, uint32_t, x86::Gp) \
+    { f(a, p->type, p->rd, p->ri, p->imm8); }
+#define EMIT_DIMM12(f)							\
+    static void op_##f(ZAssembler &a, instr_t* p, uint32_t, x86::Gp) \
+    { f(a, p->type, p->rd, p->imm12); }
+
+// dispatch on op and isa in emit_instruction_switch
+static void op_switch(ZAssembler &a, instr_t* p, uint32_t reg_mask, x86::Gp rfp)
+{
+    emit_instruction_switch(a, p, reg_mask, rfp);
+}
+
+static void op_nop(ZAssembler &a, instr_t* p, uint32_t, x86::Gp)
+{
+    (void) p;
+    a.nop();
+}
+
+static void op_vcvtph2ps(ZAssembler &a, instr_t* p, uint32_t, x86::Gp)
+{
+    a.vcvtph2ps(xreg(p->rd), xreg(p->ri));
+}
+
+static void op_vcvtps2ph(ZAssembler &a, instr_t* p, uint32_t, x86::Gp)
+{
+    a.vcvtps2ph(xreg(p->rd), xreg(p->ri), 0);
+}
+
+static void op_vcvt_f16_sse2(ZAssembler &a, instr_t* p, uint32_t, x86::Gp)
+{
+    emit_vcvt_f16_sse2(a, p->rd, p->ri);
+}
+
+static void op_vcvtn_f16_sse2(ZAssembler &a, instr_t* p, uint32_t, x86::Gp)
+{
+    emit_vcvtn_f16_sse2(a, p->rd, p->ri);
+}
+
+static void op_vcvt_bf16_sse2(ZAssembler &a, instr_t* p, uint32_t, x86::Gp)
+{
+    emit_vcvt_bf16_sse2(a, p->rd, p->ri);
+}
+
+static void op_vcvtn_bf16_sse2(ZAssembler &a, instr_t* p, uint32_t, x86::Gp)
+{
+    emit_vcvtn_bf16_sse2(a, p->rd, p->ri);
+}
+
+EMIT_DI(emit_movr)
+EMIT_DIMM12(emit_movi)
+EMIT_DI(emit_vmov)
+EMIT_DIMM12(emit_vmovi)
+EMIT_DI(emit_neg)
+EMIT_DI(emit_vneg_avx)
+EMIT_DI(emit_vneg_sse2)
+EMIT_DI(emit_bnot)
+EMIT_DI(emit_vbnot)
+EMIT_DIJ(emit_add)
+EMIT_DIIMM8(emit_addi)
+EMIT_DIJ(emit_vadd_avx)
+EMIT_DIJ(emit_vadd_sse2)
+EMIT_DIIMM8(emit_vaddi)
+EMIT_DIJ(emit_sub)
+EMIT_DIIMM8(emit_subi)
+EMIT_DIJ(emit_vsub_avx)
+EMIT_DIJ(emit_vsub_sse2)
+EMIT_DIIMM8(emit_vsubi)
+EMIT_DIJ(emit_rsub)
+EMIT_DIIMM8(emit_rsubi)
+EMIT_DIJ(emit_vrsub)
+EMIT_DIIMM8(emit_vrsubi)
+EMIT_DIJ(emit_mul)
+EMIT_DIIMM8(emit_muli)
+EMIT_DIJ(emit_vmul_avx)
+EMIT_DIJ(emit_vmul_sse2)
+EMIT_DIIMM8(emit_vmuli)
+EMIT_DIJ(emit_sll)
+EMIT_DIIMM8(emit_slli)
+EMIT_DIJ(emit_vsll_avx)
+EMIT_DIJ(emit_vsll_sse2)
+EMIT_DIIMM8(emit_vslli_avx)
+EMIT_DIIMM8(emit_vslli_sse2)
+EMIT_DIJ(emit_srl)
+EMIT_DIIMM8(emit_srli)
+EMIT_DIJ(emit_vsrl)
+EMIT_DIIMM8(emit_vsrli)
+EMIT_DIJ(emit_sra)
+EMIT_DIIMM8(emit_srai)
+EMIT_DIJ(emit_vsra)
+EMIT_DIIMM8(emit_vsrai)
+EMIT_DIJ(emit_band)
+EMIT_DIIMM8(emit_bandi)
+EMIT_DIJ(emit_vband_avx)
+EMIT_DIJ(emit_vband_sse2)
+EMIT_DIIMM8(emit_vbandi)
+EMIT_DIJ(emit_bandn)
+EMIT_DIIMM8(emit_bandni)
+EMIT_DIJ(emit_vbandn)
+EMIT_DIIMM8(emit_vbandni)
+EMIT_DIJ(emit_bor)
+EMIT_DIIMM8(emit_bori)
+EMIT_DIJ(emit_vbor_avx)
+EMIT_DIJ(emit_vbor_sse2)
+EMIT_DIIMM8(emit_vbori)
+EMIT_DIJ(emit_bxor)
+EMIT_DIIMM8(emit_bxori)
+EMIT_DIJ(emit_vbxor_avx)
+EMIT_DIJ(emit_vbxor_sse2)
+EMIT_DIIMM8(emit_vbxori)
+EMIT_DIJ(emit_cmplt)
+EMIT_DIIMM8(emit_cmplti)
+EMIT_DIJ(emit_vcmplt)
+EMIT_DIIMM8(emit_vcmplti)
+EMIT_DIJ(emit_cmple)
+EMIT_DIIMM8(emit_cmplei)
+EMIT_DIJ(emit_vcmple)
+EMIT_DIIMM8(emit_vcmplei)
+EMIT_DIJ(emit_cmpeq)
+EMIT_DIIMM8(emit_cmpeqi)
+EMIT_DIJ(emit_vcmpeq)
+EMIT_DIIMM8(emit_vcmpeqi)
+EMIT_DIJ(emit_cmpgt)
+EMIT_DIIMM8(emit_cmpgti)
+EMIT_DIJ(emit_vcmpgt)
+EMIT_DIIMM8(emit_vcmpgti)
+EMIT_DIJ(emit_cmpge)
+EMIT_DIIMM8(emit_cmpgei)
+EMIT_DIJ(emit_vcmpge)
+EMIT_DIIMM8(emit_vcmpgei)
+EMIT_DIJ(emit_cmpne)
+EMIT_DIIMM8(emit_cmpnei)
+EMIT_DIJ(emit_vcmpne)
+EMIT_DIIMM8(emit_vcmpnei)
+EMIT_DIJK(emit_vsel_avx)
+EMIT_DIJK(emit_vsel_sse2)
+
+// element types with emitters, other types crash
+static const uint8_t emit_types[] = {
+    UINT8, UINT16, UINT32, UINT64, INT8, INT16, INT32, INT64,
+    FLOAT16, BFLOAT16, FLOAT32, FLOAT64
+};
+
+#define NUM_EMIT_TYPES (sizeof(emit_types)/sizeof(emit_types[0]))
+
+static void emit_table_op(emit_table_t* t, uint8_t op, emit_fn_t fn)
+{
+    size_t i;
+    for (i = 0; i < NUM_EMIT_TYPES; i++)
+	t->fn[op][emit_types[i]] = fn;
+}
+
+static emit_table_t* emit_table_new(unsigned vec)
+{
+    emit_table_t* t = (emit_table_t*) calloc(1, sizeof(emit_table_t));
+    int avx = (vec & VEC_TYPE_AVX) != 0;
+    int sse2 = (vec & VEC_TYPE_SSE2) != 0;
+    int f16c = (vec & VEC_TYPE_F16C) != 0;
+
+#define VSEL3(avx_fn, sse2_fn, fn) \
+    (avx ? (avx_fn) : (sse2 ? (sse2_fn) : (fn)))
+
+    emit_table_op(t, OP_NOP, op_nop);
+    emit_table_op(t, OP_VNOP, op_nop);
+    emit_table_op(t, OP_RET, op_switch);
+    emit_table_op(t, OP_VRET, op_switch);
+    emit_table_op(t, OP_MOV, op_emit_movr);
+    emit_table_op(t, OP_MOVI, op_emit_movi);
+    emit_table_op(t, OP_VMOV, op_emit_vmov);
+    emit_table_op(t, OP_VMOVI, op_emit_vmovi);
+    emit_table_op(t, OP_NEG, op_emit_neg);
+    emit_table_op(t, OP_VNEG,
+		  VSEL3(op_emit_vneg_avx, op_emit_vneg_sse2, op_emit_neg));
+    emit_table_op(t, OP_BNOT, op_emit_bnot);
+    emit_table_op(t, OP_VBNOT, op_emit_vbnot);
+
+    // type selects the conversion
+    t->fn[OP_VCVT][FLOAT16] =
+	f16c ? op_vcvtph2ps : (sse2 ? op_vcvt_f16_sse2 : NULL);
+    t->fn[OP_VCVT][BFLOAT16] = sse2 ? op_vcvt_bf16_sse2 : NULL;
+    t->fn[OP_VCVTN][FLOAT16] =
+	f16c ? op_vcvtps2ph : (sse2 ? op_vcvtn_f16_sse2 : NULL);
+    t->fn[OP_VCVTN][BFLOAT16] = sse2 ? op_vcvtn_bf16_sse2 : NULL;
+
+    emit_table_op(t, OP_ADD, op_emit_add);
+    emit_table_op(t, OP_ADDI, op_emit_addi);
+    emit_table_op(t, OP_VADD,
+		  VSEL3(op_emit_vadd_avx, op_emit_vadd_sse2, op_emit_add));
+    emit_table_op(t, OP_VADDI, op_emit_vaddi);
+    emit_table_op(t, OP_SUB, op_emit_sub);
+    emit_table_op(t, OP_SUBI, op_emit_subi);
+    emit_table_op(t, OP_VSUB,
+		  VSEL3(op_emit_vsub_avx, op_emit_vsub_sse2, op_emit_sub));
+    emit_table_op(t, OP_VSUBI, op_emit_vsubi);
+    emit_table_op(t, OP_RSUB, op_emit_rsub);
+    emit_table_op(t, OP_RSUBI, op_emit_rsubi);
+    emit_table_op(t, OP_VRSUB, op_emit_vrsub);
+    emit_table_op(t, OP_VRSUBI, op_emit_vrsubi);
+    emit_table_op(t, OP_MUL, op_emit_mul);
+    emit_table_op(t, OP_MULI, op_emit_muli);
+    emit_table_op(t, OP_VMUL,
+		  VSEL3(op_emit_vmul_avx, op_emit_vmul_sse2, op_emit_mul));
+    emit_table_op(t, OP_VMULI, op_emit_vmuli);
+    emit_table_op(t, OP_SLL, op_emit_sll);
+    emit_table_op(t, OP_SLLI, op_emit_slli);
+    emit_table_op(t, OP_VSLL,
+		  VSEL3(op_emit_vsll_avx, op_emit_vsll_sse2, op_emit_sll));
+    emit_table_op(t, OP_VSLLI,
+		  VSEL3(op_emit_vslli_avx, op_emit_vslli_sse2, op_emit_slli));
+    emit_table_op(t, OP_SRL, op_emit_srl);
+    emit_table_op(t, OP_SRLI, op_emit_srli);
+    emit_table_op(t, OP_VSRL, op_emit_vsrl);
+    emit_table_op(t, OP_VSRLI, op_emit_vsrli);
+    emit_table_op(t, OP_SRA, op_emit_sra);
+    emit_table_op(t, OP_SRAI, op_emit_srai);
+    emit_table_op(t, OP_VSRA, op_emit_vsra);
+    emit_table_op(t, OP_VSRAI, op_emit_vsrai);
+    emit_table_op(t, OP_BAND, op_emit_band);
+    emit_table_op(t, OP_BANDI, op_emit_bandi);
+    emit_table_op(t, OP_VBAND,
+		  VSEL3(op_emit_vband_avx, op_emit_vband_sse2, op_emit_band));
+    emit_table_op(t, OP_VBANDI, op_emit_vbandi);
+    emit_table_op(t, OP_BANDN, op_emit_bandn);
+    emit_table_op(t, OP_BANDNI, op_emit_bandni);
+    emit_table_op(t, OP_VBANDN, op_emit_vbandn);
+    emit_table_op(t, OP_VBANDNI, op_emit_vbandni);
+    emit_table_op(t, OP_BOR, op_emit_bor);
+    emit_table_op(t, OP_BORI, op_emit_bori);
+    emit_table_op(t, OP_VBOR,
+		  VSEL3(op_emit_vbor_avx, op_emit_vbor_sse2, op_emit_bor));
+    emit_table_op(t, OP_VBORI, op_emit_vbori);
+    emit_table_op(t, OP_BXOR, op_emit_bxor);
+    emit_table_op(t, OP_BXORI, op_emit_bxori);
+    emit_table_op(t, OP_VBXOR,
+		  VSEL3(op_emit_vbxor_avx, op_emit_vbxor_sse2, op_emit_bxor));
+    emit_table_op(t, OP_VBXORI, op_emit_vbxori);
+    emit_table_op(t, OP_CMPLT, op_emit_cmplt);
+    emit_table_op(t, OP_CMPLTI, op_emit_cmplti);
+    emit_table_op(t, OP_VCMPLT, op_emit_vcmplt);
+    emit_table_op(t, OP_VCMPLTI, op_emit_vcmplti);
+    emit_table_op(t, OP_CMPLE, op_emit_cmple);
+    emit_table_op(t, OP_CMPLEI, op_emit_cmplei);
+    emit_table_op(t, OP_VCMPLE, op_emit_vcmple);
+    emit_table_op(t, OP_VCMPLEI, op_emit_vcmplei);
+    emit_table_op(t, OP_CMPEQ, op_emit_cmpeq);
+    emit_table_op(t, OP_CMPEQI, op_emit_cmpeqi);
+    emit_table_op(t, OP_VCMPEQ, op_emit_vcmpeq);
+    emit_table_op(t, OP_VCMPEQI, op_emit_vcmpeqi);
+    emit_table_op(t, OP_CMPGT, op_emit_cmpgt);
+    emit_table_op(t, OP_CMPGTI, op_emit_cmpgti);
+    emit_table_op(t, OP_VCMPGT, op_emit_vcmpgt);
+    emit_table_op(t, OP_VCMPGTI, op_emit_vcmpgti);
+    emit_table_op(t, OP_CMPGE, op_emit_cmpge);
+    emit_table_op(t, OP_CMPGEI, op_emit_cmpgei);
+    emit_table_op(t, OP_VCMPGE, op_emit_vcmpge);
+    emit_table_op(t, OP_VCMPGEI, op_emit_vcmpgei);
+    emit_table_op(t, OP_CMPNE, op_emit_cmpne);
+    emit_table_op(t, OP_CMPNEI, op_emit_cmpnei);
+    emit_table_op(t, OP_VCMPNE, op_emit_vcmpne);
+    emit_table_op(t, OP_VCMPNEI, op_emit_vcmpnei);
+    if (avx)
+	emit_table_op(t, OP_VSEL, op_emit_vsel_avx);
+    else if (sse2)
+	emit_table_op(t, OP_VSEL, op_emit_vsel_sse2);
+#undef VSEL3
+    return t;
+}
+
+// features that select emitters, index into emit_tables
+static unsigned emit_table_index(unsigned vec)
+{
+    return ((vec & VEC_TYPE_AVX) ? 1 : 0) |
+	((vec & VEC_TYPE_SSE4_1) ? 2 : 0) |
+	((vec & VEC_TYPE_SSE2) ? 4 : 0) |
+	((vec & VEC_TYPE_F16C) ? 8 : 0);
+}
+
+static std::atomic<emit_table_t*> emit_tables[16];
+
+static const emit_table_t* emit_table(ZAssembler &a)
+{
+    const emit_table_t* t;
+    unsigned vec = a.enabled();
+    unsigned ix;
+    emit_table_t* nt;
+    emit_table_t* expect = NULL;
+
+    if ((t = (const emit_table_t*) a.dispatch()) != NULL)
+	return t;
+    ix = emit_table_index(vec);
+    if ((nt = emit_tables[ix].load(std::memory_order_acquire)) == NULL) {
+	// built by several threads at most once each, first one is kept
+	nt = emit_table_new(vec);
+	if (!emit_tables[ix].compare_exchange_strong(expect, nt)) {
+	    free(nt);
+	    nt = expect;
+	}
+    }
+    a.set_dispatch(nt);
+    return nt;
+}
+
+void emit_instruction(ZAssembler &a, instr_t* p, uint32_t reg_mask, x86::Gp rfp)
+{
+    a.reg_alloc_reset();  // reset allocation for every instruction
+
+    if (a.use_dispatch()) {
+	emit_fn_t fn = emit_table(a)->fn[p->op][get_scalar_type(p->type)];
+	if (fn == NULL)
+	    crash(__FILE__, __LINE__, p->type);
+	fn(a, p, reg_mask, rfp);
+    }
+    else
+	emit_instruction_switch(a, p, reg_mask, rfp);
+}
+
 void add_dirty_regs(ZAssembler &a, instr_t* code, size_t n)
 {
     while (n--) {
-	if ((code->op == OP_JMP) ||
-	    (code->op == OP_NOP) ||
-	    (code->op == OP_JNZ) ||
-	    (code->op == OP_JZ)) {
+	if (OP_IS_JUMP(code->op) || (code->op == OP_NOP)) {
 	}
-	if (code->op & OP_VEC) {
+	else if (code->op & OP_VEC) {
 	    a.add_dirty_reg(xreg(code->rd));
 	}
 	else {
@@ -2558,6 +3350,95 @@ void add_dirty_regs(ZAssembler &a, instr_t* code, size_t n)
     }
 }
 
+// load registers in mask (bit 0-15 vector, 16-31 scalar) from rfp
+static void emit_load_regs(ZAssembler &a, x86::Gp rfp, uint32_t mask)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	if (mask & (1 << i)) {
+	    int offs = offsetof(vregfile_t, v) + i*sizeof(vector_t);  
+	    a.movdqu(xreg(i), x86::ptr(rfp, offs));
+	}
+    }
+    // gp registers reversed
+    for (i = 15; i >= 0; i--) {
+	if (mask & (1 << (i+16))) {
+	    int offs = offsetof(vregfile_t, r) + i*sizeof(scalar0_t);
+	    a.mov(reg(i), x86::ptr(rfp, offs));
+	}
+    }
+}
+
+// store registers in mask to rfp
+static void emit_store_regs(ZAssembler &a, x86::Gp rfp, uint32_t mask)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	if (mask & (1 << i)) {
+	    int offs = offsetof(vregfile_t, v) + i*sizeof(vector_t);
+	    a.movdqu(x86::ptr(rfp, offs), xreg(i));
+	}
+	if (mask & (1 << (i+16))) {
+	    int offs = offsetof(vregfile_t, r) + i*sizeof(scalar0_t);
+	    a.mov(x86::ptr(rfp, offs), reg(i));
+	}
+    }
+}
+
+// rdx:rax = rax = cycle counter
+static void emit_prof_read(ZAssembler &a, int mode)
+{
+    if (mode == PROF_PMC) {
+	a.mov(x86::ecx, 0x40000001);  // fixed counter 1
+	a.rdpmc();
+    }
+    else {
+	a.lfence();  // do not start before earlier instructions
+	a.rdtsc();
+    }
+    a.shl(x86::rdx, 32);
+    a.or_(x86::rax, x86::rdx);
+}
+
+static TypeId type_id(uint8_t type)
+{
+    switch(type) {
+    case UINT8:   return TypeId::kUInt8;
+    case UINT16:  return TypeId::kUInt16;
+    case UINT32:  return TypeId::kUInt32;
+    case UINT64:  return TypeId::kUInt64;
+    case INT8:    return TypeId::kInt8;
+    case INT16:   return TypeId::kInt16;
+    case INT32:   return TypeId::kInt32;
+    case INT64:   return TypeId::kInt64;
+    case FLOAT32: return TypeId::kFloat32;
+    case FLOAT64: return TypeId::kFloat64;
+    case VOID:    return TypeId::kVoid;
+    default: crash(__FILE__, __LINE__, type); return TypeId::kVoid;
+    }
+}
+
+// move register rd to rax/xmm0, small integers are extended to 32 bit
+static void emit_native_ret(ZAssembler &a, uint8_t type, int rd)
+{
+    switch(type) {
+    case VOID: break;
+    case UINT8:   a.movzx(x86::eax, reg(rd).r8()); break;
+    case INT8:    a.movsx(x86::eax, reg(rd).r8()); break;
+    case UINT16:  a.movzx(x86::eax, reg(rd).r16()); break;
+    case INT16:   a.movsx(x86::eax, reg(rd).r16()); break;
+    case UINT32:
+    case INT32:   a.mov(x86::eax, reg(rd).r32()); break;
+    case UINT64:
+    case INT64:   if (rd != 0) a.mov(x86::rax, reg(rd)); break;
+    case FLOAT32:
+    case FLOAT64: if (rd != 0) a.movaps(x86::xmm0, xreg(rd)); break;
+    default: crash(__FILE__, __LINE__, type); break;
+    }
+}
+
 //
 //  save_ptr points to 512 bytes (128bit aligned ) memory area
 //   that can hold data fro fxsave64
@@ -2566,22 +3447,38 @@ void add_dirty_regs(ZAssembler &a, instr_t* code, size_t n)
 //            xmm0
 //            xmm1
 //            xmm2
-//           
 //
-void assemble(ZAssembler &a, const Environment &env,
-	      uint32_t reg_mask,
-	      x86::Mem save_ptr,
-	      instr_t* code, size_t n)
+//  proto != NULL builds a C function from the prototype instead,
+//  see assemble_native
+//
+static void assemble_code(ZAssembler &a, const Environment &env,
+			  uint32_t reg_mask,
+			  x86::Mem save_ptr,
+			  const jit_proto_t* proto,
+			  instr_t* code, size_t n)
 {
     FuncDetail func;
     FuncFrame frame;
     x86::Gp rfp = a.zdi();
+    int prof = (proto == NULL) ? a.prof() : PROF_NONE;
+    int fuel = (proto == NULL) && a.fuel();
+    Label ret_label;
     int i;
     
-    func.init(FuncSignatureT<void*, void*>(CallConvId::kHost), env);
+    if (proto == NULL)
+	func.init(FuncSignatureT<void*, void*>(CallConvId::kHost), env);
+    else {
+	FuncSignatureBuilder sig(CallConvId::kHost);
+	sig.setRet(type_id(proto->ret));
+	for (i = 0; i < proto->nargs; i++)
+	    sig.addArg(type_id(proto->arg[i]));
+	func.init(sig, env);
+	ret_label = a.newLabel();
+    }
     frame.init(func);
     a.set_func_frame(&frame);
-    frame.addDirtyRegs(rfp);
+    if (proto == NULL)
+	frame.addDirtyRegs(rfp);
     // FIXME: how do we get this info before generating code?
     for (i = 0; i < 16; i++) {
 	if (R_FREE_MASK & (1 << i))
@@ -2589,103 +3486,158 @@ void assemble(ZAssembler &a, const Environment &env,
     }
     
     add_dirty_regs(a, code, n);
+    // profiling keeps the start time after the spill area
+    frame.setLocalStackSize(SPILL_SIZE + ((prof != PROF_NONE) ? 16 : 0));
+    frame.setLocalStackAlignment(16);
 
     FuncArgsAssignment args(&func);   // Create arguments assignment context.
-    args.assignAll(rfp);             // Assign our registers to arguments.
+    if (proto == NULL)
+	args.assignAll(rfp);         // Assign our registers to arguments.
+    else {                           // argument i in register i
+	for (i = 0; i < proto->nargs; i++) {
+	    if (IS_FLOAT_TYPE(proto->arg[i]))
+		args.assignReg(i, xreg(i));
+	    else {
+		args.assignReg(i, reg(i));
+		frame.addDirtyRegs(reg(i));
+	    }
+	}
+    }
     args.updateFuncFrame(frame);      // Reflect our args in FuncFrame.
     frame.finalize();                 // Finalize the FuncFrame (updates it).
 
     a.emitProlog(frame);              // Emit function prolog.
     a.emitArgsAssignment(frame, args);// Assign arguments to registers.
 
-    // load vector registers
-    for (i = 0; i < 16; i++) {
-	if (reg_mask & (1 << i)) {
-	    int offs = offsetof(vregfile_t, v) + i*sizeof(vector_t);  
-	    a.movdqu(xreg(i), x86::ptr(rfp, offs));
-	}
+    x86::Mem prof_start = x86::ptr(x86::rsp,
+				   frame.localStackOffset() + SPILL_SIZE);
+    if (prof != PROF_NONE) {
+	emit_prof_read(a, prof);
+	a.mov(prof_start, x86::rax);
     }
 
-    // load gp registers reversed
-    for (i = 15; i >= 0; i--) {
-	if (reg_mask & (1 << (i+16))) {
-	    int offs = offsetof(vregfile_t, r) + i*sizeof(scalar0_t);
-	    a.mov(reg(i), x86::ptr(rfp, offs));
-	}
-    }
+    if (proto == NULL)
+	emit_load_regs(a, rfp, reg_mask);
     
+    uint32_t live[n];  // registers live after instruction
+    instr_liveness(code, n, live);
+
     // Setup all labels
-    Label lbl[n];    // potential landing positions
+    Label lbl[n+1];    // potential landing positions (n = end of code)
+    Label back[n+1];   // fuel check before backward jump to lbl[j]
+    Label done, leave, yield;
+    uint32_t saved = 0;  // registers kept in rfp while yielded
 
-    for (i = 0; i < (int) n; i++)
+    for (i = 0; i <= (int) n; i++) {
 	lbl[i].reset();
+	back[i].reset();
+    }
 
     for (i = 0; i < (int) n; i++) {
-	if ((code[i].op == OP_JMP) ||
-	    (code[i].op == OP_JZ) ||
-	    (code[i].op == OP_JNZ)) {
+	if (OP_IS_JUMP(code[i].op)) {
 	    int j = (i+1)+code[i].imm12;
 	    if (lbl[j].id() == Globals::kInvalidId) //?
 		lbl[j] = a.newLabel();
+	    if (fuel && (code[i].imm12 < 0) &&
+		(back[j].id() == Globals::kInvalidId))
+		back[j] = a.newLabel();
+	}
+    }
+
+    if (fuel) {  // resume at rfp->pc after a yield
+	Label body = a.newLabel();
+	done = a.newLabel();
+	leave = a.newLabel();
+	yield = a.newLabel();
+	saved = reg_mask;
+	for (i = 0; i < (int) n; i++) {
+	    uint32_t m = instr_uses(&code[i]) | instr_defs(&code[i]);
+	    // scalar floats are kept in xmm(i), not in the gp register
+	    if (!(code[i].op & OP_VEC) &&
+		((code[i].type == FLOAT32) || (code[i].type == FLOAT64)))
+		m = m >> 16;
+	    saved |= m;
+	}
+	a.cmp(x86::dword_ptr(rfp, offsetof(vregfile_t, status)), EXEC_YIELD);
+	a.jne(body);
+	emit_load_regs(a, rfp, saved);
+	for (i = 0; i < (int) n; i++) {
+	    if (back[i].id() != Globals::kInvalidId) {
+		a.cmp(x86::dword_ptr(rfp, offsetof(vregfile_t, pc)), i);
+		a.je(lbl[i]);
+	    }
 	}
+	a.jmp(done);
+	a.bind(body);
     }
     
     // assemble all code
     for (i = 0; i < (int)n; i++) {
+	jit_stats_t* st = a.stats();
+	uint32_t* map = a.pc_map();
+	uint32_t ninstr = (st != NULL) ? st->ninstr : 0;
+	int i0 = i;
+
 	if (lbl[i].id() != Globals::kInvalidId)
 	    a.bind(lbl[i]);
-	if (code[i].op == OP_JMP) {
+	if (map != NULL)
+	    map[i] = a.offset();
+	if (OP_IS_JUMP(code[i].op)) {
 	    int j = (i+1)+code[i].imm12;
-	    a.jmp(lbl[j]);
-	}
-	else if (code[i].op == OP_JNZ) {
-	    int j = (i+1)+code[i].imm12;
-	    switch(code[i].type) {
-	    case INT8:
-	    case UINT8:	a.cmp(reg(code[i].rd).r8(), 0); break;
-	    case INT16:
-	    case UINT16: a.cmp(reg(code[i].rd).r16(), 0); break;
-	    case INT32:	    
-	    case UINT32: a.cmp(reg(code[i].rd).r32(), 0); break;
-	    case INT64:	    
-	    case UINT64: a.cmp(reg(code[i].rd).r64(), 0); break;
-#ifdef FIXME
-	    case FLOAT32:
-		a.cmpps(reg(code[i].rd),0.0); break;
-	    case FLOAT64:
-		a.cmppd(reg(code[i].rd), 0.0); break;
-#endif
-	    default: crash(__FILE__, __LINE__, code[i].type); break;
+	    Label target = (fuel && (code[i].imm12 < 0)) ? back[j] : lbl[j];
+	    a.reg_alloc_reset();
+	    a.reg_pin(instr_uses(&code[i]));
+	    switch(code[i].op) {
+	    case OP_JMP: a.jmp(target); break;
+	    case OP_JNZ: emit_jnz(a, code[i].type, code[i].rd, target); break;
+	    case OP_JZ: emit_jz(a, code[i].type, code[i].rd, target); break;
+	    case OP_VJANY: emit_vjany(a, code[i].type, code[i].rd, target); break;
+	    case OP_VJALL: emit_vjall(a, code[i].type, code[i].rd, target); break;
+	    default: crash(__FILE__, __LINE__, code[i].op); break;
 	    }
-	    a.jnz(lbl[j]);
 	}
-	else if (code[i].op == OP_JZ) {
-	    int j = (i+1)+code[i].imm12;
-	    switch(code[i].type) {
-	    case INT8:
-	    case UINT8:	a.cmp(reg(code[i].rd).r8(), 0); break;
-	    case INT16:
-	    case UINT16: a.cmp(reg(code[i].rd).r16(), 0); break;
-	    case INT32:	    
-	    case UINT32: a.cmp(reg(code[i].rd).r32(), 0); break;
-	    case INT64:	    
-	    case UINT64: a.cmp(reg(code[i].rd).r64(), 0); break;
-#ifdef FIXME
-	    case FLOAT32:
-		a.cmpps(reg(code[i].rd),0.0); break;
-	    case FLOAT64:
-		a.cmppd(reg(code[i].rd), 0.0); break;
-#endif
-	    default: crash(__FILE__, __LINE__, code[i].type); break;
-	    }
-	    a.jz(lbl[j]);
-	}	
+	else if ((i+1 < (int)n) &&
+		 (lbl[i+1].id() == Globals::kInvalidId) &&
+		 is_cmp_jump(&code[i], live[i+1])) {
+	    int j = (i+2)+code[i+1].imm12;
+	    Label target = (fuel && (code[i+1].imm12 < 0)) ? back[j] : lbl[j];
+	    a.reg_alloc_reset();
+	    a.reg_pin(instr_uses(&code[i]) | instr_defs(&code[i]) |
+		      instr_uses(&code[i+1]));
+	    emit_cmp_jump(a, &code[i], target);
+	    if (map != NULL)  // jump code is part of the compare
+		map[i+1] = a.offset();
+	    i++;
+	}
+	else if ((proto != NULL) &&
+		 ((code[i].op == OP_RET) || (code[i].op == OP_VRET))) {
+	    emit_native_ret(a, proto->ret, code[i].rd);
+	    if (i < (int) n-1)
+		a.jmp(ret_label);
+	}
 	else {
+	    a.reg_pin(instr_uses(&code[i]) | instr_defs(&code[i]));
 	    emit_instruction(a, &code[i], reg_mask, rfp);
 	}
+	if (st != NULL) {  // fused jump is counted on the compare
+	    st->op_native[code[i0].op] += st->ninstr - ninstr;
+	    for (; i0 <= i; i0++)
+		st->op_count[code[i0].op]++;
+	}
+    }
+    if (lbl[n].id() != Globals::kInvalidId)
+	a.bind(lbl[n]);
+    if (proto != NULL)
+	a.bind(ret_label);
+    if (a.pc_map() != NULL)
+	a.pc_map()[n] = a.offset();
+    if (fuel) {
+	a.bind(done);
+	a.mov(x86::dword_ptr(rfp, offsetof(vregfile_t, status)), EXEC_DONE);
+	a.bind(leave);
     }
     // dump register so we can have a look
-    if (a.cpuFeatures().x86().hasFXSR()) {
+    if ((proto == NULL) && a.dump() && a.cpuFeatures().x86().hasFXSR()) {
 	// fprintf(stderr, "has fxsave\n");
 	Error err;
 	err = a.rex_w().fxsave64(save_ptr);
@@ -2693,6 +3645,166 @@ void assemble(ZAssembler &a, const Environment &env,
 	    fprintf(stderr, "a.fxsave64 ERROR\n");
 	}
     }
-    a.lea(x86::regs::rax, save_ptr);
+    if (prof != PROF_NONE) {
+	emit_prof_read(a, prof);
+	a.sub(x86::rax, prof_start);
+	a.lock().add(x86::qword_ptr(a.prof_label(),
+				    offsetof(jit_prof_t, cycles)), x86::rax);
+	a.lock().inc(x86::qword_ptr(a.prof_label(),
+				    offsetof(jit_prof_t, calls)));
+    }
+    if ((proto == NULL) && a.dump())
+	a.lea(x86::regs::rax, save_ptr);
+    else if (proto == NULL)
+	a.xor_(x86::regs::eax, x86::regs::eax);
     a.emitEpilog(frame);              // Emit function epilog and return.
+    if (fuel) {  // out of line, taken backward jumps pass here
+	for (i = 0; i < (int) n; i++) {
+	    if (back[i].id() != Globals::kInvalidId) {
+		a.bind(back[i]);
+		a.sub(x86::qword_ptr(rfp, offsetof(vregfile_t, fuel)), 1);
+		a.jns(lbl[i]);
+		a.mov(x86::dword_ptr(rfp, offsetof(vregfile_t, pc)), i);
+		a.jmp(yield);
+	    }
+	}
+	a.bind(yield);
+	emit_store_regs(a, rfp, saved);
+	a.mov(x86::dword_ptr(rfp, offsetof(vregfile_t, status)), EXEC_YIELD);
+	a.jmp(leave);
+    }
+    a.embed_const_pool();
+    if (prof != PROF_NONE) {  // counters away from the code
+	Section* text = a.code()->textSection();
+	Section* sect;
+	jit_prof_t zero;
+
+	memset(&zero, 0, sizeof(zero));
+	a.code()->newSection(&sect, ".prof", SIZE_MAX, SectionFlags::kNone, 64);
+	a.section(sect);
+	a.bind(a.prof_label());
+	a.embed(&zero, sizeof(zero));
+	a.section(text);
+    }
+}
+
+void assemble(ZAssembler &a, const Environment &env,
+	      uint32_t reg_mask,
+	      x86::Mem save_ptr,
+	      instr_t* code, size_t n)
+{
+    assemble_code(a, env, reg_mask, save_ptr, NULL, code, n);
+}
+
+// lower wide code and assemble it, -1 if it can not be lowered,
+// registers 16-31 are rejected since reg_mask and rfp have 16
+int assemble_wide(ZAssembler &a, const Environment &env,
+		  uint32_t reg_mask,
+		  x86::Mem save_ptr,
+		  instr64_t* wcode, size_t n)
+{
+    instr_t* code;
+    int len;
+
+    if ((len = jit_narrow(wcode, n, NULL, 0)) < 0)
+	return -1;
+    code = (instr_t*) malloc((len+1)*sizeof(instr_t));
+    jit_narrow(wcode, n, code, len);
+    assemble(a, env, reg_mask, save_ptr, code, len);
+    free(code);
+    return 0;
+}
+
+// assemble code as a C function with prototype proto. Argument i is
+// passed in register i, the register of the ret/vret is returned.
+// There is no register file, so no fxsave dump, profiling or fuel.
+void assemble_native(ZAssembler &a, const Environment &env,
+		     const jit_proto_t* proto,
+		     instr_t* code, size_t n)
+{
+    if (proto->nargs > JIT_MAX_ARGS)
+	crash(__FILE__, __LINE__, proto->nargs);
+    assemble_code(a, env, 0, x86::Mem(), proto, code, n);
+}
+
+// assemble and collect compile statistics in *sp
+void assemble_stats(ZAssembler &a, const Environment &env,
+		    uint32_t reg_mask,
+		    x86::Mem save_ptr,
+		    instr_t* code, size_t n, jit_stats_t* sp)
+{
+    Section* text;
+
+    memset(sp, 0, sizeof(jit_stats_t));
+    sp->nops = n;
+    sp->vec_mask = a.enabled();
+    a.set_stats(sp);
+    assemble(a, env, reg_mask, save_ptr, code, n);
+    a.set_stats(NULL);
+    if ((text = a.code()->textSection()) != NULL)
+	sp->code_size = text->bufferSize();
+}
+
+// assemble and record the code offset of each instruction in map[0..n-1],
+// map[n] is the offset of the epilog. A jump fused into the compare
+// before it emits no code of its own and gets the offset of the next
+// instruction.
+void assemble_map(ZAssembler &a, const Environment &env,
+		  uint32_t reg_mask,
+		  x86::Mem save_ptr,
+		  instr_t* code, size_t n, uint32_t* map)
+{
+    a.set_pc_map(map);
+    assemble(a, env, reg_mask, save_ptr, code, n);
+    a.set_pc_map(NULL);
+}
+
+// counter block of code assembled with a.set_prof(), fn is the entry
+// from JitRuntime::add and the CodeHolder must still be alive
+jit_prof_t* prof_block(ZAssembler &a, void* fn)
+{
+    return (jit_prof_t*) ((uint8_t*) fn +
+			  a.code()->labelOffsetFromBase(a.prof_label()));
+}
+
+// rdpmc is allowed in user mode for any counter
+int prof_pmc_available(void)
+{
+    FILE* f;
+    int v = 0;
+
+    if ((f = fopen("/sys/bus/event_source/devices/cpu/rdpmc", "r")) == NULL)
+	return 0;
+    if (fscanf(f, "%d", &v) != 1)
+	v = 0;
+    fclose(f);
+    return v == 2;
+}
+
+// print statistics, ops sorted by native instructions emitted
+void print_stats(FILE* f, jit_stats_t* sp)
+{
+    uint8_t ops[256];
+    int i, j, nops = 0;
+
+    fprintf(f, "code_size=%lu pool_size=%lu nops=%u ninstr=%u\n",
+	    sp->code_size, sp->pool_size, sp->nops, sp->ninstr);
+    fprintf(f, "gp_peak=%u xmm_peak=%u spills=%u vec_mask=%x\n",
+	    sp->gp_peak, sp->xmm_peak, sp->spills, sp->vec_mask);
+    for (i = 0; i < 256; i++) {
+	if (sp->op_count[i] == 0)
+	    continue;
+	j = nops++;
+	while((j > 0) && (sp->op_native[ops[j-1]] < sp->op_native[i])) {
+	    ops[j] = ops[j-1];
+	    j--;
+	}
+	ops[j] = i;
+    }
+    for (i = 0; i < nops; i++) {
+	int op = ops[i];
+	fprintf(f, "  %-8s count=%-6u native=%-6u (%.1f/op)\n",
+		asm_opname(op), sp->op_count[op], sp->op_native[op],
+		(double) sp->op_native[op] / sp->op_count[op]);
+    }
 }